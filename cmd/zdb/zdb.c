@@ -45,6 +45,7 @@
 #include <sys/vdev.h>
 #include <sys/vdev_impl.h>
 #include <sys/metaslab_impl.h>
+#include <sys/vdev_log_spacemap.h>
 #include <sys/dmu_objset.h>
 #include <sys/dsl_dir.h>
 #include <sys/dsl_dataset.h>
@@ -681,6 +682,18 @@ get_metaslab_refcount(vdev_t *vd)
 				refcount++;
 		}
 	}
+	if (vd->vdev_top == vd) {
+		vdev_log_sm_entry_t *vlse;
+		dmu_object_info_t doi;
+
+		for (vlse = avl_first(&vd->vdev_log_sms); vlse != NULL;
+		    vlse = AVL_NEXT(&vd->vdev_log_sms, vlse)) {
+			VERIFY0(dmu_object_info(spa_meta_objset(vd->vdev_spa),
+			    vlse->vlse_object, &doi));
+			if (doi.doi_bonus_size == sizeof (space_map_phys_t))
+				refcount++;
+		}
+	}
 	for (c = 0; c < vd->vdev_children; c++)
 		refcount += get_metaslab_refcount(vd->vdev_child[c]);
 
@@ -765,13 +778,13 @@ dump_metaslab_stats(metaslab_t *msp)
 {
 	char maxbuf[32];
 	range_tree_t *rt = msp->ms_tree;
-	avl_tree_t *t = &msp->ms_size_tree;
+	zfs_btree_t *t = &msp->ms_size_tree;
 	int free_pct = range_tree_space(rt) * 100 / msp->ms_size;
 
 	zdb_nicenum(metaslab_block_maxsize(msp), maxbuf);
 
 	(void) printf("\t %25s %10lu   %7s  %6s   %4s %4d%%\n",
-	    "segments", avl_numnodes(t), "maxsize", maxbuf,
+	    "segments", zfs_btree_numnodes(t), "maxsize", maxbuf,
 	    "freepct", free_pct);
 	(void) printf("\tIn-memory histogram:\n");
 	dump_histogram(rt->rt_histogram, RANGE_TREE_HISTOGRAM_SIZE, 0);
@@ -785,7 +798,7 @@ dump_metaslab(metaslab_t *msp)
 	space_map_t *sm = msp->ms_sm;
 	char freebuf[32];
 
-	zdb_nicenum(msp->ms_size - space_map_allocated(sm), freebuf);
+	zdb_nicenum(msp->ms_size - metaslab_allocated_space(msp), freebuf);
 
 	(void) printf(
 	    "\tmetaslab %6llu   offset %12llx   spacemap %6llu   free    %5s\n",
@@ -2853,6 +2866,8 @@ zdb_leak_init(spa_t *spa, zdb_cb_t *zcb)
 		 */
 		spa->spa_normal_class->mc_ops = &zdb_metaslab_ops;
 		spa->spa_log_class->mc_ops = &zdb_metaslab_ops;
+		spa->spa_special_class->mc_ops = &zdb_metaslab_ops;
+		spa->spa_dedup_class->mc_ops = &zdb_metaslab_ops;
 
 		for (c = 0; c < rvd->vdev_children; c++) {
 			vdev_t *vd = rvd->vdev_child[c];
@@ -2890,6 +2905,17 @@ zdb_leak_init(spa_t *spa, zdb_cb_t *zcb)
 					VERIFY0(space_map_load(msp->ms_sm,
 					    msp->ms_tree, SM_ALLOC));
 
+					/*
+					 * Apply the changes that are only
+					 * in the vdev's log space maps.
+					 */
+					range_tree_walk(
+					    msp->ms_unflushed_allocs,
+					    range_tree_add, msp->ms_tree);
+					range_tree_walk(
+					    msp->ms_unflushed_frees,
+					    range_tree_remove, msp->ms_tree);
+
 					if (!msp->ms_loaded) {
 						msp->ms_loaded = B_TRUE;
 					}
@@ -2966,6 +2992,8 @@ dump_block_stats(spa_t *spa)
 	zdb_cb_t zcb;
 	zdb_blkstats_t *zb, *tzb;
 	uint64_t norm_alloc, norm_space, total_alloc, total_found;
+	uint64_t special_alloc, special_space;
+	uint64_t dedup_alloc, dedup_space;
 	int flags = TRAVERSE_PRE | TRAVERSE_PREFETCH_METADATA |
 	    TRAVERSE_NO_DECRYPT | TRAVERSE_HARD;
 	boolean_t leaks = B_FALSE;
@@ -3008,7 +3036,9 @@ dump_block_stats(spa_t *spa)
 	if (dump_opt['c'] > 1)
 		flags |= TRAVERSE_PREFETCH_DATA;
 
-	zcb.zcb_totalasize = metaslab_class_get_alloc(spa_normal_class(spa));
+	zcb.zcb_totalasize = metaslab_class_get_alloc(spa_normal_class(spa)) +
+	    metaslab_class_get_alloc(spa_special_class(spa)) +
+	    metaslab_class_get_alloc(spa_dedup_class(spa));
 	zcb.zcb_start = zcb.zcb_lastprint = gethrtime();
 	zcb.zcb_haderrors |= traverse_pool(spa, 0, flags, zdb_blkptr_cb, &zcb);
 
@@ -3047,7 +3077,14 @@ dump_block_stats(spa_t *spa)
 	norm_alloc = metaslab_class_get_alloc(spa_normal_class(spa));
 	norm_space = metaslab_class_get_space(spa_normal_class(spa));
 
-	total_alloc = norm_alloc + metaslab_class_get_alloc(spa_log_class(spa));
+	special_alloc = metaslab_class_get_alloc(spa_special_class(spa));
+	special_space = metaslab_class_get_space(spa_special_class(spa));
+
+	dedup_alloc = metaslab_class_get_alloc(spa_dedup_class(spa));
+	dedup_space = metaslab_class_get_space(spa_dedup_class(spa));
+
+	total_alloc = norm_alloc + special_alloc + dedup_alloc +
+	    metaslab_class_get_alloc(spa_log_class(spa));
 	total_found = tzb->zb_asize - zcb.zcb_dedup_asize;
 
 	if (total_found == total_alloc) {
@@ -3092,6 +3129,16 @@ dump_block_stats(spa_t *spa)
 	    (double)zcb.zcb_dedup_asize / tzb->zb_asize + 1.0);
 	(void) printf("\tSPA allocated: %10llu     used: %5.2f%%\n",
 	    (u_longlong_t)norm_alloc, 100.0 * norm_alloc / norm_space);
+	if (special_space != 0) {
+		(void) printf("\tSpecial class: %10llu     used: %5.2f%%\n",
+		    (u_longlong_t)special_alloc,
+		    100.0 * special_alloc / special_space);
+	}
+	if (dedup_space != 0) {
+		(void) printf("\tDedup class:   %10llu     used: %5.2f%%\n",
+		    (u_longlong_t)dedup_alloc,
+		    100.0 * dedup_alloc / dedup_space);
+	}
 
 	for (i = 0; i < NUM_BP_EMBEDDED_TYPES; i++) {
 		if (zcb.zcb_embedded_blocks[i] == 0)
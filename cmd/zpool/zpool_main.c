@@ -92,6 +92,7 @@ static int zpool_do_replace(int, char **);
 static int zpool_do_split(int, char **);
 
 static int zpool_do_scrub(int, char **);
+static int zpool_do_trim(int, char **);
 
 static int zpool_do_import(int, char **);
 static int zpool_do_export(int, char **);
@@ -141,6 +142,7 @@ typedef enum {
 	HELP_REPLACE,
 	HELP_REMOVE,
 	HELP_SCRUB,
+	HELP_TRIM,
 	HELP_STATUS,
 	HELP_UPGRADE,
 	HELP_EVENTS,
@@ -226,6 +228,19 @@ static const char *vsx_type_to_nvlist[IOS_COUNT][11] = {
  */
 #define	IOS_HISTO_IDX(a)	(highbit64(a & IOS_ANYHISTO_M) - 1)
 
+/*
+ * Deadline misses shown by -q.  Older modules don't report them, so unlike
+ * vsx_type_to_nvlist they are optional: -q leaves their columns out unless
+ * every pool has them.
+ */
+static const char *vsx_queue_missed_nvlist[] = {
+	ZPOOL_CONFIG_VDEV_SYNC_R_DEADLINE_MISSED,
+	ZPOOL_CONFIG_VDEV_SYNC_W_DEADLINE_MISSED,
+	ZPOOL_CONFIG_VDEV_ASYNC_R_DEADLINE_MISSED,
+	ZPOOL_CONFIG_VDEV_ASYNC_W_DEADLINE_MISSED,
+	ZPOOL_CONFIG_VDEV_SCRUB_DEADLINE_MISSED,
+};
+
 typedef struct zpool_command {
 	const char	*name;
 	int		(*func)(int, char **);
@@ -265,6 +280,7 @@ static zpool_command_t command_table[] = {
 	{ "split",	zpool_do_split,		HELP_SPLIT		},
 	{ NULL },
 	{ "scrub",	zpool_do_scrub,		HELP_SCRUB		},
+	{ "trim",	zpool_do_trim,		HELP_TRIM		},
 	{ NULL },
 	{ "import",	zpool_do_import,	HELP_IMPORT		},
 	{ "export",	zpool_do_export,	HELP_EXPORT		},
@@ -342,6 +358,8 @@ get_usage(zpool_help_t idx) {
 		return (gettext("\treopen <pool>\n"));
 	case HELP_SCRUB:
 		return (gettext("\tscrub [-s | -p] <pool> ...\n"));
+	case HELP_TRIM:
+		return (gettext("\ttrim [-r <rate>] [-s] <pool> ...\n"));
 	case HELP_STATUS:
 		return (gettext("\tstatus [-gLPvxD] [-T d|u] [pool] ... "
 		    "[interval [count]]\n"));
@@ -454,9 +472,38 @@ usage(boolean_t requested)
 	exit(requested ? 0 : 2);
 }
 
+/*
+ * Allocation classes other than the normal and log classes, in the order
+ * their sections are displayed.
+ */
+static const char *alloc_class_bias[] = {
+	VDEV_ALLOC_BIAS_DEDUP,
+	VDEV_ALLOC_BIAS_SPECIAL
+};
+
+/*
+ * Return the class of a top-level vdev: VDEV_TYPE_LOG for intent log
+ * devices, its allocation bias for dedup and special vdevs and NULL for
+ * the normal class.
+ */
+static const char *
+vdev_class(nvlist_t *nv)
+{
+	uint64_t is_log = B_FALSE;
+
+	(void) nvlist_lookup_uint64(nv, ZPOOL_CONFIG_IS_LOG, &is_log);
+	if (is_log)
+		return (VDEV_TYPE_LOG);
+	return (vdev_alloc_bias(nv));
+}
+
+/*
+ * Print the top-level vdevs of the given class (see vdev_class()) and
+ * their children.
+ */
 void
 print_vdev_tree(zpool_handle_t *zhp, const char *name, nvlist_t *nv, int indent,
-    boolean_t print_logs, int name_flags)
+    const char *match, int name_flags)
 {
 	nvlist_t **child;
 	uint_t c, children;
@@ -470,16 +517,15 @@ print_vdev_tree(zpool_handle_t *zhp, const char *name, nvlist_t *nv, int indent,
 		return;
 
 	for (c = 0; c < children; c++) {
-		uint64_t is_log = B_FALSE;
+		const char *class = vdev_class(child[c]);
 
-		(void) nvlist_lookup_uint64(child[c], ZPOOL_CONFIG_IS_LOG,
-		    &is_log);
-		if ((is_log && !print_logs) || (!is_log && print_logs))
+		if (class == NULL ? match != NULL :
+		    match == NULL || strcmp(class, match) != 0)
 			continue;
 
 		vname = zpool_vdev_name(g_zfs, zhp, child[c], name_flags);
 		print_vdev_tree(zhp, vname, child[c], indent + 2,
-		    B_FALSE, name_flags);
+		    NULL, name_flags);
 		free(vname);
 	}
 }
@@ -704,21 +750,36 @@ zpool_do_add(int argc, char **argv)
 		    "configuration:\n"), zpool_get_name(zhp));
 
 		/* print original main pool and new tree */
-		print_vdev_tree(zhp, poolname, poolnvroot, 0, B_FALSE,
+		print_vdev_tree(zhp, poolname, poolnvroot, 0, NULL,
 		    name_flags);
-		print_vdev_tree(zhp, NULL, nvroot, 0, B_FALSE, name_flags);
+		print_vdev_tree(zhp, NULL, nvroot, 0, NULL, name_flags);
 
 		/* Do the same for the logs */
 		if (num_logs(poolnvroot) > 0) {
-			print_vdev_tree(zhp, "logs", poolnvroot, 0, B_TRUE,
-			    name_flags);
-			print_vdev_tree(zhp, NULL, nvroot, 0, B_TRUE,
+			print_vdev_tree(zhp, "logs", poolnvroot, 0,
+			    VDEV_TYPE_LOG, name_flags);
+			print_vdev_tree(zhp, NULL, nvroot, 0, VDEV_TYPE_LOG,
 			    name_flags);
 		} else if (num_logs(nvroot) > 0) {
-			print_vdev_tree(zhp, "logs", nvroot, 0, B_TRUE,
+			print_vdev_tree(zhp, "logs", nvroot, 0, VDEV_TYPE_LOG,
 			    name_flags);
 		}
 
+		/* And for the dedup and special vdevs */
+		for (c = 0; c < ARRAY_SIZE(alloc_class_bias); c++) {
+			const char *bias = alloc_class_bias[c];
+
+			if (num_class_vdevs(poolnvroot, bias) > 0) {
+				print_vdev_tree(zhp, bias, poolnvroot, 0,
+				    bias, name_flags);
+				print_vdev_tree(zhp, NULL, nvroot, 0,
+				    bias, name_flags);
+			} else if (num_class_vdevs(nvroot, bias) > 0) {
+				print_vdev_tree(zhp, bias, nvroot, 0,
+				    bias, name_flags);
+			}
+		}
+
 		/* Do the same for the caches */
 		if (nvlist_lookup_nvlist_array(poolnvroot, ZPOOL_CONFIG_L2CACHE,
 		    &l2child, &l2children) == 0 && l2children) {
@@ -1211,9 +1272,19 @@ zpool_do_create(int argc, char **argv)
 		(void) printf(gettext("would create '%s' with the "
 		    "following layout:\n\n"), poolname);
 
-		print_vdev_tree(NULL, poolname, nvroot, 0, B_FALSE, 0);
-		if (num_logs(nvroot) > 0)
-			print_vdev_tree(NULL, "logs", nvroot, 0, B_TRUE, 0);
+		print_vdev_tree(NULL, poolname, nvroot, 0, NULL, 0);
+		if (num_logs(nvroot) > 0) {
+			print_vdev_tree(NULL, "logs", nvroot, 0,
+			    VDEV_TYPE_LOG, 0);
+		}
+		for (c = 0; c < ARRAY_SIZE(alloc_class_bias); c++) {
+			const char *bias = alloc_class_bias[c];
+
+			if (num_class_vdevs(nvroot, bias) > 0) {
+				print_vdev_tree(NULL, bias, nvroot, 0,
+				    bias, 0);
+			}
+		}
 
 		ret = 0;
 	} else {
@@ -1661,12 +1732,12 @@ print_status_config(zpool_handle_t *zhp, const char *name, nvlist_t *nv,
 	for (c = 0; c < children; c++) {
 		uint64_t islog = B_FALSE, ishole = B_FALSE;
 
-		/* Don't print logs or holes here */
+		/* Don't print logs, special vdevs or holes here */
 		(void) nvlist_lookup_uint64(child[c], ZPOOL_CONFIG_IS_LOG,
 		    &islog);
 		(void) nvlist_lookup_uint64(child[c], ZPOOL_CONFIG_IS_HOLE,
 		    &ishole);
-		if (islog || ishole)
+		if (islog || ishole || vdev_alloc_bias(child[c]) != NULL)
 			continue;
 		vname = zpool_vdev_name(g_zfs, zhp, child[c],
 		    name_flags | VDEV_NAME_TYPE_ID);
@@ -1741,11 +1812,7 @@ print_import_config(const char *name, nvlist_t *nv, int namewidth, int depth,
 		return;
 
 	for (c = 0; c < children; c++) {
-		uint64_t is_log = B_FALSE;
-
-		(void) nvlist_lookup_uint64(child[c], ZPOOL_CONFIG_IS_LOG,
-		    &is_log);
-		if (is_log)
+		if (vdev_class(child[c]) != NULL)
 			continue;
 
 		vname = zpool_vdev_name(g_zfs, NULL, child[c],
@@ -1779,16 +1846,17 @@ print_import_config(const char *name, nvlist_t *nv, int namewidth, int depth,
 }
 
 /*
- * Print log vdevs.
+ * Print log or special vdevs.
  * Logs are recorded as top level vdevs in the main pool child array
- * but with "is_log" set to 1. We use either print_status_config() or
- * print_import_config() to print the top level logs then any log
- * children (eg mirrored slogs) are printed recursively - which
- * works because only the top level vdev is marked "is_log"
+ * but with "is_log" set to 1, special vdevs with an allocation bias of
+ * "special". We use either print_status_config() or
+ * print_import_config() to print the top level vdevs of the class then
+ * any children (eg mirrored slogs) are printed recursively - which
+ * works because only the top level vdev is marked.
  */
 static void
-print_logs(zpool_handle_t *zhp, nvlist_t *nv, int namewidth, boolean_t verbose,
-    int name_flags)
+print_class_vdevs(zpool_handle_t *zhp, nvlist_t *nv, int namewidth,
+    boolean_t verbose, const char *class, int name_flags)
 {
 	uint_t c, children;
 	nvlist_t **child;
@@ -1797,15 +1865,16 @@ print_logs(zpool_handle_t *zhp, nvlist_t *nv, int namewidth, boolean_t verbose,
 	    &children) != 0)
 		return;
 
-	(void) printf(gettext("\tlogs\n"));
+	if (strcmp(class, VDEV_TYPE_LOG) == 0)
+		(void) printf(gettext("\tlogs\n"));
+	else
+		(void) printf("\t%s\n", class);
 
 	for (c = 0; c < children; c++) {
-		uint64_t is_log = B_FALSE;
+		const char *vclass = vdev_class(child[c]);
 		char *name;
 
-		(void) nvlist_lookup_uint64(child[c], ZPOOL_CONFIG_IS_LOG,
-		    &is_log);
-		if (!is_log)
+		if (vclass == NULL || strcmp(vclass, class) != 0)
 			continue;
 		name = zpool_vdev_name(g_zfs, zhp, child[c],
 		    name_flags | VDEV_NAME_TYPE_ID);
@@ -1835,7 +1904,7 @@ show_import(nvlist_t *config)
 	zpool_status_t reason;
 	zpool_errata_t errata;
 	const char *health;
-	uint_t vsc;
+	uint_t vsc, c;
 	int namewidth;
 	char *comment;
 
@@ -2069,8 +2138,16 @@ show_import(nvlist_t *config)
 		namewidth = 10;
 
 	print_import_config(name, nvroot, namewidth, 0, 0);
-	if (num_logs(nvroot) > 0)
-		print_logs(NULL, nvroot, namewidth, B_FALSE, 0);
+	if (num_logs(nvroot) > 0) {
+		print_class_vdevs(NULL, nvroot, namewidth, B_FALSE,
+		    VDEV_TYPE_LOG, 0);
+	}
+	for (c = 0; c < ARRAY_SIZE(alloc_class_bias); c++) {
+		if (num_class_vdevs(nvroot, alloc_class_bias[c]) > 0) {
+			print_class_vdevs(NULL, nvroot, namewidth, B_FALSE,
+			    alloc_class_bias[c], 0);
+		}
+	}
 
 	if (reason == ZPOOL_STATUS_BAD_GUID_SUM) {
 		(void) printf(gettext("\n\tAdditional devices are known to "
@@ -2660,6 +2737,7 @@ typedef struct iostat_cbdata {
 	boolean_t cb_verbose;
 	boolean_t cb_literal;
 	boolean_t cb_scripted;
+	boolean_t cb_queue_missed;	/* -q includes deadline misses */
 	zpool_list_t *cb_list;
 } iostat_cbdata_t;
 
@@ -2702,6 +2780,32 @@ static const name_and_columns_t iostat_bottom_labels[][IOSTAT_MAX_LABELS] =
 	    {"ind"}, {"agg"}, {"ind"}, {"agg"}, {NULL}},
 };
 
+/* The -q labels when the deadline misses are included */
+static const name_and_columns_t iostat_top_queue_missed_labels[] = {
+	{"syncq_read", 3}, {"syncq_write", 3}, {"asyncq_read", 3},
+	{"asyncq_write", 3}, {"scrubq_read", 3}, {NULL}};
+
+static const name_and_columns_t iostat_bottom_queue_missed_labels[] = {
+	{"pend"}, {"activ"}, {"miss"}, {"pend"}, {"activ"}, {"miss"},
+	{"pend"}, {"activ"}, {"miss"}, {"pend"}, {"activ"}, {"miss"},
+	{"pend"}, {"activ"}, {"miss"}, {NULL}};
+
+/*
+ * Return the row of "labels" (iostat_top_labels or iostat_bottom_labels) for
+ * stat type "idx".
+ */
+static const name_and_columns_t *
+iostat_labels_row(iostat_cbdata_t *cb,
+    const name_and_columns_t labels[][IOSTAT_MAX_LABELS], int idx)
+{
+	if (idx == IOS_QUEUES && cb->cb_queue_missed) {
+		return (labels == iostat_top_labels ?
+		    iostat_top_queue_missed_labels :
+		    iostat_bottom_queue_missed_labels);
+	}
+	return (labels[idx]);
+}
+
 static const char *histo_to_title[] = {
 	[IOS_L_HISTO] = "latency",
 	[IOS_RQ_HISTO] = "req_size",
@@ -2784,21 +2888,23 @@ print_iostat_labels(iostat_cbdata_t *cb, unsigned int force_column_width,
 	uint64_t flags = cb->cb_flags;
 	uint64_t f;
 	unsigned int column_width = force_column_width;
+	const name_and_columns_t *row;
 
 	/* For each bit set in flags */
 	for (f = flags; f; f &= ~(1ULL << idx)) {
 		idx = lowbit64(f) - 1;
 		if (!force_column_width)
 			column_width = default_column_width(cb, idx);
+		row = iostat_labels_row(cb, labels, idx);
 		/* Print our top labels centered over "read  write" label. */
-		for (i = 0; i < label_array_len(labels[idx]); i++) {
-			const char *name = labels[idx][i].name;
+		for (i = 0; i < label_array_len(row); i++) {
+			const char *name = row[i].name;
 			/*
 			 * We treat labels[][].columns == 0 as shorthand
 			 * for one column.  It makes writing out the label
 			 * tables more concise.
 			 */
-			unsigned int columns = MAX(1, labels[idx][i].columns);
+			unsigned int columns = MAX(1, row[i].columns);
 			unsigned int slen = strlen(name);
 
 			rw_column_width = (column_width * columns) +
@@ -2884,7 +2990,7 @@ print_iostat_dashes(iostat_cbdata_t *cb, unsigned int force_column_width,
 		else
 			column_width = default_column_width(cb, idx);
 
-		labels = iostat_bottom_labels[idx];
+		labels = iostat_labels_row(cb, iostat_bottom_labels, idx);
 		for (i = 0; i < label_array_len(labels); i++) {
 			if (name)
 				printf("  %*s-", column_width - 1, " ");
@@ -3250,6 +3356,11 @@ single_histo_average(uint64_t *histo, unsigned int buckets)
 	return (count == 0 ? 0 : total / count);
 }
 
+/*
+ * Print the queue depths of each class, which are instantaneous values,
+ * followed by the rate of deadline misses over the interval if the module
+ * reports them.
+ */
 static void
 print_iostat_queues(iostat_cbdata_t *cb, nvlist_t *oldnv,
     nvlist_t *newnv, double scale)
@@ -3268,13 +3379,16 @@ print_iostat_queues(iostat_cbdata_t *cb, nvlist_t *oldnv,
 		ZPOOL_CONFIG_VDEV_SCRUB_PEND_QUEUE,
 		ZPOOL_CONFIG_VDEV_SCRUB_ACTIVE_QUEUE,
 	};
-
-	struct stat_array *nva;
+	struct stat_array *nva, *missed = NULL;
 
 	unsigned int column_width = default_column_width(cb, IOS_QUEUES);
 	enum zfs_nicenum_format format;
 
 	nva = calc_and_alloc_stats_ex(names, ARRAY_SIZE(names), NULL, newnv);
+	if (cb->cb_queue_missed) {
+		missed = calc_and_alloc_stats_ex(vsx_queue_missed_nvlist,
+		    ARRAY_SIZE(vsx_queue_missed_nvlist), oldnv, newnv);
+	}
 
 	if (cb->cb_literal)
 		format = ZFS_NICENUM_RAW;
@@ -3284,8 +3398,17 @@ print_iostat_queues(iostat_cbdata_t *cb, nvlist_t *oldnv,
 	for (i = 0; i < ARRAY_SIZE(names); i++) {
 		val = nva[i].data[0] * scale;
 		print_one_stat(val, format, column_width, cb->cb_scripted);
+
+		/* After each class's pend and activ columns */
+		if (missed != NULL && i % 2 == 1) {
+			val = missed[i / 2].data[0] * scale;
+			print_one_stat(val, format, column_width,
+			    cb->cb_scripted);
+		}
 	}
 
+	if (missed != NULL)
+		free_calc_stats(missed, ARRAY_SIZE(vsx_queue_missed_nvlist));
 	free_calc_stats(nva, ARRAY_SIZE(names));
 }
 
@@ -3495,7 +3618,7 @@ children:
 		(void) nvlist_lookup_uint64(newchild[c], ZPOOL_CONFIG_IS_LOG,
 		    &islog);
 
-		if (ishole || islog)
+		if (ishole || islog || vdev_alloc_bias(newchild[c]) != NULL)
 			continue;
 
 		vname = zpool_vdev_name(g_zfs, zhp, newchild[c],
@@ -3532,6 +3655,33 @@ children:
 
 	}
 
+	/*
+	 * Dedup and special device sections
+	 */
+
+	for (i = 0; i < ARRAY_SIZE(alloc_class_bias); i++) {
+		const char *bias = alloc_class_bias[i];
+
+		if (num_class_vdevs(newnv, bias) == 0)
+			continue;
+
+		if ((!(cb->cb_flags & IOS_ANYHISTO_M)) && !cb->cb_scripted &&
+		    !cb->cb_vdev_names) {
+			print_iostat_dashes(cb, 0, bias);
+		}
+
+		for (c = 0; c < children; c++) {
+			if (!is_class_vdev(newchild[c], bias))
+				continue;
+
+			vname = zpool_vdev_name(g_zfs, zhp, newchild[c],
+			    cb->cb_name_flags);
+			ret += print_vdev_stats(zhp, vname, oldnv ?
+			    oldchild[c] : NULL, newchild[c], cb, depth + 2);
+			free(vname);
+		}
+	}
+
 	/*
 	 * Include level 2 ARC devices in iostat output
 	 */
@@ -3799,6 +3949,33 @@ end:
 	return (0);
 }
 
+/*
+ * Clear "*data" if a pool doesn't report the optional deadline misses of -q.
+ */
+static int
+get_queue_missed_cb(zpool_handle_t *zhp, void *data)
+{
+	boolean_t *missed = data;
+	nvlist_t *config, *nvroot, *nvx;
+	int i;
+
+	config = zpool_get_config(zhp, NULL);
+	verify(nvlist_lookup_nvlist(config, ZPOOL_CONFIG_VDEV_TREE,
+	    &nvroot) == 0);
+
+	if (nvlist_lookup_nvlist(nvroot, ZPOOL_CONFIG_VDEV_STATS_EX,
+	    &nvx) != 0) {
+		*missed = B_FALSE;
+		return (0);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(vsx_queue_missed_nvlist); i++) {
+		if (!nvlist_exists(nvx, vsx_queue_missed_nvlist[i]))
+			*missed = B_FALSE;
+	}
+	return (0);
+}
+
 /*
  * Return a bitmask of stats that are supported on all pools by both the module
  * and zpool iostat.
@@ -4008,7 +4185,7 @@ fsleep(float sec) {
  *	-H	Scripted mode.  Don't display headers, and separate properties
  *		by a single tab.
  *	-l	Display average latency
- *	-q	Display queue depths
+ *	-q	Display queue depths and deadline misses
  *	-w	Display latency histograms
  *	-r	Display request size histogram
  *	-T	Display a timestamp in date(1) or Unix format
@@ -4238,6 +4415,12 @@ zpool_do_iostat(int argc, char **argv)
 		return (1);
 	}
 
+	if (cb.cb_flags & IOS_QUEUES_M) {
+		cb.cb_queue_missed = B_TRUE;
+		pool_list_iter(list, B_FALSE, get_queue_missed_cb,
+		    &cb.cb_queue_missed);
+	}
+
 
 	for (;;) {
 		if ((npools = pool_list_count(list)) == 0)
@@ -4508,6 +4691,8 @@ print_list_stats(zpool_handle_t *zhp, const char *name, nvlist_t *nv,
 	boolean_t scripted = cb->cb_scripted;
 	uint64_t islog = B_FALSE;
 	boolean_t haslog = B_FALSE;
+	boolean_t hasclass = B_FALSE;
+	uint_t n;
 	char *dashes = "%-*s      -      -      -         -      -      -\n";
 
 	verify(nvlist_lookup_uint64_array(nv, ZPOOL_CONFIG_VDEV_STATS,
@@ -4565,6 +4750,11 @@ print_list_stats(zpool_handle_t *zhp, const char *name, nvlist_t *nv,
 			continue;
 		}
 
+		if (vdev_alloc_bias(child[c]) != NULL) {
+			hasclass = B_TRUE;
+			continue;
+		}
+
 		vname = zpool_vdev_name(g_zfs, zhp, child[c],
 		    cb->cb_name_flags);
 		print_list_stats(zhp, vname, child[c], cb, depth + 2);
@@ -4585,6 +4775,27 @@ print_list_stats(zpool_handle_t *zhp, const char *name, nvlist_t *nv,
 		}
 	}
 
+	/*
+	 * The dedup section shows the space the dedup tables take up on
+	 * the dedup vdevs.
+	 */
+	for (n = 0; hasclass && n < ARRAY_SIZE(alloc_class_bias); n++) {
+		const char *bias = alloc_class_bias[n];
+
+		if (num_class_vdevs(nv, bias) == 0)
+			continue;
+		/* LINTED E_SEC_PRINTF_VAR_FMT */
+		(void) printf(dashes, cb->cb_namewidth, bias);
+		for (c = 0; c < children; c++) {
+			if (!is_class_vdev(child[c], bias))
+				continue;
+			vname = zpool_vdev_name(g_zfs, zhp, child[c],
+			    cb->cb_name_flags);
+			print_list_stats(zhp, vname, child[c], cb, depth + 2);
+			free(vname);
+		}
+	}
+
 	if (nvlist_lookup_nvlist_array(nv, ZPOOL_CONFIG_L2CACHE,
 	    &child, &children) == 0 && children > 0) {
 		/* LINTED E_SEC_PRINTF_VAR_FMT */
@@ -5081,7 +5292,7 @@ zpool_do_split(int argc, char **argv)
 		if (flags.dryrun) {
 			(void) printf(gettext("would create '%s' with the "
 			    "following layout:\n\n"), newpool);
-			print_vdev_tree(NULL, newpool, config, 0, B_FALSE,
+			print_vdev_tree(NULL, newpool, config, 0, NULL,
 			    flags.name_flags);
 		}
 	}
@@ -5513,6 +5724,81 @@ zpool_do_scrub(int argc, char **argv)
 	return (for_each_pool(argc, argv, B_TRUE, NULL, scrub_callback, &cb));
 }
 
+typedef struct trim_cbdata {
+	boolean_t	cb_start;
+	uint64_t	cb_rate;
+} trim_cbdata_t;
+
+int
+trim_callback(zpool_handle_t *zhp, void *data)
+{
+	trim_cbdata_t *cb = data;
+
+	/*
+	 * Ignore faulted pools.
+	 */
+	if (zpool_get_state(zhp) == POOL_STATE_UNAVAIL) {
+		(void) fprintf(stderr, gettext("cannot trim '%s': pool is "
+		    "currently unavailable\n"), zpool_get_name(zhp));
+		return (1);
+	}
+
+	return (zpool_trim(zhp, cb->cb_start, cb->cb_rate) != 0);
+}
+
+/*
+ * zpool trim [-r <rate>] [-s] <pool> ...
+ *
+ *	-r	Rate.  Trim at no more than <rate> bytes per second.
+ *	-s	Stop.  Stops any in-progress trim.
+ */
+int
+zpool_do_trim(int argc, char **argv)
+{
+	int c;
+	trim_cbdata_t cb;
+
+	cb.cb_start = B_TRUE;
+	cb.cb_rate = 0;
+
+	/* check options */
+	while ((c = getopt(argc, argv, ":r:s")) != -1) {
+		switch (c) {
+		case 'r':
+			if (zfs_nicestrtonum(g_zfs, optarg,
+			    &cb.cb_rate) != 0) {
+				(void) fprintf(stderr,
+				    gettext("invalid rate '%s': %s\n"),
+				    optarg, libzfs_error_description(g_zfs));
+				usage(B_FALSE);
+			}
+			break;
+		case 's':
+			cb.cb_start = B_FALSE;
+			break;
+		case ':':
+			(void) fprintf(stderr, gettext("missing argument for "
+			    "'%c' option\n"), optopt);
+			usage(B_FALSE);
+			break;
+		case '?':
+			(void) fprintf(stderr, gettext("invalid option '%c'\n"),
+			    optopt);
+			usage(B_FALSE);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1) {
+		(void) fprintf(stderr, gettext("missing pool name argument\n"));
+		usage(B_FALSE);
+	}
+
+	return (for_each_pool(argc, argv, B_TRUE, NULL, trim_callback, &cb));
+}
+
 typedef struct status_cbdata {
 	int		cb_count;
 	int		cb_name_flags;
@@ -5532,10 +5818,11 @@ print_scan_status(pool_scan_stat_t *ps)
 {
 	time_t start, end, pause;
 	uint64_t elapsed, mins_left, hours_left;
-	uint64_t pass_exam, examined, total;
-	uint_t rate;
+	uint64_t pass_exam, pass_issued, examined, issued, total;
+	uint_t rate, issue_rate;
 	double fraction_done;
-	char processed_buf[7], examined_buf[7], total_buf[7], rate_buf[7];
+	char processed_buf[7], examined_buf[7], issued_buf[7], total_buf[7];
+	char rate_buf[7], issue_rate_buf[7];
 
 	(void) printf(gettext("  scan: "));
 
@@ -5607,21 +5894,30 @@ print_scan_status(pool_scan_stat_t *ps)
 		    ctime(&start));
 	}
 
+	/*
+	 * A sorted scan first scans (traverses) the pool, queueing what it
+	 * finds, then issues the reads; progress is in terms of the latter.
+	 */
 	examined = ps->pss_examined ? ps->pss_examined : 1;
+	issued = ps->pss_issued ? ps->pss_issued : 1;
 	total = ps->pss_to_examine;
-	fraction_done = (double)examined / total;
+	fraction_done = (double)issued / total;
 
 	/* elapsed time for this pass */
 	elapsed = time(NULL) - ps->pss_pass_start;
 	elapsed -= ps->pss_pass_scrub_spent_paused;
 	elapsed = elapsed ? elapsed : 1;
 	pass_exam = ps->pss_pass_exam ? ps->pss_pass_exam : 1;
+	pass_issued = ps->pss_pass_issued ? ps->pss_pass_issued : 1;
 	rate = pass_exam / elapsed;
 	rate = rate ? rate : 1;
-	mins_left = ((total - examined) / rate) / 60;
+	issue_rate = pass_issued / elapsed;
+	issue_rate = issue_rate ? issue_rate : 1;
+	mins_left = ((total - MIN(issued, total)) / issue_rate) / 60;
 	hours_left = mins_left / 60;
 
 	zfs_nicenum(examined, examined_buf, sizeof (examined_buf));
+	zfs_nicenum(issued, issued_buf, sizeof (issued_buf));
 	zfs_nicenum(total, total_buf, sizeof (total_buf));
 
 	/*
@@ -5630,8 +5926,12 @@ print_scan_status(pool_scan_stat_t *ps)
 	 */
 	if (pause == 0) {
 		zfs_nicenum(rate, rate_buf, sizeof (rate_buf));
-		(void) printf(gettext("\t%s scanned out of %s at %s/s"),
-		    examined_buf, total_buf, rate_buf);
+		zfs_nicenum(issue_rate, issue_rate_buf,
+		    sizeof (issue_rate_buf));
+		(void) printf(gettext("\t%s scanned at %s/s, "
+		    "%s issued at %s/s, %s total"),
+		    examined_buf, rate_buf, issued_buf, issue_rate_buf,
+		    total_buf);
 		if (hours_left < (30 * 24)) {
 			(void) printf(gettext(", %lluh%um to go\n"),
 			    (u_longlong_t)hours_left, (uint_t)(mins_left % 60));
@@ -5640,8 +5940,8 @@ print_scan_status(pool_scan_stat_t *ps)
 			    ", (scan is slow, no estimated time)\n"));
 		}
 	} else {
-		(void) printf(gettext("\t%s scanned out of %s\n"),
-		    examined_buf, total_buf);
+		(void) printf(gettext("\t%s scanned, %s issued, %s total\n"),
+		    examined_buf, issued_buf, total_buf);
 	}
 
 	if (ps->pss_func == POOL_SCAN_RESILVER) {
@@ -5653,6 +5953,64 @@ print_scan_status(pool_scan_stat_t *ps)
 	}
 }
 
+/*
+ * Print out the progress of "zpool trim" and how much autotrim has
+ * trimmed.
+ */
+static void
+print_trim_status(pool_trim_stat_t *pts)
+{
+	time_t start, end;
+	uint64_t minutes_taken, to_examine;
+	char bytes_buf[7], rate_buf[7], auto_buf[7];
+
+	/* Pools that have never been trimmed don't report anything. */
+	if (pts == NULL)
+		return;
+
+	start = pts->pts_start_time;
+	end = pts->pts_end_time;
+	zfs_nicenum(pts->pts_bytes, bytes_buf, sizeof (bytes_buf));
+
+	(void) printf(gettext("  trim: "));
+
+	switch (pts->pts_state) {
+	case POOL_TRIM_ACTIVE:
+		to_examine = pts->pts_to_examine ? pts->pts_to_examine : 1;
+		(void) printf(gettext("trim in progress since %s"),
+		    ctime(&start));
+		(void) printf(gettext("    %s trimmed, %.2f%% done"),
+		    bytes_buf, 100.0 * MIN(pts->pts_examined, to_examine) /
+		    to_examine);
+		if (pts->pts_rate != 0) {
+			zfs_nicenum(pts->pts_rate, rate_buf,
+			    sizeof (rate_buf));
+			(void) printf(gettext(", limited to %s/s"), rate_buf);
+		}
+		(void) printf("\n");
+		break;
+	case POOL_TRIM_FINISHED:
+		minutes_taken = (end - start) / 60;
+		(void) printf(gettext("trimmed %s in %lluh%um on %s"),
+		    bytes_buf, (u_longlong_t)(minutes_taken / 60),
+		    (uint_t)(minutes_taken % 60), ctime(&end));
+		break;
+	case POOL_TRIM_CANCELED:
+		(void) printf(gettext("trim canceled after %s on %s"),
+		    bytes_buf, ctime(&end));
+		break;
+	default:
+		(void) printf(gettext("none requested\n"));
+		break;
+	}
+
+	if (pts->pts_auto_bytes != 0) {
+		zfs_nicenum(pts->pts_auto_bytes, auto_buf, sizeof (auto_buf));
+		(void) printf(gettext("    %s trimmed by autotrim\n"),
+		    auto_buf);
+	}
+}
+
 static void
 print_error_log(zpool_handle_t *zhp)
 {
@@ -6060,11 +6418,16 @@ status_callback(zpool_handle_t *zhp, void *data)
 		nvlist_t **spares, **l2cache;
 		uint_t nspares, nl2cache;
 		pool_scan_stat_t *ps = NULL;
+		pool_trim_stat_t *pts = NULL;
 
 		(void) nvlist_lookup_uint64_array(nvroot,
 		    ZPOOL_CONFIG_SCAN_STATS, (uint64_t **)&ps, &c);
 		print_scan_status(ps);
 
+		(void) nvlist_lookup_uint64_array(nvroot,
+		    ZPOOL_CONFIG_TRIM_STATS, (uint64_t **)&pts, &c);
+		print_trim_status(pts);
+
 		namewidth = max_width(zhp, nvroot, 0, 0, cbp->cb_name_flags);
 		if (namewidth < 10)
 			namewidth = 10;
@@ -6075,9 +6438,17 @@ status_callback(zpool_handle_t *zhp, void *data)
 		print_status_config(zhp, zpool_get_name(zhp), nvroot,
 		    namewidth, 0, B_FALSE, cbp->cb_name_flags);
 
-		if (num_logs(nvroot) > 0)
-			print_logs(zhp, nvroot, namewidth, B_TRUE,
-			    cbp->cb_name_flags);
+		if (num_logs(nvroot) > 0) {
+			print_class_vdevs(zhp, nvroot, namewidth, B_TRUE,
+			    VDEV_TYPE_LOG, cbp->cb_name_flags);
+		}
+		for (c = 0; c < ARRAY_SIZE(alloc_class_bias); c++) {
+			if (num_class_vdevs(nvroot, alloc_class_bias[c]) > 0) {
+				print_class_vdevs(zhp, nvroot, namewidth,
+				    B_TRUE, alloc_class_bias[c],
+				    cbp->cb_name_flags);
+			}
+		}
 		if (nvlist_lookup_nvlist_array(nvroot, ZPOOL_CONFIG_L2CACHE,
 		    &l2cache, &nl2cache) == 0)
 			print_l2cache(zhp, l2cache, nl2cache, namewidth,
@@ -86,6 +86,52 @@ num_logs(nvlist_t *nv)
 	return (nlogs);
 }
 
+/*
+ * Return the allocation bias (VDEV_ALLOC_BIAS_*) of the supplied top-level
+ * vdev, or NULL if it has none
+ */
+const char *
+vdev_alloc_bias(nvlist_t *nv)
+{
+	char *bias;
+
+	if (nvlist_lookup_string(nv, ZPOOL_CONFIG_ALLOCATION_BIAS, &bias) != 0)
+		return (NULL);
+	return (bias);
+}
+
+/*
+ * Return whether the supplied top-level vdev has the given allocation bias
+ */
+boolean_t
+is_class_vdev(nvlist_t *nv, const char *bias)
+{
+	const char *vbias = vdev_alloc_bias(nv);
+
+	return (vbias != NULL && strcmp(vbias, bias) == 0);
+}
+
+/*
+ * Return the number of vdevs in supplied nvlist with the given allocation bias
+ */
+uint_t
+num_class_vdevs(nvlist_t *nv, const char *bias)
+{
+	uint_t nclass = 0;
+	uint_t c, children;
+	nvlist_t **child;
+
+	if (nvlist_lookup_nvlist_array(nv, ZPOOL_CONFIG_CHILDREN,
+	    &child, &children) != 0)
+		return (0);
+
+	for (c = 0; c < children; c++) {
+		if (is_class_vdev(child[c], bias))
+			nclass++;
+	}
+	return (nclass);
+}
+
 /* Find the max element in an array of uint64_t values */
 uint64_t
 array64_max(uint64_t array[], unsigned int len) {
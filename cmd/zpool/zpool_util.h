@@ -39,6 +39,9 @@ extern "C" {
 void *safe_malloc(size_t);
 void zpool_no_memory(void);
 uint_t num_logs(nvlist_t *nv);
+const char *vdev_alloc_bias(nvlist_t *nv);
+boolean_t is_class_vdev(nvlist_t *nv, const char *bias);
+uint_t num_class_vdevs(nvlist_t *nv, const char *bias);
 uint64_t array64_max(uint64_t array[], unsigned int len);
 int zfs_isnumber(char *str);
 
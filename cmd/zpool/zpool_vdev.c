@@ -1483,6 +1483,18 @@ is_grouping(const char *type, int *mindev, int *maxdev)
 		return (VDEV_TYPE_L2CACHE);
 	}
 
+	if (strcmp(type, VDEV_ALLOC_BIAS_SPECIAL) == 0) {
+		if (mindev != NULL)
+			*mindev = 1;
+		return (VDEV_ALLOC_BIAS_SPECIAL);
+	}
+
+	if (strcmp(type, VDEV_ALLOC_BIAS_DEDUP) == 0) {
+		if (mindev != NULL)
+			*mindev = 1;
+		return (VDEV_ALLOC_BIAS_DEDUP);
+	}
+
 	return (NULL);
 }
 
@@ -1497,9 +1509,10 @@ construct_spec(nvlist_t *props, int argc, char **argv)
 {
 	nvlist_t *nvroot, *nv, **top, **spares, **l2cache;
 	int t, toplevels, mindev, maxdev, nspares, nlogs, nl2cache;
-	const char *type;
+	int nspecial, ndedup, *nbias;
+	const char *type, *bias;
 	uint64_t is_log;
-	boolean_t seen_logs;
+	boolean_t seen_logs, seen_special, seen_dedup;
 
 	top = NULL;
 	toplevels = 0;
@@ -1508,8 +1521,14 @@ construct_spec(nvlist_t *props, int argc, char **argv)
 	nspares = 0;
 	nlogs = 0;
 	nl2cache = 0;
+	nspecial = 0;
+	ndedup = 0;
+	nbias = NULL;
 	is_log = B_FALSE;
 	seen_logs = B_FALSE;
+	bias = NULL;
+	seen_special = B_FALSE;
+	seen_dedup = B_FALSE;
 
 	while (argc > 0) {
 		nv = NULL;
@@ -1531,6 +1550,7 @@ construct_spec(nvlist_t *props, int argc, char **argv)
 					return (NULL);
 				}
 				is_log = B_FALSE;
+				bias = NULL;
 			}
 
 			if (strcmp(type, VDEV_TYPE_LOG) == 0) {
@@ -1543,6 +1563,7 @@ construct_spec(nvlist_t *props, int argc, char **argv)
 				}
 				seen_logs = B_TRUE;
 				is_log = B_TRUE;
+				bias = NULL;
 				argc--;
 				argv++;
 				/*
@@ -1552,6 +1573,34 @@ construct_spec(nvlist_t *props, int argc, char **argv)
 				continue;
 			}
 
+			if (strcmp(type, VDEV_ALLOC_BIAS_SPECIAL) == 0 ||
+			    strcmp(type, VDEV_ALLOC_BIAS_DEDUP) == 0) {
+				boolean_t special = (strcmp(type,
+				    VDEV_ALLOC_BIAS_SPECIAL) == 0);
+				boolean_t *seen = special ?
+				    &seen_special : &seen_dedup;
+
+				if (*seen) {
+					(void) fprintf(stderr,
+					    gettext("invalid vdev "
+					    "specification: '%s' can be "
+					    "specified only once\n"), type);
+					return (NULL);
+				}
+				*seen = B_TRUE;
+				bias = type;
+				nbias = special ? &nspecial : &ndedup;
+				is_log = B_FALSE;
+				argc--;
+				argv++;
+				/*
+				 * Like log, special and dedup are not real
+				 * grouping devices; the vdevs that follow
+				 * them are.
+				 */
+				continue;
+			}
+
 			if (strcmp(type, VDEV_TYPE_L2CACHE) == 0) {
 				if (l2cache != NULL) {
 					(void) fprintf(stderr,
@@ -1561,6 +1610,7 @@ construct_spec(nvlist_t *props, int argc, char **argv)
 					return (NULL);
 				}
 				is_log = B_FALSE;
+				bias = NULL;
 			}
 
 			if (is_log) {
@@ -1574,6 +1624,9 @@ construct_spec(nvlist_t *props, int argc, char **argv)
 				nlogs++;
 			}
 
+			if (bias != NULL)
+				(*nbias)++;
+
 			for (c = 1; c < argc; c++) {
 				if (is_grouping(argv[c], NULL, NULL) != NULL)
 					break;
@@ -1620,6 +1673,11 @@ construct_spec(nvlist_t *props, int argc, char **argv)
 				    type) == 0);
 				verify(nvlist_add_uint64(nv,
 				    ZPOOL_CONFIG_IS_LOG, is_log) == 0);
+				if (bias != NULL) {
+					verify(nvlist_add_string(nv,
+					    ZPOOL_CONFIG_ALLOCATION_BIAS,
+					    bias) == 0);
+				}
 				if (strcmp(type, VDEV_TYPE_RAIDZ) == 0) {
 					verify(nvlist_add_uint64(nv,
 					    ZPOOL_CONFIG_NPARITY,
@@ -1643,6 +1701,11 @@ construct_spec(nvlist_t *props, int argc, char **argv)
 				return (NULL);
 			if (is_log)
 				nlogs++;
+			if (bias != NULL) {
+				verify(nvlist_add_string(nv,
+				    ZPOOL_CONFIG_ALLOCATION_BIAS, bias) == 0);
+				(*nbias)++;
+			}
 			argc--;
 			argv++;
 		}
@@ -1667,6 +1730,18 @@ construct_spec(nvlist_t *props, int argc, char **argv)
 		return (NULL);
 	}
 
+	if (seen_special && nspecial == 0) {
+		(void) fprintf(stderr, gettext("invalid vdev specification: "
+		    "special requires at least 1 device\n"));
+		return (NULL);
+	}
+
+	if (seen_dedup && ndedup == 0) {
+		(void) fprintf(stderr, gettext("invalid vdev specification: "
+		    "dedup requires at least 1 device\n"));
+		return (NULL);
+	}
+
 	/*
 	 * Finally, create nvroot and add all top-level vdevs to it.
 	 */
@@ -103,6 +103,7 @@
 #include <sys/zil_impl.h>
 #include <sys/vdev_impl.h>
 #include <sys/vdev_file.h>
+#include <sys/vdev_trim.h>
 #include <sys/spa_impl.h>
 #include <sys/metaslab_impl.h>
 #include <sys/dsl_prop.h>
@@ -192,6 +193,7 @@ static const ztest_shared_opts_t ztest_opts_defaults = {
 extern uint64_t metaslab_gang_bang;
 extern uint64_t metaslab_df_alloc_threshold;
 extern int metaslab_preload_limit;
+extern int spa_allocators;
 extern boolean_t zfs_compressed_arc_enabled;
 extern boolean_t zfs_abd_scatter_enabled;
 
@@ -273,6 +275,7 @@ typedef struct ztest_od {
 	uint64_t	od_crblocksize;
 	uint64_t	od_gen;
 	uint64_t	od_crgen;
+	uint64_t	od_crdnodesize;
 	char		od_name[ZFS_MAX_DATASET_NAME_LEN];
 } ztest_od_t;
 
@@ -316,10 +319,14 @@ ztest_func_t ztest_dmu_read_write;
 ztest_func_t ztest_dmu_write_parallel;
 ztest_func_t ztest_dmu_object_alloc_free;
 ztest_func_t ztest_dmu_commit_callbacks;
+ztest_func_t ztest_dnode_dirty_release;
 ztest_func_t ztest_zap;
 ztest_func_t ztest_zap_parallel;
 ztest_func_t ztest_zil_commit;
 ztest_func_t ztest_zil_remount;
+ztest_func_t ztest_zil_stripe;
+ztest_func_t ztest_metaslab_allocators;
+ztest_func_t ztest_range_tree;
 ztest_func_t ztest_dmu_read_write_zcopy;
 ztest_func_t ztest_dmu_objset_create_destroy;
 ztest_func_t ztest_dmu_prealloc;
@@ -333,14 +340,17 @@ ztest_func_t ztest_ddt_repair;
 ztest_func_t ztest_dmu_snapshot_hold;
 ztest_func_t ztest_spa_rename;
 ztest_func_t ztest_scrub;
+ztest_func_t ztest_trim;
 ztest_func_t ztest_dsl_dataset_promote_busy;
 ztest_func_t ztest_vdev_attach_detach;
 ztest_func_t ztest_vdev_LUN_growth;
 ztest_func_t ztest_vdev_add_remove;
+ztest_func_t ztest_vdev_class_add;
 ztest_func_t ztest_vdev_aux_add_remove;
 ztest_func_t ztest_split_pool;
 ztest_func_t ztest_reguid;
 ztest_func_t ztest_spa_upgrade;
+ztest_func_t ztest_spa_create_multi_vdev;
 
 uint64_t zopt_always = 0ULL * NANOSEC;		/* all the time */
 uint64_t zopt_incessant = 1ULL * NANOSEC / 10;	/* every 1/10 second */
@@ -359,11 +369,15 @@ ztest_info_t ztest_info[] = {
 	ZTI_INIT(ztest_dmu_write_parallel, 10, &zopt_always),
 	ZTI_INIT(ztest_dmu_object_alloc_free, 1, &zopt_always),
 	ZTI_INIT(ztest_dmu_commit_callbacks, 1, &zopt_always),
+	ZTI_INIT(ztest_dnode_dirty_release, 1, &zopt_sometimes),
 	ZTI_INIT(ztest_zap, 30, &zopt_always),
 	ZTI_INIT(ztest_zap_parallel, 100, &zopt_always),
 	ZTI_INIT(ztest_split_pool, 1, &zopt_always),
 	ZTI_INIT(ztest_zil_commit, 1, &zopt_incessant),
 	ZTI_INIT(ztest_zil_remount, 1, &zopt_sometimes),
+	ZTI_INIT(ztest_zil_stripe, 1, &zopt_sometimes),
+	ZTI_INIT(ztest_metaslab_allocators, 1, &zopt_often),
+	ZTI_INIT(ztest_range_tree, 1, &zopt_often),
 	ZTI_INIT(ztest_dmu_read_write_zcopy, 1, &zopt_often),
 	ZTI_INIT(ztest_dmu_objset_create_destroy, 1, &zopt_often),
 	ZTI_INIT(ztest_dsl_prop_get_set, 1, &zopt_often),
@@ -380,11 +394,14 @@ ztest_info_t ztest_info[] = {
 	ZTI_INIT(ztest_reguid, 1, &zopt_rarely),
 	ZTI_INIT(ztest_spa_rename, 1, &zopt_rarely),
 	ZTI_INIT(ztest_scrub, 1, &zopt_rarely),
+	ZTI_INIT(ztest_trim, 1, &zopt_sometimes),
 	ZTI_INIT(ztest_spa_upgrade, 1, &zopt_rarely),
+	ZTI_INIT(ztest_spa_create_multi_vdev, 1, &zopt_rarely),
 	ZTI_INIT(ztest_dsl_dataset_promote_busy, 1, &zopt_rarely),
 	ZTI_INIT(ztest_vdev_attach_detach, 1, &zopt_sometimes),
 	ZTI_INIT(ztest_vdev_LUN_growth, 1, &zopt_rarely),
 	ZTI_INIT(ztest_vdev_add_remove, 1, &ztest_opts.zo_vdevtime),
+	ZTI_INIT(ztest_vdev_class_add, 1, &ztest_opts.zo_vdevtime),
 	ZTI_INIT(ztest_vdev_aux_add_remove, 1, &ztest_opts.zo_vdevtime),
 };
 
@@ -418,6 +435,7 @@ typedef struct ztest_shared {
 	uint64_t	zs_mirrors;
 	uint64_t	zs_metaslab_sz;
 	uint64_t	zs_metaslab_df_alloc_threshold;
+	uint64_t	zs_spa_allocators;
 	uint64_t	zs_guid;
 } ztest_shared_t;
 
@@ -1074,6 +1092,33 @@ ztest_random_ibshift(void)
 	    ztest_random(DN_MAX_INDBLKSHIFT - DN_MIN_INDBLKSHIFT + 1));
 }
 
+static int
+ztest_random_dnodesize(void)
+{
+	uint64_t r;
+	int slots;
+	int max_slots = spa_maxdnodesize(ztest_spa) >> DNODE_SHIFT;
+
+	if (max_slots == DNODE_MIN_SLOTS)
+		return (DNODE_MIN_SIZE);
+
+	/*
+	 * Weight the random distribution more heavily toward smaller
+	 * dnode sizes since that is more likely to reflect real-world
+	 * usage.
+	 */
+	ASSERT3U(max_slots, >, 4);
+	r = ztest_random(10);
+	if (r == 0)
+		slots = 5 + ztest_random(max_slots - 4);
+	else if (r < 5)
+		slots = 2 + ztest_random(3);
+	else
+		slots = 1;
+
+	return (slots << DNODE_SHIFT);
+}
+
 static uint64_t
 ztest_random_vdev_top(spa_t *spa, boolean_t log_ok)
 {
@@ -1405,7 +1450,7 @@ ztest_bt_bonus(dmu_buf_t *db)
 #define	lrz_blocksize	lr_uid
 #define	lrz_ibshift	lr_gid
 #define	lrz_bonustype	lr_rdev
-#define	lrz_bonuslen	lr_crtime[1]
+#define	lrz_dnodesize	lr_crtime[1]
 
 static void
 ztest_log_create(ztest_ds_t *zd, dmu_tx_t *tx, lr_create_t *lr)
@@ -1516,9 +1561,11 @@ ztest_replay_create(ztest_ds_t *zd, lr_create_t *lr, boolean_t byteswap)
 	objset_t *os = zd->zd_os;
 	ztest_block_tag_t *bbt;
 	dmu_buf_t *db;
+	dmu_object_info_t doi;
 	dmu_tx_t *tx;
 	uint64_t txg;
 	int error = 0;
+	int bonuslen;
 
 	if (byteswap)
 		byteswap_uint64_array(lr, sizeof (*lr));
@@ -1526,6 +1573,8 @@ ztest_replay_create(ztest_ds_t *zd, lr_create_t *lr, boolean_t byteswap)
 	ASSERT(lr->lr_doid == ZTEST_DIROBJ);
 	ASSERT(name[0] != '\0');
 
+	bonuslen = DN_BONUS_SIZE(lr->lrz_dnodesize);
+
 	tx = dmu_tx_create(os);
 
 	dmu_tx_hold_zap(tx, lr->lr_doid, B_TRUE, name);
@@ -1544,23 +1593,23 @@ ztest_replay_create(ztest_ds_t *zd, lr_create_t *lr, boolean_t byteswap)
 
 	if (lr->lrz_type == DMU_OT_ZAP_OTHER) {
 		if (lr->lr_foid == 0) {
-			lr->lr_foid = zap_create(os,
-			    lr->lrz_type, lr->lrz_bonustype,
-			    lr->lrz_bonuslen, tx);
+			lr->lr_foid = zap_create_norm_dnsize(os,
+			    0, lr->lrz_type, lr->lrz_bonustype,
+			    bonuslen, lr->lrz_dnodesize, tx);
 		} else {
-			error = zap_create_claim(os, lr->lr_foid,
-			    lr->lrz_type, lr->lrz_bonustype,
-			    lr->lrz_bonuslen, tx);
+			error = zap_create_claim_norm_dnsize(os, lr->lr_foid,
+			    0, lr->lrz_type, lr->lrz_bonustype,
+			    bonuslen, lr->lrz_dnodesize, tx);
 		}
 	} else {
 		if (lr->lr_foid == 0) {
-			lr->lr_foid = dmu_object_alloc(os,
+			lr->lr_foid = dmu_object_alloc_dnsize(os,
 			    lr->lrz_type, 0, lr->lrz_bonustype,
-			    lr->lrz_bonuslen, tx);
+			    bonuslen, lr->lrz_dnodesize, tx);
 		} else {
-			error = dmu_object_claim(os, lr->lr_foid,
+			error = dmu_object_claim_dnsize(os, lr->lr_foid,
 			    lr->lrz_type, 0, lr->lrz_bonustype,
-			    lr->lrz_bonuslen, tx);
+			    bonuslen, lr->lrz_dnodesize, tx);
 		}
 	}
 
@@ -1573,6 +1622,9 @@ ztest_replay_create(ztest_ds_t *zd, lr_create_t *lr, boolean_t byteswap)
 
 	ASSERT(lr->lr_foid != 0);
 
+	VERIFY0(dmu_object_info(os, lr->lr_foid, &doi));
+	VERIFY3U(doi.doi_dnodesize, ==, lr->lrz_dnodesize);
+
 	if (lr->lrz_type != DMU_OT_ZAP_OTHER)
 		VERIFY3U(0, ==, dmu_object_set_blocksize(os, lr->lr_foid,
 		    lr->lrz_blocksize, lr->lrz_ibshift, tx));
@@ -1919,14 +1971,14 @@ ztest_get_done(zgd_t *zgd, int error)
 	ztest_object_unlock(zd, object);
 
 	if (error == 0 && zgd->zgd_bp)
-		zil_add_block(zgd->zgd_zilog, zgd->zgd_bp);
+		zil_lwb_add_block(zgd->zgd_lwb, zgd->zgd_bp);
 
 	umem_free(zgd, sizeof (*zgd));
 }
 
 static int
-ztest_get_data(void *arg, lr_write_t *lr, char *buf, zio_t *zio,
-			   struct znode *zp, struct rl *rl)
+ztest_get_data(void *arg, lr_write_t *lr, char *buf, struct lwb *lwb,
+    zio_t *zio, struct znode *zp, struct rl *rl)
 {
 	ztest_ds_t *zd = arg;
 	objset_t *os = zd->zd_os;
@@ -1940,6 +1992,10 @@ ztest_get_data(void *arg, lr_write_t *lr, char *buf, zio_t *zio,
 	zgd_t *zgd;
 	int error;
 
+	ASSERT3P(lwb, !=, NULL);
+	ASSERT3P(zio, !=, NULL);
+	ASSERT3U(size, !=, 0);
+
 	ztest_object_lock(zd, object, RL_READER);
 	error = dmu_bonus_hold(os, object, FTAG, &db);
 	if (error) {
@@ -1960,7 +2016,7 @@ ztest_get_data(void *arg, lr_write_t *lr, char *buf, zio_t *zio,
 	db = NULL;
 
 	zgd = umem_zalloc(sizeof (*zgd), UMEM_NOFAIL);
-	zgd->zgd_zilog = zd->zd_zilog;
+	zgd->zgd_lwb = lwb;
 	zgd->zgd_private = zd;
 
 	if (buf != NULL) {	/* immediate write */
@@ -2097,7 +2153,7 @@ ztest_create(ztest_ds_t *zd, ztest_od_t *od, int count)
 		lr->lrz_blocksize = od->od_crblocksize;
 		lr->lrz_ibshift = ztest_random_ibshift();
 		lr->lrz_bonustype = DMU_OT_UINT64_OTHER;
-		lr->lrz_bonuslen = dmu_bonus_max();
+		lr->lrz_dnodesize = od->od_crdnodesize;
 		lr->lr_gen = od->od_crgen;
 		lr->lr_crtime[0] = time(NULL);
 
@@ -2348,6 +2404,7 @@ ztest_od_init(ztest_od_t *od, uint64_t id, char *tag, uint64_t index,
 	od->od_crtype = type;
 	od->od_crblocksize = blocksize ? blocksize : ztest_random_blocksize();
 	od->od_crgen = gen;
+	od->od_crdnodesize = ztest_random_dnodesize();
 
 	od->od_type = DMU_OT_NONE;
 	od->od_blocksize = 0;
@@ -2434,6 +2491,358 @@ ztest_zil_remount(ztest_ds_t *zd, uint64_t id)
 	mutex_exit(&zd->zd_dirobj_lock);
 }
 
+/*
+ * Commit a run of writes one at a time, so that the dataset's log chain
+ * allocates a block per commit, and check that the blocks were spread
+ * over the log vdevs: with at least two healthy log vdevs every one of
+ * them must have been written, and each must have taken at least a
+ * minimum-sized log block.  With -VVV the achieved log bandwidth is
+ * reported, which makes this usable as a benchmark against file-backed
+ * log devices (e.g. ztest -T 60 -VVV with log vdevs added by
+ * ztest_vdev_add_remove).
+ */
+#define	ZTEST_ZIL_STRIPE_WRITES	64
+
+static boolean_t
+ztest_zil_stripe_healthy(vdev_t *rvd)
+{
+	uint64_t c;
+
+	for (c = 0; c < rvd->vdev_children; c++) {
+		vdev_t *tvd = rvd->vdev_child[c];
+
+		if (tvd->vdev_islog && tvd->vdev_state != VDEV_STATE_HEALTHY)
+			return (B_FALSE);
+	}
+	return (B_TRUE);
+}
+
+void
+ztest_zil_stripe(ztest_ds_t *zd, uint64_t id)
+{
+	spa_t *spa = ztest_spa;
+	objset_t *os = zd->zd_os;
+	vdev_t *rvd = spa->spa_root_vdev;
+	ztest_od_t *od;
+	uint64_t *ops, *bytes;
+	uint64_t blocksize, logbytes = 0;
+	uint64_t minbytes = UINT64_MAX, maxbytes = 0;
+	uint64_t children, c;
+	int nlogs = 0, used = 0;
+	boolean_t healthy;
+	hrtime_t start, delta;
+	void *data;
+	int i;
+
+	/*
+	 * Hold the log vdevs in place: adding and removing them takes
+	 * ztest_vdev_lock, and offlining a slog takes ztest_name_lock as
+	 * writer.
+	 */
+	mutex_enter(&ztest_vdev_lock);
+	(void) rw_rdlock(&ztest_name_lock);
+
+	spa_config_enter(spa, SCL_VDEV, FTAG, RW_READER);
+	children = rvd->vdev_children;
+	ops = umem_zalloc(children * sizeof (uint64_t), UMEM_NOFAIL);
+	bytes = umem_zalloc(children * sizeof (uint64_t), UMEM_NOFAIL);
+	for (c = 0; c < children; c++) {
+		vdev_t *tvd = rvd->vdev_child[c];
+
+		if (!tvd->vdev_islog)
+			continue;
+		nlogs++;
+		ops[c] = tvd->vdev_stat.vs_ops[ZIO_TYPE_WRITE];
+		bytes[c] = tvd->vdev_stat.vs_bytes[ZIO_TYPE_WRITE];
+	}
+	healthy = ztest_zil_stripe_healthy(rvd);
+	spa_config_exit(spa, SCL_VDEV, FTAG);
+
+	od = umem_alloc(sizeof (ztest_od_t), UMEM_NOFAIL);
+	ztest_od_init(od, id, FTAG, 0, DMU_OT_UINT64_OTHER, 0, 0);
+
+	/*
+	 * The log vdevs are only used for latency-biased, synchronous
+	 * datasets.
+	 */
+	if (nlogs < 2 || !healthy || os->os_logbias == ZFS_LOGBIAS_THROUGHPUT ||
+	    os->os_sync == ZFS_SYNC_DISABLED ||
+	    ztest_object_init(zd, od, sizeof (ztest_od_t), B_FALSE) != 0) {
+		(void) rw_unlock(&ztest_name_lock);
+		mutex_exit(&ztest_vdev_lock);
+		umem_free(od, sizeof (ztest_od_t));
+		umem_free(bytes, children * sizeof (uint64_t));
+		umem_free(ops, children * sizeof (uint64_t));
+		return;
+	}
+
+	blocksize = od->od_blocksize;
+	data = umem_alloc(blocksize, UMEM_NOFAIL);
+	(void) memset(data, 'a' + id % 26, blocksize);
+
+	(void) rw_rdlock(&zd->zd_zilog_lock);
+
+	start = gethrtime();
+	for (i = 0; i < ZTEST_ZIL_STRIPE_WRITES; i++) {
+		(void) ztest_write(zd, od->od_object, i * blocksize,
+		    blocksize, data);
+		zil_commit(zd->zd_zilog, od->od_object);
+	}
+	delta = gethrtime() - start;
+
+	(void) rw_unlock(&zd->zd_zilog_lock);
+
+	spa_config_enter(spa, SCL_VDEV, FTAG, RW_READER);
+	ASSERT3U(rvd->vdev_children, ==, children);
+	for (c = 0; c < children; c++) {
+		vdev_t *tvd = rvd->vdev_child[c];
+		uint64_t b;
+
+		if (!tvd->vdev_islog)
+			continue;
+		if (tvd->vdev_stat.vs_ops[ZIO_TYPE_WRITE] != ops[c])
+			used++;
+		b = tvd->vdev_stat.vs_bytes[ZIO_TYPE_WRITE] - bytes[c];
+		minbytes = MIN(minbytes, b);
+		maxbytes = MAX(maxbytes, b);
+		logbytes += b;
+	}
+	healthy = ztest_zil_stripe_healthy(rvd);
+	spa_config_exit(spa, SCL_VDEV, FTAG);
+
+	(void) rw_unlock(&ztest_name_lock);
+	mutex_exit(&ztest_vdev_lock);
+
+	if (ztest_opts.zo_verbose >= 3) {
+		(void) printf("zil stripe: %d of %d log vdevs, "
+		    "%llu bytes (%llu to %llu per vdev) in %llu us "
+		    "(%llu MB/s)\n", used, nlogs, (u_longlong_t)logbytes,
+		    (u_longlong_t)minbytes, (u_longlong_t)maxbytes,
+		    (u_longlong_t)(delta / (NANOSEC / MICROSEC)),
+		    (u_longlong_t)(delta == 0 ? 0 :
+		    logbytes * (NANOSEC / MICROSEC) / delta));
+	}
+
+	/*
+	 * A log vdev that faulted meanwhile may have been skipped by the
+	 * allocator, so only check a run that stayed healthy.
+	 */
+	if (healthy) {
+		VERIFY3U(used, ==, nlogs);
+		VERIFY3U(minbytes, >=, ZIL_MIN_BLKSZ);
+	}
+
+	umem_free(data, blocksize);
+	umem_free(od, sizeof (ztest_od_t));
+	umem_free(bytes, children * sizeof (uint64_t));
+	umem_free(ops, children * sizeof (uint64_t));
+}
+
+/*
+ * While the other threads keep allocating, check that the active
+ * metaslabs of every allocator are consistent: each occupied slot holds
+ * an active metaslab of that group, which records the same allocator and
+ * the same kind (primary or secondary), and no metaslab occupies two
+ * slots.  The number of allocators is varied from pass to pass.
+ */
+void
+ztest_metaslab_allocators(ztest_ds_t *zd, uint64_t id)
+{
+	spa_t *spa = ztest_spa;
+	vdev_t *rvd = spa->spa_root_vdev;
+	uint64_t c;
+	int a, b, active = 0;
+
+	spa_config_enter(spa, SCL_ALLOC, FTAG, RW_READER);
+	for (c = 0; c < rvd->vdev_children; c++) {
+		metaslab_group_t *mg = rvd->vdev_child[c]->vdev_mg;
+
+		if (mg == NULL)
+			continue;
+
+		mutex_enter(&mg->mg_lock);
+		VERIFY3S(mg->mg_allocators, ==, spa->spa_alloc_count);
+		for (a = 0; a < mg->mg_allocators; a++) {
+			metaslab_t *pri = mg->mg_primaries[a];
+			metaslab_t *sec = mg->mg_secondaries[a];
+
+			if (pri != NULL) {
+				VERIFY3P(pri->ms_group, ==, mg);
+				VERIFY3S(pri->ms_allocator, ==, a);
+				VERIFY(pri->ms_primary);
+				VERIFY(pri->ms_weight &
+				    METASLAB_WEIGHT_PRIMARY);
+				active++;
+			}
+			if (sec != NULL) {
+				VERIFY3P(sec->ms_group, ==, mg);
+				VERIFY3S(sec->ms_allocator, ==, a);
+				VERIFY(!sec->ms_primary);
+				VERIFY(sec->ms_weight &
+				    METASLAB_WEIGHT_SECONDARY);
+				active++;
+			}
+			for (b = 0; b < a; b++) {
+				VERIFY(pri == NULL ||
+				    mg->mg_primaries[b] != pri);
+				VERIFY(sec == NULL ||
+				    mg->mg_secondaries[b] != sec);
+			}
+		}
+		mutex_exit(&mg->mg_lock);
+	}
+	spa_config_exit(spa, SCL_ALLOC, FTAG);
+
+	if (ztest_opts.zo_verbose >= 3) {
+		(void) printf("metaslab allocators: %d, %d active metaslabs\n",
+		    spa->spa_alloc_count, active);
+	}
+}
+
+/*
+ * Exercise a range tree outside of any metaslab: add, remove and clear
+ * random extents while keeping a reference bitmap, then walk the tree and
+ * check that it describes exactly the set units, with adjacent extents
+ * merged into one segment.  With -VVV the update and walk times are
+ * reported, which makes this a quick benchmark of the range tree and its
+ * B-tree.
+ */
+#define	ZTEST_RT_UNITS	(1 << 16)
+#define	ZTEST_RT_SHIFT	9
+#define	ZTEST_RT_OPS	20000
+
+typedef struct ztest_rt_walk {
+	uint8_t		*rw_map;
+	uint64_t	rw_end;		/* end of the previous segment */
+	uint64_t	rw_space;
+	uint64_t	rw_segs;
+} ztest_rt_walk_t;
+
+static void
+ztest_range_tree_count(void *arg, uint64_t start, uint64_t size)
+{
+	ztest_rt_walk_t *rw = arg;
+
+	rw->rw_space += size;
+	rw->rw_segs++;
+}
+
+static void
+ztest_range_tree_check(void *arg, uint64_t start, uint64_t size)
+{
+	ztest_rt_walk_t *rw = arg;
+	uint64_t u;
+
+	VERIFY(rw->rw_segs == 0 || start > rw->rw_end);
+	VERIFY0(P2PHASE(start | size, 1ULL << ZTEST_RT_SHIFT));
+	for (u = rw->rw_end >> ZTEST_RT_SHIFT;
+	    u < start >> ZTEST_RT_SHIFT; u++)
+		VERIFY0(rw->rw_map[u]);
+	for (u = start >> ZTEST_RT_SHIFT;
+	    u < (start + size) >> ZTEST_RT_SHIFT; u++)
+		VERIFY(rw->rw_map[u]);
+
+	rw->rw_end = start + size;
+	ztest_range_tree_count(arg, start, size);
+}
+
+/* ARGSUSED */
+void
+ztest_range_tree(ztest_ds_t *zd, uint64_t id)
+{
+	kmutex_t lock;
+	range_tree_t *rt;
+	ztest_rt_walk_t rw;
+	uint8_t *map;
+	uint64_t u;
+	hrtime_t start, op_time, walk_time;
+	int i;
+
+	map = umem_zalloc(ZTEST_RT_UNITS, UMEM_NOFAIL);
+	mutex_init(&lock, NULL, MUTEX_DEFAULT, NULL);
+	rt = range_tree_create(NULL, NULL, &lock);
+
+	mutex_enter(&lock);
+	start = gethrtime();
+	for (i = 0; i < ZTEST_RT_OPS; i++) {
+		uint64_t first = ztest_random(ZTEST_RT_UNITS);
+		uint64_t len = 1 +
+		    ztest_random(MIN(16, ZTEST_RT_UNITS - first));
+		uint8_t set = map[first];
+
+		/*
+		 * Now and then clear an extent regardless of its state;
+		 * unlike remove, clear accepts any mix of set and free units.
+		 */
+		if (ztest_random(8) == 0) {
+			uint64_t space = range_tree_space(rt);
+			uint64_t cleared = 0;
+
+			for (u = first; u < first + len; u++)
+				cleared += map[u];
+			range_tree_clear(rt,
+			    first << ZTEST_RT_SHIFT, len << ZTEST_RT_SHIFT);
+			VERIFY3U(space - range_tree_space(rt), ==,
+			    cleared << ZTEST_RT_SHIFT);
+			(void) memset(map + first, 0, len);
+			continue;
+		}
+
+		/*
+		 * Trim the extent to units in the same state as the first,
+		 * then flip it: free extents are added, allocated removed.
+		 */
+		for (u = first + 1; u < first + len; u++) {
+			if (map[u] != set)
+				break;
+		}
+		len = u - first;
+
+		if (set) {
+			VERIFY(range_tree_contains(rt,
+			    first << ZTEST_RT_SHIFT, len << ZTEST_RT_SHIFT));
+			range_tree_remove(rt,
+			    first << ZTEST_RT_SHIFT, len << ZTEST_RT_SHIFT);
+		} else {
+			range_tree_add(rt,
+			    first << ZTEST_RT_SHIFT, len << ZTEST_RT_SHIFT);
+		}
+		(void) memset(map + first, !set, len);
+	}
+	op_time = gethrtime() - start;
+
+	bzero(&rw, sizeof (rw));
+	start = gethrtime();
+	range_tree_walk(rt, ztest_range_tree_count, &rw);
+	walk_time = gethrtime() - start;
+	VERIFY3U(rw.rw_space, ==, range_tree_space(rt));
+	VERIFY3U(rw.rw_segs, ==, range_tree_numsegs(rt));
+
+	bzero(&rw, sizeof (rw));
+	rw.rw_map = map;
+	range_tree_walk(rt, ztest_range_tree_check, &rw);
+	for (u = rw.rw_end >> ZTEST_RT_SHIFT; u < ZTEST_RT_UNITS; u++)
+		VERIFY0(map[u]);
+	range_tree_stat_verify(rt);
+	zfs_btree_verify(&rt->rt_root);
+
+	if (ztest_opts.zo_verbose >= 3) {
+		(void) printf("range tree: %d ops in %llu us, "
+		    "%llu segments (%llu bytes) walked in %llu us\n",
+		    ZTEST_RT_OPS,
+		    (u_longlong_t)(op_time / (NANOSEC / MICROSEC)),
+		    (u_longlong_t)rw.rw_segs,
+		    (u_longlong_t)zfs_btree_memory(&rt->rt_root),
+		    (u_longlong_t)(walk_time / (NANOSEC / MICROSEC)));
+	}
+
+	range_tree_vacate(rt, NULL, NULL);
+	mutex_exit(&lock);
+	range_tree_destroy(rt);
+	mutex_destroy(&lock);
+	umem_free(map, ZTEST_RT_UNITS);
+}
+
 /*
  * Verify that we can't destroy an active pool, create an existing pool,
  * or create a pool with a bad vdev spec.
@@ -2550,6 +2959,70 @@ ztest_spa_upgrade(ztest_ds_t *zd, uint64_t id)
 	mutex_exit(&ztest_vdev_lock);
 }
 
+#define	ZTEST_MULTI_VDEVS	4
+
+/*
+ * Create a pool with several top-level vdevs, whose metaslabs allocate
+ * their space maps in the same txgs (concurrently, when the vdevs are
+ * synced in parallel), and verify that the spacemap_histogram refcount
+ * matches the space maps in the MOS.  The pool is reimported read-only
+ * so that nothing changes while the MOS is walked.
+ */
+/* ARGSUSED */
+void
+ztest_spa_create_multi_vdev(ztest_ds_t *zd, uint64_t id)
+{
+	spa_t *spa;
+	objset_t *mos;
+	nvlist_t *nvroot, *config, *props;
+	dmu_object_info_t doi;
+	uint64_t object, count, refcount;
+	char *name;
+
+	mutex_enter(&ztest_vdev_lock);
+	name = kmem_asprintf("%s_multi", ztest_opts.zo_pool);
+
+	nvroot = make_vdev_root(NULL, NULL, name, ztest_opts.zo_vdev_size, 0,
+	    0, 0, 0, ZTEST_MULTI_VDEVS);
+	VERIFY0(spa_create(name, nvroot, NULL, NULL, NULL));
+	fnvlist_free(nvroot);
+
+	VERIFY0(spa_open(name, &spa, FTAG));
+	VERIFY3U(spa->spa_root_vdev->vdev_children, ==, ZTEST_MULTI_VDEVS);
+	txg_wait_synced(spa_get_dsl(spa), 0);
+	spa_close(spa, FTAG);
+
+	VERIFY0(spa_export(name, &config, B_FALSE, B_FALSE));
+	props = fnvlist_alloc();
+	fnvlist_add_uint64(props, zpool_prop_to_name(ZPOOL_PROP_READONLY), 1);
+	VERIFY0(spa_import(name, config, props, 0));
+	fnvlist_free(props);
+	nvlist_free(config);
+
+	VERIFY0(spa_open(name, &spa, FTAG));
+	mos = spa_meta_objset(spa);
+	count = 0;
+	for (object = 0; dmu_object_next(mos, &object, B_FALSE, 0) == 0; ) {
+		VERIFY0(dmu_object_info(mos, object, &doi));
+		if (doi.doi_type == DMU_OT_SPACE_MAP &&
+		    doi.doi_bonus_size == sizeof (space_map_phys_t))
+			count++;
+	}
+	VERIFY0(feature_get_refcount(spa,
+	    &spa_feature_table[SPA_FEATURE_SPACEMAP_HISTOGRAM], &refcount));
+	if (ztest_opts.zo_verbose >= 4) {
+		(void) printf("%s: %llu space maps, refcount %llu\n", name,
+		    (u_longlong_t)count, (u_longlong_t)refcount);
+	}
+	VERIFY3U(count, ==, refcount);
+	spa_close(spa, FTAG);
+
+	VERIFY0(spa_export(name, NULL, B_FALSE, B_FALSE));
+
+	strfree(name);
+	mutex_exit(&ztest_vdev_lock);
+}
+
 static vdev_t *
 vdev_lookup_by_path(vdev_t *vd, const char *path)
 {
@@ -2656,6 +3129,64 @@ ztest_vdev_add_remove(ztest_ds_t *zd, uint64_t id)
 	mutex_exit(&ztest_vdev_lock);
 }
 
+/*
+ * Verify that special and dedup vdevs can be added.  Small blocks are sent
+ * to the special vdevs half of the time.
+ */
+/* ARGSUSED */
+void
+ztest_vdev_class_add(ztest_ds_t *zd, uint64_t id)
+{
+	ztest_shared_t *zs = ztest_shared;
+	spa_t *spa = ztest_spa;
+	uint64_t leaves;
+	nvlist_t *nvroot, **child;
+	uint_t children;
+	const char *class = (ztest_random(2) == 0) ?
+	    VDEV_ALLOC_BIAS_SPECIAL : VDEV_ALLOC_BIAS_DEDUP;
+	int error;
+
+	/*
+	 * Class vdevs are only added with mirrors, and only half of the
+	 * time, so that the normal class keeps most of the metadata too.
+	 */
+	if (zs->zs_mirrors < 2 || ztest_random(2) == 0 ||
+	    !spa_feature_is_enabled(spa, SPA_FEATURE_ALLOCATION_CLASSES))
+		return;
+
+	mutex_enter(&ztest_vdev_lock);
+	leaves = MAX(zs->zs_mirrors + zs->zs_splits, 1) * ztest_opts.zo_raidz;
+
+	spa_config_enter(spa, SCL_VDEV, FTAG, RW_READER);
+	ztest_shared->zs_vdev_next_leaf = find_vdev_hole(spa) * leaves;
+	spa_config_exit(spa, SCL_VDEV, FTAG);
+
+	nvroot = make_vdev_root(NULL, NULL, NULL, ztest_opts.zo_vdev_size, 0,
+	    0, ztest_opts.zo_raidz, zs->zs_mirrors, 1);
+	VERIFY0(nvlist_lookup_nvlist_array(nvroot, ZPOOL_CONFIG_CHILDREN,
+	    &child, &children));
+	VERIFY0(nvlist_add_string(child[0], ZPOOL_CONFIG_ALLOCATION_BIAS,
+	    class));
+
+	error = spa_vdev_add(spa, nvroot);
+	nvlist_free(nvroot);
+
+	if (error == ENOSPC)
+		ztest_record_enospc("spa_vdev_add");
+	else if (error != 0)
+		fatal(0, "spa_vdev_add(%s) = %d", class, error);
+
+	mutex_exit(&ztest_vdev_lock);
+
+	if (error == 0 && strcmp(class, VDEV_ALLOC_BIAS_SPECIAL) == 0 &&
+	    ztest_random(2) == 0) {
+		(void) rw_rdlock(&ztest_name_lock);
+		(void) ztest_dsl_prop_set_uint64(zd->zd_name,
+		    ZFS_PROP_SPECIAL_SMALL_BLOCKS, 32768, B_FALSE);
+		(void) rw_unlock(&ztest_name_lock);
+	}
+}
+
 /*
  * Verify that adding/removing aux devices (l2arc, hot spare) works as expected.
  */
@@ -3689,6 +4220,43 @@ ztest_dmu_object_alloc_free(ztest_ds_t *zd, uint64_t id)
 	umem_free(od, size);
 }
 
+/*
+ * Dirty an object while holding its dnode and check that, once the txg
+ * has synced, the dnode gave its dirty state back even though it is still
+ * held.
+ */
+void
+ztest_dnode_dirty_release(ztest_ds_t *zd, uint64_t id)
+{
+	objset_t *os = zd->zd_os;
+	ztest_od_t *od;
+	dnode_t *dn;
+	void *data;
+
+	od = umem_alloc(sizeof (ztest_od_t), UMEM_NOFAIL);
+	ztest_od_init(od, id, FTAG, 0, DMU_OT_UINT64_OTHER, 0, 0);
+
+	if (ztest_object_init(zd, od, sizeof (ztest_od_t), B_FALSE) != 0 ||
+	    dnode_hold(os, od->od_object, FTAG, &dn) != 0) {
+		umem_free(od, sizeof (ztest_od_t));
+		return;
+	}
+
+	data = umem_alloc(od->od_blocksize, UMEM_NOFAIL);
+	(void) memset(data, 'a' + id % 26, od->od_blocksize);
+	(void) ztest_write(zd, od->od_object, 0, od->od_blocksize, data);
+
+	txg_wait_synced(dmu_objset_pool(os), 0);
+
+	mutex_enter(&dn->dn_mtx);
+	VERIFY3P(dn->dn_dirty, ==, NULL);
+	mutex_exit(&dn->dn_mtx);
+
+	dnode_rele(dn, FTAG);
+	umem_free(data, od->od_blocksize);
+	umem_free(od, sizeof (ztest_od_t));
+}
+
 #undef OD_ARRAY_SIZE
 #define	OD_ARRAY_SIZE	2
 
@@ -5375,6 +5943,34 @@ ztest_scrub(ztest_ds_t *zd, uint64_t id)
 	(void) spa_scan(spa, POOL_SCAN_SCRUB);
 }
 
+/*
+ * Toggle autotrim, and trim the pool's free space for a moment.
+ */
+/* ARGSUSED */
+void
+ztest_trim(ztest_ds_t *zd, uint64_t id)
+{
+	spa_t *spa = ztest_spa;
+	int error;
+
+	(void) rw_rdlock(&ztest_name_lock);
+
+	(void) ztest_spa_prop_set_uint64(ZPOOL_PROP_AUTOTRIM,
+	    ztest_random(2));
+
+	error = spa_trim(spa, ztest_random(2) ? 0 : 64 << 20);
+	if (error != 0 && error != EBUSY)
+		fatal(0, "spa_trim() = %d", error);
+
+	(void) poll(NULL, 0, 100); /* let it run a moment, then stop it */
+
+	error = spa_trim_stop(spa);
+	if (error != 0 && error != ENOENT)
+		fatal(0, "spa_trim_stop() = %d", error);
+
+	(void) rw_unlock(&ztest_name_lock);
+}
+
 /*
  * Change the guid for the pool.
  */
@@ -6484,6 +7080,7 @@ main(int argc, char **argv)
 		metaslab_gang_bang = ztest_opts.zo_metaslab_gang_bang;
 		metaslab_df_alloc_threshold =
 		    zs->zs_metaslab_df_alloc_threshold;
+		spa_allocators = zs->zs_spa_allocators;
 
 		if (zs->zs_do_init)
 			ztest_run_init();
@@ -6554,6 +7151,9 @@ main(int argc, char **argv)
 		zs->zs_metaslab_df_alloc_threshold =
 		    ztest_random(zs->zs_metaslab_sz / 4) + 1;
 
+		/* Vary the number of metaslab allocators */
+		zs->zs_spa_allocators = ztest_random(8) + 1;
+
 		if (!hasalt || ztest_random(2) == 0) {
 			if (hasalt && ztest_opts.zo_verbose >= 1) {
 				(void) printf("Executing newer ztest: %s\n",
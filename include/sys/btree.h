@@ -0,0 +1,125 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+
+#ifndef	_SYS_BTREE_H
+#define	_SYS_BTREE_H
+
+#include <sys/zfs_context.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * An in-memory B-tree of fixed-size elements.
+ *
+ * Unlike an AVL tree, the B-tree does not link caller-allocated nodes
+ * together. Elements are copied into the tree by value and packed into
+ * arrays: leaf nodes are BTREE_LEAF_SIZE bytes and hold as many elements
+ * as fit, core nodes hold up to BTREE_CORE_ELEMS elements and one more
+ * child pointer. Storing a 16 byte element therefore costs little more
+ * than 16 bytes, against the three pointers plus allocator overhead of
+ * an AVL node, and walking the tree touches memory sequentially.
+ *
+ * The price is that elements move around as the tree changes: a pointer
+ * returned by any of the lookup functions, and any zfs_btree_index_t,
+ * is only valid until the next zfs_btree_add*() or zfs_btree_remove*()
+ * on the tree. An element may be modified in place through such a
+ * pointer as long as its position in the sort order does not change.
+ *
+ * The comparison function has the same contract as for avl_create():
+ * return -1, 0 or 1, and the tree must never hold two elements that
+ * compare equal. As with the AVL tree, all locking is up to the caller.
+ */
+
+#define	BTREE_CORE_ELEMS	126
+#define	BTREE_LEAF_SIZE		4096
+
+typedef struct zfs_btree_hdr {
+	struct zfs_btree_core	*bth_parent;
+	boolean_t		bth_core;	/* core node (has children)? */
+	uint32_t		bth_count;	/* number of elements */
+} zfs_btree_hdr_t;
+
+typedef struct zfs_btree_core {
+	zfs_btree_hdr_t		btc_hdr;
+	zfs_btree_hdr_t		*btc_children[BTREE_CORE_ELEMS + 1];
+	uint8_t			btc_elems[];
+} zfs_btree_core_t;
+
+typedef struct zfs_btree_leaf {
+	zfs_btree_hdr_t		btl_hdr;
+	uint8_t			btl_elems[];
+} zfs_btree_leaf_t;
+
+/*
+ * A position in the tree. If bti_before is set, the index does not name
+ * an element but the gap just before element bti_offset of the (leaf)
+ * node, which is where a value not found by zfs_btree_find() belongs.
+ */
+typedef struct zfs_btree_index {
+	zfs_btree_hdr_t		*bti_node;
+	uint32_t		bti_offset;
+	boolean_t		bti_before;
+} zfs_btree_index_t;
+
+typedef struct btree {
+	zfs_btree_hdr_t		*bt_root;
+	int64_t			bt_height;	/* core levels above leaves */
+	size_t			bt_elem_size;
+	uint32_t		bt_leaf_cap;	/* elements per leaf */
+	int			(*bt_compar) (const void *, const void *);
+	uint64_t		bt_num_elems;
+	uint64_t		bt_num_leaves;
+	uint64_t		bt_num_cores;
+} zfs_btree_t;
+
+void zfs_btree_init(void);
+void zfs_btree_fini(void);
+
+void zfs_btree_create(zfs_btree_t *, int (*) (const void *, const void *),
+    size_t);
+void zfs_btree_destroy(zfs_btree_t *);
+
+void *zfs_btree_find(zfs_btree_t *, const void *, zfs_btree_index_t *);
+void zfs_btree_add_idx(zfs_btree_t *, const void *, const zfs_btree_index_t *);
+void zfs_btree_add(zfs_btree_t *, const void *);
+void zfs_btree_remove_idx(zfs_btree_t *, zfs_btree_index_t *);
+void zfs_btree_remove(zfs_btree_t *, const void *);
+
+/*
+ * Iteration. zfs_btree_next() and zfs_btree_prev() accept a gap index
+ * as returned by zfs_btree_find(), in which case they return the first
+ * element after, or the last element before, that gap. The output index
+ * may be the same as the input index, or NULL if it is not needed.
+ */
+void *zfs_btree_first(zfs_btree_t *, zfs_btree_index_t *);
+void *zfs_btree_last(zfs_btree_t *, zfs_btree_index_t *);
+void *zfs_btree_next(zfs_btree_t *, const zfs_btree_index_t *,
+    zfs_btree_index_t *);
+void *zfs_btree_prev(zfs_btree_t *, const zfs_btree_index_t *,
+    zfs_btree_index_t *);
+void *zfs_btree_get(zfs_btree_t *, const zfs_btree_index_t *);
+
+ulong_t zfs_btree_numnodes(zfs_btree_t *);
+uint64_t zfs_btree_memory(zfs_btree_t *);
+void zfs_btree_clear(zfs_btree_t *);
+void zfs_btree_verify(zfs_btree_t *);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _SYS_BTREE_H */
@@ -326,6 +326,25 @@ void dbuf_new_size(dmu_buf_impl_t *db, int size, dmu_tx_t *tx);
 void dbuf_stats_init(dbuf_hash_table_t *hash);
 void dbuf_stats_destroy(void);
 
+/*
+ * Memory overhead of cached dbufs and of the dirty records of dirty dbufs,
+ * exported as the "dbufstats" kstat.
+ */
+typedef struct dbuf_mem_stats {
+	kstat_named_t dbuf_size;
+	kstat_named_t dbuf_count;
+	kstat_named_t dirty_record_size;
+	kstat_named_t dirty_record_count;
+	kstat_named_t overhead_bytes;
+} dbuf_mem_stats_t;
+
+extern dbuf_mem_stats_t dbuf_mem_stats;
+
+#define	DBUF_MEM_STAT_BUMP(stat) \
+	atomic_inc_64(&dbuf_mem_stats.stat.value.ui64);
+#define	DBUF_MEM_STAT_BUMPDOWN(stat) \
+	atomic_dec_64(&dbuf_mem_stats.stat.value.ui64);
+
 #define	DB_DNODE(_db)		((_db)->db_dnode_handle->dnh_dnode)
 #define	DB_DNODE_LOCK(_db)	((_db)->db_dnode_handle->dnh_zrlock)
 #define	DB_DNODE_ENTER(_db)	(zrl_add(&DB_DNODE_LOCK(_db)))
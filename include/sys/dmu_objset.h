@@ -75,6 +75,24 @@ typedef struct objset_phys {
 	dnode_phys_t os_groupused_dnode;
 } objset_phys_t;
 
+/*
+ * Per-dataset dirty data and write throttle statistics, exported as the
+ * zfs/<pool>/objset-0x<id> kstat.  See dsl_pool_need_dirty_delay().
+ */
+typedef struct objset_dirty_stats {
+	kstat_named_t ods_dirty_bytes;
+	kstat_named_t ods_dirty_share;
+	kstat_named_t ods_delays;
+	kstat_named_t ods_delay_ns;
+	kstat_named_t ods_over_max;
+	kstat_named_t ods_fair_passes;
+} objset_dirty_stats_t;
+
+#define	OS_DIRTY_STAT_BUMP(os, stat)	\
+	atomic_inc_64(&(os)->os_dirty_stats.stat.value.ui64)
+#define	OS_DIRTY_STAT_INCR(os, stat, val)	\
+	atomic_add_64(&(os)->os_dirty_stats.stat.value.ui64, (val))
+
 struct objset {
 	/* Immutable: */
 	struct dsl_dataset *os_dsl_dataset;
@@ -108,6 +126,9 @@ struct objset {
 	zfs_sync_type_t os_sync;
 	zfs_redundant_metadata_type_t os_redundant_metadata;
 	int os_recordsize;
+	int os_dnodesize;	/* default dnode size for new objects */
+	uint16_t os_ioweight;	/* vdev queue share, see vdev_queue.c */
+	uint64_t os_zpl_special_smallblock; /* see spa_preferred_class() */
 
 	/*
 	 * Pointer is constant; the blkptr it points to is protected by
@@ -136,6 +157,14 @@ struct objset {
 	list_t os_dnodes;
 	list_t os_downgraded_dbufs;
 
+	/* Protected by the pool's dp_lock, see dsl_pool_dirty_space() */
+	uint64_t os_dirty_pertxg[TXG_SIZE];
+	uint64_t os_dirty_total;
+	list_node_t os_dirty_node;	/* on dp_dirty_objsets */
+
+	objset_dirty_stats_t os_dirty_stats;
+	kstat_t *os_dirty_kstat;
+
 	/* Protects changes to DMU_{USER,GROUP}USED_OBJECT */
 	kmutex_t os_userused_lock;
 
@@ -124,7 +124,10 @@ typedef struct dmu_tx_stats {
 	kstat_named_t dmu_tx_dirty_throttle;
 	kstat_named_t dmu_tx_dirty_delay;
 	kstat_named_t dmu_tx_dirty_over_max;
+	kstat_named_t dmu_tx_dirty_fair;
 	kstat_named_t dmu_tx_quota;
+	kstat_named_t dmu_tx_write_cached;
+	kstat_named_t dmu_tx_write_uncached;
 } dmu_tx_stats_t;
 
 extern dmu_tx_stats_t dmu_tx_stats;
@@ -84,16 +84,34 @@ extern "C" {
 /*
  * Derived constants.
  */
-#define	DNODE_SIZE	(1 << DNODE_SHIFT)
-#define DN_BONUS_SIZE(dnsize)   ((dnsize) - DNODE_CORE_SIZE - \
-        (1 << SPA_BLKPTRSHIFT))
-#define DN_SLOTS_TO_BONUSLEN(slots)     DN_BONUS_SIZE((slots) << DNODE_SHIFT)
-#define	DN_MAX_NBLKPTR	((DNODE_SIZE - DNODE_CORE_SIZE) >> SPA_BLKPTRSHIFT)
-#define	DN_MAX_BONUSLEN	(DNODE_SIZE - DNODE_CORE_SIZE - (1 << SPA_BLKPTRSHIFT))
+#define	DNODE_MIN_SIZE		(1 << DNODE_SHIFT)
+#define	DNODE_MAX_SIZE		(1 << DNODE_BLOCK_SHIFT)
+#define	DNODE_BLOCK_SIZE	(1 << DNODE_BLOCK_SHIFT)
+#define	DNODE_MIN_SLOTS		(DNODE_MIN_SIZE >> DNODE_SHIFT)
+#define	DNODE_MAX_SLOTS		(DNODE_MAX_SIZE >> DNODE_SHIFT)
+#define	DN_BONUS_SIZE(dnsize)	((dnsize) - DNODE_CORE_SIZE - \
+	(1 << SPA_BLKPTRSHIFT))
+#define	DN_SLOTS_TO_BONUSLEN(slots)	DN_BONUS_SIZE((slots) << DNODE_SHIFT)
+#define	DN_OLD_MAX_BONUSLEN	(DN_BONUS_SIZE(DNODE_MIN_SIZE))
+#define	DN_MAX_NBLKPTR	((DNODE_MIN_SIZE - DNODE_CORE_SIZE) >> SPA_BLKPTRSHIFT)
 #define	DN_MAX_OBJECT	(1ULL << DN_MAX_OBJECT_SHIFT)
-#define	DN_ZERO_BONUSLEN	(DN_MAX_BONUSLEN + 1)
+#define	DN_ZERO_BONUSLEN	(DN_BONUS_SIZE(DNODE_MAX_SIZE) + 1)
 #define	DN_KILL_SPILLBLK (1)
 
+/*
+ * A dnode may span several consecutive 512-byte slots of a dnode block.
+ * Each slot's dnode_handle_t is tagged with one of the values below
+ * until a dnode_t is instantiated for it, at which point dnh_dnode
+ * points at the dnode.  Only the first slot of a multi-slot dnode ever
+ * holds a pointer; the remaining slots are marked DN_SLOT_INTERIOR.
+ */
+#define	DN_SLOT_UNINIT		((void *)NULL)	/* Uninitialized */
+#define	DN_SLOT_FREE		((void *)1UL)	/* Free slot */
+#define	DN_SLOT_ALLOCATED	((void *)2UL)	/* Allocated slot */
+#define	DN_SLOT_INTERIOR	((void *)3UL)	/* Interior allocated slot */
+#define	DN_SLOT_IS_PTR(dn)	((void *)dn > DN_SLOT_INTERIOR)
+#define	DN_SLOT_IS_VALID(dn)	((void *)dn != NULL)
+
 #define	DNODES_PER_BLOCK_SHIFT	(DNODE_BLOCK_SHIFT - DNODE_SHIFT)
 #define	DNODES_PER_BLOCK	(1ULL << DNODES_PER_BLOCK_SHIFT)
 
@@ -150,12 +168,7 @@ typedef struct dnode_phys {
 	uint8_t dn_flags;		/* DNODE_FLAG_* */
 	uint16_t dn_datablkszsec;	/* data block size in 512b sectors */
 	uint16_t dn_bonuslen;		/* length of dn_bonus */
-	/*
-	 * crypto is ready to encrypt dnodes, but until large-dnode
-	 * commit is merged, dn_extra_slots is left here as a
-	 * place-holder, but assumed to be 0 at all times.
-	 */
-	uint8_t dn_extra_slots;         /* # of subsequent slots consumed */
+	uint8_t dn_extra_slots;		/* # of subsequent slots consumed */
 	uint8_t dn_pad2[3];
 
 	/* accounting is protected by dn_dirty_mtx */
@@ -165,8 +178,11 @@ typedef struct dnode_phys {
 	uint64_t dn_pad3[4];
 
 	/*
-	 * The tail region is 448 bytes, and there are three ways to
-	 * look at it.
+	 * The tail region is 448 bytes for a 512 byte dnode, and
+	 * correspondingly larger for larger dnode sizes. The spill
+	 * block pointer, when present, is always at the end of the tail
+	 * region. There are three ways this space may be used, using
+	 * a 512 byte dnode for this diagram:
 	 *
 	 * 0       64      128     192     256     320     384     448 (offset)
 	 * +---------------+---------------+---------------+-------+
@@ -174,25 +190,26 @@ typedef struct dnode_phys {
 	 * +---------------+---------------+---------------+-------+
 	 * | dn_blkptr[0]  | dn_bonus[0..319]                      |
 	 * +---------------+-----------------------+---------------+
-	 * | dn_blkptr[0]  | /                     | dn_spill      |
+	 * | dn_blkptr[0]  | dn_bonus[0..191]      | dn_spill      |
 	 * +---------------+-----------------------+---------------+
 	 */
 	union {
-		blkptr_t dn_blkptr[1+DN_MAX_BONUSLEN/sizeof (blkptr_t)];
+		blkptr_t dn_blkptr[1+DN_OLD_MAX_BONUSLEN/sizeof (blkptr_t)];
 		struct {
 			blkptr_t __dn_ignore1;
-			uint8_t dn_bonus[DN_MAX_BONUSLEN];
+			uint8_t dn_bonus[DN_OLD_MAX_BONUSLEN];
 		};
 		struct {
 			blkptr_t __dn_ignore2;
-			uint8_t __dn_ignore3[DN_MAX_BONUSLEN-sizeof (blkptr_t)];
+			uint8_t __dn_ignore3[DN_OLD_MAX_BONUSLEN -
+			    sizeof (blkptr_t)];
 			blkptr_t dn_spill;
 		};
 	};
 } dnode_phys_t;
 
-#define DN_SPILL_BLKPTR(dnp)    (blkptr_t *)((char *)(dnp) +			\
-		(((dnp)->dn_extra_slots + 1) << DNODE_SHIFT) - (1 << SPA_BLKPTRSHIFT))
+#define	DN_SPILL_BLKPTR(dnp)	(blkptr_t *)((char *)(dnp) +		\
+	(((dnp)->dn_extra_slots + 1) << DNODE_SHIFT) - (1 << SPA_BLKPTRSHIFT))
 
 struct dnode {
 	/*
@@ -226,17 +243,18 @@ struct dnode {
 	uint8_t dn_indblkshift;
 	uint8_t dn_datablkshift;	/* zero if blksz not power of 2! */
 	uint8_t dn_moved;		/* Has this dnode been moved? */
+	uint8_t dn_num_slots;		/* metadnode slots consumed on disk */
 	uint16_t dn_datablkszsec;	/* in 512b sectors */
 	uint32_t dn_datablksz;		/* in bytes */
 	uint64_t dn_maxblkid;
-	uint8_t dn_next_type[TXG_SIZE];
-	uint8_t dn_next_nblkptr[TXG_SIZE];
-	uint8_t dn_next_nlevels[TXG_SIZE];
-	uint8_t dn_next_indblkshift[TXG_SIZE];
-	uint8_t dn_next_bonustype[TXG_SIZE];
-	uint8_t dn_rm_spillblk[TXG_SIZE];	/* for removing spill blk */
-	uint16_t dn_next_bonuslen[TXG_SIZE];
-	uint32_t dn_next_blksz[TXG_SIZE];	/* next block size in bytes */
+
+	/*
+	 * Per-txg state of a dirty dnode; NULL until the dnode is first
+	 * dirtied, see dnode_dirty_state().  The fields of dnode_dirty_t
+	 * are protected by the locks noted there; the pointer is cleared
+	 * under dn_mtx, so lookups without a hold must take it.
+	 */
+	struct dnode_dirty *dn_dirty;
 
 	/* protected by dn_dbufs_mtx; declared here to fill 32-bit hole */
 	uint32_t dn_dbufs_count;	/* count of dn_dbufs */
@@ -246,8 +264,6 @@ struct dnode {
 
 	/* protected by dn_mtx: */
 	kmutex_t dn_mtx;
-	list_t dn_dirty_records[TXG_SIZE];
-	struct range_tree *dn_free_ranges[TXG_SIZE];
 	uint64_t dn_allocated_txg;
 	uint64_t dn_free_txg;
 	uint64_t dn_assigned_txg;
@@ -292,6 +308,29 @@ struct dnode {
 	struct zfetch	dn_zfetch;
 };
 
+/*
+ * State that is only needed once a dnode has been dirtied: the pending
+ * changes to its dnode_phys_t for each open txg, the dirty records of its
+ * dbufs and the ranges it freed.  Most cached dnodes are only ever read, so
+ * this is allocated separately the first time the dnode is dirtied and
+ * released by dnode_dirty_release() once no txg has it dirty.
+ */
+typedef struct dnode_dirty {
+	/* protected by dn_struct_rwlock: */
+	uint8_t dnd_next_type[TXG_SIZE];
+	uint8_t dnd_next_nblkptr[TXG_SIZE];
+	uint8_t dnd_next_nlevels[TXG_SIZE];
+	uint8_t dnd_next_indblkshift[TXG_SIZE];
+	uint8_t dnd_next_bonustype[TXG_SIZE];
+	uint8_t dnd_rm_spillblk[TXG_SIZE];	/* for removing spill blk */
+	uint16_t dnd_next_bonuslen[TXG_SIZE];
+	uint32_t dnd_next_blksz[TXG_SIZE];	/* next block size in bytes */
+
+	/* protected by dn_mtx: */
+	list_t dnd_dirty_records[TXG_SIZE];
+	struct range_tree *dnd_free_ranges[TXG_SIZE];
+} dnode_dirty_t;
+
 /*
  * Adds a level of indirection between the dbuf and the dnode to avoid
  * iterating descendent dbufs in dnode_move(). Handles are not allocated
@@ -325,18 +364,21 @@ void dnode_rm_spill(dnode_t *dn, dmu_tx_t *tx);
 
 int dnode_hold(struct objset *dd, uint64_t object,
     void *ref, dnode_t **dnp);
-int dnode_hold_impl(struct objset *dd, uint64_t object, int flag,
+int dnode_hold_impl(struct objset *dd, uint64_t object, int flag, int slots,
     void *ref, dnode_t **dnp);
 boolean_t dnode_add_ref(dnode_t *dn, void *ref);
 void dnode_rele(dnode_t *dn, void *ref);
 void dnode_rele_and_unlock(dnode_t *dn, void *tag);
 void dnode_setdirty(dnode_t *dn, dmu_tx_t *tx);
+dnode_dirty_t *dnode_dirty_state(dnode_t *dn);
+void dnode_dirty_release(dnode_t *dn);
 void dnode_sync(dnode_t *dn, dmu_tx_t *tx);
 void dnode_allocate(dnode_t *dn, dmu_object_type_t ot, int blocksize, int ibs,
-    dmu_object_type_t bonustype, int bonuslen, dmu_tx_t *tx);
+    dmu_object_type_t bonustype, int bonuslen, int dn_slots, dmu_tx_t *tx);
 void dnode_reallocate(dnode_t *dn, dmu_object_type_t ot, int blocksize,
-    dmu_object_type_t bonustype, int bonuslen, dmu_tx_t *tx);
+    dmu_object_type_t bonustype, int bonuslen, int dn_slots, dmu_tx_t *tx);
 void dnode_free(dnode_t *dn, dmu_tx_t *tx);
+void dnode_free_interior_slots(dnode_t *dn);
 void dnode_byteswap(dnode_phys_t *dnp);
 void dnode_buf_byteswap(void *buf, size_t size);
 void dnode_verify(dnode_t *dn);
@@ -364,6 +406,73 @@ void dnode_evict_bonus(dnode_t *dn);
 	((_dn)->dn_objset->os_primary_cache == ZFS_CACHE_ALL ||		\
 	(_dn)->dn_objset->os_primary_cache == ZFS_CACHE_METADATA)
 
+/*
+ * Used for dnodestats kstat.
+ */
+typedef struct dnode_stats {
+	/*
+	 * Number of failed attempts to hold a meta dnode dbuf.
+	 */
+	kstat_named_t dnode_hold_dbuf_hold;
+	/*
+	 * Number of failed attempts to read a meta dnode dbuf.
+	 */
+	kstat_named_t dnode_hold_dbuf_read;
+	/*
+	 * Statistics for successful calls to dnode_hold_impl() with
+	 * DNODE_MUST_BE_ALLOCATED, and failures due to a hole, an interior
+	 * slot, lock contention, or an unallocated type.
+	 */
+	kstat_named_t dnode_hold_alloc_hits;
+	kstat_named_t dnode_hold_alloc_misses;
+	kstat_named_t dnode_hold_alloc_interior;
+	kstat_named_t dnode_hold_alloc_lock_retry;
+	kstat_named_t dnode_hold_alloc_lock_misses;
+	kstat_named_t dnode_hold_alloc_type_none;
+	/*
+	 * Statistics for calls to dnode_hold_impl() with DNODE_MUST_BE_FREE.
+	 */
+	kstat_named_t dnode_hold_free_hits;
+	kstat_named_t dnode_hold_free_misses;
+	kstat_named_t dnode_hold_free_lock_misses;
+	kstat_named_t dnode_hold_free_lock_retry;
+	kstat_named_t dnode_hold_free_overflow;
+	kstat_named_t dnode_hold_free_refcount;
+	/*
+	 * Number of times dnode_free_interior_slots() needed to retry
+	 * acquiring a slot zrl lock due to contention.
+	 */
+	kstat_named_t dnode_free_interior_lock_retry;
+	/*
+	 * Number of new dnodes allocated and reallocated.
+	 */
+	kstat_named_t dnode_allocate;
+	kstat_named_t dnode_reallocate;
+	/*
+	 * Number of times dmu_object_alloc_dnsize() skipped to the next
+	 * dnode block because the remaining slots could not fit a dnode
+	 * of the requested size.
+	 */
+	kstat_named_t dnode_alloc_next_block;
+	/*
+	 * Memory overhead of cached dnodes: the size of a dnode_t and of
+	 * its separately allocated dirty state, the number of each that
+	 * currently exist, and the total bytes they use.
+	 */
+	kstat_named_t dnode_size;
+	kstat_named_t dnode_dirty_size;
+	kstat_named_t dnode_count;
+	kstat_named_t dnode_dirty_count;
+	kstat_named_t dnode_overhead_bytes;
+} dnode_stats_t;
+
+extern dnode_stats_t dnode_stats;
+
+#define	DNODE_STAT_BUMP(stat) \
+	atomic_inc_64(&dnode_stats.stat.value.ui64);
+#define	DNODE_STAT_BUMPDOWN(stat) \
+	atomic_dec_64(&dnode_stats.stat.value.ui64);
+
 #ifdef ZFS_DEBUGXXX
 
 /*
@@ -100,6 +100,23 @@ typedef enum dsl_scan_flags {
  *			the scan but have not yet been processed (i.e deferred
  *			frees) are accounted for.
  *
+ * The following members control the sorted scan, in which the traversal
+ * queues scrub I/Os by device offset and they are issued separately:
+ *
+ * scn_is_sorted -	scrub I/Os are queued rather than issued as the
+ *			blocks are visited.  Only changes while the queues
+ *			are empty.
+ *
+ * scn_draining -	the traversal has stopped (memory limit reached, or
+ *			at the end of a dataset) and the queues are being
+ *			issued.  Traversal resumes once they are empty.
+ *
+ * scn_ckpt_phys -	the traversal state as of the last time the queues
+ *			were empty.  This is what is written to disk while
+ *			queued I/Os remain, so that a scan resumed after a
+ *			reboot never skips a block which was queued but not
+ *			yet read.
+ *
  * This structure also maintains information about deferred frees which are
  * a special kind of traversal. Deferred free can exist in either a bptree or
  * a bpobj structure. The scn_is_bptree flag will indicate the type of
@@ -121,6 +138,16 @@ typedef struct dsl_scan {
 	boolean_t scn_async_stalled;
 	uint64_t scn_visited_this_txg;
 
+	/* for the sorted scan */
+	boolean_t scn_is_sorted;
+	boolean_t scn_draining;
+	kmutex_t scn_queue_lock;	/* protects the queues and counts */
+	struct dsl_scan_io_queue **scn_queues; /* indexed by top-level vdev */
+	uint64_t scn_nqueues;
+	uint64_t scn_queued_ios;	/* scrub I/Os waiting to be issued */
+	uint64_t scn_queued_bytes;	/* allocated bytes they cover */
+	dsl_scan_phys_t scn_ckpt_phys;
+
 	dsl_scan_phys_t scn_phys;
 } dsl_scan_t;
 
@@ -142,6 +169,7 @@ void dsl_scan_ds_clone_swapped(struct dsl_dataset *ds1, struct dsl_dataset *ds2,
     struct dmu_tx *tx);
 boolean_t dsl_scan_active(dsl_scan_t *scn);
 boolean_t dsl_scan_is_paused_scrub(const dsl_scan_t *scn);
+void dsl_scan_freed(spa_t *spa, const blkptr_t *bp);
 
 #ifdef	__cplusplus
 }
@@ -186,6 +186,9 @@ typedef enum {
 	ZFS_PROP_ENCRYPTION_ROOT,
 	ZFS_PROP_KEY_GUID,
 	ZFS_PROP_KEYSTATUS,
+	ZFS_PROP_DNODESIZE,
+	ZFS_PROP_IOWEIGHT,
+	ZFS_PROP_SPECIAL_SMALL_BLOCKS,
 	ZFS_NUM_PROPS
 } zfs_prop_t;
 
@@ -233,6 +236,7 @@ typedef enum {
 	ZPOOL_PROP_LEAKED,
 	ZPOOL_PROP_MAXBLOCKSIZE,
 	ZPOOL_PROP_TNAME,
+	ZPOOL_PROP_AUTOTRIM,
 	ZPOOL_NUM_PROPS
 } zpool_prop_t;
 
@@ -399,6 +403,30 @@ typedef enum {
 	ZFS_REDUNDANT_METADATA_MOST
 } zfs_redundant_metadata_type_t;
 
+typedef enum {
+	ZFS_DNSIZE_LEGACY = 0,
+	ZFS_DNSIZE_AUTO = 1,
+	ZFS_DNSIZE_1K = 1024,
+	ZFS_DNSIZE_2K = 2048,
+	ZFS_DNSIZE_4K = 4096,
+	ZFS_DNSIZE_8K = 8192,
+	ZFS_DNSIZE_16K = 16384
+} zfs_dnsize_type_t;
+
+/*
+ * Range and default of the ioweight property, the relative share of the
+ * vdev queue a dataset's i/o gets within its priority class.
+ */
+#define	ZFS_IOWEIGHT_MIN	1
+#define	ZFS_IOWEIGHT_MAX	1000
+#define	ZFS_IOWEIGHT_DEFAULT	100
+
+/*
+ * Largest value of the special_small_blocks property.  Data blocks no larger
+ * than the property are allocated from the special class, if there is one.
+ */
+#define	ZFS_SPECIAL_SMALL_BLOCKS_MAX	(128 * 1024)
+
 typedef enum zfs_keystatus {
 	ZFS_KEYSTATUS_NONE = 0,
 	ZFS_KEYSTATUS_UNAVAILABLE,
@@ -585,6 +613,7 @@ typedef struct zpool_rewind_policy {
 #define	ZPOOL_CONFIG_ASIZE		"asize"
 #define	ZPOOL_CONFIG_DTL		"DTL"
 #define	ZPOOL_CONFIG_SCAN_STATS		"scan_stats"	/* not stored on disk */
+#define	ZPOOL_CONFIG_TRIM_STATS		"trim_stats"	/* not stored on disk */
 #define	ZPOOL_CONFIG_VDEV_STATS		"vdev_stats"	/* not stored on disk */
 
 /* container nvlist of extended stats */
@@ -627,6 +656,21 @@ typedef struct zpool_rewind_policy {
 #define	ZPOOL_CONFIG_VDEV_ASYNC_AGG_W_HISTO	"vdev_async_agg_w_histo"
 #define	ZPOOL_CONFIG_VDEV_AGG_SCRUB_HISTO	"vdev_agg_scrub_histo"
 
+/* Number of ZIOs completed after their vdev queue deadline */
+#define	ZPOOL_CONFIG_VDEV_SYNC_R_DEADLINE_MISSED \
+	"vdev_sync_r_deadline_missed"
+#define	ZPOOL_CONFIG_VDEV_SYNC_W_DEADLINE_MISSED \
+	"vdev_sync_w_deadline_missed"
+#define	ZPOOL_CONFIG_VDEV_ASYNC_R_DEADLINE_MISSED \
+	"vdev_async_r_deadline_missed"
+#define	ZPOOL_CONFIG_VDEV_ASYNC_W_DEADLINE_MISSED \
+	"vdev_async_w_deadline_missed"
+#define	ZPOOL_CONFIG_VDEV_SCRUB_DEADLINE_MISSED \
+	"vdev_scrub_deadline_missed"
+
+/* Average read service time, as used to select mirror children */
+#define	ZPOOL_CONFIG_VDEV_READ_LAT_EWMA	"vdev_read_lat_ewma"
+
 #define	ZPOOL_CONFIG_WHOLE_DISK		"whole_disk"
 #define	ZPOOL_CONFIG_ERRCOUNT		"error_count"
 #define	ZPOOL_CONFIG_NOT_PRESENT	"not_present"
@@ -668,6 +712,7 @@ typedef struct zpool_rewind_policy {
 #define	ZPOOL_CONFIG_VDEV_LEAF_ZAP	"com.delphix:vdev_zap_leaf"
 #define	ZPOOL_CONFIG_HAS_PER_VDEV_ZAPS	"com.delphix:has_per_vdev_zaps"
 #define	ZPOOL_CONFIG_ERRATA		"errata"	/* not stored on disk */
+#define	ZPOOL_CONFIG_ALLOCATION_BIAS	"alloc_bias"
 
 /*
  * The persistent vdev state is stored as separate values rather than a single
@@ -705,6 +750,13 @@ typedef struct zpool_rewind_policy {
 #define	VDEV_TYPE_LOG			"log"
 #define	VDEV_TYPE_L2CACHE		"l2cache"
 
+/*
+ * Values of ZPOOL_CONFIG_ALLOCATION_BIAS, the allocation class a top-level
+ * vdev's space belongs to.
+ */
+#define	VDEV_ALLOC_BIAS_SPECIAL		"special"
+#define	VDEV_ALLOC_BIAS_DEDUP		"dedup"
+
 /*
  * This is needed in userland to report the minimum necessary device size.
  *
@@ -837,6 +889,8 @@ typedef struct pool_scan_stat {
 	uint64_t	pss_pass_scrub_pause; /* pause time of a scurb pass */
 	/* cumulative time scrub spent paused, needed for rate calculation */
 	uint64_t	pss_pass_scrub_spent_paused;
+	uint64_t	pss_pass_issued; /* issued bytes per scan pass */
+	uint64_t	pss_issued;	/* total bytes checked by scanner */
 } pool_scan_stat_t;
 
 typedef enum dsl_scan_state {
@@ -847,6 +901,29 @@ typedef enum dsl_scan_state {
 	DSS_NUM_STATES
 } dsl_scan_state_t;
 
+/*
+ * Manual TRIM ("zpool trim") statistics.  Like pool_scan_stat_t, all fields
+ * are 64-bit so the structure can be passed as an nvlist uint64 array.
+ */
+typedef enum pool_trim_state {
+	POOL_TRIM_NONE,
+	POOL_TRIM_ACTIVE,
+	POOL_TRIM_CANCELED,
+	POOL_TRIM_FINISHED,
+	POOL_TRIM_STATES
+} pool_trim_state_t;
+
+typedef struct pool_trim_stat {
+	uint64_t	pts_state;	/* pool_trim_state_t */
+	uint64_t	pts_start_time;	/* trim start time */
+	uint64_t	pts_end_time;	/* trim end time */
+	uint64_t	pts_rate;	/* bytes per second, 0 = unlimited */
+	uint64_t	pts_to_examine;	/* total metaslabs to trim */
+	uint64_t	pts_examined;	/* metaslabs trimmed so far */
+	uint64_t	pts_bytes;	/* bytes trimmed by this trim */
+	uint64_t	pts_auto_bytes;	/* bytes trimmed by autotrim */
+} pool_trim_stat_t;
+
 /*
  * Errata described by http://zfsonlinux.org/msg/ZFS-8000-ER.  The ordering
  * of this enum must be maintained to ensure the errata identifiers map to
@@ -935,6 +1012,12 @@ typedef struct vdev_stat_ex {
 	uint64_t vsx_agg_histo[ZIO_PRIORITY_NUM_QUEUEABLE]
 	    [VDEV_RQ_HISTO_BUCKETS];
 
+	/* Number of ZIOs completed after their queue deadline */
+	uint64_t vsx_deadline_missed[ZIO_PRIORITY_NUM_QUEUEABLE];
+
+	/* Average read service time in ns (leaf vdevs only) */
+	uint64_t vsx_read_ewma;
+
 } vdev_stat_ex_t;
 
 /*
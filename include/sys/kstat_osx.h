@@ -71,6 +71,13 @@ typedef struct osx_kstat {
 	kstat_named_t zfs_vdev_aggregation_limit;
 	kstat_named_t zfs_vdev_read_gap_limit;
 	kstat_named_t zfs_vdev_write_gap_limit;
+	kstat_named_t zfs_vdev_fair_queue;
+	kstat_named_t zfs_vdev_deadline;
+	kstat_named_t zfs_vdev_sync_read_deadline_ms;
+	kstat_named_t zfs_vdev_sync_write_deadline_ms;
+	kstat_named_t zfs_vdev_async_read_deadline_ms;
+	kstat_named_t zfs_vdev_async_write_deadline_ms;
+	kstat_named_t zfs_vdev_scrub_deadline_ms;
 
 	kstat_named_t arc_reduce_dnlc_percent;
 	kstat_named_t arc_lotsfree_percent;
@@ -79,7 +86,15 @@ typedef struct osx_kstat {
 	kstat_named_t zfs_delay_max_ns;
 	kstat_named_t zfs_delay_min_dirty_percent;
 	kstat_named_t zfs_delay_scale;
+	kstat_named_t zfs_dirty_data_fair;
 	kstat_named_t spa_asize_inflation;
+	kstat_named_t spa_allocators;
+	kstat_named_t zfs_special_class_metadata_reserve_pct;
+	kstat_named_t zfs_sync_vdevs_parallel;
+	kstat_named_t zfs_trim_extent_bytes_max;
+	kstat_named_t zfs_trim_extent_bytes_min;
+	kstat_named_t zfs_trim_txg_batch;
+	kstat_named_t zfs_frag_history;
 	kstat_named_t zfs_mdcomp_disable;
 	kstat_named_t zfs_prefetch_disable;
 	kstat_named_t zfetch_max_streams;
@@ -104,9 +119,15 @@ typedef struct osx_kstat {
 	kstat_named_t zfs_read_chunk_size;
 	kstat_named_t zfs_nocacheflush;
 	kstat_named_t zil_replay_disable;
+	kstat_named_t zil_replay_threads;
+	kstat_named_t zfs_commit_timeout_pct;
+	kstat_named_t zil_lwb_decay_shift;
 	kstat_named_t metaslab_gang_bang;
 	kstat_named_t metaslab_df_alloc_threshold;
 	kstat_named_t metaslab_df_free_pct;
+	kstat_named_t metaslab_preload_limit;
+	kstat_named_t zfs_unflushed_max_txgs;
+	kstat_named_t zfs_min_metaslabs_to_flush;
 	kstat_named_t zio_injection_enabled;
 	kstat_named_t zvol_immediate_write_sz;
 
@@ -118,6 +139,8 @@ typedef struct osx_kstat {
 	kstat_named_t zfs_resilver_delay;
 	kstat_named_t zfs_scrub_delay;
 	kstat_named_t zfs_scan_idle;
+	kstat_named_t zfs_scan_legacy;
+	kstat_named_t zfs_scan_mem_lim_fact;
 
 	kstat_named_t zfs_recover;
 
@@ -133,6 +156,8 @@ typedef struct osx_kstat {
 	kstat_named_t zfs_vdev_mirror_rotating_seek_offset;
 	kstat_named_t zfs_vdev_mirror_non_rotating_inc;
 	kstat_named_t zfs_vdev_mirror_non_rotating_seek_inc;
+	kstat_named_t zfs_vdev_mirror_latency_select;
+	kstat_named_t zfs_vdev_read_ewma_shift;
 
 	kstat_named_t zvol_inhibit_dev;
 	kstat_named_t zfs_send_set_freerecords_bit;
@@ -190,11 +215,25 @@ extern int zfs_vdev_async_write_active_max_dirty_percent;
 extern int zfs_vdev_aggregation_limit;
 extern int zfs_vdev_read_gap_limit;
 extern int zfs_vdev_write_gap_limit;
+extern int zfs_vdev_fair_queue;
+extern int zfs_vdev_deadline;
+extern uint32_t zfs_vdev_sync_read_deadline_ms;
+extern uint32_t zfs_vdev_sync_write_deadline_ms;
+extern uint32_t zfs_vdev_async_read_deadline_ms;
+extern uint32_t zfs_vdev_async_write_deadline_ms;
+extern uint32_t zfs_vdev_scrub_deadline_ms;
 
 extern uint_t arc_reduce_dnlc_percent;
 extern int arc_lotsfree_percent;
 extern hrtime_t zfs_delay_max_ns;
 extern int spa_asize_inflation;
+extern int spa_allocators;
+extern int zfs_special_class_metadata_reserve_pct;
+extern int zfs_sync_vdevs_parallel;
+extern int zfs_trim_extent_bytes_max;
+extern int zfs_trim_extent_bytes_min;
+extern int zfs_trim_txg_batch;
+extern int zfs_frag_history;
 extern unsigned int	zfetch_max_streams;
 extern unsigned int	zfetch_min_sec_reap;
 extern int zfs_default_bs;
@@ -209,6 +248,9 @@ extern offset_t zfs_read_chunk_size;
 extern uint64_t metaslab_gang_bang;
 extern uint64_t metaslab_df_alloc_threshold;
 extern int metaslab_df_free_pct;
+extern int metaslab_preload_limit;
+extern int zfs_unflushed_max_txgs;
+extern int zfs_min_metaslabs_to_flush;
 extern ssize_t zvol_immediate_write_sz;
 
 extern boolean_t l2arc_noprefetch;
@@ -219,6 +261,8 @@ extern int zfs_top_maxinflight;
 extern int zfs_resilver_delay;
 extern int zfs_scrub_delay;
 extern int zfs_scan_idle;
+extern int zfs_scan_legacy;
+extern int zfs_scan_mem_lim_fact;
 
 extern uint64_t zfs_free_max_blocks;
 extern int64_t zfs_free_bpobj_enabled;
@@ -232,6 +276,8 @@ extern uint64_t zfs_vdev_mirror_rotating_seek_inc;
 extern uint64_t zfs_vdev_mirror_rotating_seek_offset;
 extern uint64_t zfs_vdev_mirror_non_rotating_inc;
 extern uint64_t zfs_vdev_mirror_non_rotating_seek_inc;
+extern int zfs_vdev_mirror_latency_select;
+extern int zfs_vdev_read_ewma_shift;
 extern uint64_t zvol_inhibit_dev;
 extern uint64_t zfs_send_set_freerecords_bit;
 
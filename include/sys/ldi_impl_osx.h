@@ -134,6 +134,7 @@ int handle_get_media_info_ext_iokit(struct ldi_handle *,
 int handle_check_media_iokit(struct ldi_handle *, int *);
 int handle_is_solidstate_iokit(struct ldi_handle *, int *);
 int handle_sync_iokit(struct ldi_handle *);
+int handle_unmap_iokit(struct ldi_handle *, dkioc_free_t *);
 int buf_strategy_iokit(ldi_buf_t *, struct ldi_handle *);
 int ldi_open_media_by_dev(dev_t, int, ldi_handle_t *);
 int ldi_open_media_by_path(char *, int, ldi_handle_t *);
@@ -155,6 +156,7 @@ int handle_get_media_info_ext_vnode(struct ldi_handle *,
 int handle_check_media_vnode(struct ldi_handle *, int *);
 int handle_is_solidstate_vnode(struct ldi_handle *, int *);
 int handle_sync_vnode(struct ldi_handle *);
+int handle_unmap_vnode(struct ldi_handle *, dkioc_free_t *);
 int buf_strategy_vnode(ldi_buf_t *, struct ldi_handle *);
 int ldi_open_vnode_by_path(char *, dev_t, int, ldi_handle_t *);
 int handle_get_bootinfo_vnode(struct ldi_handle *,
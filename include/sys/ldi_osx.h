@@ -125,6 +125,18 @@ struct dk_callback {
 /* XXX Created this additional ioctl */
 #define	DKIOCGETBOOTINFO	(DKIOC | 99)
 
+/* Free (unmap) a range of the device, as on illumos */
+#ifndef DKIOCFREE
+#define	DKIOCFREE		(DKIOC | 50)
+#endif
+
+typedef struct dkioc_free_s {
+	uint32_t	df_flags;
+	uint32_t	df_reserved;
+	uint64_t	df_start;
+	uint64_t	df_length;
+} dkioc_free_t;
+
 /*
  * This state enum is the argument passed to the DKIOCSTATE ioctl.
  */
@@ -67,7 +67,8 @@ typedef enum trace_alloc_type {
 	TRACE_GROUP_FAILURE	= -5ULL,
 	TRACE_ENOSPC		= -6ULL,
 	TRACE_CONDENSING	= -7ULL,
-	TRACE_VDEV_ERROR	= -8ULL
+	TRACE_VDEV_ERROR	= -8ULL,
+	TRACE_TRIMMING		= -9ULL
 } trace_alloc_type_t;
 
 #define	METASLAB_WEIGHT_PRIMARY		(1ULL << 63)
@@ -145,13 +146,25 @@ typedef enum trace_alloc_type {
  * class defines the low-level block allocator that will be used as the
  * final step in allocation. These allocators are pluggable allowing each class
  * to use a block allocator that best suits that class.
+ *
+ * To keep concurrent writers from all contending for the same metaslab,
+ * a class is split into spa_alloc_count allocators. Each allocator has
+ * its own position on the rotor (mc_allocator[]) and its own active
+ * metaslabs in every group (mg_primaries[] and mg_secondaries[]); the
+ * allocator used for a block is chosen by hashing its bookmark.
  */
+typedef struct metaslab_class_allocator {
+	metaslab_group_t	*mca_rotor;
+	uint64_t		mca_aliquot;
+} metaslab_class_allocator_t;
+
 struct metaslab_class {
 	kmutex_t		mc_lock;
 	spa_t			*mc_spa;
 	metaslab_group_t	*mc_rotor;
 	metaslab_ops_t		*mc_ops;
-	uint64_t		mc_aliquot;
+	int			mc_allocators;
+	metaslab_class_allocator_t *mc_allocator;
 
 	/*
 	 * Track the number of metaslab groups that have been initialized
@@ -223,6 +236,14 @@ struct metaslab_group {
 	metaslab_group_t	*mg_prev;
 	metaslab_group_t	*mg_next;
 
+	/*
+	 * The active metaslabs of each allocator, indexed by allocator.
+	 * A metaslab occupies at most one slot; protected by mg_lock.
+	 */
+	int			mg_allocators;
+	metaslab_t		**mg_primaries;
+	metaslab_t		**mg_secondaries;
+
 	/*
 	 * Each metaslab group can handle mg_max_alloc_queue_depth allocations
 	 * which are tracked by mg_alloc_queue_depth. It's possible for a
@@ -308,6 +329,13 @@ struct metaslab_group {
  * metaslab needs to condense then we must set the ms_condensing flag to
  * ensure that allocations are not performed on the metaslab that is
  * being written.
+ *
+ * When the vdev_log_spacemap feature is enabled, a top-level vdev appends
+ * the allocs and frees of all its metaslabs for a txg to a single log space
+ * map (see vdev_log_spacemap.c) instead of writing each metaslab's own
+ * space map. The changes that are in the logs but not yet in ms_sm are
+ * kept in ms_unflushed_allocs and ms_unflushed_frees, which are written
+ * to ms_sm ("flushed") a few metaslabs at a time.
  */
 struct metaslab {
 	kmutex_t	ms_lock;
@@ -330,9 +358,37 @@ struct metaslab {
 	range_tree_t	*ms_freedtree; /* already freed this syncing txg */
 	range_tree_t	*ms_defertree[TXG_DEFER_SIZE];
 
+	/*
+	 * Unflushed changes: space allocated, and space freed, since ms_sm
+	 * was last flushed. The two trees are disjoint and, like ms_sm, are
+	 * only updated in metaslab_sync_done(). ms_logged_* accumulate what
+	 * the syncing txg appends to the log until then. ms_unflushed_txg
+	 * is the first txg whose log holds changes missing from ms_sm, or
+	 * zero if there are none; ms_flushed_txg is the last txg in which
+	 * ms_sm was brought up to date.
+	 */
+	range_tree_t	*ms_unflushed_allocs;
+	range_tree_t	*ms_unflushed_frees;
+	range_tree_t	*ms_logged_allocs;
+	range_tree_t	*ms_logged_frees;
+	uint64_t	ms_unflushed_txg;
+	uint64_t	ms_flushed_txg;
+	avl_node_t	ms_unflushed_node; /* vdev_unflushed_ms linkage	*/
+
 	boolean_t	ms_condensing;	/* condensing? */
 	boolean_t	ms_condense_wanted;
 
+	/*
+	 * Free space waiting for autotrim (see vdev_trim.c). Ranges enter
+	 * ms_trimtree once they leave the defer trees, and are cleared
+	 * from it when they are allocated again. While a TRIM of the
+	 * metaslab is in flight ms_trimming is set, and, as when
+	 * condensing, no allocations are made from the metaslab.
+	 */
+	range_tree_t	*ms_trimtree;
+	boolean_t	ms_trimming;	/* TRIM in flight? */
+	kcondvar_t	ms_trim_cv;	/* signalled when TRIM completes */
+
 	/*
 	 * We must hold both ms_lock and ms_group->mg_lock in order to
 	 * modify ms_loaded.
@@ -344,6 +400,15 @@ struct metaslab {
 	uint64_t	ms_weight;	/* weight vs. others in group	*/
 	uint64_t	ms_activation_weight;	/* activation weight	*/
 
+	/*
+	 * The allocator this metaslab is active for (-1 if none) and
+	 * whether it is that allocator's primary or secondary metaslab.
+	 * Both only change with ms_group->mg_lock held and, except when
+	 * the metaslab is being torn down, with ms_lock held as well.
+	 */
+	int		ms_allocator;
+	boolean_t	ms_primary;
+
 	/*
 	 * Track of whenever a metaslab is selected for loading or allocation.
 	 * We use this value to determine how long the metaslab should
@@ -361,7 +426,7 @@ struct metaslab {
 	 * same number of segments as the ms_tree. The only difference
 	 * is that the ms_size_tree is ordered by segment sizes.
 	 */
-	avl_tree_t	ms_size_tree;
+	zfs_btree_t	ms_size_tree;
 	uint64_t	ms_lbas[MAX_LBAS];
 
 	metaslab_group_t *ms_group;	/* metaslab group		*/
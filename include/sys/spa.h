@@ -830,6 +830,19 @@ extern void spa_sync(spa_t *spa, uint64_t txg); /* only for DMU use */
 extern void spa_sync_allpools(void);
 
 extern int zfs_sync_pass_deferred_free;
+extern int zfs_sync_vdevs_parallel;
+
+/*
+ * Phases of spa_sync() whose duration is kept in the txg history.
+ */
+typedef enum spa_sync_phase {
+	SPA_SYNC_PHASE_DATASETS,	/* dsl_pool_sync(), all passes */
+	SPA_SYNC_PHASE_FREES,		/* frees and deferred frees */
+	SPA_SYNC_PHASE_VDEVS,		/* vdev_sync(), all passes */
+	SPA_SYNC_PHASE_CONFIG,		/* label and uberblock writes */
+	SPA_SYNC_PHASE_DONE,		/* vdev_sync_done() */
+	SPA_SYNC_PHASES
+} spa_sync_phase_t;
 
 /* spa namespace global mutex */
 extern kmutex_t spa_namespace_lock;
@@ -891,9 +904,37 @@ typedef struct spa_stats {
 	spa_stats_history_t	read_history;
 	spa_stats_history_t	txg_history;
 	spa_stats_history_t	tx_assign_histogram;
+	spa_stats_history_t	zil_commit_histogram;
+	spa_stats_history_t	zil_lwb_histogram;
 	spa_stats_history_t	io_history;
+	spa_stats_history_t	frag_history;
 } spa_stats_t;
 
+/*
+ * Latency histograms exported by the dmu_tx_assign kstat.  SPA_TXA_WAIT
+ * covers all time spent in dmu_tx_wait() and keeps the original bucket
+ * names; the per-reason histograms break that time down further.
+ */
+typedef enum spa_tx_assign_hist {
+	SPA_TXA_WAIT = 0,	/* any dmu_tx_wait() */
+	SPA_TXA_ASSIGN,		/* dmu_tx_assign() entry to assignment */
+	SPA_TXA_DIRTY,		/* dirty data throttle */
+	SPA_TXA_SUSPENDED,	/* pool suspended or never tried */
+	SPA_TXA_DNODE,		/* dnode still assigned to previous txg */
+	SPA_TXA_OPEN,		/* waiting for the next open txg */
+	SPA_TXA_HISTS
+} spa_tx_assign_hist_t;
+
+/*
+ * Latency histograms exported by the zil_commit kstat.
+ */
+typedef enum spa_zil_commit_hist {
+	SPA_ZCH_COMMIT = 0,	/* zil_commit() entry to return */
+	SPA_ZCH_WAIT,		/* sleeping on the commit waiter */
+	SPA_ZCH_LWB,		/* lwb issue to write and flush done */
+	SPA_ZCH_HISTS
+} spa_zil_commit_hist_t;
+
 typedef enum txg_state {
 	TXG_STATE_BIRTH		= 0,
 	TXG_STATE_OPEN		= 1,
@@ -912,7 +953,17 @@ extern int spa_txg_history_set(spa_t *spa,  uint64_t txg,
     txg_state_t completed_state, hrtime_t completed_time);
 extern int spa_txg_history_set_io(spa_t *spa,  uint64_t txg, uint64_t nread,
     uint64_t nwritten, uint64_t reads, uint64_t writes, uint64_t ndirty);
-extern void spa_tx_assign_add_nsecs(spa_t *spa, uint64_t nsecs);
+extern int spa_txg_history_set_sm(spa_t *spa, uint64_t txg, uint64_t smlogged,
+    uint64_t smflushed, uint64_t smsaved);
+extern int spa_txg_history_set_sync(spa_t *spa, uint64_t txg, uint64_t passes,
+    const hrtime_t *phase_time);
+extern void spa_tx_assign_add_nsecs(spa_t *spa, spa_tx_assign_hist_t hist,
+    uint64_t nsecs);
+extern void spa_frag_history_add(spa_t *spa, uint64_t txg,
+    metaslab_group_t *mg);
+extern void spa_zil_commit_add_nsecs(spa_t *spa, spa_zil_commit_hist_t hist,
+    uint64_t nsecs);
+extern void spa_zil_lwb_add(spa_t *spa, uint64_t size, uint64_t fill);
 
 /* Pool configuration locks */
 extern int spa_config_tryenter(spa_t *spa, int locks, void *tag, krw_t rw);
@@ -974,6 +1025,10 @@ extern uint64_t spa_version(spa_t *spa);
 extern boolean_t spa_deflate(spa_t *spa);
 extern metaslab_class_t *spa_normal_class(spa_t *spa);
 extern metaslab_class_t *spa_log_class(spa_t *spa);
+extern metaslab_class_t *spa_special_class(spa_t *spa);
+extern metaslab_class_t *spa_dedup_class(spa_t *spa);
+extern metaslab_class_t *spa_preferred_class(spa_t *spa, uint64_t size,
+    dmu_object_type_t objtype, uint_t level, uint_t special_smallblk);
 extern void spa_evicting_os_register(spa_t *, objset_t *os);
 extern void spa_evicting_os_deregister(spa_t *, objset_t *os);
 extern void spa_evicting_os_wait(spa_t *spa);
@@ -997,6 +1052,8 @@ extern char *spa_strdup(const char *);
 extern void spa_strfree(char *);
 extern uint64_t spa_get_random(uint64_t range);
 extern uint64_t spa_generate_guid(spa_t *spa);
+extern int spa_alloc_select(spa_t *spa, uint64_t objset, uint64_t object,
+    uint64_t blkid);
 extern void snprintf_blkptr(char *buf, size_t buflen, const blkptr_t *bp);
 extern void spa_freeze(spa_t *spa);
 extern int spa_change_guid(spa_t *spa);
@@ -1013,6 +1070,7 @@ extern boolean_t spa_is_root(spa_t *spa);
 extern boolean_t spa_writeable(spa_t *spa);
 extern boolean_t spa_has_pending_synctask(spa_t *spa);
 extern int spa_maxblocksize(spa_t *spa);
+extern int spa_maxdnodesize(spa_t *spa);
 extern void zfs_blkptr_verify(spa_t *spa, const blkptr_t *bp);
 
 extern int spa_mode(spa_t *spa);
@@ -1051,6 +1109,10 @@ extern void spa_get_errlists(spa_t *spa, avl_tree_t *last, avl_tree_t *scrub);
 /* vdev cache */
 extern void vdev_cache_stat_init(void);
 extern void vdev_cache_stat_fini(void);
+extern void vdev_queue_cache_init(void);
+extern void vdev_queue_cache_fini(void);
+extern void vdev_queue_stat_init(void);
+extern void vdev_queue_stat_fini(void);
 
 /* Initialization and termination */
 extern void spa_init(int flags);
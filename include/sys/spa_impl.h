@@ -143,6 +143,9 @@ struct spa {
 	nvlist_t	*spa_load_info;		/* info and errors from load */
 	uint64_t	spa_config_txg;		/* txg of last config change */
 	int		spa_sync_pass;		/* iterate-to-convergence */
+	uint64_t	spa_sm_logged;		/* ms changes logged */
+	uint64_t	spa_sm_flushed;		/* metaslabs flushed */
+	uint64_t	spa_sm_saved;		/* space map bytes saved */
 	pool_state_t	spa_state;		/* pool state */
 	int		spa_inject_ref;		/* injection references */
 	uint8_t		spa_sync_on;		/* sync threads are running */
@@ -153,6 +156,8 @@ struct spa {
 	boolean_t	spa_is_initializing;	/* true while opening pool */
 	metaslab_class_t *spa_normal_class;	/* normal data class */
 	metaslab_class_t *spa_log_class;	/* intent log data class */
+	metaslab_class_t *spa_special_class;	/* special allocation class */
+	metaslab_class_t *spa_dedup_class;	/* dedup allocation class */
 	uint64_t	spa_first_txg;		/* first txg after spa_open() */
 	uint64_t	spa_final_txg;		/* txg of export/destroy */
 	uint64_t	spa_freeze_txg;		/* freeze pool at this txg */
@@ -174,6 +179,7 @@ struct spa {
 	list_t		spa_state_dirty_list;	/* vdevs with dirty state */
 	kmutex_t	spa_alloc_lock;
 	avl_tree_t	spa_alloc_tree;
+	int		spa_alloc_count;	/* # of metaslab allocators */
 	spa_aux_vdev_t	spa_spares;		/* hot spares */
 	spa_aux_vdev_t	spa_l2cache;		/* L2ARC cache devices */
 	nvlist_t	*spa_label_features;	/* Features for reading MOS */
@@ -246,6 +252,7 @@ struct spa {
 	int		spa_mode;		/* FREAD | FWRITE */
 	spa_log_state_t spa_log_state;		/* log state */
 	uint64_t	spa_autoexpand;		/* lun expansion on/off */
+	uint64_t	spa_autotrim;		/* automatic TRIM on/off */
 	ddt_t		*spa_ddt[ZIO_CHECKSUM_FUNCTIONS]; /* in-core DDTs */
 	uint64_t	spa_ddt_stat_object;	/* DDT statistics */
 	uint64_t	spa_dedup_ditto;	/* dedup ditto threshold */
@@ -269,6 +276,7 @@ struct spa {
 	nvlist_t	*spa_feat_stats;	/* Cache of enabled features */
 	/* cache feature refcounts */
 	uint64_t	spa_feat_refcount_cache[SPA_FEATURES];
+	kmutex_t	spa_feat_refcount_lock;	/* feature_do_action() */
 	taskqid_t	spa_deadman_tqid;	/* Task id */
 	uint64_t	spa_deadman_calls;	/* number of deadman calls */
 	hrtime_t	spa_sync_starttime;	/* starting time of spa_sync */
@@ -280,6 +288,13 @@ struct spa {
 	spa_keystore_t	spa_keystore;		/* loaded crypto keys */
 	hrtime_t	spa_ccw_fail_time;	/* Conf cache write fail time */
 	taskq_t		*spa_zvol_taskq;	/* Taskq for minor managment */
+	taskq_t		*spa_auto_trim_taskq;	/* runs autotrim passes */
+	kmutex_t	spa_trim_lock;		/* protects spa_*trim* below */
+	kcondvar_t	spa_trim_cv;		/* trim thread/task exited */
+	boolean_t	spa_auto_trimming;	/* autotrim pass queued */
+	kthread_t	*spa_trim_thread;	/* "zpool trim" thread */
+	boolean_t	spa_trim_stop;		/* ask trim thread to exit */
+	pool_trim_stat_t spa_trim_stats;	/* for "zpool status" */
 #ifdef __APPLE__
 	spa_iokit_t	*spa_iokit_proxy;	/* IOKit pool proxy */
 #endif
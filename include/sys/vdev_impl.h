@@ -39,6 +39,11 @@
 #include <sys/ldi_buf.h>
 #endif
 
+/* Not every platform's dkio.h has the TRIM/UNMAP ioctl */
+#ifndef DKIOCFREE
+#define	DKIOCFREE	(DKIOC|50)
+#endif
+
 #ifdef	__cplusplus
 extern "C" {
 #endif
@@ -107,6 +112,16 @@ struct vdev_cache {
 	kmutex_t	vc_lock;
 };
 
+/*
+ * Per-dataset state of the weighted-fair queueing within a class.
+ */
+typedef struct vdev_queue_flow {
+	uint64_t	vqf_objset;
+	uint64_t	vqf_finish;	/* finish tag of the newest queued i/o */
+	uint32_t	vqf_queued;
+	avl_node_t	vqf_node;
+} vdev_queue_flow_t;
+
 typedef struct vdev_queue_class {
 	uint32_t	vqc_active;
 
@@ -115,6 +130,21 @@ typedef struct vdev_queue_class {
 	 * LBA-ordered vs FIFO.
 	 */
 	avl_tree_t	vqc_queued_tree;
+
+	/*
+	 * Weighted-fair queueing, see the comment in vdev_queue.c.
+	 */
+	avl_tree_t	vqc_fair_tree;	/* queued i/os sorted by io_vtime */
+	avl_tree_t	vqc_flow_tree;	/* vdev_queue_flow_t by objset */
+	uint64_t	vqc_vtime;	/* finish tag of the last issued i/o */
+	uint32_t	vqc_weighted;	/* queued i/os with non-default weight */
+	vdev_queue_flow_t vqc_spill_flow; /* flows we failed to allocate */
+
+	/*
+	 * Queued i/os in arrival (and so deadline) order, see the
+	 * comment on zfs_vdev_deadline in vdev_queue.c.
+	 */
+	list_t		vqc_deadline_list;
 } vdev_queue_class_t;
 
 struct vdev_queue {
@@ -129,8 +159,19 @@ struct vdev_queue {
 	zio_t		vq_io_search; /* used as local for stack reduction */
 	kmutex_t	vq_lock;
 	uint64_t	vq_lastoffset;
+	hrtime_t	vq_read_ewma;	/* average read service time */
 };
 
+/*
+ * Allocation class a top-level vdev's metaslab group belongs to, other than
+ * the normal and log classes (see ZPOOL_CONFIG_ALLOCATION_BIAS).
+ */
+typedef enum vdev_alloc_bias {
+	VDEV_BIAS_NONE,
+	VDEV_BIAS_SPECIAL,	/* metadata and small blocks */
+	VDEV_BIAS_DEDUP		/* dedup tables */
+} vdev_alloc_bias_t;
+
 /*
  * Virtual device descriptor
  */
@@ -186,8 +227,24 @@ struct vdev {
 	uint64_t	vdev_islog;	/* is an intent log device	*/
 	uint64_t	vdev_removing;	/* device is being removed?	*/
 	boolean_t	vdev_ishole;	/* is a hole in the namespace	*/
+	vdev_alloc_bias_t vdev_alloc_bias; /* metaslab allocation class	*/
 	kmutex_t	vdev_queue_lock; /* protects vdev_queue_depth	*/
 	uint64_t	vdev_top_zap;
+	hrtime_t	vdev_flush_covered; /* issue time of last ZIL flush */
+	int		vdev_load_error; /* error loading metaslabs	*/
+
+	/*
+	 * Log space maps (see vdev_log_spacemap.c). vdev_log_sms holds one
+	 * vdev_log_sm_entry_t per log, sorted by txg; vdev_unflushed_ms
+	 * holds the metaslabs with unflushed changes, sorted by
+	 * ms_unflushed_txg. The open log of the syncing txg, the trees and
+	 * ms_unflushed_txg are protected by vdev_log_sm_lock.
+	 */
+	uint64_t	vdev_log_sm_zap; /* txg -> log space map object	*/
+	uint64_t	vdev_unflushed_array; /* ms_unflushed_txg array	*/
+	avl_tree_t	vdev_log_sms;	/* log space maps		*/
+	avl_tree_t	vdev_unflushed_ms; /* metaslabs to flush	*/
+	space_map_t	*vdev_log_sm;	/* log of the syncing txg	*/
 
 	/*
 	 * The queue depth parameters determine how many async writes are
@@ -221,6 +278,7 @@ struct vdev {
 	uint64_t	vdev_not_present; /* not present during import	*/
 	uint64_t	vdev_unspare;	/* unspare when resilvering done */
 	boolean_t	vdev_nowritecache; /* true if flushwritecache failed */
+	boolean_t	vdev_notrim;	/* true if DKIOCFREE failed	*/
 	boolean_t	vdev_checkremove; /* temporary online test	*/
 	boolean_t	vdev_forcefault; /* force online fault		*/
 	boolean_t	vdev_splitting;	/* split or repair in progress  */
@@ -248,6 +306,8 @@ struct vdev {
 	kmutex_t	vdev_dtl_lock;	/* vdev_dtl_{map,resilver}	*/
 	kmutex_t	vdev_stat_lock;	/* vdev_stat			*/
 	kmutex_t	vdev_probe_lock; /* protects vdev_probe_zio	*/
+	kmutex_t	vdev_flush_lock; /* vdev_flush_covered		*/
+	kmutex_t	vdev_log_sm_lock; /* log space map state	*/
 };
 
 #define	VDEV_RAIDZ_MAXPARITY	3
@@ -336,7 +396,7 @@ extern void vdev_load_log_state(vdev_t *nvd, vdev_t *ovd);
 extern boolean_t vdev_log_state_valid(vdev_t *vd);
 extern void vdev_load(vdev_t *vd);
 extern int vdev_dtl_load(vdev_t *vd);
-extern void vdev_sync(vdev_t *vd, uint64_t txg);
+extern void vdev_sync(vdev_t *vd, uint64_t txg, taskq_t *tq);
 extern void vdev_sync_done(vdev_t *vd, uint64_t txg);
 extern void vdev_dirty(vdev_t *vd, int flags, void *arg, uint64_t txg);
 extern void vdev_dirty_leaves(vdev_t *vd, int flags, uint64_t txg);
@@ -361,6 +421,11 @@ extern uint64_t vdev_default_asize(vdev_t *vd, uint64_t psize);
 extern uint64_t vdev_get_min_asize(vdev_t *vd);
 extern void vdev_set_min_asize(vdev_t *vd);
 
+/*
+ * Map a range of a RAID-Z vdev to the range it covers on one child
+ */
+extern void vdev_raidz_xlate(vdev_t *cvd, uint64_t *start, uint64_t *end);
+
 /*
  * Global variables
  */
@@ -0,0 +1,63 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+
+#ifndef _SYS_VDEV_LOG_SPACEMAP_H
+#define	_SYS_VDEV_LOG_SPACEMAP_H
+
+#include <sys/avl.h>
+#include <sys/dmu.h>
+#include <sys/metaslab.h>
+#include <sys/vdev.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Entries of the top-level vdev ZAP. The first names a ZAP that maps each
+ * txg that has a log to the log's space map object; the second an object
+ * array holding ms_unflushed_txg for each metaslab.
+ */
+#define	VDEV_TOP_ZAP_LOG_SPACEMAPS	"com.delphix:log_spacemaps"
+#define	VDEV_TOP_ZAP_UNFLUSHED_TXGS	"com.delphix:ms_unflushed_txgs"
+
+typedef struct vdev_log_sm_entry {
+	uint64_t	vlse_txg;	/* txg the log was written in */
+	uint64_t	vlse_object;	/* space map object of the log */
+	avl_node_t	vlse_node;
+} vdev_log_sm_entry_t;
+
+extern int zfs_unflushed_max_txgs;
+extern int zfs_min_metaslabs_to_flush;
+
+void vdev_log_sm_create(vdev_t *);
+void vdev_log_sm_destroy(vdev_t *);
+void vdev_log_sm_transfer(vdev_t *, vdev_t *);
+
+boolean_t vdev_log_sm_enabled(vdev_t *);
+int vdev_log_sm_load(vdev_t *);
+void vdev_log_sm_fini(vdev_t *);
+
+void vdev_log_sm_open(vdev_t *, dmu_tx_t *);
+void vdev_log_sm_write(vdev_t *, metaslab_t *, range_tree_t *, dmu_tx_t *);
+void vdev_log_sm_set_unflushed(vdev_t *, metaslab_t *, uint64_t, dmu_tx_t *);
+void vdev_log_sm_sync(vdev_t *, uint64_t);
+void vdev_log_sm_sync_done(vdev_t *, uint64_t);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _SYS_VDEV_LOG_SPACEMAP_H */
@@ -118,6 +118,8 @@ struct zfsvfs {
     	uint64_t	    z_userquota_obj;
         uint64_t	    z_groupquota_obj;
         uint64_t	    z_replay_eof;	/* New end of file - replay only */
+        uint64_t	    z_replay_eof_obj; /* object z_replay_eof applies to */
+        kmutex_t	    z_replay_eof_lock; /* serializes z_replay_eof users */
         sa_attr_type_t  *z_attr_table;  /* SA attr mapping->id */
 #define ZFS_OBJ_MTX_SZ  256
         kmutex_t        z_hold_mtx[ZFS_OBJ_MTX_SZ];     /* znode hold locks */
@@ -40,6 +40,7 @@ extern "C" {
 
 struct dsl_pool;
 struct dsl_dataset;
+struct lwb;
 
 /*
  * Intent log format:
@@ -131,6 +132,7 @@ typedef enum zil_create {
 /*
  * Intent log transaction types and record structures
  */
+#define	TX_COMMIT		0	/* Commit marker (no on-disk state) */
 #define	TX_CREATE		1	/* Create file */
 #define	TX_MKDIR		2	/* Make directory */
 #define	TX_MKXATTR		3	/* Make XATTR directory */
@@ -210,6 +212,20 @@ typedef struct {
 	/* remainder of array and any additional fields */
 } lr_attr_t;
 
+/*
+ * Additional lr_foid information for creates:
+ *
+ * The upper 8 bits of lr_foid encode the number of dnode slots
+ * (minus one) consumed by the newly created object, and the lower
+ * DN_MAX_OBJECT_SHIFT bits hold the object number.  Pools without
+ * large dnodes always record zero in the upper bits, so old logs
+ * replay unchanged.
+ */
+#define	LR_FOID_GET_SLOTS(oid) (BF64_GET((oid), 56, 8) + 1)
+#define	LR_FOID_SET_SLOTS(oid, x) BF64_SET((oid), 56, 8, (x) - 1)
+#define	LR_FOID_GET_OBJ(oid) BF64_GET((oid), 0, DN_MAX_OBJECT_SHIFT)
+#define	LR_FOID_SET_OBJ(oid, x) BF64_SET((oid), 0, DN_MAX_OBJECT_SHIFT, (x))
+
 /*
  * log record for creates without optional ACL.
  * This log record does support optional xvattr_t attributes.
@@ -429,6 +445,33 @@ typedef struct zil_stats {
 	 */
 	kstat_named_t zil_itx_metaslab_slog_count;
 	kstat_named_t zil_itx_metaslab_slog_bytes;
+
+	/*
+	 * Vdev cache flushes after lwb writes.  A flush is skipped when the
+	 * vdev has no volatile write cache, or when a flush issued after the
+	 * writes completed has already finished (see zil_lwb_write_done()).
+	 */
+	kstat_named_t zil_flush_issued;
+	kstat_named_t zil_flush_skipped;
+
+	/*
+	 * Intent log replay (see zil_replay()).  "records" counts every
+	 * record applied, of which "concurrent" were applied by the
+	 * per-object lanes and "barriers" by the parsing thread alone.
+	 * "inflight" is the number of records currently queued on the
+	 * lanes.  "bytes" accumulates log record sizes, not the data of
+	 * indirect writes.  Times are in milliseconds.
+	 */
+	kstat_named_t zil_replay_count;
+	kstat_named_t zil_replay_blocks;
+	kstat_named_t zil_replay_records;
+	kstat_named_t zil_replay_records_concurrent;
+	kstat_named_t zil_replay_records_inflight;
+	kstat_named_t zil_replay_barriers;
+	kstat_named_t zil_replay_bytes;
+	kstat_named_t zil_replay_errors;
+	kstat_named_t zil_replay_time_ms;
+	kstat_named_t zil_replay_last_ms;
 } zil_stats_t;
 
 extern zil_stats_t zil_stats;
@@ -438,6 +481,52 @@ extern zil_stats_t zil_stats;
 #define	ZIL_STAT_BUMP(stat) \
     ZIL_STAT_INCR(stat, 1);
 
+/*
+ * Per-dataset intent log statistics, exported as the
+ * zfs/<pool>/zil-0x<dsobj> kstat while the log is open.
+ *
+ * The "logged" counters are bumped when zfs_log_write() (or
+ * zvol_log_write()) chooses how a write is logged; "bytes" is the length
+ * of the write.  The "itx" counters cover records actually committed to
+ * a log block by zil_lwb_commit(), and "bytes" accumulates the record
+ * sizes including any copied data.  The histograms are power-of-two
+ * latency buckets, starting at 1us, for the lwb write (issue to write
+ * done) and the following vdev cache flush (write done to flush done).
+ */
+#define	ZIL_DS_HIST_SHIFT	10	/* 1us */
+#define	ZIL_DS_HIST_BUCKETS	28	/* 1us to 137s */
+
+typedef struct zil_ds_stats {
+	kstat_named_t zds_commit_count;
+	kstat_named_t zds_commit_writer_count;
+	kstat_named_t zds_logged_indirect_count;
+	kstat_named_t zds_logged_indirect_bytes;
+	kstat_named_t zds_logged_copied_count;
+	kstat_named_t zds_logged_copied_bytes;
+	kstat_named_t zds_logged_needcopy_count;
+	kstat_named_t zds_logged_needcopy_bytes;
+	kstat_named_t zds_itx_count;
+	kstat_named_t zds_itx_bytes;
+	kstat_named_t zds_itx_write_count;
+	kstat_named_t zds_itx_truncate_count;
+	kstat_named_t zds_itx_setattr_count;
+	kstat_named_t zds_itx_create_count;
+	kstat_named_t zds_itx_remove_count;
+	kstat_named_t zds_itx_rename_count;
+	kstat_named_t zds_lwb_count;
+	kstat_named_t zds_lwb_bytes;
+	kstat_named_t zds_lwb_write_errors;
+	kstat_named_t zds_flush_count;
+	kstat_named_t zds_flush_skipped;
+	kstat_named_t zds_write_hist[ZIL_DS_HIST_BUCKETS];
+	kstat_named_t zds_flush_hist[ZIL_DS_HIST_BUCKETS];
+} zil_ds_stats_t;
+
+#define	ZIL_DS_STAT_INCR(zilog, stat, val) \
+    atomic_add_64(&(zilog)->zl_stats.stat.value.ui64, (val));
+#define	ZIL_DS_STAT_BUMP(zilog, stat) \
+    ZIL_DS_STAT_INCR(zilog, stat, 1);
+
 typedef int zil_parse_blk_func_t(zilog_t *zilog, blkptr_t *bp, void *arg,
     uint64_t txg);
 typedef int zil_parse_lr_func_t(zilog_t *zilog, lr_t *lr, void *arg,
@@ -446,8 +535,8 @@ typedef int (*zil_replay_func_t)(void *, char *, boolean_t);
 
 struct znode;
 struct rl;
-typedef int zil_get_data_t(void *arg, lr_write_t *lr, char *dbuf, zio_t *zio,
-						   struct znode *zp, struct rl *rl);
+typedef int zil_get_data_t(void *arg, lr_write_t *lr, char *dbuf,
+    struct lwb *lwb, zio_t *zio, struct znode *zp, struct rl *rl);
 
 extern int zil_parse(zilog_t *zilog, zil_parse_blk_func_t *parse_blk_func,
     zil_parse_lr_func_t *parse_lr_func, void *arg, uint64_t txg,
@@ -471,8 +560,11 @@ extern void	zil_destroy_sync(zilog_t *zilog, dmu_tx_t *tx);
 extern itx_t	*zil_itx_create(uint64_t txtype, size_t lrsize);
 extern void	zil_itx_destroy(itx_t *itx);
 extern void	zil_itx_assign(zilog_t *zilog, itx_t *itx, dmu_tx_t *tx);
+extern void	zil_itx_logged(zilog_t *zilog, itx_wr_state_t state,
+    uint64_t len);
 
 extern void	zil_commit(zilog_t *zilog, uint64_t oid);
+extern void	zil_commit_impl(zilog_t *zilog, uint64_t oid);
 
 extern int	zil_vdev_offline(const char *osname, void *txarg);
 extern int	zil_claim(struct dsl_pool *dp,
@@ -485,7 +577,7 @@ extern void	zil_clean(zilog_t *zilog, uint64_t synced_txg);
 extern int	zil_suspend(const char *osname, void **cookiep);
 extern void	zil_resume(void *cookie);
 
-extern void	zil_add_block(zilog_t *zilog, const blkptr_t *bp);
+extern void	zil_lwb_add_block(struct lwb *lwb, const blkptr_t *bp);
 extern int	zil_bp_tree_add(zilog_t *zilog, const blkptr_t *bp);
 
 extern void	zil_set_sync(zilog_t *zilog, uint64_t syncval);
@@ -493,6 +585,9 @@ extern void	zil_set_sync(zilog_t *zilog, uint64_t syncval);
 extern void	zil_set_logbias(zilog_t *zilog, uint64_t slogval);
 
 extern int zil_replay_disable;
+extern int zil_replay_threads;
+extern int zfs_commit_timeout_pct;
+extern int zil_lwb_decay_shift;
 
 #ifdef	__cplusplus
 }
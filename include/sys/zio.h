@@ -319,6 +319,8 @@ typedef struct zio_prop {
 	boolean_t		zp_nopwrite;
 	boolean_t		zp_encrypt;
 	boolean_t		zp_byteorder;
+	uint16_t		zp_ioweight;
+	uint32_t		zp_zpl_smallblk;
 	uint8_t			zp_salt[ZIO_DATA_SALT_LEN];
 	uint8_t			zp_iv[ZIO_DATA_IV_LEN];
 	uint8_t			zp_mac[ZIO_DATA_MAC_LEN];
@@ -409,6 +411,7 @@ struct zio {
 	enum zio_child	io_child_type;
 	int		io_cmd;
 	zio_priority_t	io_priority;
+	uint16_t	io_weight;	/* dataset ioweight, 0 if none */
 	uint8_t		io_reexecute;
 	uint8_t		io_state[ZIO_WAIT_TYPES];
 	uint64_t	io_txg;
@@ -452,8 +455,15 @@ struct zio {
 					/* file). */
 	avl_node_t	io_queue_node;
 	avl_node_t	io_offset_node;
+	avl_node_t	io_fair_node;
+	uint64_t	io_vtime;	/* weighted-fair finish tag */
+	struct vdev_queue_flow *io_flow; /* NULL if not in the fair tree */
+	list_node_t	io_deadline_node;
+	hrtime_t	io_deadline;	/* vdev queue latency target */
 	avl_node_t	io_alloc_node;
 	zio_alloc_list_t 	io_alloc_list;
+	int		io_allocator;	/* metaslab allocator to use */
+	metaslab_class_t *io_metaslab_class;	/* dva throttle class */
 
 	/* Internal pipeline state */
 	enum zio_flag	io_flags;
@@ -520,6 +530,9 @@ extern zio_t *zio_claim(zio_t *pio, spa_t *spa, uint64_t txg,
 extern zio_t *zio_ioctl(zio_t *pio, spa_t *spa, vdev_t *vd, int cmd,
     zio_done_func_t *done, void *_private, enum zio_flag flags);
 
+extern zio_t *zio_trim(zio_t *pio, spa_t *spa, vdev_t *vd, uint64_t offset,
+    uint64_t size, enum zio_flag flags);
+
 extern zio_t *zio_read_phys(zio_t *pio, vdev_t *vd, uint64_t offset,
     uint64_t size, struct abd *data, int checksum,
     zio_done_func_t *done, void *_private, zio_priority_t priority,
@@ -476,6 +476,18 @@ typedef struct dk_updatefw_32 {
 #define	FW_TYPE_TEMP	0x0		/* temporary use */
 #define	FW_TYPE_PERM	0x1		/* permanent use */
 
+/*
+ * ioctl to free space (e.g. SCSI UNMAP) off a disk.
+ */
+#define	DKIOCFREE	(DKIOC|50)
+
+typedef struct dkioc_free_s {
+	uint32_t	df_flags;
+	uint32_t	df_reserved;	/* For easy 64 bit alignment below... */
+	uint64_t	df_start;
+	uint64_t	df_length;
+} dkioc_free_t;
+
 
 #ifdef	__cplusplus
 }
@@ -1210,6 +1210,29 @@ zfs_valid_proplist(libzfs_handle_t *hdl, zfs_type_t type, nvlist_t *nvl,
 			}
 			break;
 		}
+		case ZFS_PROP_IOWEIGHT:
+			if (intval < ZFS_IOWEIGHT_MIN ||
+			    intval > ZFS_IOWEIGHT_MAX) {
+				zfs_error_aux(hdl, dgettext(TEXT_DOMAIN,
+				    "'%s' must be between %d and %d"), propname,
+				    ZFS_IOWEIGHT_MIN, ZFS_IOWEIGHT_MAX);
+				(void) zfs_error(hdl, EZFS_BADPROP, errbuf);
+				goto error;
+			}
+			break;
+
+		case ZFS_PROP_SPECIAL_SMALL_BLOCKS:
+			if (intval != 0 && (intval < SPA_MINBLOCKSIZE ||
+			    intval > ZFS_SPECIAL_SMALL_BLOCKS_MAX ||
+			    !ISP2(intval))) {
+				zfs_error_aux(hdl, dgettext(TEXT_DOMAIN,
+				    "'%s' must be zero or a power of 2 from "
+				    "512B to 128KB"), propname);
+				(void) zfs_error(hdl, EZFS_BADPROP, errbuf);
+				goto error;
+			}
+			break;
+
 		case ZFS_PROP_MLSLABEL:
 		{
 #ifdef HAVE_MLSLABEL
@@ -2048,6 +2048,48 @@ zpool_scan(zpool_handle_t *zhp, pool_scan_func_t func, pool_scrub_cmd_t cmd)
 	}
 }
 
+/*
+ * Start trimming the pool's free space at no more than rate bytes per
+ * second (0 for no limit), or stop a trim in progress.
+ */
+int
+zpool_trim(zpool_handle_t *zhp, boolean_t start, uint64_t rate)
+{
+	zfs_cmd_t zc = {"\0"};
+	char msg[1024];
+	int err;
+	libzfs_handle_t *hdl = zhp->zpool_hdl;
+
+	(void) strlcpy(zc.zc_name, zhp->zpool_name, sizeof (zc.zc_name));
+	zc.zc_cookie = start;
+	zc.zc_obj = rate;
+
+	if (zfs_ioctl(hdl, ZFS_IOC_POOL_TRIM, &zc) == 0)
+		return (0);
+
+	err = errno;
+
+	if (start) {
+		(void) snprintf(msg, sizeof (msg), dgettext(TEXT_DOMAIN,
+		    "cannot trim %s"), zc.zc_name);
+	} else {
+		(void) snprintf(msg, sizeof (msg), dgettext(TEXT_DOMAIN,
+		    "cannot cancel trimming %s"), zc.zc_name);
+	}
+
+	if (err == EBUSY) {
+		zfs_error_aux(hdl, dgettext(TEXT_DOMAIN,
+		    "currently trimming"));
+		return (zfs_error(hdl, EZFS_BUSY, msg));
+	} else if (err == ENOENT && !start) {
+		zfs_error_aux(hdl, dgettext(TEXT_DOMAIN,
+		    "there is no active trim"));
+		return (zfs_error(hdl, EZFS_NOENT, msg));
+	} else {
+		return (zpool_standard_error(hdl, err, msg));
+	}
+}
+
 #ifdef illumos
 
 /*
@@ -847,6 +847,31 @@ vn_rdwr(int uio, vnode_t *vp, void *addr, ssize_t len, offset_t offset,
 	return (0);
 }
 
+/*
+ * Deallocate a range of the file, keeping its size, for a TRIM of a file
+ * vdev.
+ */
+int
+vn_trim(vnode_t *vp, offset_t offset, offset_t len)
+{
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+	if (fallocate(vp->v_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	    offset, len) == -1)
+		return (errno);
+	return (0);
+#elif defined(F_PUNCHHOLE)
+	fpunchhole_t fp = { 0 };
+
+	fp.fp_offset = offset;
+	fp.fp_length = len;
+	if (fcntl(vp->v_fd, F_PUNCHHOLE, &fp) == -1)
+		return (errno);
+	return (0);
+#else
+	return (ENOTSUP);
+#endif
+}
+
 void
 vn_close(vnode_t *vp)
 {
@@ -0,0 +1,779 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+
+#include	<sys/btree.h>
+#include	<sys/zfs_context.h>
+
+/*
+ * This is a classic B-tree: every node, core or leaf, holds a sorted array
+ * of elements, and the subtree to the left of element i of a core node is
+ * btc_children[i]. Every node other than the root is kept at least half
+ * full, so a tree of n elements is O(log n) deep with a very large fan-out.
+ *
+ * Insertion always happens in a leaf; a full node is split around its
+ * median, which moves up into the parent (and may split it in turn).
+ * Removal of an element from a core node is turned into removal of its
+ * predecessor from a leaf; a node that falls below half full borrows an
+ * element from a sibling through the parent, or is merged with it.
+ */
+
+kmem_cache_t *zfs_btree_leaf_cache;
+
+#define	BT_CORE_SIZE(tree)	(offsetof(zfs_btree_core_t, btc_elems) + \
+	BTREE_CORE_ELEMS * (tree)->bt_elem_size)
+#define	BT_CORE(hdr)		((zfs_btree_core_t *)(hdr))
+#define	BT_ELEM(tree, hdr, i)	\
+	(bt_elems(hdr) + (size_t)(i) * (tree)->bt_elem_size)
+
+void
+zfs_btree_init(void)
+{
+	zfs_btree_leaf_cache = kmem_cache_create("zfs_btree_leaf_cache",
+	    BTREE_LEAF_SIZE, 0, NULL, NULL, NULL, NULL, NULL, 0);
+}
+
+void
+zfs_btree_fini(void)
+{
+	kmem_cache_destroy(zfs_btree_leaf_cache);
+}
+
+static inline uint8_t *
+bt_elems(zfs_btree_hdr_t *hdr)
+{
+	return (hdr->bth_core ? BT_CORE(hdr)->btc_elems :
+	    ((zfs_btree_leaf_t *)hdr)->btl_elems);
+}
+
+static inline uint32_t
+bt_cap(zfs_btree_t *tree, zfs_btree_hdr_t *hdr)
+{
+	return (hdr->bth_core ? BTREE_CORE_ELEMS : tree->bt_leaf_cap);
+}
+
+static zfs_btree_hdr_t *
+bt_node_alloc(zfs_btree_t *tree, boolean_t core)
+{
+	zfs_btree_hdr_t *hdr;
+
+	if (core) {
+		hdr = kmem_alloc(BT_CORE_SIZE(tree), KM_SLEEP);
+		tree->bt_num_cores++;
+	} else {
+		hdr = kmem_cache_alloc(zfs_btree_leaf_cache, KM_SLEEP);
+		tree->bt_num_leaves++;
+	}
+	hdr->bth_parent = NULL;
+	hdr->bth_core = core;
+	hdr->bth_count = 0;
+	return (hdr);
+}
+
+static void
+bt_node_free(zfs_btree_t *tree, zfs_btree_hdr_t *hdr)
+{
+	if (hdr->bth_core) {
+		ASSERT3U(tree->bt_num_cores, >, 0);
+		tree->bt_num_cores--;
+		kmem_free(hdr, BT_CORE_SIZE(tree));
+	} else {
+		ASSERT3U(tree->bt_num_leaves, >, 0);
+		tree->bt_num_leaves--;
+		kmem_cache_free(zfs_btree_leaf_cache, hdr);
+	}
+}
+
+/*
+ * Move count elements of a node from position from to position to.
+ */
+static inline void
+bt_move(zfs_btree_t *tree, zfs_btree_hdr_t *hdr, uint32_t from, uint32_t to,
+    uint32_t count)
+{
+	if (count > 0) {
+		memmove(BT_ELEM(tree, hdr, to), BT_ELEM(tree, hdr, from),
+		    (size_t)count * tree->bt_elem_size);
+	}
+}
+
+/*
+ * Copy items [from, from + count) of the sequence that results from
+ * inserting value at position ins of the array src into dst. This lets a
+ * split distribute the items of a full node plus the new one without
+ * building the combined array first.
+ */
+static void
+bt_copy_ins(size_t size, uint8_t *dst, const uint8_t *src, uint32_t ins,
+    const void *value, uint32_t from, uint32_t count)
+{
+	uint32_t end = from + count;
+
+	if (from < ins) {
+		uint32_t n = MIN(end, ins) - from;
+		bcopy(src + from * size, dst, n * size);
+		dst += n * size;
+	}
+	if (from <= ins && ins < end) {
+		bcopy(value, dst, size);
+		dst += size;
+	}
+	if (end > ins + 1) {
+		uint32_t start = MAX(from, ins + 1);
+		bcopy(src + (start - 1) * size, dst, (end - start) * size);
+	}
+}
+
+/*
+ * Return the position of child within its parent.
+ */
+static uint32_t
+bt_child_idx(zfs_btree_core_t *parent, zfs_btree_hdr_t *child)
+{
+	uint32_t i;
+
+	for (i = 0; i <= parent->btc_hdr.bth_count; i++) {
+		if (parent->btc_children[i] == child)
+			return (i);
+	}
+	panic("btree node %p not found in parent %p", (void *)child,
+	    (void *)parent);
+	return (0);
+}
+
+void
+zfs_btree_create(zfs_btree_t *tree, int (*compar) (const void *, const void *),
+    size_t size)
+{
+	/*
+	 * A leaf must hold at least a few elements for splits and merges
+	 * to leave both halves non-empty.
+	 */
+	ASSERT3U(size, <=, (BTREE_LEAF_SIZE -
+	    offsetof(zfs_btree_leaf_t, btl_elems)) / 4);
+
+	bzero(tree, sizeof (*tree));
+	tree->bt_compar = compar;
+	tree->bt_elem_size = size;
+	tree->bt_leaf_cap = (BTREE_LEAF_SIZE -
+	    offsetof(zfs_btree_leaf_t, btl_elems)) / size;
+}
+
+void
+zfs_btree_destroy(zfs_btree_t *tree)
+{
+	ASSERT0(tree->bt_num_elems);
+	ASSERT3P(tree->bt_root, ==, NULL);
+	ASSERT0(tree->bt_num_leaves);
+	ASSERT0(tree->bt_num_cores);
+}
+
+/*
+ * Binary search within one node. Fills in idx with the position of the
+ * element, or with the gap it belongs in if it is not present.
+ */
+static void *
+bt_find_in_node(zfs_btree_t *tree, zfs_btree_hdr_t *hdr, const void *value,
+    zfs_btree_index_t *idx)
+{
+	uint32_t lo = 0;
+	uint32_t hi = hdr->bth_count;
+
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		void *elem = BT_ELEM(tree, hdr, mid);
+		int c = tree->bt_compar(value, elem);
+
+		if (c == 0) {
+			idx->bti_node = hdr;
+			idx->bti_offset = mid;
+			idx->bti_before = B_FALSE;
+			return (elem);
+		}
+		if (c < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	idx->bti_node = hdr;
+	idx->bti_offset = lo;
+	idx->bti_before = B_TRUE;
+	return (NULL);
+}
+
+void *
+zfs_btree_find(zfs_btree_t *tree, const void *value, zfs_btree_index_t *where)
+{
+	zfs_btree_hdr_t *hdr = tree->bt_root;
+	zfs_btree_index_t idx;
+	void *elem = NULL;
+
+	idx.bti_node = NULL;
+	idx.bti_offset = 0;
+	idx.bti_before = B_TRUE;
+
+	while (hdr != NULL) {
+		elem = bt_find_in_node(tree, hdr, value, &idx);
+		if (elem != NULL || !hdr->bth_core)
+			break;
+		hdr = BT_CORE(hdr)->btc_children[idx.bti_offset];
+	}
+
+	if (where != NULL)
+		*where = idx;
+	return (elem);
+}
+
+static void bt_insert_into_node(zfs_btree_t *, zfs_btree_hdr_t *, uint32_t,
+    const void *, zfs_btree_hdr_t *);
+
+/*
+ * After left has been split, add the median element and the new right
+ * node to its parent, growing the tree by a level if left was the root.
+ */
+static void
+bt_insert_into_parent(zfs_btree_t *tree, zfs_btree_hdr_t *left,
+    const void *median, zfs_btree_hdr_t *right)
+{
+	zfs_btree_core_t *parent = left->bth_parent;
+	zfs_btree_core_t *root;
+
+	if (parent != NULL) {
+		bt_insert_into_node(tree, &parent->btc_hdr,
+		    bt_child_idx(parent, left), median, right);
+		return;
+	}
+
+	ASSERT3P(left, ==, tree->bt_root);
+	root = BT_CORE(bt_node_alloc(tree, B_TRUE));
+	bcopy(median, root->btc_elems, tree->bt_elem_size);
+	root->btc_children[0] = left;
+	root->btc_children[1] = right;
+	root->btc_hdr.bth_count = 1;
+	left->bth_parent = root;
+	right->bth_parent = root;
+	tree->bt_root = &root->btc_hdr;
+	tree->bt_height++;
+}
+
+/*
+ * Insert value at position ins of hdr. For a core node, rchild is the new
+ * child to the right of value. A full node is split in two first.
+ */
+static void
+bt_insert_into_node(zfs_btree_t *tree, zfs_btree_hdr_t *hdr, uint32_t ins,
+    const void *value, zfs_btree_hdr_t *rchild)
+{
+	size_t size = tree->bt_elem_size;
+	uint32_t n = hdr->bth_count;
+	uint32_t keep, rcount, i;
+	zfs_btree_hdr_t *right;
+	uint8_t *median;
+
+	ASSERT3U(ins, <=, n);
+	ASSERT(hdr->bth_core == (rchild != NULL));
+
+	if (n < bt_cap(tree, hdr)) {
+		bt_move(tree, hdr, ins, ins + 1, n - ins);
+		bcopy(value, BT_ELEM(tree, hdr, ins), size);
+		if (hdr->bth_core) {
+			zfs_btree_core_t *core = BT_CORE(hdr);
+
+			memmove(&core->btc_children[ins + 2],
+			    &core->btc_children[ins + 1],
+			    (n - ins) * sizeof (zfs_btree_hdr_t *));
+			core->btc_children[ins + 1] = rchild;
+			rchild->bth_parent = core;
+		}
+		hdr->bth_count++;
+		return;
+	}
+
+	/*
+	 * Split. Of the n + 1 elements, the first keep stay here, the next
+	 * one moves up to the parent, and the rest go to the new right node.
+	 * The copies out of hdr must be done before hdr is shifted in place.
+	 */
+	keep = (n + 1) / 2;
+	rcount = n - keep;
+	right = bt_node_alloc(tree, hdr->bth_core);
+	median = kmem_alloc(size, KM_SLEEP);
+
+	bt_copy_ins(size, BT_ELEM(tree, right, 0), bt_elems(hdr), ins, value,
+	    keep + 1, rcount);
+	bt_copy_ins(size, median, bt_elems(hdr), ins, value, keep, 1);
+	if (ins < keep) {
+		bt_move(tree, hdr, ins, ins + 1, keep - 1 - ins);
+		bcopy(value, BT_ELEM(tree, hdr, ins), size);
+	}
+	right->bth_count = rcount;
+	hdr->bth_count = keep;
+
+	if (hdr->bth_core) {
+		zfs_btree_core_t *core = BT_CORE(hdr);
+		zfs_btree_core_t *rcore = BT_CORE(right);
+
+		bt_copy_ins(sizeof (zfs_btree_hdr_t *),
+		    (uint8_t *)rcore->btc_children,
+		    (uint8_t *)core->btc_children, ins + 1, &rchild,
+		    keep + 1, rcount + 1);
+		if (ins + 1 <= keep) {
+			memmove(&core->btc_children[ins + 2],
+			    &core->btc_children[ins + 1],
+			    (keep - ins - 1) * sizeof (zfs_btree_hdr_t *));
+			core->btc_children[ins + 1] = rchild;
+			rchild->bth_parent = core;
+		}
+		for (i = 0; i <= rcount; i++)
+			rcore->btc_children[i]->bth_parent = rcore;
+	}
+
+	bt_insert_into_parent(tree, hdr, median, right);
+	kmem_free(median, size);
+}
+
+/*
+ * Insert value at the gap returned by a failed zfs_btree_find().
+ */
+void
+zfs_btree_add_idx(zfs_btree_t *tree, const void *value,
+    const zfs_btree_index_t *where)
+{
+	if (tree->bt_root == NULL) {
+		ASSERT3P(where->bti_node, ==, NULL);
+		tree->bt_root = bt_node_alloc(tree, B_FALSE);
+		tree->bt_height = 0;
+		bt_insert_into_node(tree, tree->bt_root, 0, value, NULL);
+	} else {
+		ASSERT(where->bti_before);
+		ASSERT(!where->bti_node->bth_core);
+		bt_insert_into_node(tree, where->bti_node, where->bti_offset,
+		    value, NULL);
+	}
+	tree->bt_num_elems++;
+}
+
+void
+zfs_btree_add(zfs_btree_t *tree, const void *value)
+{
+	zfs_btree_index_t where;
+
+	VERIFY3P(zfs_btree_find(tree, value, &where), ==, NULL);
+	zfs_btree_add_idx(tree, value, &where);
+}
+
+/*
+ * Append the separator at position sep of parent and all of right to
+ * left, then drop the separator and right from parent.
+ */
+static void
+bt_merge(zfs_btree_t *tree, zfs_btree_core_t *parent, uint32_t sep,
+    zfs_btree_hdr_t *left, zfs_btree_hdr_t *right)
+{
+	size_t size = tree->bt_elem_size;
+	uint32_t n = left->bth_count;
+	uint32_t pcount = parent->btc_hdr.bth_count;
+	uint32_t i;
+
+	ASSERT3U(n + 1 + right->bth_count, <=, bt_cap(tree, left));
+
+	bcopy(BT_ELEM(tree, &parent->btc_hdr, sep), BT_ELEM(tree, left, n),
+	    size);
+	bcopy(BT_ELEM(tree, right, 0), BT_ELEM(tree, left, n + 1),
+	    right->bth_count * size);
+	if (left->bth_core) {
+		zfs_btree_core_t *lcore = BT_CORE(left);
+		zfs_btree_core_t *rcore = BT_CORE(right);
+
+		for (i = 0; i <= right->bth_count; i++) {
+			lcore->btc_children[n + 1 + i] = rcore->btc_children[i];
+			rcore->btc_children[i]->bth_parent = lcore;
+		}
+	}
+	left->bth_count = n + 1 + right->bth_count;
+
+	bt_move(tree, &parent->btc_hdr, sep + 1, sep, pcount - sep - 1);
+	memmove(&parent->btc_children[sep + 1], &parent->btc_children[sep + 2],
+	    (pcount - sep - 1) * sizeof (zfs_btree_hdr_t *));
+	parent->btc_hdr.bth_count--;
+	bt_node_free(tree, right);
+}
+
+/*
+ * Restore the fill invariant of hdr after an element was removed from it.
+ */
+static void
+bt_rebalance(zfs_btree_t *tree, zfs_btree_hdr_t *hdr)
+{
+	size_t size = tree->bt_elem_size;
+	zfs_btree_core_t *parent = hdr->bth_parent;
+	uint32_t min = bt_cap(tree, hdr) / 2;
+	zfs_btree_hdr_t *left, *right;
+	uint32_t i;
+
+	if (parent == NULL) {
+		ASSERT3P(hdr, ==, tree->bt_root);
+		if (hdr->bth_count > 0)
+			return;
+		if (hdr->bth_core) {
+			tree->bt_root = BT_CORE(hdr)->btc_children[0];
+			tree->bt_root->bth_parent = NULL;
+			tree->bt_height--;
+		} else {
+			tree->bt_root = NULL;
+		}
+		bt_node_free(tree, hdr);
+		return;
+	}
+
+	if (hdr->bth_count >= min)
+		return;
+
+	i = bt_child_idx(parent, hdr);
+	left = (i > 0) ? parent->btc_children[i - 1] : NULL;
+	right = (i < parent->btc_hdr.bth_count) ?
+	    parent->btc_children[i + 1] : NULL;
+
+	if (left != NULL && left->bth_count > min) {
+		/*
+		 * Rotate right: the separator comes down to the front of
+		 * hdr and the last element of left replaces it.
+		 */
+		bt_move(tree, hdr, 0, 1, hdr->bth_count);
+		bcopy(BT_ELEM(tree, &parent->btc_hdr, i - 1),
+		    BT_ELEM(tree, hdr, 0), size);
+		bcopy(BT_ELEM(tree, left, left->bth_count - 1),
+		    BT_ELEM(tree, &parent->btc_hdr, i - 1), size);
+		if (hdr->bth_core) {
+			zfs_btree_core_t *core = BT_CORE(hdr);
+
+			memmove(&core->btc_children[1], &core->btc_children[0],
+			    (hdr->bth_count + 1) * sizeof (zfs_btree_hdr_t *));
+			core->btc_children[0] =
+			    BT_CORE(left)->btc_children[left->bth_count];
+			core->btc_children[0]->bth_parent = core;
+		}
+		left->bth_count--;
+		hdr->bth_count++;
+		return;
+	}
+
+	if (right != NULL && right->bth_count > min) {
+		/*
+		 * Rotate left: the separator goes to the end of hdr and the
+		 * first element of right replaces it.
+		 */
+		bcopy(BT_ELEM(tree, &parent->btc_hdr, i),
+		    BT_ELEM(tree, hdr, hdr->bth_count), size);
+		bcopy(BT_ELEM(tree, right, 0),
+		    BT_ELEM(tree, &parent->btc_hdr, i), size);
+		bt_move(tree, right, 1, 0, right->bth_count - 1);
+		if (hdr->bth_core) {
+			zfs_btree_core_t *core = BT_CORE(hdr);
+			zfs_btree_core_t *rcore = BT_CORE(right);
+
+			core->btc_children[hdr->bth_count + 1] =
+			    rcore->btc_children[0];
+			core->btc_children[hdr->bth_count + 1]->bth_parent =
+			    core;
+			memmove(&rcore->btc_children[0],
+			    &rcore->btc_children[1],
+			    right->bth_count * sizeof (zfs_btree_hdr_t *));
+		}
+		right->bth_count--;
+		hdr->bth_count++;
+		return;
+	}
+
+	/*
+	 * Neither sibling can spare an element, so merge with one of them.
+	 * That takes an element from the parent, which may now need to be
+	 * rebalanced itself.
+	 */
+	if (left != NULL)
+		bt_merge(tree, parent, i - 1, left, hdr);
+	else
+		bt_merge(tree, parent, i, hdr, right);
+	bt_rebalance(tree, &parent->btc_hdr);
+}
+
+void
+zfs_btree_remove_idx(zfs_btree_t *tree, zfs_btree_index_t *where)
+{
+	zfs_btree_hdr_t *hdr = where->bti_node;
+	uint32_t idx = where->bti_offset;
+
+	ASSERT(!where->bti_before);
+	ASSERT3U(idx, <, hdr->bth_count);
+
+	if (hdr->bth_core) {
+		/*
+		 * Replace the element with its predecessor, the last element
+		 * of the subtree to its left, and remove that from its leaf.
+		 */
+		zfs_btree_hdr_t *leaf = BT_CORE(hdr)->btc_children[idx];
+
+		while (leaf->bth_core)
+			leaf = BT_CORE(leaf)->btc_children[leaf->bth_count];
+		bcopy(BT_ELEM(tree, leaf, leaf->bth_count - 1),
+		    BT_ELEM(tree, hdr, idx), tree->bt_elem_size);
+		hdr = leaf;
+		idx = leaf->bth_count - 1;
+	}
+
+	bt_move(tree, hdr, idx + 1, idx, hdr->bth_count - idx - 1);
+	hdr->bth_count--;
+	tree->bt_num_elems--;
+	bt_rebalance(tree, hdr);
+}
+
+void
+zfs_btree_remove(zfs_btree_t *tree, const void *value)
+{
+	zfs_btree_index_t where;
+
+	VERIFY3P(zfs_btree_find(tree, value, &where), !=, NULL);
+	zfs_btree_remove_idx(tree, &where);
+}
+
+static inline void *
+bt_set_idx(zfs_btree_t *tree, zfs_btree_index_t *idx, zfs_btree_hdr_t *hdr,
+    uint32_t offset)
+{
+	if (idx != NULL) {
+		idx->bti_node = hdr;
+		idx->bti_offset = offset;
+		idx->bti_before = B_FALSE;
+	}
+	return (BT_ELEM(tree, hdr, offset));
+}
+
+void *
+zfs_btree_first(zfs_btree_t *tree, zfs_btree_index_t *where)
+{
+	zfs_btree_hdr_t *hdr = tree->bt_root;
+
+	if (hdr == NULL) {
+		if (where != NULL) {
+			where->bti_node = NULL;
+			where->bti_offset = 0;
+			where->bti_before = B_TRUE;
+		}
+		return (NULL);
+	}
+	while (hdr->bth_core)
+		hdr = BT_CORE(hdr)->btc_children[0];
+	return (bt_set_idx(tree, where, hdr, 0));
+}
+
+void *
+zfs_btree_last(zfs_btree_t *tree, zfs_btree_index_t *where)
+{
+	zfs_btree_hdr_t *hdr = tree->bt_root;
+
+	if (hdr == NULL) {
+		if (where != NULL) {
+			where->bti_node = NULL;
+			where->bti_offset = 0;
+			where->bti_before = B_TRUE;
+		}
+		return (NULL);
+	}
+	while (hdr->bth_core)
+		hdr = BT_CORE(hdr)->btc_children[hdr->bth_count];
+	return (bt_set_idx(tree, where, hdr, hdr->bth_count - 1));
+}
+
+void *
+zfs_btree_next(zfs_btree_t *tree, const zfs_btree_index_t *idx,
+    zfs_btree_index_t *out)
+{
+	zfs_btree_hdr_t *hdr = idx->bti_node;
+	uint32_t off = idx->bti_offset;
+
+	if (hdr == NULL)
+		return (NULL);
+
+	if (hdr->bth_core) {
+		/* The successor is the first element of the right subtree. */
+		ASSERT(!idx->bti_before);
+		hdr = BT_CORE(hdr)->btc_children[off + 1];
+		while (hdr->bth_core)
+			hdr = BT_CORE(hdr)->btc_children[0];
+		return (bt_set_idx(tree, out, hdr, 0));
+	}
+
+	if (!idx->bti_before)
+		off++;
+	if (off < hdr->bth_count)
+		return (bt_set_idx(tree, out, hdr, off));
+
+	/*
+	 * Past the end of the leaf: climb until we come up from a child
+	 * that has a separator to its right.
+	 */
+	for (;;) {
+		zfs_btree_core_t *parent = hdr->bth_parent;
+		uint32_t i;
+
+		if (parent == NULL)
+			return (NULL);
+		i = bt_child_idx(parent, hdr);
+		if (i < parent->btc_hdr.bth_count)
+			return (bt_set_idx(tree, out, &parent->btc_hdr, i));
+		hdr = &parent->btc_hdr;
+	}
+}
+
+void *
+zfs_btree_prev(zfs_btree_t *tree, const zfs_btree_index_t *idx,
+    zfs_btree_index_t *out)
+{
+	zfs_btree_hdr_t *hdr = idx->bti_node;
+	uint32_t off = idx->bti_offset;
+
+	if (hdr == NULL)
+		return (NULL);
+
+	if (hdr->bth_core) {
+		/* The predecessor is the last element of the left subtree. */
+		ASSERT(!idx->bti_before);
+		hdr = BT_CORE(hdr)->btc_children[off];
+		while (hdr->bth_core)
+			hdr = BT_CORE(hdr)->btc_children[hdr->bth_count];
+		return (bt_set_idx(tree, out, hdr, hdr->bth_count - 1));
+	}
+
+	if (off > 0)
+		return (bt_set_idx(tree, out, hdr, off - 1));
+
+	for (;;) {
+		zfs_btree_core_t *parent = hdr->bth_parent;
+		uint32_t i;
+
+		if (parent == NULL)
+			return (NULL);
+		i = bt_child_idx(parent, hdr);
+		if (i > 0)
+			return (bt_set_idx(tree, out, &parent->btc_hdr, i - 1));
+		hdr = &parent->btc_hdr;
+	}
+}
+
+void *
+zfs_btree_get(zfs_btree_t *tree, const zfs_btree_index_t *idx)
+{
+	if (idx->bti_node == NULL || idx->bti_before)
+		return (NULL);
+	ASSERT3U(idx->bti_offset, <, idx->bti_node->bth_count);
+	return (BT_ELEM(tree, idx->bti_node, idx->bti_offset));
+}
+
+ulong_t
+zfs_btree_numnodes(zfs_btree_t *tree)
+{
+	return (tree->bt_num_elems);
+}
+
+/*
+ * Memory used by the nodes of the tree, for the benefit of callers that
+ * account for or report it.
+ */
+uint64_t
+zfs_btree_memory(zfs_btree_t *tree)
+{
+	return (tree->bt_num_leaves * BTREE_LEAF_SIZE +
+	    tree->bt_num_cores * BT_CORE_SIZE(tree));
+}
+
+static void
+bt_clear_node(zfs_btree_t *tree, zfs_btree_hdr_t *hdr)
+{
+	uint32_t i;
+
+	if (hdr->bth_core) {
+		for (i = 0; i <= hdr->bth_count; i++)
+			bt_clear_node(tree, BT_CORE(hdr)->btc_children[i]);
+	}
+	bt_node_free(tree, hdr);
+}
+
+/*
+ * Remove all elements from the tree. Unlike avl_destroy_nodes() there is
+ * nothing for the caller to free, so this is a single call.
+ */
+void
+zfs_btree_clear(zfs_btree_t *tree)
+{
+	if (tree->bt_root != NULL)
+		bt_clear_node(tree, tree->bt_root);
+	tree->bt_root = NULL;
+	tree->bt_height = 0;
+	tree->bt_num_elems = 0;
+	ASSERT0(tree->bt_num_leaves);
+	ASSERT0(tree->bt_num_cores);
+}
+
+static void
+bt_verify_node(zfs_btree_t *tree, zfs_btree_hdr_t *hdr, int64_t depth,
+    const void *lo, const void *hi, uint64_t *count)
+{
+	uint32_t n = hdr->bth_count;
+	uint32_t i;
+
+	VERIFY3U(n, <=, bt_cap(tree, hdr));
+	VERIFY3U(n, >, 0);
+	if (hdr != tree->bt_root)
+		VERIFY3U(n, >=, bt_cap(tree, hdr) / 2);
+	VERIFY(hdr->bth_core == (depth < tree->bt_height));
+
+	for (i = 1; i < n; i++) {
+		VERIFY3S(tree->bt_compar(BT_ELEM(tree, hdr, i - 1),
+		    BT_ELEM(tree, hdr, i)), <, 0);
+	}
+	if (lo != NULL)
+		VERIFY3S(tree->bt_compar(lo, BT_ELEM(tree, hdr, 0)), <, 0);
+	if (hi != NULL)
+		VERIFY3S(tree->bt_compar(BT_ELEM(tree, hdr, n - 1), hi), <, 0);
+	*count += n;
+
+	if (!hdr->bth_core)
+		return;
+	for (i = 0; i <= n; i++) {
+		zfs_btree_hdr_t *child = BT_CORE(hdr)->btc_children[i];
+
+		VERIFY3P(child->bth_parent, ==, BT_CORE(hdr));
+		bt_verify_node(tree, child, depth + 1,
+		    i == 0 ? lo : BT_ELEM(tree, hdr, i - 1),
+		    i == n ? hi : BT_ELEM(tree, hdr, i), count);
+	}
+}
+
+/*
+ * Check the structure of the whole tree. This is expensive and meant for
+ * debugging and for ztest.
+ */
+void
+zfs_btree_verify(zfs_btree_t *tree)
+{
+	uint64_t count = 0;
+
+	if (tree->bt_root == NULL) {
+		VERIFY0(tree->bt_num_elems);
+		return;
+	}
+	VERIFY3P(tree->bt_root->bth_parent, ==, NULL);
+	bt_verify_node(tree, tree->bt_root, 0, NULL, NULL, &count);
+	VERIFY3U(count, ==, tree->bt_num_elems);
+}
@@ -218,15 +218,71 @@ dbuf_stats_hash_table_destroy(void)
 	mutex_destroy(&dsh->lock);
 }
 
+/*
+ * ==========================================================================
+ * Dbuf Memory Statistics
+ * ==========================================================================
+ */
+dbuf_mem_stats_t dbuf_mem_stats = {
+	{ "dbuf_size",			KSTAT_DATA_UINT64 },
+	{ "dbuf_count",			KSTAT_DATA_UINT64 },
+	{ "dirty_record_size",		KSTAT_DATA_UINT64 },
+	{ "dirty_record_count",		KSTAT_DATA_UINT64 },
+	{ "overhead_bytes",		KSTAT_DATA_UINT64 },
+};
+
+static kstat_t *dbuf_mem_ksp;
+
+static int
+dbuf_stats_mem_update(kstat_t *ksp, int rw)
+{
+	dbuf_mem_stats_t *dms = ksp->ks_data;
+
+	if (rw == KSTAT_WRITE)
+		return (SET_ERROR(EACCES));
+
+	dms->dbuf_size.value.ui64 = sizeof (dmu_buf_impl_t);
+	dms->dirty_record_size.value.ui64 = sizeof (dbuf_dirty_record_t);
+	dms->overhead_bytes.value.ui64 =
+	    dms->dbuf_count.value.ui64 * sizeof (dmu_buf_impl_t) +
+	    dms->dirty_record_count.value.ui64 * sizeof (dbuf_dirty_record_t);
+
+	return (0);
+}
+
+static void
+dbuf_stats_mem_init(void)
+{
+	dbuf_mem_ksp = kstat_create("zfs", 0, "dbufstats", "misc",
+	    KSTAT_TYPE_NAMED, sizeof (dbuf_mem_stats) / sizeof (kstat_named_t),
+	    KSTAT_FLAG_VIRTUAL);
+	if (dbuf_mem_ksp != NULL) {
+		dbuf_mem_ksp->ks_data = &dbuf_mem_stats;
+		dbuf_mem_ksp->ks_update = dbuf_stats_mem_update;
+		kstat_install(dbuf_mem_ksp);
+	}
+}
+
+static void
+dbuf_stats_mem_destroy(void)
+{
+	if (dbuf_mem_ksp != NULL) {
+		kstat_delete(dbuf_mem_ksp);
+		dbuf_mem_ksp = NULL;
+	}
+}
+
 void
 dbuf_stats_init(dbuf_hash_table_t *hash)
 {
 	dbuf_stats_hash_table_init(hash);
+	dbuf_stats_mem_init();
 }
 
 void
 dbuf_stats_destroy(void)
 {
+	dbuf_stats_mem_destroy();
 	dbuf_stats_hash_table_destroy();
 }
 
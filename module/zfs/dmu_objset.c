@@ -77,6 +77,15 @@ int dmu_rescan_dnode_threshold = 131072;
 
 static void dmu_objset_find_dp_cb(void *arg);
 
+static const objset_dirty_stats_t objset_dirty_stats_template = {
+	{ "dirty_bytes",		KSTAT_DATA_UINT64 },
+	{ "dirty_share",		KSTAT_DATA_UINT64 },
+	{ "delays",			KSTAT_DATA_UINT64 },
+	{ "delay_ns",			KSTAT_DATA_UINT64 },
+	{ "over_max_waits",		KSTAT_DATA_UINT64 },
+	{ "fair_passes",		KSTAT_DATA_UINT64 },
+};
+
 void
 dmu_objset_init(void)
 {
@@ -150,6 +159,12 @@ dmu_objset_logbias(objset_t *os)
 	return (os->os_logbias);
 }
 
+int
+dmu_objset_dnodesize(objset_t *os)
+{
+	return (os->os_dnodesize);
+}
+
 static void
 checksum_changed_cb(void *arg, uint64_t newval)
 {
@@ -287,6 +302,56 @@ recordsize_changed_cb(void *arg, uint64_t newval)
 	os->os_recordsize = newval;
 }
 
+static void
+dnodesize_changed_cb(void *arg, uint64_t newval)
+{
+	objset_t *os = arg;
+
+	switch (newval) {
+	case ZFS_DNSIZE_LEGACY:
+		os->os_dnodesize = DNODE_MIN_SIZE;
+		break;
+	case ZFS_DNSIZE_AUTO:
+		/*
+		 * Choose a dnode size that will work well for most
+		 * workloads if the user specified "auto". Future code
+		 * improvements could dynamically select a dnode size
+		 * based on observed workload patterns.
+		 */
+		os->os_dnodesize = DNODE_MIN_SIZE * 2;
+		break;
+	case ZFS_DNSIZE_1K:
+	case ZFS_DNSIZE_2K:
+	case ZFS_DNSIZE_4K:
+	case ZFS_DNSIZE_8K:
+	case ZFS_DNSIZE_16K:
+		os->os_dnodesize = newval;
+		break;
+	}
+}
+
+static void
+ioweight_changed_cb(void *arg, uint64_t newval)
+{
+	objset_t *os = arg;
+
+	os->os_ioweight = MIN(MAX(newval, ZFS_IOWEIGHT_MIN), ZFS_IOWEIGHT_MAX);
+}
+
+static void
+smallblk_changed_cb(void *arg, uint64_t newval)
+{
+	objset_t *os = arg;
+
+	/*
+	 * Inheritance and range checking should have been done by now.
+	 */
+	ASSERT(newval <= ZFS_SPECIAL_SMALL_BLOCKS_MAX);
+	ASSERT(ISP2(newval));
+
+	os->os_zpl_special_smallblock = newval;
+}
+
 void
 dmu_objset_byteswap(void *buf, size_t size)
 {
@@ -335,6 +400,49 @@ dnode_multilist_index_func(multilist_t *ml, void *obj)
 	    multilist_get_num_sublists(ml));
 }
 
+static int
+dmu_objset_dirty_kstat_update(kstat_t *ksp, int rw)
+{
+	objset_t *os = ksp->ks_private;
+	objset_dirty_stats_t *ods = ksp->ks_data;
+	dsl_pool_t *dp = spa_get_dsl(os->os_spa);
+
+	if (rw == KSTAT_WRITE)
+		return (SET_ERROR(EACCES));
+
+	mutex_enter(&dp->dp_lock);
+	ods->ods_dirty_bytes.value.ui64 = os->os_dirty_total;
+	ods->ods_dirty_share.value.ui64 = dsl_pool_dirty_share(dp);
+	mutex_exit(&dp->dp_lock);
+
+	return (0);
+}
+
+static void
+dmu_objset_dirty_kstat_init(objset_t *os)
+{
+	char module[KSTAT_STRLEN];
+	char name[KSTAT_STRLEN];
+	kstat_t *ksp;
+
+	os->os_dirty_stats = objset_dirty_stats_template;
+
+	(void) snprintf(module, KSTAT_STRLEN, "zfs/%s", spa_name(os->os_spa));
+	(void) snprintf(name, KSTAT_STRLEN, "objset-0x%llx",
+	    (u_longlong_t)os->os_dsl_dataset->ds_object);
+
+	ksp = kstat_create(module, 0, name, "misc", KSTAT_TYPE_NAMED,
+	    sizeof (objset_dirty_stats_t) / sizeof (kstat_named_t),
+	    KSTAT_FLAG_VIRTUAL);
+	if (ksp != NULL) {
+		ksp->ks_data = &os->os_dirty_stats;
+		ksp->ks_private = os;
+		ksp->ks_update = dmu_objset_dirty_kstat_update;
+		kstat_install(ksp);
+	}
+	os->os_dirty_kstat = ksp;
+}
+
 /*
  * Instantiates the objset_t in-memory structure corresponding to the
  * objset_phys_t that's pointed to by the specified blkptr_t.
@@ -474,6 +582,22 @@ dmu_objset_open_impl(spa_t *spa, dsl_dataset_t *ds, blkptr_t *bp,
 				    zfs_prop_to_name(ZFS_PROP_RECORDSIZE),
 				    recordsize_changed_cb, os);
 			}
+			if (err == 0) {
+				err = dsl_prop_register(ds,
+				    zfs_prop_to_name(ZFS_PROP_DNODESIZE),
+				    dnodesize_changed_cb, os);
+			}
+			if (err == 0) {
+				err = dsl_prop_register(ds,
+				    zfs_prop_to_name(ZFS_PROP_IOWEIGHT),
+				    ioweight_changed_cb, os);
+			}
+			if (err == 0) {
+				err = dsl_prop_register(ds,
+				    zfs_prop_to_name(
+				    ZFS_PROP_SPECIAL_SMALL_BLOCKS),
+				    smallblk_changed_cb, os);
+			}
 		}
 		if (needlock)
 			dsl_pool_config_exit(dmu_objset_pool(os), FTAG);
@@ -494,6 +618,9 @@ dmu_objset_open_impl(spa_t *spa, dsl_dataset_t *ds, blkptr_t *bp,
 		os->os_sync = ZFS_SYNC_STANDARD;
 		os->os_primary_cache = ZFS_CACHE_ALL;
 		os->os_secondary_cache = ZFS_CACHE_ALL;
+		os->os_dnodesize = DNODE_MIN_SIZE;
+		os->os_ioweight = ZFS_IOWEIGHT_DEFAULT;
+		os->os_zpl_special_smallblock = 0;
 	}
 
 	if (ds == NULL || !ds->ds_is_snapshot)
@@ -517,6 +644,10 @@ dmu_objset_open_impl(spa_t *spa, dsl_dataset_t *ds, blkptr_t *bp,
 	mutex_init(&os->os_obj_lock, NULL, MUTEX_DEFAULT, NULL);
 	mutex_init(&os->os_user_ptr_lock, NULL, MUTEX_DEFAULT, NULL);
 
+	list_link_init(&os->os_dirty_node);
+	if (ds != NULL && !ds->ds_is_snapshot)
+		dmu_objset_dirty_kstat_init(os);
+
 	dnode_special_open(os, &os->os_phys->os_meta_dnode,
 	    DMU_META_DNODE_OBJECT, &os->os_meta_dnode);
 	if (arc_buf_size(os->os_phys_buf) >= sizeof (objset_phys_t)) {
@@ -805,8 +936,14 @@ dmu_objset_evict(objset_t *os)
 	for (t = 0; t < TXG_SIZE; t++)
 		ASSERT(!dmu_objset_is_dirty(os, t));
 
-	if (ds)
+	if (ds) {
 		dsl_prop_unregister_all(ds, os);
+		if (os->os_dirty_kstat != NULL) {
+			kstat_delete(os->os_dirty_kstat);
+			os->os_dirty_kstat = NULL;
+		}
+		dsl_pool_undirty_objset(spa_get_dsl(os->os_spa), os);
+	}
 
 	if (os->os_sa)
 		sa_tear_down(os);
@@ -887,7 +1024,7 @@ dmu_objset_create_impl_dnstats(spa_t *spa, dsl_dataset_t *ds, blkptr_t *bp,
 	mdn = DMU_META_DNODE(os);
 
 	dnode_allocate(mdn, DMU_OT_DNODE, blksz, DN_MAX_INDBLKSHIFT,
-	    DMU_OT_NONE, 0, tx);
+	    DMU_OT_NONE, 0, DNODE_MIN_SLOTS, tx);
 
 	/*
 	 * We don't want to have to increase the meta-dnode's nlevels
@@ -921,7 +1058,7 @@ dmu_objset_create_impl_dnstats(spa_t *spa, dsl_dataset_t *ds, blkptr_t *bp,
 				levels++;
 		}
 
-		mdn->dn_next_nlevels[tx->tx_txg & TXG_MASK] =
+		mdn->dn_dirty->dnd_next_nlevels[tx->tx_txg & TXG_MASK] =
 		    mdn->dn_nlevels = levels;
 	}
 
@@ -1435,7 +1572,7 @@ dmu_objset_sync(objset_t *os, zio_t *pio, dmu_tx_t *tx)
 	}
 	taskq_wait(dmu_objset_pool(os)->dp_sync_taskq);
 
-	list = &DMU_META_DNODE(os)->dn_dirty_records[txgoff];
+	list = &DMU_META_DNODE(os)->dn_dirty->dnd_dirty_records[txgoff];
 	while ((dr = list_head(list)) != NULL) {
 		ASSERT0(dr->dr_dbuf->db_level);
 		list_remove(list, dr);
@@ -1559,7 +1696,7 @@ do_userquota_update(userquota_cache_t *cache, uint64_t used, uint64_t flags,
     uint64_t user, uint64_t group, boolean_t subtract)
 {
 	if ((flags & DNODE_FLAG_USERUSED_ACCOUNTED)) {
-		int64_t delta = DNODE_SIZE + used;
+		int64_t delta = DNODE_MIN_SIZE + used;
 		if (subtract)
 			delta = -delta;
 
@@ -1630,7 +1767,9 @@ userquota_updates_task(void *arg)
 		mutex_exit(&dn->dn_mtx);
 
 		multilist_sublist_remove(list, dn);
-		dnode_rele(dn, os->os_synced_dnodes);
+		mutex_enter(&dn->dn_mtx);
+		dnode_dirty_release(dn);
+		dnode_rele_and_unlock(dn, os->os_synced_dnodes);
 	}
 	do_userquota_cacheflush(os, &cache, tx);
 	multilist_sublist_unlock(list);
@@ -2453,6 +2592,6 @@ dmu_objset_willuse_space(objset_t *os, int64_t space, dmu_tx_t *tx)
 
 	if (ds != NULL) {
 		dsl_dir_willuse_space(ds->ds_dir, aspace, tx);
-		dsl_pool_dirty_space(dmu_tx_pool(tx), space, tx);
+		dsl_pool_dirty_space(dmu_tx_pool(tx), os, space, tx);
 	}
 }
@@ -54,7 +54,10 @@ dmu_tx_stats_t dmu_tx_stats = {
 	{ "dmu_tx_dirty_throttle",	KSTAT_DATA_UINT64 },
 	{ "dmu_tx_dirty_delay",		KSTAT_DATA_UINT64 },
 	{ "dmu_tx_dirty_over_max",	KSTAT_DATA_UINT64 },
+	{ "dmu_tx_dirty_fair",		KSTAT_DATA_UINT64 },
 	{ "dmu_tx_quota",		KSTAT_DATA_UINT64 },
+	{ "dmu_tx_write_cached",	KSTAT_DATA_UINT64 },
+	{ "dmu_tx_write_uncached",	KSTAT_DATA_UINT64 },
 };
 
 static kstat_t *dmu_tx_ksp;
@@ -218,6 +221,68 @@ dmu_tx_check_ioerr(zio_t *zio, dnode_t *dn, int level, uint64_t blkid)
 	return (err);
 }
 
+/*
+ * Returns B_TRUE if the given block is already cached, without holding
+ * it and therefore without reading (or even looking up) its parents.
+ */
+static boolean_t
+dmu_tx_dbuf_cached(dnode_t *dn, int level, uint64_t blkid)
+{
+	dmu_buf_impl_t *db;
+	boolean_t cached;
+
+	db = dbuf_find(dn->dn_objset, dn->dn_object, level, blkid);
+	if (db == NULL)
+		return (B_FALSE);
+	cached = (db->db_state == DB_CACHED);
+	mutex_exit(&db->db_mtx);
+
+	return (cached);
+}
+
+/*
+ * Fast path for dmu_tx_count_write().  The blocks read by the slow path
+ * below exist only to surface i/o errors (and warm the cache) before the
+ * tx is assigned.  For in-place overwrites -- the common case for zvols
+ * and databases -- those blocks are usually already cached, in which
+ * case there is no error to find.  Using only the dnode's block geometry,
+ * work out which blocks the slow path would read and look each one up in
+ * the dbuf hash.  If any of them is missing, return B_FALSE so that the
+ * caller falls back to reading them through dbuf_hold_level().
+ */
+static boolean_t
+dmu_tx_count_write_cached(dnode_t *dn, uint64_t off, uint64_t len)
+{
+	if (dn->dn_maxblkid == 0) {
+		if (off < dn->dn_datablksz &&
+		    (off > 0 || len < dn->dn_datablksz))
+			return (dmu_tx_dbuf_cached(dn, 0, 0));
+		return (B_TRUE);
+	}
+
+	uint64_t start = off >> dn->dn_datablkshift;
+	uint64_t end = (off + len - 1) >> dn->dn_datablkshift;
+
+	if ((P2PHASE(off, dn->dn_datablksz) || len < dn->dn_datablksz) &&
+	    !dmu_tx_dbuf_cached(dn, 0, start))
+		return (B_FALSE);
+
+	if (end != start && end <= dn->dn_maxblkid &&
+	    P2PHASE(off + len, dn->dn_datablksz) &&
+	    !dmu_tx_dbuf_cached(dn, 0, end))
+		return (B_FALSE);
+
+	if (dn->dn_nlevels > 1) {
+		int shft = dn->dn_indblkshift - SPA_BLKPTRSHIFT;
+		for (uint64_t i = (start >> shft) + 1; i < end >> shft; i++) {
+			if (!dmu_tx_dbuf_cached(dn, 1, i))
+				return (B_FALSE);
+		}
+	}
+
+	return (B_TRUE);
+}
+
 /* ARGSUSED */
 static void
 dmu_tx_count_write(dmu_tx_hold_t *txh, uint64_t off, uint64_t len)
@@ -236,6 +301,12 @@ dmu_tx_count_write(dmu_tx_hold_t *txh, uint64_t off, uint64_t len)
 	if (dn == NULL)
 		return;
 
+	if (dmu_tx_count_write_cached(dn, off, len)) {
+		DMU_TX_STAT_BUMP(dmu_tx_write_cached);
+		return;
+	}
+	DMU_TX_STAT_BUMP(dmu_tx_write_uncached);
+
 	/*
 	 * For i/o error checking, read the blocks that will be needed
 	 * to perform the write: the first and last level-0 blocks (if
@@ -295,7 +366,7 @@ dmu_tx_count_write(dmu_tx_hold_t *txh, uint64_t off, uint64_t len)
 static void
 dmu_tx_count_dnode(dmu_tx_hold_t *txh)
 {
-	(void) refcount_add_many(&txh->txh_space_towrite, DNODE_SIZE, FTAG);
+	(void) refcount_add_many(&txh->txh_space_towrite, DNODE_MIN_SIZE, FTAG);
 }
 
 void
@@ -812,6 +883,10 @@ dmu_tx_delay(dmu_tx_t *tx, uint64_t dirty)
 	mutex_exit(&dp->dp_lock);
 
 	DMU_TX_STAT_BUMP(dmu_tx_dirty_delay);
+	if (tx->tx_objset != NULL) {
+		OS_DIRTY_STAT_BUMP(tx->tx_objset, ods_delays);
+		OS_DIRTY_STAT_INCR(tx->tx_objset, ods_delay_ns, wakeup - now);
+	}
 	zfs_sleep_until(wakeup);
 }
 
@@ -886,7 +961,7 @@ dmu_tx_try_assign(dmu_tx_t *tx, txg_how_t txg_how)
 	}
 
 	if (!tx->tx_waited &&
-	    dsl_pool_need_dirty_delay(tx->tx_pool)) {
+	    dsl_pool_need_dirty_delay(tx->tx_pool, tx->tx_objset)) {
 		tx->tx_wait_dirty = B_TRUE;
 		DMU_TX_STAT_BUMP(dmu_tx_dirty_delay);
 		return (ERESTART);
@@ -995,6 +1070,7 @@ dmu_tx_unassign(dmu_tx_t *tx)
 int
 dmu_tx_assign(dmu_tx_t *tx, txg_how_t txg_how)
 {
+	hrtime_t before = gethrtime();
 	int err;
 
 	ASSERT(tx->tx_txg == 0);
@@ -1019,6 +1095,9 @@ dmu_tx_assign(dmu_tx_t *tx, txg_how_t txg_how)
 
 	txg_rele_to_quiesce(&tx->tx_txgh);
 
+	spa_tx_assign_add_nsecs(tx->tx_pool->dp_spa, SPA_TXA_ASSIGN,
+	    gethrtime() - before);
+
 	return (0);
 }
 
@@ -1027,7 +1106,8 @@ dmu_tx_wait(dmu_tx_t *tx)
 {
 	spa_t *spa = tx->tx_pool->dp_spa;
 	dsl_pool_t *dp = tx->tx_pool;
-	hrtime_t before;
+	spa_tx_assign_hist_t hist;
+	hrtime_t before, delta;
 
 	ASSERT(tx->tx_txg == 0);
 	ASSERT(!dsl_pool_config_held(tx->tx_pool));
@@ -1036,23 +1116,31 @@ dmu_tx_wait(dmu_tx_t *tx)
 
 	if (tx->tx_wait_dirty) {
 		uint64_t dirty;
+		boolean_t fair;
 
 		/*
 		 * dmu_tx_try_assign() has determined that we need to wait
 		 * because we've consumed much or all of the dirty buffer
-		 * space.
+		 * space.  A dataset that is still within its fair share
+		 * only waits for the hard limit; it is not delayed.
 		 */
 		mutex_enter(&dp->dp_lock);
-		if (dp->dp_dirty_total >= zfs_dirty_data_max)
+		if (dp->dp_dirty_total >= zfs_dirty_data_max) {
 			DMU_TX_STAT_BUMP(dmu_tx_dirty_over_max);
+			if (tx->tx_objset != NULL)
+				OS_DIRTY_STAT_BUMP(tx->tx_objset, ods_over_max);
+		}
 		while (dp->dp_dirty_total >= zfs_dirty_data_max)
 			cv_wait(&dp->dp_spaceavail_cv, &dp->dp_lock);
 		dirty = dp->dp_dirty_total;
+		fair = dsl_pool_dirty_within_share(dp, tx->tx_objset);
 		mutex_exit(&dp->dp_lock);
 
-		dmu_tx_delay(tx, dirty);
+		if (!fair)
+			dmu_tx_delay(tx, dirty);
 
 		tx->tx_wait_dirty = B_FALSE;
+		hist = SPA_TXA_DIRTY;
 
 		/*
 		 * Note: setting tx_waited only has effect if the caller
@@ -1070,6 +1158,7 @@ dmu_tx_wait(dmu_tx_t *tx)
 		 * would not have been set.
 		 */
 		txg_wait_synced(dp, spa_last_synced_txg(spa) + 1);
+		hist = SPA_TXA_SUSPENDED;
 	} else if (tx->tx_needassign_txh) {
 		dnode_t *dn = tx->tx_needassign_txh->txh_dnode;
 
@@ -1078,15 +1167,19 @@ dmu_tx_wait(dmu_tx_t *tx)
 			cv_wait(&dn->dn_notxholds, &dn->dn_mtx);
 		mutex_exit(&dn->dn_mtx);
 		tx->tx_needassign_txh = NULL;
+		hist = SPA_TXA_DNODE;
 	} else {
 		/*
 		 * A dnode is assigned to the quiescing txg.  Wait for its
 		 * transaction to complete.
 		 */
 		txg_wait_open(tx->tx_pool, tx->tx_lasttried_txg + 1);
+		hist = SPA_TXA_OPEN;
 	}
 
-	spa_tx_assign_add_nsecs(spa, gethrtime() - before);
+	delta = gethrtime() - before;
+	spa_tx_assign_add_nsecs(spa, SPA_TXA_WAIT, delta);
+	spa_tx_assign_add_nsecs(spa, hist, delta);
 }
 
 static void
@@ -1269,7 +1362,7 @@ dmu_tx_hold_sa_create(dmu_tx_t *tx, int attrsize)
 
 	dmu_tx_sa_registration_hold(sa, tx);
 
-	if (attrsize <= DN_MAX_BONUSLEN && !sa->sa_force_spill)
+	if (attrsize <= DN_OLD_MAX_BONUSLEN && !sa->sa_force_spill)
 		return;
 
 	(void) dmu_tx_hold_object_impl(tx, tx->tx_objset, DMU_NEW_OBJECT,
@@ -38,8 +38,37 @@
 #include <sys/dmu_zfetch.h>
 #include <sys/range_tree.h>
 #include <sys/trace_dnode.h>
-
+#include <sys/kstat.h>
+
+dnode_stats_t dnode_stats = {
+	{ "dnode_hold_dbuf_hold",		KSTAT_DATA_UINT64 },
+	{ "dnode_hold_dbuf_read",		KSTAT_DATA_UINT64 },
+	{ "dnode_hold_alloc_hits",		KSTAT_DATA_UINT64 },
+	{ "dnode_hold_alloc_misses",		KSTAT_DATA_UINT64 },
+	{ "dnode_hold_alloc_interior",		KSTAT_DATA_UINT64 },
+	{ "dnode_hold_alloc_lock_retry",	KSTAT_DATA_UINT64 },
+	{ "dnode_hold_alloc_lock_misses",	KSTAT_DATA_UINT64 },
+	{ "dnode_hold_alloc_type_none",		KSTAT_DATA_UINT64 },
+	{ "dnode_hold_free_hits",		KSTAT_DATA_UINT64 },
+	{ "dnode_hold_free_misses",		KSTAT_DATA_UINT64 },
+	{ "dnode_hold_free_lock_misses",	KSTAT_DATA_UINT64 },
+	{ "dnode_hold_free_lock_retry",		KSTAT_DATA_UINT64 },
+	{ "dnode_hold_free_overflow",		KSTAT_DATA_UINT64 },
+	{ "dnode_hold_free_refcount",		KSTAT_DATA_UINT64 },
+	{ "dnode_free_interior_lock_retry",	KSTAT_DATA_UINT64 },
+	{ "dnode_allocate",			KSTAT_DATA_UINT64 },
+	{ "dnode_reallocate",			KSTAT_DATA_UINT64 },
+	{ "dnode_alloc_next_block",		KSTAT_DATA_UINT64 },
+	{ "dnode_size",				KSTAT_DATA_UINT64 },
+	{ "dnode_dirty_size",			KSTAT_DATA_UINT64 },
+	{ "dnode_count",			KSTAT_DATA_UINT64 },
+	{ "dnode_dirty_count",			KSTAT_DATA_UINT64 },
+	{ "dnode_overhead_bytes",		KSTAT_DATA_UINT64 },
+};
+
+static kstat_t *dnode_ksp;
 kmem_cache_t *dnode_cache;
+static kmem_cache_t *dnode_dirty_cache;
 /*
  * Define DNODE_STATS to turn on statistic gathering. By default, it is only
  * turned on when DEBUG is also defined.
@@ -120,22 +149,10 @@ dnode_cons(void *arg, void *unused, int kmflag)
 	refcount_create(&dn->dn_tx_holds);
 	list_link_init(&dn->dn_link);
 
-	bzero(&dn->dn_next_nblkptr[0], sizeof (dn->dn_next_nblkptr));
-	bzero(&dn->dn_next_nlevels[0], sizeof (dn->dn_next_nlevels));
-	bzero(&dn->dn_next_indblkshift[0], sizeof (dn->dn_next_indblkshift));
-	bzero(&dn->dn_next_bonustype[0], sizeof (dn->dn_next_bonustype));
-	bzero(&dn->dn_rm_spillblk[0], sizeof (dn->dn_rm_spillblk));
-	bzero(&dn->dn_next_bonuslen[0], sizeof (dn->dn_next_bonuslen));
-	bzero(&dn->dn_next_blksz[0], sizeof (dn->dn_next_blksz));
-
-	for (i = 0; i < TXG_SIZE; i++) {
+	for (i = 0; i < TXG_SIZE; i++)
 		list_link_init(&dn->dn_dirty_link[i]);
-		dn->dn_free_ranges[i] = NULL;
-		list_create(&dn->dn_dirty_records[i],
-		    sizeof (dbuf_dirty_record_t),
-		    offsetof(dbuf_dirty_record_t, dr_dirty_node));
-	}
 
+	dn->dn_dirty = NULL;
 	dn->dn_allocated_txg = 0;
 	dn->dn_free_txg = 0;
 	dn->dn_assigned_txg = 0;
@@ -157,7 +174,7 @@ dnode_cons(void *arg, void *unused, int kmflag)
 	    offsetof(dmu_buf_impl_t, db_link));
 
 	dn->dn_moved = 0;
-
+	dn->dn_num_slots = 0;
 
 	return (0);
 }
@@ -177,19 +194,10 @@ dnode_dest(void *arg, void *unused)
 	refcount_destroy(&dn->dn_tx_holds);
 	ASSERT(!list_link_active(&dn->dn_link));
 
-	for (i = 0; i < TXG_SIZE; i++) {
+	for (i = 0; i < TXG_SIZE; i++)
 		ASSERT(!list_link_active(&dn->dn_dirty_link[i]));
-		ASSERT3P(dn->dn_free_ranges[i], ==, NULL);
-		list_destroy(&dn->dn_dirty_records[i]);
-		ASSERT0(dn->dn_next_nblkptr[i]);
-		ASSERT0(dn->dn_next_nlevels[i]);
-		ASSERT0(dn->dn_next_indblkshift[i]);
-		ASSERT0(dn->dn_next_bonustype[i]);
-		ASSERT0(dn->dn_rm_spillblk[i]);
-		ASSERT0(dn->dn_next_bonuslen[i]);
-		ASSERT0(dn->dn_next_blksz[i]);
-	}
 
+	ASSERT3P(dn->dn_dirty, ==, NULL);
 	ASSERT0(dn->dn_allocated_txg);
 	ASSERT0(dn->dn_free_txg);
 	ASSERT0(dn->dn_assigned_txg);
@@ -210,6 +218,144 @@ dnode_dest(void *arg, void *unused)
 	avl_destroy(&dn->dn_dbufs);
 }
 
+/* ARGSUSED */
+static int
+dnode_dirty_cons(void *arg, void *unused, int kmflag)
+{
+	dnode_dirty_t *dnd = arg;
+	int i;
+
+	bzero(dnd, offsetof(dnode_dirty_t, dnd_dirty_records));
+	for (i = 0; i < TXG_SIZE; i++) {
+		dnd->dnd_free_ranges[i] = NULL;
+		list_create(&dnd->dnd_dirty_records[i],
+		    sizeof (dbuf_dirty_record_t),
+		    offsetof(dbuf_dirty_record_t, dr_dirty_node));
+	}
+
+	return (0);
+}
+
+/* ARGSUSED */
+static void
+dnode_dirty_dest(void *arg, void *unused)
+{
+	dnode_dirty_t *dnd = arg;
+	int i;
+
+	for (i = 0; i < TXG_SIZE; i++) {
+		ASSERT3P(dnd->dnd_free_ranges[i], ==, NULL);
+		list_destroy(&dnd->dnd_dirty_records[i]);
+		ASSERT0(dnd->dnd_next_type[i]);
+		ASSERT0(dnd->dnd_next_nblkptr[i]);
+		ASSERT0(dnd->dnd_next_nlevels[i]);
+		ASSERT0(dnd->dnd_next_indblkshift[i]);
+		ASSERT0(dnd->dnd_next_bonustype[i]);
+		ASSERT0(dnd->dnd_rm_spillblk[i]);
+		ASSERT0(dnd->dnd_next_bonuslen[i]);
+		ASSERT0(dnd->dnd_next_blksz[i]);
+	}
+}
+
+/*
+ * Return the dirty state of the dnode, allocating it if this is the first
+ * time the dnode is being dirtied.  Racing allocators are resolved by whoever
+ * installs its copy first; the loser returns its copy to the cache.
+ */
+dnode_dirty_t *
+dnode_dirty_state(dnode_t *dn)
+{
+	dnode_dirty_t *dnd, *winner;
+
+	if ((dnd = dn->dn_dirty) != NULL)
+		return (dnd);
+
+	dnd = kmem_cache_alloc(dnode_dirty_cache, KM_SLEEP);
+	membar_producer();
+	winner = atomic_cas_ptr(&dn->dn_dirty, NULL, dnd);
+	if (winner != NULL) {
+		kmem_cache_free(dnode_dirty_cache, dnd);
+		return (winner);
+	}
+	arc_space_consume(sizeof (dnode_dirty_t), ARC_SPACE_OTHER);
+	DNODE_STAT_BUMP(dnode_dirty_count);
+
+	return (dnd);
+}
+
+static void
+dnode_dirty_free(dnode_t *dn)
+{
+	dnode_dirty_t *dnd = dn->dn_dirty;
+	int i;
+
+	if (dnd == NULL)
+		return;
+
+	for (i = 0; i < TXG_SIZE; i++) {
+		ASSERT3P(list_head(&dnd->dnd_dirty_records[i]), ==, NULL);
+		ASSERT3P(dnd->dnd_free_ranges[i], ==, NULL);
+	}
+
+	dn->dn_dirty = NULL;
+	kmem_cache_free(dnode_dirty_cache, dnd);
+	arc_space_return(sizeof (dnode_dirty_t), ARC_SPACE_OTHER);
+	DNODE_STAT_BUMPDOWN(dnode_dirty_count);
+}
+
+/*
+ * Free the dirty state of a dnode which is no longer dirty in any txg.  A
+ * dnode can only be dirtied again through a hold or, in open context, a tx
+ * hold, so this is called with dn_mtx held when the last hold is dropped and
+ * once the syncing txg is written out: from userquota_updates_task() for a
+ * dnode on os_synced_dnodes, otherwise from dnode_sync().
+ */
+void
+dnode_dirty_release(dnode_t *dn)
+{
+	dnode_dirty_t *dnd = dn->dn_dirty;
+	int i;
+
+	ASSERT(MUTEX_HELD(&dn->dn_mtx));
+
+	if (dnd == NULL || !refcount_is_zero(&dn->dn_tx_holds))
+		return;
+
+	for (i = 0; i < TXG_SIZE; i++) {
+		if (multilist_link_active(&dn->dn_dirty_link[i]) ||
+		    list_head(&dnd->dnd_dirty_records[i]) != NULL ||
+		    dnd->dnd_free_ranges[i] != NULL ||
+		    dnd->dnd_next_type[i] != 0 ||
+		    dnd->dnd_next_nblkptr[i] != 0 ||
+		    dnd->dnd_next_nlevels[i] != 0 ||
+		    dnd->dnd_next_indblkshift[i] != 0 ||
+		    dnd->dnd_next_bonustype[i] != 0 ||
+		    dnd->dnd_rm_spillblk[i] != 0 ||
+		    dnd->dnd_next_bonuslen[i] != 0 ||
+		    dnd->dnd_next_blksz[i] != 0)
+			return;
+	}
+
+	dnode_dirty_free(dn);
+}
+
+static int
+dnode_kstats_update(kstat_t *ksp, int rw)
+{
+	dnode_stats_t *ds = ksp->ks_data;
+
+	if (rw == KSTAT_WRITE)
+		return (SET_ERROR(EACCES));
+
+	ds->dnode_size.value.ui64 = sizeof (dnode_t);
+	ds->dnode_dirty_size.value.ui64 = sizeof (dnode_dirty_t);
+	ds->dnode_overhead_bytes.value.ui64 =
+	    ds->dnode_count.value.ui64 * sizeof (dnode_t) +
+	    ds->dnode_dirty_count.value.ui64 * sizeof (dnode_dirty_t);
+
+	return (0);
+}
+
 void
 dnode_init(void)
 {
@@ -217,11 +363,30 @@ dnode_init(void)
 	dnode_cache = kmem_cache_create("dnode_t", sizeof (dnode_t),
 	    0, dnode_cons, dnode_dest, NULL, NULL, NULL, 0);
 	kmem_cache_set_move(dnode_cache, dnode_move);
+	dnode_dirty_cache = kmem_cache_create("dnode_dirty_t",
+	    sizeof (dnode_dirty_t), 0, dnode_dirty_cons, dnode_dirty_dest,
+	    NULL, NULL, NULL, 0);
+
+	dnode_ksp = kstat_create("zfs", 0, "dnodestats", "misc",
+	    KSTAT_TYPE_NAMED, sizeof (dnode_stats) / sizeof (kstat_named_t),
+	    KSTAT_FLAG_VIRTUAL);
+	if (dnode_ksp != NULL) {
+		dnode_ksp->ks_data = &dnode_stats;
+		dnode_ksp->ks_update = dnode_kstats_update;
+		kstat_install(dnode_ksp);
+	}
 }
 
 void
 dnode_fini(void)
 {
+	if (dnode_ksp != NULL) {
+		kstat_delete(dnode_ksp);
+		dnode_ksp = NULL;
+	}
+
+	kmem_cache_destroy(dnode_dirty_cache);
+	dnode_dirty_cache = NULL;
 	kmem_cache_destroy(dnode_cache);
 	dnode_cache = NULL;
 }
@@ -258,15 +423,19 @@ dnode_verify(dnode_t *dn)
 		ASSERT(DMU_OT_IS_VALID(dn->dn_type));
 		ASSERT3U(dn->dn_nblkptr, >=, 1);
 		ASSERT3U(dn->dn_nblkptr, <=, DN_MAX_NBLKPTR);
-		ASSERT3U(dn->dn_bonuslen, <=, DN_MAX_BONUSLEN);
+		ASSERT3U(dn->dn_bonuslen, <=,
+		    DN_SLOTS_TO_BONUSLEN(dn->dn_num_slots));
 		ASSERT3U(dn->dn_datablksz, ==,
 		    dn->dn_datablkszsec << SPA_MINBLOCKSHIFT);
 		ASSERT3U(ISP2(dn->dn_datablksz), ==, dn->dn_datablkshift != 0);
 		ASSERT3U((dn->dn_nblkptr - 1) * sizeof (blkptr_t) +
-		    dn->dn_bonuslen, <=, DN_MAX_BONUSLEN);
-		for (i = 0; i < TXG_SIZE; i++) {
-			ASSERT3U(dn->dn_next_nlevels[i], <=, dn->dn_nlevels);
+		    dn->dn_bonuslen, <=, DN_SLOTS_TO_BONUSLEN(dn->dn_num_slots));
+		mutex_enter(&dn->dn_mtx);
+		for (i = 0; dn->dn_dirty != NULL && i < TXG_SIZE; i++) {
+			ASSERT3U(dn->dn_dirty->dnd_next_nlevels[i], <=,
+			    dn->dn_nlevels);
 		}
+		mutex_exit(&dn->dn_mtx);
 	}
 	if (dn->dn_phys->dn_type != DMU_OT_NONE)
 		ASSERT3U(dn->dn_phys->dn_nlevels, <=, dn->dn_nlevels);
@@ -292,6 +461,11 @@ dnode_byteswap(dnode_phys_t *dnp)
 		return;
 	}
 
+	/*
+	 * dn_extra_slots is only one byte, so it's OK to read it in
+	 * either byte order.  It must be read before the bonus buffer
+	 * is swapped so that its full length is known.
+	 */
 	dnp->dn_datablkszsec = BSWAP_16(dnp->dn_datablkszsec);
 	dnp->dn_bonuslen = BSWAP_16(dnp->dn_bonuslen);
 	dnp->dn_maxblkid = BSWAP_64(dnp->dn_maxblkid);
@@ -319,8 +493,9 @@ dnode_byteswap(dnode_phys_t *dnp)
 		 * pointer (instead of packing it against the end of the
 		 * dnode buffer).
 		 */
+		int slots = dnp->dn_extra_slots + 1;
 		int off = (dnp->dn_nblkptr-1) * sizeof (blkptr_t);
-		size_t len = DN_MAX_BONUSLEN - off;
+		size_t len = DN_SLOTS_TO_BONUSLEN(slots) - off;
 		dmu_object_byteswap_t byteswap;
 		ASSERT(DMU_OT_IS_VALID(dnp->dn_bonustype));
 		byteswap = DMU_OT_BYTESWAP(dnp->dn_bonustype);
@@ -329,23 +504,24 @@ dnode_byteswap(dnode_phys_t *dnp)
 
 	/* Swap SPILL block if we have one */
 	if (dnp->dn_flags & DNODE_FLAG_SPILL_BLKPTR)
-		byteswap_uint64_array(&dnp->dn_spill, sizeof (blkptr_t));
-
+		byteswap_uint64_array(DN_SPILL_BLKPTR(dnp), sizeof (blkptr_t));
 }
 
 void
 dnode_buf_byteswap(void *vbuf, size_t size)
 {
-	dnode_phys_t *buf = vbuf;
-	int i;
+	int i = 0;
 
 	ASSERT3U(sizeof (dnode_phys_t), ==, (1<<DNODE_SHIFT));
 	ASSERT((size & (sizeof (dnode_phys_t)-1)) == 0);
 
-	size >>= DNODE_SHIFT;
-	for (i = 0; i < size; i++) {
-		dnode_byteswap(buf);
-		buf++;
+	while (i < size) {
+		dnode_phys_t *dnp = (void *)(((char *)vbuf) + i);
+		dnode_byteswap(dnp);
+
+		i += DNODE_MIN_SIZE;
+		if (dnp->dn_type != DMU_OT_NONE)
+			i += dnp->dn_extra_slots * DNODE_MIN_SIZE;
 	}
 }
 
@@ -356,13 +532,15 @@ dnode_setbonuslen(dnode_t *dn, int newsize, dmu_tx_t *tx)
 
 	dnode_setdirty(dn, tx);
 	rw_enter(&dn->dn_struct_rwlock, RW_WRITER);
-	ASSERT3U(newsize, <=, DN_MAX_BONUSLEN -
+	ASSERT3U(newsize, <=, DN_SLOTS_TO_BONUSLEN(dn->dn_num_slots) -
 	    (dn->dn_nblkptr-1) * sizeof (blkptr_t));
 	dn->dn_bonuslen = newsize;
 	if (newsize == 0)
-		dn->dn_next_bonuslen[tx->tx_txg & TXG_MASK] = DN_ZERO_BONUSLEN;
+		dn->dn_dirty->dnd_next_bonuslen[tx->tx_txg & TXG_MASK] =
+		    DN_ZERO_BONUSLEN;
 	else
-		dn->dn_next_bonuslen[tx->tx_txg & TXG_MASK] = dn->dn_bonuslen;
+		dn->dn_dirty->dnd_next_bonuslen[tx->tx_txg & TXG_MASK] =
+		    dn->dn_bonuslen;
 	rw_exit(&dn->dn_struct_rwlock);
 }
 
@@ -373,7 +551,8 @@ dnode_setbonus_type(dnode_t *dn, dmu_object_type_t newtype, dmu_tx_t *tx)
 	dnode_setdirty(dn, tx);
 	rw_enter(&dn->dn_struct_rwlock, RW_WRITER);
 	dn->dn_bonustype = newtype;
-	dn->dn_next_bonustype[tx->tx_txg & TXG_MASK] = dn->dn_bonustype;
+	dn->dn_dirty->dnd_next_bonustype[tx->tx_txg & TXG_MASK] =
+	    dn->dn_bonustype;
 	rw_exit(&dn->dn_struct_rwlock);
 }
 
@@ -383,7 +562,7 @@ dnode_rm_spill(dnode_t *dn, dmu_tx_t *tx)
 	ASSERT3U(refcount_count(&dn->dn_holds), >=, 1);
 	ASSERT(RW_WRITE_HELD(&dn->dn_struct_rwlock));
 	dnode_setdirty(dn, tx);
-	dn->dn_rm_spillblk[tx->tx_txg&TXG_MASK] = DN_KILL_SPILLBLK;
+	dn->dn_dirty->dnd_rm_spillblk[tx->tx_txg&TXG_MASK] = DN_KILL_SPILLBLK;
 	dn->dn_have_spill = B_FALSE;
 }
 
@@ -407,6 +586,7 @@ dnode_create(objset_t *os, dnode_phys_t *dnp, dmu_buf_impl_t *db,
 	dnode_t *dn;
 
 	dn = kmem_cache_alloc(dnode_cache, KM_SLEEP);
+	DNODE_STAT_BUMP(dnode_count);
 
 #ifndef __APPLE__  // Our kmem_cache does not use KMEM_UNINITIALIZED_PATTERN
 	ASSERT(!POINTER_IS_VALID(dn->dn_objset));
@@ -440,18 +620,15 @@ dnode_create(objset_t *os, dnode_phys_t *dnp, dmu_buf_impl_t *db,
 	dn->dn_maxblkid = dnp->dn_maxblkid;
 	dn->dn_have_spill = ((dnp->dn_flags & DNODE_FLAG_SPILL_BLKPTR) != 0);
 	dn->dn_id_flags = 0;
+	dn->dn_num_slots = dnp->dn_extra_slots + 1;
 
 	dmu_zfetch_init(&dn->dn_zfetch, dn);
 
 	ASSERT(DMU_OT_IS_VALID(dn->dn_phys->dn_type));
+	ASSERT(zrl_is_locked(&dnh->dnh_zrlock));
+	ASSERT(!DN_SLOT_IS_PTR(dnh->dnh_dnode));
 
 	mutex_enter(&os->os_lock);
-	if (dnh->dnh_dnode != NULL) {
-		/* Lost the allocation race. */
-		mutex_exit(&os->os_lock);
-		kmem_cache_free(dnode_cache, dn);
-		return (dnh->dnh_dnode);
-	}
 
 	/*
 	 * Exclude special dnodes from os_dnodes so an empty os_dnodes
@@ -500,7 +677,8 @@ dnode_destroy(dnode_t *dn)
 	mutex_exit(&os->os_lock);
 
 	/* the dnode can no longer move, so we can release the handle */
-	zrl_remove(&dn->dn_handle->dnh_zrlock);
+	if (!zrl_is_locked(&dn->dn_handle->dnh_zrlock))
+		zrl_remove(&dn->dn_handle->dnh_zrlock);
 
 	dn->dn_allocated_txg = 0;
 	dn->dn_free_txg = 0;
@@ -526,9 +704,12 @@ dnode_destroy(dnode_t *dn)
 	dn->dn_newuid = 0;
 	dn->dn_newgid = 0;
 	dn->dn_id_flags = 0;
+	dn->dn_num_slots = 0;
+	dnode_dirty_free(dn);
 
 	dmu_zfetch_fini(&dn->dn_zfetch);
 	kmem_cache_free(dnode_cache, dn);
+	DNODE_STAT_BUMPDOWN(dnode_count);
 	arc_space_return(sizeof (dnode_t), ARC_SPACE_OTHER);
 
 	if (complete_os_eviction)
@@ -537,10 +718,16 @@ dnode_destroy(dnode_t *dn)
 
 void
 dnode_allocate(dnode_t *dn, dmu_object_type_t ot, int blocksize, int ibs,
-    dmu_object_type_t bonustype, int bonuslen, dmu_tx_t *tx)
+    dmu_object_type_t bonustype, int bonuslen, int dn_slots, dmu_tx_t *tx)
 {
+	dnode_dirty_t *dnd;
 	int i;
 
+	ASSERT3U(dn_slots, >, 0);
+	ASSERT3U(dn_slots << DNODE_SHIFT, <=,
+	    spa_maxdnodesize(dmu_objset_spa(dn->dn_objset)));
+	DNODE_STAT_BUMP(dnode_allocate);
+
 	ASSERT3U(blocksize, <=,
 	    spa_maxblocksize(dmu_objset_spa(dn->dn_objset)));
 	if (blocksize == 0)
@@ -553,8 +740,8 @@ dnode_allocate(dnode_t *dn, dmu_object_type_t ot, int blocksize, int ibs,
 
 	ibs = MIN(MAX(ibs, DN_MIN_INDBLKSHIFT), DN_MAX_INDBLKSHIFT);
 
-	dprintf("os=%p obj=%llu txg=%llu blocksize=%d ibs=%d\n", dn->dn_objset,
-	    dn->dn_object, tx->tx_txg, blocksize, ibs);
+	dprintf("os=%p obj=%llu txg=%llu blocksize=%d ibs=%d dn_slots=%d\n",
+	    dn->dn_objset, dn->dn_object, tx->tx_txg, blocksize, ibs, dn_slots);
 
 	ASSERT(dn->dn_type == DMU_OT_NONE);
 	ASSERT(bcmp(dn->dn_phys, &dnode_phys_zero, sizeof (dnode_phys_t)) == 0);
@@ -565,7 +752,7 @@ dnode_allocate(dnode_t *dn, dmu_object_type_t ot, int blocksize, int ibs,
 	    (bonustype == DMU_OT_SA && bonuslen == 0) ||
 	    (bonustype != DMU_OT_NONE && bonuslen != 0));
 	ASSERT(DMU_OT_IS_VALID(bonustype));
-	ASSERT3U(bonuslen, <=, DN_MAX_BONUSLEN);
+	ASSERT3U(bonuslen, <=, DN_SLOTS_TO_BONUSLEN(dn_slots));
 	ASSERT(dn->dn_type == DMU_OT_NONE);
 	ASSERT0(dn->dn_maxblkid);
 	ASSERT0(dn->dn_allocated_txg);
@@ -575,27 +762,33 @@ dnode_allocate(dnode_t *dn, dmu_object_type_t ot, int blocksize, int ibs,
 	ASSERT(avl_is_empty(&dn->dn_dbufs));
 
 	for (i = 0; i < TXG_SIZE; i++) {
-		ASSERT0(dn->dn_next_nblkptr[i]);
-		ASSERT0(dn->dn_next_nlevels[i]);
-		ASSERT0(dn->dn_next_indblkshift[i]);
-		ASSERT0(dn->dn_next_bonuslen[i]);
-		ASSERT0(dn->dn_next_bonustype[i]);
-		ASSERT0(dn->dn_rm_spillblk[i]);
-		ASSERT0(dn->dn_next_blksz[i]);
 		ASSERT(!list_link_active(&dn->dn_dirty_link[i]));
-		ASSERT3P(list_head(&dn->dn_dirty_records[i]), ==, NULL);
-		ASSERT3P(dn->dn_free_ranges[i], ==, NULL);
+		if (dn->dn_dirty == NULL)
+			continue;
+		ASSERT0(dn->dn_dirty->dnd_next_nblkptr[i]);
+		ASSERT0(dn->dn_dirty->dnd_next_nlevels[i]);
+		ASSERT0(dn->dn_dirty->dnd_next_indblkshift[i]);
+		ASSERT0(dn->dn_dirty->dnd_next_bonuslen[i]);
+		ASSERT0(dn->dn_dirty->dnd_next_bonustype[i]);
+		ASSERT0(dn->dn_dirty->dnd_rm_spillblk[i]);
+		ASSERT0(dn->dn_dirty->dnd_next_blksz[i]);
+		ASSERT3P(list_head(&dn->dn_dirty->dnd_dirty_records[i]), ==,
+		    NULL);
+		ASSERT3P(dn->dn_dirty->dnd_free_ranges[i], ==, NULL);
 	}
 
 	dn->dn_type = ot;
 	dnode_setdblksz(dn, blocksize);
 	dn->dn_indblkshift = ibs;
 	dn->dn_nlevels = 1;
-	if (bonustype == DMU_OT_SA) /* Maximize bonus space for SA */
+	dn->dn_num_slots = dn_slots;
+	if (bonustype == DMU_OT_SA) { /* Maximize bonus space for SA */
 		dn->dn_nblkptr = 1;
-	else
-		dn->dn_nblkptr = 1 +
-		    ((DN_MAX_BONUSLEN - bonuslen) >> SPA_BLKPTRSHIFT);
+	} else {
+		dn->dn_nblkptr = MIN(DN_MAX_NBLKPTR,
+		    1 + ((DN_SLOTS_TO_BONUSLEN(dn_slots) - bonuslen) >>
+		    SPA_BLKPTRSHIFT));
+	}
 	dn->dn_bonustype = bonustype;
 	dn->dn_bonuslen = bonuslen;
 	dn->dn_checksum = ZIO_CHECKSUM_INHERIT;
@@ -612,16 +805,18 @@ dnode_allocate(dnode_t *dn, dmu_object_type_t ot, int blocksize, int ibs,
 	dn->dn_id_flags = 0;
 
 	dnode_setdirty(dn, tx);
-	dn->dn_next_indblkshift[tx->tx_txg & TXG_MASK] = ibs;
-	dn->dn_next_bonuslen[tx->tx_txg & TXG_MASK] = dn->dn_bonuslen;
-	dn->dn_next_bonustype[tx->tx_txg & TXG_MASK] = dn->dn_bonustype;
-	dn->dn_next_blksz[tx->tx_txg & TXG_MASK] = dn->dn_datablksz;
+	dnd = dn->dn_dirty;
+	dnd->dnd_next_indblkshift[tx->tx_txg & TXG_MASK] = ibs;
+	dnd->dnd_next_bonuslen[tx->tx_txg & TXG_MASK] = dn->dn_bonuslen;
+	dnd->dnd_next_bonustype[tx->tx_txg & TXG_MASK] = dn->dn_bonustype;
+	dnd->dnd_next_blksz[tx->tx_txg & TXG_MASK] = dn->dn_datablksz;
 }
 
 void
 dnode_reallocate(dnode_t *dn, dmu_object_type_t ot, int blocksize,
-    dmu_object_type_t bonustype, int bonuslen, dmu_tx_t *tx)
+    dmu_object_type_t bonustype, int bonuslen, int dn_slots, dmu_tx_t *tx)
 {
+	dnode_dirty_t *dnd;
 	int nblkptr;
 
 	ASSERT3U(blocksize, >=, SPA_MINBLOCKSIZE);
@@ -634,7 +829,9 @@ dnode_reallocate(dnode_t *dn, dmu_object_type_t ot, int blocksize,
 	    (bonustype != DMU_OT_NONE && bonuslen != 0) ||
 	    (bonustype == DMU_OT_SA && bonuslen == 0));
 	ASSERT(DMU_OT_IS_VALID(bonustype));
-	ASSERT3U(bonuslen, <=, DN_MAX_BONUSLEN);
+	ASSERT3U(bonuslen, <=, DN_SLOTS_TO_BONUSLEN(dn_slots));
+	ASSERT3U(dn_slots, ==, dn->dn_num_slots);
+	DNODE_STAT_BUMP(dnode_reallocate);
 
 	/* clean up any unreferenced dbufs */
 	dnode_evict_dbufs(dn);
@@ -643,25 +840,29 @@ dnode_reallocate(dnode_t *dn, dmu_object_type_t ot, int blocksize,
 
 	rw_enter(&dn->dn_struct_rwlock, RW_WRITER);
 	dnode_setdirty(dn, tx);
+	dnd = dn->dn_dirty;
 	if (dn->dn_datablksz != blocksize) {
 		/* change blocksize */
 		ASSERT(dn->dn_maxblkid == 0 &&
 		    (BP_IS_HOLE(&dn->dn_phys->dn_blkptr[0]) ||
 		    dnode_block_freed(dn, 0)));
 		dnode_setdblksz(dn, blocksize);
-		dn->dn_next_blksz[tx->tx_txg&TXG_MASK] = blocksize;
+		dnd->dnd_next_blksz[tx->tx_txg&TXG_MASK] = blocksize;
 	}
 	if (dn->dn_bonuslen != bonuslen)
-		dn->dn_next_bonuslen[tx->tx_txg&TXG_MASK] = bonuslen;
+		dnd->dnd_next_bonuslen[tx->tx_txg&TXG_MASK] = bonuslen;
 
-	if (bonustype == DMU_OT_SA) /* Maximize bonus space for SA */
+	if (bonustype == DMU_OT_SA) { /* Maximize bonus space for SA */
 		nblkptr = 1;
-	else
-		nblkptr = 1 + ((DN_MAX_BONUSLEN - bonuslen) >> SPA_BLKPTRSHIFT);
+	} else {
+		nblkptr = MIN(DN_MAX_NBLKPTR,
+		    1 + ((DN_SLOTS_TO_BONUSLEN(dn_slots) - bonuslen) >>
+		    SPA_BLKPTRSHIFT));
+	}
 	if (dn->dn_bonustype != bonustype)
-		dn->dn_next_bonustype[tx->tx_txg&TXG_MASK] = bonustype;
+		dnd->dnd_next_bonustype[tx->tx_txg&TXG_MASK] = bonustype;
 	if (dn->dn_nblkptr != nblkptr)
-		dn->dn_next_nblkptr[tx->tx_txg&TXG_MASK] = nblkptr;
+		dnd->dnd_next_nblkptr[tx->tx_txg&TXG_MASK] = nblkptr;
 	if (dn->dn_phys->dn_flags & DNODE_FLAG_SPILL_BLKPTR) {
 		dbuf_rm_spill(dn, tx);
 		dnode_rm_spill(dn, tx);
@@ -683,7 +884,8 @@ dnode_reallocate(dnode_t *dn, dmu_object_type_t ot, int blocksize,
 	/* fix up the bonus db_size */
 	if (dn->dn_bonus) {
 		dn->dn_bonus->db.db_size =
-		    DN_MAX_BONUSLEN - (dn->dn_nblkptr-1) * sizeof (blkptr_t);
+		    DN_SLOTS_TO_BONUSLEN(dn->dn_num_slots) -
+		    (dn->dn_nblkptr - 1) * sizeof (blkptr_t);
 		ASSERT(dn->dn_bonuslen <= dn->dn_bonus->db.db_size);
 	}
 
@@ -707,8 +909,6 @@ static struct {
 static void
 dnode_move_impl(dnode_t *odn, dnode_t *ndn)
 {
-	int i;
-
 	ASSERT(!RW_LOCK_HELD(&odn->dn_struct_rwlock));
 	ASSERT(MUTEX_NOT_HELD(&odn->dn_mtx));
 	ASSERT(MUTEX_NOT_HELD(&odn->dn_dbufs_mtx));
@@ -732,26 +932,9 @@ dnode_move_impl(dnode_t *odn, dnode_t *ndn)
 	ndn->dn_datablkszsec = odn->dn_datablkszsec;
 	ndn->dn_datablksz = odn->dn_datablksz;
 	ndn->dn_maxblkid = odn->dn_maxblkid;
-	bcopy(&odn->dn_next_nblkptr[0], &ndn->dn_next_nblkptr[0],
-	    sizeof (odn->dn_next_nblkptr));
-	bcopy(&odn->dn_next_nlevels[0], &ndn->dn_next_nlevels[0],
-	    sizeof (odn->dn_next_nlevels));
-	bcopy(&odn->dn_next_indblkshift[0], &ndn->dn_next_indblkshift[0],
-	    sizeof (odn->dn_next_indblkshift));
-	bcopy(&odn->dn_next_bonustype[0], &ndn->dn_next_bonustype[0],
-	    sizeof (odn->dn_next_bonustype));
-	bcopy(&odn->dn_rm_spillblk[0], &ndn->dn_rm_spillblk[0],
-	    sizeof (odn->dn_rm_spillblk));
-	bcopy(&odn->dn_next_bonuslen[0], &ndn->dn_next_bonuslen[0],
-	    sizeof (odn->dn_next_bonuslen));
-	bcopy(&odn->dn_next_blksz[0], &ndn->dn_next_blksz[0],
-	    sizeof (odn->dn_next_blksz));
-	for (i = 0; i < TXG_SIZE; i++) {
-		list_move_tail(&ndn->dn_dirty_records[i],
-		    &odn->dn_dirty_records[i]);
-	}
-	bcopy(&odn->dn_free_ranges[0], &ndn->dn_free_ranges[0],
-	    sizeof (odn->dn_free_ranges));
+	ndn->dn_num_slots = odn->dn_num_slots;
+	ASSERT3P(ndn->dn_dirty, ==, NULL);
+	ndn->dn_dirty = odn->dn_dirty;
 	ndn->dn_allocated_txg = odn->dn_allocated_txg;
 	ndn->dn_free_txg = odn->dn_free_txg;
 	ndn->dn_assigned_txg = odn->dn_assigned_txg;
@@ -806,18 +989,7 @@ dnode_move_impl(dnode_t *odn, dnode_t *ndn)
 	/*
 	 * Satisfy the destructor.
 	 */
-	for (i = 0; i < TXG_SIZE; i++) {
-		list_create(&odn->dn_dirty_records[i],
-		    sizeof (dbuf_dirty_record_t),
-		    offsetof(dbuf_dirty_record_t, dr_dirty_node));
-		odn->dn_free_ranges[i] = NULL;
-		odn->dn_next_nlevels[i] = 0;
-		odn->dn_next_indblkshift[i] = 0;
-		odn->dn_next_bonustype[i] = 0;
-		odn->dn_rm_spillblk[i] = 0;
-		odn->dn_next_bonuslen[i] = 0;
-		odn->dn_next_blksz[i] = 0;
-	}
+	odn->dn_dirty = NULL;
 	odn->dn_allocated_txg = 0;
 	odn->dn_free_txg = 0;
 	odn->dn_assigned_txg = 0;
@@ -1018,9 +1190,191 @@ dnode_special_open(objset_t *os, dnode_phys_t *dnp, uint64_t object,
 {
 	dnode_t *dn;
 
-	dn = dnode_create(os, dnp, NULL, object, dnh);
 	zrl_init(&dnh->dnh_zrlock);
+	VERIFY(zrl_tryenter(&dnh->dnh_zrlock));
+
+	dn = dnode_create(os, dnp, NULL, object, dnh);
 	DNODE_VERIFY(dn);
+
+	zrl_exit(&dnh->dnh_zrlock);
+}
+
+/*
+ * Is the dnode on any of its objset's per-txg dirty lists?
+ */
+static boolean_t
+dnode_is_dirty(dnode_t *dn)
+{
+	int i;
+
+	for (i = 0; i < TXG_SIZE; i++) {
+		if (multilist_link_active(&dn->dn_dirty_link[i]))
+			return (B_TRUE);
+	}
+
+	return (B_FALSE);
+}
+
+/*
+ * Hold the zrlock of every dnode handle in the range [idx, idx + slots).
+ * This pins the handles (and any dnodes they point at) against
+ * dnode_move() without excluding other readers.
+ */
+static void
+dnode_slots_hold(dnode_children_t *children, int idx, int slots)
+{
+	int i;
+
+	ASSERT3S(idx + slots, <=, DNODES_PER_BLOCK);
+
+	for (i = idx; i < idx + slots; i++) {
+		dnode_handle_t *dnh = &children->dnc_children[i];
+		zrl_add(&dnh->dnh_zrlock);
+	}
+}
+
+static void
+dnode_slots_rele(dnode_children_t *children, int idx, int slots)
+{
+	int i;
+
+	ASSERT3S(idx + slots, <=, DNODES_PER_BLOCK);
+
+	for (i = idx; i < idx + slots; i++) {
+		dnode_handle_t *dnh = &children->dnc_children[i];
+
+		if (zrl_is_locked(&dnh->dnh_zrlock))
+			zrl_exit(&dnh->dnh_zrlock);
+		else
+			zrl_remove(&dnh->dnh_zrlock);
+	}
+}
+
+/*
+ * Try to take every handle in the range exclusively.  On failure nothing
+ * is left locked and 0 is returned.
+ */
+static int
+dnode_slots_tryenter(dnode_children_t *children, int idx, int slots)
+{
+	int i, j;
+
+	ASSERT3S(idx + slots, <=, DNODES_PER_BLOCK);
+
+	for (i = idx; i < idx + slots; i++) {
+		dnode_handle_t *dnh = &children->dnc_children[i];
+
+		if (!zrl_tryenter(&dnh->dnh_zrlock)) {
+			for (j = idx; j < i; j++) {
+				dnh = &children->dnc_children[j];
+				zrl_exit(&dnh->dnh_zrlock);
+			}
+
+			return (0);
+		}
+	}
+
+	return (1);
+}
+
+static void
+dnode_set_slots(dnode_children_t *children, int idx, int slots, void *ptr)
+{
+	int i;
+
+	ASSERT3S(idx + slots, <=, DNODES_PER_BLOCK);
+
+	for (i = idx; i < idx + slots; i++) {
+		dnode_handle_t *dnh = &children->dnc_children[i];
+		dnh->dnh_dnode = ptr;
+	}
+}
+
+/*
+ * Returns B_TRUE when every slot in the range is either free or holds an
+ * unreferenced, unallocated dnode which may be evicted to make room.
+ */
+static boolean_t
+dnode_check_slots_free(dnode_children_t *children, int idx, int slots)
+{
+	int i;
+
+	ASSERT3S(idx + slots, <=, DNODES_PER_BLOCK);
+
+	for (i = idx; i < idx + slots; i++) {
+		dnode_handle_t *dnh = &children->dnc_children[i];
+		dnode_t *dn = dnh->dnh_dnode;
+
+		if (dn == DN_SLOT_FREE) {
+			continue;
+		} else if (DN_SLOT_IS_PTR(dn)) {
+			boolean_t can_free;
+
+			mutex_enter(&dn->dn_mtx);
+			can_free = (dn->dn_type == DMU_OT_NONE &&
+			    refcount_is_zero(&dn->dn_holds) &&
+			    dn->dn_free_txg == 0 &&
+			    !dnode_is_dirty(dn));
+			mutex_exit(&dn->dn_mtx);
+
+			if (!can_free)
+				return (B_FALSE);
+		} else {
+			return (B_FALSE);
+		}
+	}
+
+	return (B_TRUE);
+}
+
+/*
+ * Destroy the in-core dnodes occupying slots which are about to become
+ * the interior of a larger dnode.  The caller holds every slot in the
+ * range exclusively.
+ */
+static void
+dnode_reclaim_slots(dnode_children_t *children, int idx, int slots)
+{
+	int i;
+
+	ASSERT3S(idx + slots, <=, DNODES_PER_BLOCK);
+
+	for (i = idx; i < idx + slots; i++) {
+		dnode_handle_t *dnh = &children->dnc_children[i];
+
+		ASSERT(zrl_is_locked(&dnh->dnh_zrlock));
+
+		if (DN_SLOT_IS_PTR(dnh->dnh_dnode)) {
+			ASSERT3S(dnh->dnh_dnode->dn_type, ==, DMU_OT_NONE);
+			dnode_destroy(dnh->dnh_dnode);
+			dnh->dnh_dnode = DN_SLOT_FREE;
+		}
+	}
+}
+
+/*
+ * Mark the interior slots of a freed multi-slot dnode free again so that
+ * they may be handed out by dnode_hold_impl().  Called from syncing
+ * context once the dnode has been zeroed on disk.
+ */
+void
+dnode_free_interior_slots(dnode_t *dn)
+{
+	dnode_children_t *children = dmu_buf_get_user(&dn->dn_dbuf->db);
+	int epb = dn->dn_dbuf->db.db_size >> DNODE_SHIFT;
+	int idx = (dn->dn_object & (epb - 1)) + 1;
+	int slots = dn->dn_num_slots - 1;
+
+	if (slots == 0)
+		return;
+
+	ASSERT3S(idx + slots, <=, DNODES_PER_BLOCK);
+
+	while (!dnode_slots_tryenter(children, idx, slots))
+		DNODE_STAT_BUMP(dnode_free_interior_lock_retry);
+
+	dnode_set_slots(children, idx, slots, DN_SLOT_FREE);
+	dnode_slots_rele(children, idx, slots);
 }
 
 static void
@@ -1038,8 +1392,9 @@ dnode_buf_evict_async(void *dbu)
 		 * another valid address, so there is no need here to guard
 		 * against changes to or from NULL.
 		 */
-		if (dnh->dnh_dnode == NULL) {
+		if (!DN_SLOT_IS_PTR(dnh->dnh_dnode)) {
 			zrl_destroy(&dnh->dnh_zrlock);
+			dnh->dnh_dnode = DN_SLOT_UNINIT;
 			continue;
 		}
 
@@ -1056,31 +1411,50 @@ dnode_buf_evict_async(void *dbu)
 
 		dnode_destroy(dn); /* implicit zrl_remove() */
 		zrl_destroy(&dnh->dnh_zrlock);
-		dnh->dnh_dnode = NULL;
+		dnh->dnh_dnode = DN_SLOT_UNINIT;
 	}
 	kmem_free(children_dnodes, sizeof (dnode_children_t) +
 	    children_dnodes->dnc_count * sizeof (dnode_handle_t));
 }
 
 /*
+ * When the DNODE_MUST_BE_FREE flag is set, the "slots" parameter is used
+ * to ensure the hole at the specified object offset is large enough to
+ * hold the dnode being created. The slots parameter is also used to ensure
+ * a dnode does not span multiple dnode blocks. In both of these cases, if
+ * a failure occurs, ENOSPC is returned. Keep in mind, these failure cases
+ * are only possible when using DNODE_MUST_BE_FREE.
+ *
+ * If the DNODE_MUST_BE_ALLOCATED flag is set, "slots" must be 0.
+ * dnode_hold_impl() will check if the requested dnode is already consumed
+ * as an extra dnode slot by an large dnode, in which case it returns
+ * ENOENT.
+ *
  * errors:
- * EINVAL - invalid object number.
- * EIO - i/o error.
- * succeeds even for free dnodes.
+ * EINVAL - invalid object number or flags.
+ * ENOSPC - hole too small to fulfill "slots" request (DNODE_MUST_BE_FREE)
+ * EEXIST - Refers to an allocated dnode (DNODE_MUST_BE_FREE)
+ *        - Refers to an interior dnode slot (DNODE_MUST_BE_ALLOCATED)
+ * ENOENT - The requested dnode is not allocated (DNODE_MUST_BE_ALLOCATED)
+ * EIO    - i/o error error when reading the meta dnode dbuf.
  */
 int
-dnode_hold_impl(objset_t *os, uint64_t object, int flag,
+dnode_hold_impl(objset_t *os, uint64_t object, int flag, int slots,
     void *tag, dnode_t **dnp)
 {
-	int epb, idx, err;
+	int epb, idx, err, i;
 	int drop_struct_lock = FALSE;
 	int type;
 	uint64_t blk;
 	dnode_t *mdn, *dn;
 	dmu_buf_impl_t *db;
 	dnode_children_t *children_dnodes;
+	dnode_phys_t *dn_block;
 	dnode_handle_t *dnh;
 
+	ASSERT(!(flag & DNODE_MUST_BE_ALLOCATED) || (slots == 0));
+	ASSERT(!(flag & DNODE_MUST_BE_FREE) || (slots > 0));
+
 	/*
 	 * If you are holding the spa config lock as writer, you shouldn't
 	 * be asking the DMU to do *anything* unless it's the root pool
@@ -1126,8 +1500,10 @@ dnode_hold_impl(objset_t *os, uint64_t object, int flag,
 	db = dbuf_hold(mdn, blk, FTAG);
 	if (drop_struct_lock)
 		rw_exit(&mdn->dn_struct_rwlock);
-	if (db == NULL)
+	if (db == NULL) {
+		DNODE_STAT_BUMP(dnode_hold_dbuf_hold);
 		return (SET_ERROR(EIO));
+	}
 
 	/*
 	 * We do not need to decrypt to read the dnode so it doesn't matter
@@ -1135,6 +1511,7 @@ dnode_hold_impl(objset_t *os, uint64_t object, int flag,
 	 */
 	err = dbuf_read(db, NULL, DB_RF_CANFAIL | DB_RF_NO_DECRYPT);
 	if (err) {
+		DNODE_STAT_BUMP(dnode_hold_dbuf_read);
 		dbuf_rele(db, FTAG);
 		return (err);
 	}
@@ -1142,20 +1519,43 @@ dnode_hold_impl(objset_t *os, uint64_t object, int flag,
 	ASSERT3U(db->db.db_size, >=, 1<<DNODE_SHIFT);
 	epb = db->db.db_size >> DNODE_SHIFT;
 
-	idx = object & (epb-1);
+	idx = object & (epb - 1);
+	dn_block = (dnode_phys_t *)db->db.db_data;
 
 	ASSERT(DB_DNODE(db)->dn_type == DMU_OT_DNODE);
 	children_dnodes = dmu_buf_get_user(&db->db);
 	if (children_dnodes == NULL) {
-		int i;
 		dnode_children_t *winner;
+		int skip = 0;
+
 		children_dnodes = kmem_zalloc(sizeof (dnode_children_t) +
 		    epb * sizeof (dnode_handle_t), KM_SLEEP);
 		children_dnodes->dnc_count = epb;
 		dnh = &children_dnodes->dnc_children[0];
+
+		/* Initialize dnode slot status from dnode_phys_t */
 		for (i = 0; i < epb; i++) {
 			zrl_init(&dnh[i].dnh_zrlock);
+
+			if (skip) {
+				skip--;
+				continue;
+			}
+
+			if (dn_block[i].dn_type != DMU_OT_NONE) {
+				int interior = dn_block[i].dn_extra_slots;
+
+				dnode_set_slots(children_dnodes, i, 1,
+				    DN_SLOT_ALLOCATED);
+				dnode_set_slots(children_dnodes, i + 1,
+				    interior, DN_SLOT_INTERIOR);
+				skip = interior;
+			} else {
+				dnh[i].dnh_dnode = DN_SLOT_FREE;
+				skip = 0;
+			}
 		}
+
 		dmu_buf_init_user(&children_dnodes->dnc_dbu, NULL,
 		    dnode_buf_evict_async, NULL);
 		winner = dmu_buf_set_user(&db->db, &children_dnodes->dnc_dbu);
@@ -1172,33 +1572,136 @@ dnode_hold_impl(objset_t *os, uint64_t object, int flag,
 	}
 	ASSERT(children_dnodes->dnc_count == epb);
 
-	dnh = &children_dnodes->dnc_children[idx];
-	zrl_add(&dnh->dnh_zrlock);
-	dn = dnh->dnh_dnode;
-	if (dn == NULL) {
-		dnode_phys_t *phys = (dnode_phys_t *)db->db.db_data+idx;
+	dn = DN_SLOT_UNINIT;
 
-		dn = dnode_create(os, phys, db, object, dnh);
-	}
+	if (flag & DNODE_MUST_BE_ALLOCATED) {
+		slots = 1;
 
-	mutex_enter(&dn->dn_mtx);
-	type = dn->dn_type;
-	if (dn->dn_free_txg ||
-	    ((flag & DNODE_MUST_BE_ALLOCATED) && type == DMU_OT_NONE) ||
-	    ((flag & DNODE_MUST_BE_FREE) &&
-	    (type != DMU_OT_NONE || !refcount_is_zero(&dn->dn_holds)))) {
-		mutex_exit(&dn->dn_mtx);
-		zrl_remove(&dnh->dnh_zrlock);
+		while (dn == DN_SLOT_UNINIT) {
+			dnode_slots_hold(children_dnodes, idx, slots);
+			dnh = &children_dnodes->dnc_children[idx];
+
+			if (DN_SLOT_IS_PTR(dnh->dnh_dnode)) {
+				dn = dnh->dnh_dnode;
+				break;
+			} else if (dnh->dnh_dnode == DN_SLOT_INTERIOR) {
+				DNODE_STAT_BUMP(dnode_hold_alloc_interior);
+				dnode_slots_rele(children_dnodes, idx, slots);
+				dbuf_rele(db, FTAG);
+				return (SET_ERROR(EEXIST));
+			} else if (dnh->dnh_dnode != DN_SLOT_ALLOCATED) {
+				DNODE_STAT_BUMP(dnode_hold_alloc_misses);
+				dnode_slots_rele(children_dnodes, idx, slots);
+				dbuf_rele(db, FTAG);
+				return (SET_ERROR(ENOENT));
+			}
+
+			dnode_slots_rele(children_dnodes, idx, slots);
+			if (!dnode_slots_tryenter(children_dnodes, idx, slots)) {
+				DNODE_STAT_BUMP(dnode_hold_alloc_lock_retry);
+				continue;
+			}
+
+			/*
+			 * Someone else won the race and called dnode_create()
+			 * after we checked DN_SLOT_IS_PTR() above but before
+			 * we acquired the lock.
+			 */
+			if (DN_SLOT_IS_PTR(dnh->dnh_dnode)) {
+				DNODE_STAT_BUMP(dnode_hold_alloc_lock_misses);
+				dn = dnh->dnh_dnode;
+			} else {
+				dn = dnode_create(os, dn_block + idx, db,
+				    object, dnh);
+			}
+		}
+
+		mutex_enter(&dn->dn_mtx);
+		if (dn->dn_type == DMU_OT_NONE || dn->dn_free_txg != 0) {
+			DNODE_STAT_BUMP(dnode_hold_alloc_type_none);
+			mutex_exit(&dn->dn_mtx);
+			dnode_slots_rele(children_dnodes, idx, slots);
+			dbuf_rele(db, FTAG);
+			return (SET_ERROR(ENOENT));
+		}
+
+		DNODE_STAT_BUMP(dnode_hold_alloc_hits);
+	} else if (flag & DNODE_MUST_BE_FREE) {
+
+		if (idx + slots - 1 >= DNODES_PER_BLOCK) {
+			DNODE_STAT_BUMP(dnode_hold_free_overflow);
+			dbuf_rele(db, FTAG);
+			return (SET_ERROR(ENOSPC));
+		}
+
+		while (dn == DN_SLOT_UNINIT) {
+			dnode_slots_hold(children_dnodes, idx, slots);
+
+			if (!dnode_check_slots_free(children_dnodes, idx,
+			    slots)) {
+				DNODE_STAT_BUMP(dnode_hold_free_misses);
+				dnode_slots_rele(children_dnodes, idx, slots);
+				dbuf_rele(db, FTAG);
+				return (SET_ERROR(ENOSPC));
+			}
+
+			dnode_slots_rele(children_dnodes, idx, slots);
+			if (!dnode_slots_tryenter(children_dnodes, idx, slots)) {
+				DNODE_STAT_BUMP(dnode_hold_free_lock_retry);
+				continue;
+			}
+
+			if (!dnode_check_slots_free(children_dnodes, idx,
+			    slots)) {
+				DNODE_STAT_BUMP(dnode_hold_free_lock_misses);
+				dnode_slots_rele(children_dnodes, idx, slots);
+				dbuf_rele(db, FTAG);
+				return (SET_ERROR(ENOSPC));
+			}
+
+			/*
+			 * Allocated but otherwise free dnodes which would
+			 * be in the interior of a multi-slot dnodes need
+			 * to be freed.  Single slot dnodes can be safely
+			 * re-purposed as a performance optimization.
+			 */
+			if (slots > 1)
+				dnode_reclaim_slots(children_dnodes, idx + 1,
+				    slots - 1);
+
+			dnh = &children_dnodes->dnc_children[idx];
+			if (DN_SLOT_IS_PTR(dnh->dnh_dnode)) {
+				dn = dnh->dnh_dnode;
+			} else {
+				dn = dnode_create(os, dn_block + idx, db,
+				    object, dnh);
+			}
+		}
+
+		mutex_enter(&dn->dn_mtx);
+		if (!refcount_is_zero(&dn->dn_holds) || dn->dn_free_txg) {
+			DNODE_STAT_BUMP(dnode_hold_free_refcount);
+			mutex_exit(&dn->dn_mtx);
+			dnode_slots_rele(children_dnodes, idx, slots);
+			dbuf_rele(db, FTAG);
+			return (SET_ERROR(EEXIST));
+		}
+
+		dnode_set_slots(children_dnodes, idx + 1, slots - 1,
+		    DN_SLOT_INTERIOR);
+		DNODE_STAT_BUMP(dnode_hold_free_hits);
+	} else {
 		dbuf_rele(db, FTAG);
-		return (type == DMU_OT_NONE ? ENOENT : EEXIST);
+		return (SET_ERROR(EINVAL));
 	}
+
 	if (refcount_add(&dn->dn_holds, tag) == 1)
 		dbuf_add_ref(db, dnh);
 
 	mutex_exit(&dn->dn_mtx);
 
 	/* Now we can rely on the hold to prevent the dnode from moving. */
-	zrl_remove(&dnh->dnh_zrlock);
+	dnode_slots_rele(children_dnodes, idx, slots);
 
 	DNODE_VERIFY(dn);
 	ASSERT3P(dn->dn_dbuf, ==, db);
@@ -1215,7 +1718,8 @@ dnode_hold_impl(objset_t *os, uint64_t object, int flag,
 int
 dnode_hold(objset_t *os, uint64_t object, void *tag, dnode_t **dnp)
 {
-	return (dnode_hold_impl(os, object, DNODE_MUST_BE_ALLOCATED, tag, dnp));
+	return (dnode_hold_impl(os, object, DNODE_MUST_BE_ALLOCATED, 0, tag,
+	    dnp));
 }
 
 /*
@@ -1254,6 +1758,8 @@ dnode_rele_and_unlock(dnode_t *dn, void *tag)
 
 	refs = refcount_remove(&dn->dn_holds, tag);
     dprintf("dnode: -dn_hold %d\n", refcount_count(&dn->dn_holds));
+	if (refs == 0)
+		dnode_dirty_release(dn);
 	mutex_exit(&dn->dn_mtx);
 
 	/*
@@ -1287,6 +1793,12 @@ dnode_setdirty(dnode_t *dn, dmu_tx_t *tx)
 	objset_t *os = dn->dn_objset;
 	uint64_t txg = tx->tx_txg;
 
+	/*
+	 * Callers rely on the dirty state existing once the dnode has
+	 * been marked dirty, so set it up before anything else.
+	 */
+	(void) dnode_dirty_state(dn);
+
 	if (DMU_OBJECT_IS_SPECIAL(dn->dn_object)) {
 		dsl_dataset_dirty(os->os_dsl_dataset, tx);
 		return;
@@ -1320,9 +1832,9 @@ dnode_setdirty(dnode_t *dn, dmu_tx_t *tx)
 	ASSERT(!refcount_is_zero(&dn->dn_holds) ||
 	    !avl_is_empty(&dn->dn_dbufs));
 	ASSERT(dn->dn_datablksz != 0);
-	ASSERT0(dn->dn_next_bonuslen[txg&TXG_MASK]);
-	ASSERT0(dn->dn_next_blksz[txg&TXG_MASK]);
-	ASSERT0(dn->dn_next_bonustype[txg&TXG_MASK]);
+	ASSERT0(dn->dn_dirty->dnd_next_bonuslen[txg&TXG_MASK]);
+	ASSERT0(dn->dn_dirty->dnd_next_blksz[txg&TXG_MASK]);
+	ASSERT0(dn->dn_dirty->dnd_next_bonustype[txg&TXG_MASK]);
 
 	dprintf_ds(os->os_dsl_dataset, "obj=%llu txg=%llu\n",
 	    dn->dn_object, txg);
@@ -1412,10 +1924,10 @@ dnode_set_blksz(dnode_t *dn, uint64_t size, int ibs, dmu_tx_t *tx)
 
 	dnode_setdblksz(dn, size);
 	dnode_setdirty(dn, tx);
-	dn->dn_next_blksz[tx->tx_txg&TXG_MASK] = size;
+	dn->dn_dirty->dnd_next_blksz[tx->tx_txg&TXG_MASK] = size;
 	if (ibs) {
 		dn->dn_indblkshift = ibs;
-		dn->dn_next_indblkshift[tx->tx_txg&TXG_MASK] = ibs;
+		dn->dn_dirty->dnd_next_indblkshift[tx->tx_txg&TXG_MASK] = ibs;
 	}
 	/* rele after we have fixed the blocksize in the dnode */
 	if (db)
@@ -1434,6 +1946,7 @@ dnode_set_nlevels_impl(dnode_t *dn, int new_nlevels, dmu_tx_t *tx)
 {
 	uint64_t txgoff = tx->tx_txg & TXG_MASK;
 	int old_nlevels = dn->dn_nlevels;
+	dnode_dirty_t *dnd = dnode_dirty_state(dn);
 	dmu_buf_impl_t *db;
 	list_t *list;
 	dbuf_dirty_record_t *new, *dr, *dr_next;
@@ -1442,8 +1955,8 @@ dnode_set_nlevels_impl(dnode_t *dn, int new_nlevels, dmu_tx_t *tx)
 
 	dn->dn_nlevels = new_nlevels;
 
-	ASSERT3U(new_nlevels, >, dn->dn_next_nlevels[txgoff]);
-	dn->dn_next_nlevels[txgoff] = new_nlevels;
+	ASSERT3U(new_nlevels, >, dnd->dnd_next_nlevels[txgoff]);
+	dnd->dnd_next_nlevels[txgoff] = new_nlevels;
 
 	/* dirty the left indirects */
 	db = dbuf_hold_level(dn, old_nlevels, 0, FTAG);
@@ -1454,14 +1967,14 @@ dnode_set_nlevels_impl(dnode_t *dn, int new_nlevels, dmu_tx_t *tx)
 	/* transfer the dirty records to the new indirect */
 	mutex_enter(&dn->dn_mtx);
 	mutex_enter(&new->dt.di.dr_mtx);
-	list = &dn->dn_dirty_records[txgoff];
+	list = &dnd->dnd_dirty_records[txgoff];
 	for (dr = list_head(list); dr; dr = dr_next) {
-		dr_next = list_next(&dn->dn_dirty_records[txgoff], dr);
+		dr_next = list_next(list, dr);
 		if (dr->dr_dbuf->db_level != new_nlevels-1 &&
 		    dr->dr_dbuf->db_blkid != DMU_BONUS_BLKID &&
 		    dr->dr_dbuf->db_blkid != DMU_SPILL_BLKID) {
 			ASSERT(dr->dr_dbuf->db_level == old_nlevels-1);
-			list_remove(&dn->dn_dirty_records[txgoff], dr);
+			list_remove(list, dr);
 			list_insert_tail(&new->dt.di.dr_children, dr);
 			dr->dr_parent = new;
 		}
@@ -1744,12 +2257,13 @@ done:
 	mutex_enter(&dn->dn_mtx);
 	{
 	int txgoff = tx->tx_txg & TXG_MASK;
-	if (dn->dn_free_ranges[txgoff] == NULL) {
-		dn->dn_free_ranges[txgoff] =
+	dnode_dirty_t *dnd = dnode_dirty_state(dn);
+	if (dnd->dnd_free_ranges[txgoff] == NULL) {
+		dnd->dnd_free_ranges[txgoff] =
 		    range_tree_create(NULL, NULL, &dn->dn_mtx);
 	}
-	range_tree_clear(dn->dn_free_ranges[txgoff], blkid, nblks);
-	range_tree_add(dn->dn_free_ranges[txgoff], blkid, nblks);
+	range_tree_clear(dnd->dnd_free_ranges[txgoff], blkid, nblks);
+	range_tree_add(dnd->dnd_free_ranges[txgoff], blkid, nblks);
 	}
 	dprintf_dnode(dn, "blkid=%llu nblks=%llu txg=%llu\n",
 	    blkid, nblks, tx->tx_txg);
@@ -1765,12 +2279,15 @@ out:
 static boolean_t
 dnode_spill_freed(dnode_t *dn)
 {
-	int i;
+	dnode_dirty_t *dnd;
+	int i = TXG_SIZE;
 
 	mutex_enter(&dn->dn_mtx);
-	for (i = 0; i < TXG_SIZE; i++) {
-		if (dn->dn_rm_spillblk[i] == DN_KILL_SPILLBLK)
-			break;
+	if ((dnd = dn->dn_dirty) != NULL) {
+		for (i = 0; i < TXG_SIZE; i++) {
+			if (dnd->dnd_rm_spillblk[i] == DN_KILL_SPILLBLK)
+				break;
+		}
 	}
 	mutex_exit(&dn->dn_mtx);
 	return (i < TXG_SIZE);
@@ -1781,6 +2298,7 @@ uint64_t
 dnode_block_freed(dnode_t *dn, uint64_t blkid)
 {
 	void *dp = spa_get_dsl(dn->dn_objset->os_spa);
+	dnode_dirty_t *dnd;
 	int i;
 
 	if (blkid == DMU_BONUS_BLKID)
@@ -1800,9 +2318,14 @@ dnode_block_freed(dnode_t *dn, uint64_t blkid)
 		return (dnode_spill_freed(dn));
 
 	mutex_enter(&dn->dn_mtx);
+	/* a dnode that isn't dirty has nothing pending to free */
+	if ((dnd = dn->dn_dirty) == NULL) {
+		mutex_exit(&dn->dn_mtx);
+		return (FALSE);
+	}
 	for (i = 0; i < TXG_SIZE; i++) {
-		if (dn->dn_free_ranges[i] != NULL &&
-		    range_tree_contains(dn->dn_free_ranges[i], blkid, 1))
+		if (dnd->dnd_free_ranges[i] != NULL &&
+		    range_tree_contains(dnd->dnd_free_ranges[i], blkid, 1))
 			break;
 	}
 	mutex_exit(&dn->dn_mtx);
@@ -1916,17 +2439,25 @@ dnode_next_offset_level(dnode_t *dn, int flags, uint64_t *offset,
 		error = SET_ERROR(ESRCH);
 	} else if (lvl == 0) {
 		dnode_phys_t *dnp = data;
-		span = DNODE_SHIFT;
+
 		ASSERT(dn->dn_type == DMU_OT_DNODE);
+		ASSERT(!(flags & DNODE_FIND_BACKWARDS));
 
-		for (i = (*offset >> span) & (blkfill - 1);
-		    i >= 0 && i < blkfill; i += inc) {
+		/*
+		 * Step over the interior slots of large dnodes so that they
+		 * are never reported as holes.
+		 */
+		for (i = (*offset >> DNODE_SHIFT) & (blkfill - 1);
+		    i < blkfill; i += dnp[i].dn_extra_slots + 1) {
 			if ((dnp[i].dn_type == DMU_OT_NONE) == hole)
 				break;
-			*offset += (1ULL << span) * inc;
 		}
-		if (i < 0 || i == blkfill)
+
+		if (i == blkfill)
 			error = SET_ERROR(ESRCH);
+
+		*offset = (*offset & ~(DNODE_BLOCK_SIZE - 1)) +
+		    (i << DNODE_SHIFT);
 	} else {
 		blkptr_t *bp = data;
 		uint64_t start = *offset;
@@ -44,7 +44,7 @@ dnode_increase_indirection(dnode_t *dn, dmu_tx_t *tx)
 	int txgoff = tx->tx_txg & TXG_MASK;
 	int nblkptr = dn->dn_phys->dn_nblkptr;
 	int old_toplvl = dn->dn_phys->dn_nlevels - 1;
-	int new_level = dn->dn_next_nlevels[txgoff];
+	int new_level = dn->dn_dirty->dnd_next_nlevels[txgoff];
 	int i;
 
 	rw_enter(&dn->dn_struct_rwlock, RW_WRITER);
@@ -488,6 +488,7 @@ dnode_undirty_dbufs(list_t *list)
 			list_destroy(&dr->dt.di.dr_children);
 		}
 		kmem_free(dr, sizeof (dbuf_dirty_record_t));
+		DBUF_MEM_STAT_BUMPDOWN(dirty_record_count);
 		dbuf_rele_and_unlock(db, (void *)(uintptr_t)txg);
 	}
 }
@@ -495,6 +496,7 @@ dnode_undirty_dbufs(list_t *list)
 static void
 dnode_sync_free(dnode_t *dn, dmu_tx_t *tx)
 {
+	dnode_dirty_t *dnd = dn->dn_dirty;
 	int txgoff = tx->tx_txg & TXG_MASK;
 
 	ASSERT(dmu_tx_is_syncing(tx));
@@ -506,7 +508,7 @@ dnode_sync_free(dnode_t *dn, dmu_tx_t *tx)
 	ASSERT0(DN_USED_BYTES(dn->dn_phys));
 	ASSERT(BP_IS_HOLE(dn->dn_phys->dn_blkptr));
 
-	dnode_undirty_dbufs(&dn->dn_dirty_records[txgoff]);
+	dnode_undirty_dbufs(&dnd->dnd_dirty_records[txgoff]);
 	dnode_evict_dbufs(dn);
 
 	/*
@@ -520,9 +522,9 @@ dnode_sync_free(dnode_t *dn, dmu_tx_t *tx)
 	 */
 
 	/* Undirty next bits */
-	dn->dn_next_nlevels[txgoff] = 0;
-	dn->dn_next_indblkshift[txgoff] = 0;
-	dn->dn_next_blksz[txgoff] = 0;
+	dnd->dnd_next_nlevels[txgoff] = 0;
+	dnd->dnd_next_indblkshift[txgoff] = 0;
+	dnd->dnd_next_blksz[txgoff] = 0;
 
 	/* ASSERT(blkptrs are zero); */
 	ASSERT(dn->dn_phys->dn_type != DMU_OT_NONE);
@@ -531,7 +533,8 @@ dnode_sync_free(dnode_t *dn, dmu_tx_t *tx)
 	ASSERT(dn->dn_free_txg > 0);
 	if (dn->dn_allocated_txg != dn->dn_free_txg)
 		dmu_buf_will_dirty(&dn->dn_dbuf->db, tx);
-	bzero(dn->dn_phys, sizeof (dnode_phys_t));
+	bzero(dn->dn_phys, sizeof (dnode_phys_t) * dn->dn_num_slots);
+	dnode_free_interior_slots(dn);
 
 	mutex_enter(&dn->dn_mtx);
 	dn->dn_type = DMU_OT_NONE;
@@ -559,7 +562,8 @@ dnode_sync(dnode_t *dn, dmu_tx_t *tx)
 	objset_t *os = dn->dn_objset;
 	dnode_phys_t *dnp = dn->dn_phys;
 	int txgoff = tx->tx_txg & TXG_MASK;
-	list_t *list = &dn->dn_dirty_records[txgoff];
+	dnode_dirty_t *dnd = dnode_dirty_state(dn);
+	list_t *list = &dnd->dnd_dirty_records[txgoff];
 	boolean_t kill_spill = B_FALSE;
 	boolean_t freeing_dnode;
 	ASSERTV(static const dnode_phys_t zerodn = { 0 });
@@ -567,7 +571,7 @@ dnode_sync(dnode_t *dn, dmu_tx_t *tx)
 	ASSERT(dmu_tx_is_syncing(tx));
 	ASSERT(dnp->dn_type != DMU_OT_NONE || dn->dn_allocated_txg);
 	ASSERT(dnp->dn_type != DMU_OT_NONE ||
-	    bcmp(dnp, &zerodn, DNODE_SIZE) == 0);
+	    bcmp(dnp, &zerodn, DNODE_MIN_SIZE) == 0);
 	DNODE_VERIFY(dn);
 
 	ASSERT(dn->dn_dbuf == NULL || arc_released(dn->dn_dbuf->db_buf));
@@ -590,6 +594,14 @@ dnode_sync(dnode_t *dn, dmu_tx_t *tx)
 		    DNODE_FLAG_USERUSED_ACCOUNTED));
 	}
 
+	if (dn->dn_num_slots > DNODE_MIN_SLOTS) {
+		dsl_dataset_t *ds = dn->dn_objset->os_dsl_dataset;
+		mutex_enter(&ds->ds_lock);
+		ds->ds_feature_activation_needed[SPA_FEATURE_LARGE_DNODE] =
+		    B_TRUE;
+		mutex_exit(&ds->ds_lock);
+	}
+
 	mutex_enter(&dn->dn_mtx);
 	if (dn->dn_allocated_txg == tx->tx_txg) {
 		/* The dnode is newly allocated or reallocated */
@@ -603,6 +615,9 @@ dnode_sync(dnode_t *dn, dmu_tx_t *tx)
 		dnp->dn_bonustype = dn->dn_bonustype;
 		dnp->dn_bonuslen = dn->dn_bonuslen;
 	}
+
+	dnp->dn_extra_slots = dn->dn_num_slots - 1;
+
 	ASSERT(dnp->dn_nlevels > 1 ||
 	    BP_IS_HOLE(&dnp->dn_blkptr[0]) ||
 	    BP_IS_EMBEDDED(&dnp->dn_blkptr[0]) ||
@@ -612,37 +627,38 @@ dnode_sync(dnode_t *dn, dmu_tx_t *tx)
 	    BP_IS_HOLE(&dnp->dn_blkptr[0]) ||
 	    BP_GET_LSIZE(&dnp->dn_blkptr[0]) == 1 << dnp->dn_indblkshift);
 
-	if (dn->dn_next_type[txgoff] != 0) {
+	if (dnd->dnd_next_type[txgoff] != 0) {
 		dnp->dn_type = dn->dn_type;
-		dn->dn_next_type[txgoff] = 0;
+		dnd->dnd_next_type[txgoff] = 0;
 	}
 
-	if (dn->dn_next_blksz[txgoff] != 0) {
-		ASSERT(P2PHASE(dn->dn_next_blksz[txgoff],
+	if (dnd->dnd_next_blksz[txgoff] != 0) {
+		ASSERT(P2PHASE(dnd->dnd_next_blksz[txgoff],
 		    SPA_MINBLOCKSIZE) == 0);
 		ASSERT(BP_IS_HOLE(&dnp->dn_blkptr[0]) ||
 		    dn->dn_maxblkid == 0 || list_head(list) != NULL ||
-		    dn->dn_next_blksz[txgoff] >> SPA_MINBLOCKSHIFT ==
+		    dnd->dnd_next_blksz[txgoff] >> SPA_MINBLOCKSHIFT ==
 		    dnp->dn_datablkszsec ||
-		    range_tree_space(dn->dn_free_ranges[txgoff]) != 0);
+		    range_tree_space(dnd->dnd_free_ranges[txgoff]) != 0);
 		dnp->dn_datablkszsec =
-		    dn->dn_next_blksz[txgoff] >> SPA_MINBLOCKSHIFT;
-		dn->dn_next_blksz[txgoff] = 0;
+		    dnd->dnd_next_blksz[txgoff] >> SPA_MINBLOCKSHIFT;
+		dnd->dnd_next_blksz[txgoff] = 0;
 	}
 
-	if (dn->dn_next_bonuslen[txgoff] != 0) {
-		if (dn->dn_next_bonuslen[txgoff] == DN_ZERO_BONUSLEN)
+	if (dnd->dnd_next_bonuslen[txgoff] != 0) {
+		if (dnd->dnd_next_bonuslen[txgoff] == DN_ZERO_BONUSLEN)
 			dnp->dn_bonuslen = 0;
 		else
-			dnp->dn_bonuslen = dn->dn_next_bonuslen[txgoff];
-		ASSERT(dnp->dn_bonuslen <= DN_MAX_BONUSLEN);
-		dn->dn_next_bonuslen[txgoff] = 0;
+			dnp->dn_bonuslen = dnd->dnd_next_bonuslen[txgoff];
+		ASSERT(dnp->dn_bonuslen <=
+		    DN_SLOTS_TO_BONUSLEN(dnp->dn_extra_slots + 1));
+		dnd->dnd_next_bonuslen[txgoff] = 0;
 	}
 
-	if (dn->dn_next_bonustype[txgoff] != 0) {
-		ASSERT(DMU_OT_IS_VALID(dn->dn_next_bonustype[txgoff]));
-		dnp->dn_bonustype = dn->dn_next_bonustype[txgoff];
-		dn->dn_next_bonustype[txgoff] = 0;
+	if (dnd->dnd_next_bonustype[txgoff] != 0) {
+		ASSERT(DMU_OT_IS_VALID(dnd->dnd_next_bonustype[txgoff]));
+		dnp->dn_bonustype = dnd->dnd_next_bonustype[txgoff];
+		dnd->dnd_next_bonustype[txgoff] = 0;
 	}
 
 	freeing_dnode = dn->dn_free_txg > 0 && dn->dn_free_txg <= tx->tx_txg;
@@ -651,16 +667,16 @@ dnode_sync(dnode_t *dn, dmu_tx_t *tx)
 	 * Remove the spill block if we have been explicitly asked to
 	 * remove it, or if the object is being removed.
 	 */
-	if (dn->dn_rm_spillblk[txgoff] || freeing_dnode) {
+	if (dnd->dnd_rm_spillblk[txgoff] || freeing_dnode) {
 		if (dnp->dn_flags & DNODE_FLAG_SPILL_BLKPTR)
 			kill_spill = B_TRUE;
-		dn->dn_rm_spillblk[txgoff] = 0;
+		dnd->dnd_rm_spillblk[txgoff] = 0;
 	}
 
-	if (dn->dn_next_indblkshift[txgoff] != 0) {
+	if (dnd->dnd_next_indblkshift[txgoff] != 0) {
 		ASSERT(dnp->dn_nlevels == 1);
-		dnp->dn_indblkshift = dn->dn_next_indblkshift[txgoff];
-		dn->dn_next_indblkshift[txgoff] = 0;
+		dnp->dn_indblkshift = dnd->dnd_next_indblkshift[txgoff];
+		dnd->dnd_next_indblkshift[txgoff] = 0;
 	}
 
 	/*
@@ -674,22 +690,22 @@ dnode_sync(dnode_t *dn, dmu_tx_t *tx)
 	mutex_exit(&dn->dn_mtx);
 
 	if (kill_spill) {
-		free_blocks(dn, &dn->dn_phys->dn_spill, 1, tx);
+		free_blocks(dn, DN_SPILL_BLKPTR(dn->dn_phys), 1, tx);
 		mutex_enter(&dn->dn_mtx);
 		dnp->dn_flags &= ~DNODE_FLAG_SPILL_BLKPTR;
 		mutex_exit(&dn->dn_mtx);
 	}
 
 	/* process all the "freed" ranges in the file */
-	if (dn->dn_free_ranges[txgoff] != NULL) {
+	if (dnd->dnd_free_ranges[txgoff] != NULL) {
 		dnode_sync_free_range_arg_t dsfra;
 		dsfra.dsfra_dnode = dn;
 		dsfra.dsfra_tx = tx;
 		mutex_enter(&dn->dn_mtx);
-		range_tree_vacate(dn->dn_free_ranges[txgoff],
+		range_tree_vacate(dnd->dnd_free_ranges[txgoff],
 		    dnode_sync_free_range, &dsfra);
-		range_tree_destroy(dn->dn_free_ranges[txgoff]);
-		dn->dn_free_ranges[txgoff] = NULL;
+		range_tree_destroy(dnd->dnd_free_ranges[txgoff]);
+		dnd->dnd_free_ranges[txgoff] = NULL;
 		mutex_exit(&dn->dn_mtx);
 	}
 
@@ -699,33 +715,33 @@ dnode_sync(dnode_t *dn, dmu_tx_t *tx)
 		return;
 	}
 
-	if (dn->dn_next_nlevels[txgoff]) {
+	if (dnd->dnd_next_nlevels[txgoff]) {
 		dnode_increase_indirection(dn, tx);
-		dn->dn_next_nlevels[txgoff] = 0;
+		dnd->dnd_next_nlevels[txgoff] = 0;
 	}
 
-	if (dn->dn_next_nblkptr[txgoff]) {
+	if (dnd->dnd_next_nblkptr[txgoff]) {
 		/* this should only happen on a realloc */
 		ASSERT(dn->dn_allocated_txg == tx->tx_txg);
-		if (dn->dn_next_nblkptr[txgoff] > dnp->dn_nblkptr) {
+		if (dnd->dnd_next_nblkptr[txgoff] > dnp->dn_nblkptr) {
 			/* zero the new blkptrs we are gaining */
 			bzero(dnp->dn_blkptr + dnp->dn_nblkptr,
 			    sizeof (blkptr_t) *
-			    (dn->dn_next_nblkptr[txgoff] - dnp->dn_nblkptr));
+			    (dnd->dnd_next_nblkptr[txgoff] - dnp->dn_nblkptr));
 #ifdef ZFS_DEBUG
 		} else {
 			int i;
-			ASSERT(dn->dn_next_nblkptr[txgoff] < dnp->dn_nblkptr);
+			ASSERT(dnd->dnd_next_nblkptr[txgoff] < dnp->dn_nblkptr);
 			/* the blkptrs we are losing better be unallocated */
 			for (i = 0; i < dnp->dn_nblkptr; i++) {
-				if (i >= dn->dn_next_nblkptr[txgoff])
+				if (i >= dnd->dnd_next_nblkptr[txgoff])
 					ASSERT(BP_IS_HOLE(&dnp->dn_blkptr[i]));
 			}
 #endif
 		}
 		mutex_enter(&dn->dn_mtx);
-		dnp->dn_nblkptr = dn->dn_next_nblkptr[txgoff];
-		dn->dn_next_nblkptr[txgoff] = 0;
+		dnp->dn_nblkptr = dnd->dnd_next_nblkptr[txgoff];
+		dnd->dnd_next_nblkptr[txgoff] = 0;
 		mutex_exit(&dn->dn_mtx);
 	}
 
@@ -733,7 +749,15 @@ dnode_sync(dnode_t *dn, dmu_tx_t *tx)
 
 	if (!DMU_OBJECT_IS_SPECIAL(dn->dn_object)) {
 		ASSERT3P(list_head(list), ==, NULL);
-		dnode_rele(dn, (void *)(uintptr_t)tx->tx_txg);
+		mutex_enter(&dn->dn_mtx);
+		/*
+		 * A dnode on os_synced_dnodes is still linked through this
+		 * txg's dn_dirty_link; userquota_updates_task() releases
+		 * its dirty state once it takes it off that list.
+		 */
+		if (!multilist_link_active(&dn->dn_dirty_link[txgoff]))
+			dnode_dirty_release(dn);
+		dnode_rele_and_unlock(dn, (void *)(uintptr_t)tx->tx_txg);
 	}
 
 	/*
@@ -90,6 +90,15 @@
  *
  * The delay is also calculated based on the amount of dirty data.  See the
  * comment above dmu_tx_delay() for details.
+ *
+ * Dirty space is also accounted per objset (os_dirty_pertxg[] and
+ * os_dirty_total, under dp_lock), and every objset with dirty data is kept
+ * on dp_dirty_objsets.  When zfs_dirty_data_fair is set, each of those
+ * active datasets is entitled to an equal share of the delay threshold.
+ * Once the pool is past the threshold, only datasets over their share are
+ * delayed; a dataset still within its share is let through, so a single
+ * bulk writer can not stall latency-sensitive writers on other datasets.
+ * The zfs_dirty_data_max hard limit still applies to everyone.
  */
 
 /*
@@ -114,6 +123,12 @@ uint64_t zfs_dirty_data_sync = 64 * 1024 * 1024;
  */
 int zfs_delay_min_dirty_percent = 60;
 
+/*
+ * Share the delay threshold fairly among the datasets with dirty data,
+ * rather than delaying every writer once the pool is over it.
+ */
+int zfs_dirty_data_fair = 1;
+
 /*
  * This controls how quickly the delay approaches infinity.
  * Larger values cause it to delay more for a given amount of dirty data.
@@ -169,6 +184,8 @@ dsl_pool_open_impl(spa_t *spa, uint64_t txg)
 	    offsetof(dsl_dir_t, dd_dirty_link));
 	txg_list_create(&dp->dp_sync_tasks,
 	    offsetof(dsl_sync_task_t, dst_node));
+	list_create(&dp->dp_dirty_objsets, sizeof (objset_t),
+	    offsetof(objset_t, os_dirty_node));
 
 	dp->dp_sync_taskq = taskq_create("dp_sync_taskq",
 	    zfs_sync_taskq_batch_pct, minclsyspri, 1, INT_MAX,
@@ -324,6 +341,8 @@ dsl_pool_close(dsl_pool_t *dp)
 	txg_list_destroy(&dp->dp_dirty_zilogs);
 	txg_list_destroy(&dp->dp_sync_tasks);
 	txg_list_destroy(&dp->dp_dirty_dirs);
+	ASSERT0(dp->dp_dirty_objsets_count);
+	list_destroy(&dp->dp_dirty_objsets);
 
 	taskq_destroy(dp->dp_sync_taskq);
 
@@ -477,6 +496,56 @@ dsl_pool_dirty_delta(dsl_pool_t *dp, int64_t delta)
 		cv_signal(&dp->dp_spaceavail_cv);
 }
 
+/*
+ * Only objsets belonging to a dataset are charged for dirty space; see
+ * dmu_objset_willuse_space().
+ */
+#define	DSL_POOL_OS_ACCOUNTED(os) \
+	((os) != NULL && (os)->os_dsl_dataset != NULL)
+
+static void
+dsl_pool_objset_dirty_delta(dsl_pool_t *dp, objset_t *os, uint64_t txg,
+    int64_t delta)
+{
+	ASSERT(MUTEX_HELD(&dp->dp_lock));
+
+	if (delta > 0 && os->os_dirty_total == 0) {
+		list_insert_tail(&dp->dp_dirty_objsets, os);
+		dp->dp_dirty_objsets_count++;
+	}
+	if (delta < 0)
+		ASSERT3U(-delta, <=, os->os_dirty_pertxg[txg & TXG_MASK]);
+
+	os->os_dirty_pertxg[txg & TXG_MASK] += delta;
+	os->os_dirty_total += delta;
+
+	if (delta < 0 && os->os_dirty_total == 0) {
+		list_remove(&dp->dp_dirty_objsets, os);
+		dp->dp_dirty_objsets_count--;
+	}
+}
+
+/*
+ * Drop whatever per-objset dirty space is left for this txg once all of its
+ * dirty data has been written; see the comment in dsl_pool_sync().
+ */
+static void
+dsl_pool_undirty_objsets(dsl_pool_t *dp, uint64_t txg)
+{
+	objset_t *os, *next;
+
+	mutex_enter(&dp->dp_lock);
+	for (os = list_head(&dp->dp_dirty_objsets); os != NULL; os = next) {
+		uint64_t space = os->os_dirty_pertxg[txg & TXG_MASK];
+
+		next = list_next(&dp->dp_dirty_objsets, os);
+		if (space != 0)
+			dsl_pool_objset_dirty_delta(dp, os, txg,
+			    -(int64_t)space);
+	}
+	mutex_exit(&dp->dp_lock);
+}
+
 void
 dsl_pool_sync(dsl_pool_t *dp, uint64_t txg)
 {
@@ -515,7 +584,9 @@ dsl_pool_sync(dsl_pool_t *dp, uint64_t txg)
 	 * rounding error in dbuf_write_physdone).
 	 * Shore up the accounting of any dirtied space now.
 	 */
-	dsl_pool_undirty_space(dp, dp->dp_dirty_pertxg[txg & TXG_MASK], txg);
+	dsl_pool_undirty_objsets(dp, txg);
+	dsl_pool_undirty_space(dp, NULL, dp->dp_dirty_pertxg[txg & TXG_MASK],
+	    txg);
 
 	/*
 	 * Update the long range free counter after
@@ -658,8 +729,46 @@ dsl_pool_adjustedsize(dsl_pool_t *dp, boolean_t netfree)
 	return (space - resv);
 }
 
+/*
+ * The portion of the delay threshold each dataset with dirty data is
+ * entitled to.  A dataset that has no dirty data yet counts itself in.
+ */
+uint64_t
+dsl_pool_dirty_share(dsl_pool_t *dp)
+{
+	uint64_t delay_min_bytes =
+	    zfs_dirty_data_max * zfs_delay_min_dirty_percent / 100;
+
+	return (delay_min_bytes / MAX(dp->dp_dirty_objsets_count, 1));
+}
+
+/*
+ * Returns B_TRUE if the fair throttle exempts this objset from the dirty
+ * data delay, i.e. other datasets also have dirty data and this one is
+ * below its share.  Called with dp_lock held.
+ */
 boolean_t
-dsl_pool_need_dirty_delay(dsl_pool_t *dp)
+dsl_pool_dirty_within_share(dsl_pool_t *dp, objset_t *os)
+{
+	uint64_t active;
+
+	ASSERT(MUTEX_HELD(&dp->dp_lock));
+
+	if (!zfs_dirty_data_fair || !DSL_POOL_OS_ACCOUNTED(os))
+		return (B_FALSE);
+
+	active = dp->dp_dirty_objsets_count;
+	if (os->os_dirty_total == 0)
+		active++;
+	if (active < 2)
+		return (B_FALSE);
+
+	return (os->os_dirty_total <
+	    zfs_dirty_data_max * zfs_delay_min_dirty_percent / 100 / active);
+}
+
+boolean_t
+dsl_pool_need_dirty_delay(dsl_pool_t *dp, objset_t *os)
 {
 	uint64_t delay_min_bytes =
 	    zfs_dirty_data_max * zfs_delay_min_dirty_percent / 100;
@@ -669,29 +778,45 @@ dsl_pool_need_dirty_delay(dsl_pool_t *dp)
 	if (dp->dp_dirty_total > zfs_dirty_data_sync)
 		txg_kick(dp);
 	rv = (dp->dp_dirty_total > delay_min_bytes);
+	if (rv && dp->dp_dirty_total < zfs_dirty_data_max &&
+	    dsl_pool_dirty_within_share(dp, os)) {
+		DMU_TX_STAT_BUMP(dmu_tx_dirty_fair);
+		OS_DIRTY_STAT_BUMP(os, ods_fair_passes);
+		rv = B_FALSE;
+	}
 	mutex_exit(&dp->dp_lock);
 	return (rv);
 }
 
 void
-dsl_pool_dirty_space(dsl_pool_t *dp, int64_t space, dmu_tx_t *tx)
+dsl_pool_dirty_space(dsl_pool_t *dp, objset_t *os, int64_t space,
+    dmu_tx_t *tx)
 {
 	if (space > 0) {
 		mutex_enter(&dp->dp_lock);
 		dp->dp_dirty_pertxg[tx->tx_txg & TXG_MASK] += space;
 		dsl_pool_dirty_delta(dp, space);
+		if (DSL_POOL_OS_ACCOUNTED(os))
+			dsl_pool_objset_dirty_delta(dp, os, tx->tx_txg, space);
 		mutex_exit(&dp->dp_lock);
 	}
 }
 
 void
-dsl_pool_undirty_space(dsl_pool_t *dp, int64_t space, uint64_t txg)
+dsl_pool_undirty_space(dsl_pool_t *dp, objset_t *os, int64_t space,
+    uint64_t txg)
 {
 	ASSERT3S(space, >=, 0);
 	if (space == 0)
 		return;
 
 	mutex_enter(&dp->dp_lock);
+	if (DSL_POOL_OS_ACCOUNTED(os)) {
+		int64_t os_space = MIN(space,
+		    os->os_dirty_pertxg[txg & TXG_MASK]);
+		if (os_space != 0)
+			dsl_pool_objset_dirty_delta(dp, os, txg, -os_space);
+	}
 	if (dp->dp_dirty_pertxg[txg & TXG_MASK] < space) {
 		/* XXX writing something we didn't dirty? */
 		space = dp->dp_dirty_pertxg[txg & TXG_MASK];
@@ -703,6 +828,23 @@ dsl_pool_undirty_space(dsl_pool_t *dp, int64_t space, uint64_t txg)
 	mutex_exit(&dp->dp_lock);
 }
 
+/*
+ * Forget any dirty space still charged to an objset that is being evicted.
+ * The pool-wide accounting is left to dsl_pool_sync().
+ */
+void
+dsl_pool_undirty_objset(dsl_pool_t *dp, objset_t *os)
+{
+	mutex_enter(&dp->dp_lock);
+	if (os->os_dirty_total != 0) {
+		list_remove(&dp->dp_dirty_objsets, os);
+		dp->dp_dirty_objsets_count--;
+		bzero(os->os_dirty_pertxg, sizeof (os->os_dirty_pertxg));
+		os->os_dirty_total = 0;
+	}
+	mutex_exit(&dp->dp_lock);
+}
+
 /* ARGSUSED */
 static int
 upgrade_clones_cb(dsl_pool_t *dp, dsl_dataset_t *hds, void *arg)
@@ -61,6 +61,11 @@ static scan_cb_t dsl_scan_scrub_cb;
 static void dsl_scan_cancel_sync(void *, dmu_tx_t *);
 static void dsl_scan_sync_state(dsl_scan_t *, dmu_tx_t *);
 static boolean_t dsl_scan_restarting(dsl_scan_t *, dmu_tx_t *);
+static void dsl_scan_exec_io(dsl_pool_t *, const blkptr_t *, int,
+    const zbookmark_phys_t *);
+static boolean_t dsl_scan_queues_pending(dsl_scan_t *);
+static void dsl_scan_issue(dsl_scan_t *);
+static void dsl_scan_queues_destroy(dsl_scan_t *);
 
 int zfs_top_maxinflight = 32;		/* maximum I/Os per top-level */
 int zfs_resilver_delay = 2;		/* number of ticks to delay resilver */
@@ -77,6 +82,37 @@ int dsl_scan_delay_completion = B_FALSE; /* set to delay scan completion */
 /* max number of blocks to free in a single TXG */
 uint64_t zfs_free_max_blocks = 100000;
 
+/*
+ * Sorted scrub and resilver.
+ *
+ * Reading each block as the traversal visits it means reading in logical
+ * (block tree) order, which on a fragmented pool is close to random.  In
+ * a sorted scan the traversal instead queues each block on the queue of
+ * the top-level vdev holding its first DVA, ordered by offset, and the
+ * queues are issued separately in offset order, so that the reads sweep
+ * across each device and adjacent reads are aggregated by the vdev queue
+ * into large sequential ones.
+ *
+ * The traversal stops to let the queues drain when they hold more than
+ * 1/zfs_scan_mem_lim_fact of physical memory, and at the end of each
+ * dataset, as moving on to the next one updates the on-disk work queue.
+ * Setting zfs_scan_legacy reads each block as it is visited instead; the
+ * change takes effect the next time the queues are empty.
+ */
+int zfs_scan_legacy = B_FALSE;
+int zfs_scan_mem_lim_fact = 20;
+
+typedef struct scan_io {
+	avl_node_t	sio_node;
+	blkptr_t	sio_bp;
+	zbookmark_phys_t sio_zb;
+	int		sio_flags;
+} scan_io_t;
+
+typedef struct dsl_scan_io_queue {
+	avl_tree_t	q_tree;		/* scan_io_t, by offset of DVA 0 */
+} dsl_scan_io_queue_t;
+
 #define	DSL_SCAN_IS_SCRUB_RESILVER(scn) \
 	((scn)->scn_phys.scn_func == POOL_SCAN_SCRUB || \
 	(scn)->scn_phys.scn_func == POOL_SCAN_RESILVER)
@@ -103,6 +139,8 @@ dsl_scan_init(dsl_pool_t *dp, uint64_t txg)
 
 	scn = dp->dp_scan = kmem_zalloc(sizeof (dsl_scan_t), KM_SLEEP);
 	scn->scn_dp = dp;
+	scn->scn_is_sorted = !zfs_scan_legacy;
+	mutex_init(&scn->scn_queue_lock, NULL, MUTEX_DEFAULT, NULL);
 
 	/*
 	 * It's possible that we're resuming a scan after a reboot so
@@ -193,6 +231,7 @@ dsl_scan_init(dsl_pool_t *dp, uint64_t txg)
 		}
 	}
 
+	scn->scn_ckpt_phys = scn->scn_phys;
 	spa_scan_stat_init(spa);
 	return (0);
 }
@@ -201,6 +240,8 @@ void
 dsl_scan_fini(dsl_pool_t *dp)
 {
 	if (dp->dp_scan) {
+		dsl_scan_queues_destroy(dp->dp_scan);
+		mutex_destroy(&dp->dp_scan->scn_queue_lock);
 		kmem_free(dp->dp_scan, sizeof (dsl_scan_t));
 		dp->dp_scan = NULL;
 	}
@@ -321,6 +362,10 @@ dsl_scan_done(dsl_scan_t *scn, boolean_t complete, dmu_tx_t *tx)
 		scn->scn_phys.scn_queue_obj = 0;
 	}
 
+	/* A completed scan has already issued everything it queued. */
+	ASSERT(!complete || !dsl_scan_queues_pending(scn));
+	dsl_scan_queues_destroy(scn);
+
 	scn->scn_phys.scn_flags &= ~DSF_SCRUB_PAUSED;
 
 	/*
@@ -524,24 +569,256 @@ dsl_scan_ds_maxtxg(dsl_dataset_t *ds)
 	return (smt);
 }
 
+/*
+ * While queued I/Os remain, the traversal position cannot be persisted,
+ * since a scan resumed from it after a reboot would skip the blocks they
+ * were for.  Write out the position as of the last time the queues were
+ * empty instead, along with the current values of everything else.
+ */
 static void
 dsl_scan_sync_state(dsl_scan_t *scn, dmu_tx_t *tx)
 {
+	dsl_scan_phys_t *ckpt = &scn->scn_ckpt_phys;
+	dsl_scan_phys_t phys = scn->scn_phys;
+
+	if (dsl_scan_queues_pending(scn)) {
+		phys.scn_cur_min_txg = ckpt->scn_cur_min_txg;
+		phys.scn_cur_max_txg = ckpt->scn_cur_max_txg;
+		phys.scn_examined = ckpt->scn_examined;
+		phys.scn_ddt_bookmark = ckpt->scn_ddt_bookmark;
+		phys.scn_bookmark = ckpt->scn_bookmark;
+		phys.scn_flags = (phys.scn_flags & ~DSF_VISIT_DS_AGAIN) |
+		    (ckpt->scn_flags & DSF_VISIT_DS_AGAIN);
+	} else {
+		*ckpt = scn->scn_phys;
+	}
+
 	VERIFY0(zap_update(scn->scn_dp->dp_meta_objset,
 	    DMU_POOL_DIRECTORY_OBJECT,
 	    DMU_POOL_SCAN, sizeof (uint64_t), SCAN_PHYS_NUMINTS,
-	    &scn->scn_phys, tx));
+	    &phys, tx));
+}
+
+static int
+scan_io_compare(const void *x1, const void *x2)
+{
+	const scan_io_t *s1 = x1;
+	const scan_io_t *s2 = x2;
+	uint64_t o1 = DVA_GET_OFFSET(&s1->sio_bp.blk_dva[0]);
+	uint64_t o2 = DVA_GET_OFFSET(&s2->sio_bp.blk_dva[0]);
+
+	if (o1 < o2)
+		return (-1);
+	if (o1 > o2)
+		return (1);
+	return (0);
+}
+
+static boolean_t
+dsl_scan_queues_pending(dsl_scan_t *scn)
+{
+	return (scn->scn_queued_ios != 0);
+}
+
+static boolean_t
+dsl_scan_queues_full(dsl_scan_t *scn)
+{
+	uint64_t limit = physmem * PAGESIZE / MAX(zfs_scan_mem_lim_fact, 1);
+
+	return (scn->scn_queued_ios * sizeof (scan_io_t) >= limit);
+}
+
+/*
+ * Return the queue for the given top-level vdev, creating it if asked to.
+ * Called with scn_queue_lock held.
+ */
+static dsl_scan_io_queue_t *
+dsl_scan_queue_lookup(dsl_scan_t *scn, uint64_t vdev, boolean_t create)
+{
+	dsl_scan_io_queue_t *q;
+
+	ASSERT(MUTEX_HELD(&scn->scn_queue_lock));
+
+	if (vdev >= scn->scn_nqueues) {
+		dsl_scan_io_queue_t **queues;
+		uint64_t n;
+
+		if (!create)
+			return (NULL);
+
+		n = MAX(vdev + 1, scn->scn_dp->dp_spa->spa_root_vdev->
+		    vdev_children);
+		queues = kmem_zalloc(n * sizeof (dsl_scan_io_queue_t *),
+		    KM_SLEEP);
+		if (scn->scn_queues != NULL) {
+			bcopy(scn->scn_queues, queues,
+			    scn->scn_nqueues * sizeof (dsl_scan_io_queue_t *));
+			kmem_free(scn->scn_queues,
+			    scn->scn_nqueues * sizeof (dsl_scan_io_queue_t *));
+		}
+		scn->scn_queues = queues;
+		scn->scn_nqueues = n;
+	}
+
+	q = scn->scn_queues[vdev];
+	if (q == NULL && create) {
+		q = kmem_alloc(sizeof (dsl_scan_io_queue_t), KM_SLEEP);
+		avl_create(&q->q_tree, scan_io_compare, sizeof (scan_io_t),
+		    offsetof(scan_io_t, sio_node));
+		scn->scn_queues[vdev] = q;
+	}
+	return (q);
+}
+
+/*
+ * Queue a scrub I/O on the top-level vdev of the block's first DVA.  A
+ * block already queued (visited again via the DDT, say) is not queued
+ * twice.
+ */
+static void
+dsl_scan_enqueue(dsl_scan_t *scn, const blkptr_t *bp, int zio_flags,
+    const zbookmark_phys_t *zb)
+{
+	scan_io_t *sio = kmem_alloc(sizeof (scan_io_t), KM_SLEEP);
+	dsl_scan_io_queue_t *q;
+	avl_index_t where;
+
+	sio->sio_bp = *bp;
+	sio->sio_zb = *zb;
+	sio->sio_flags = zio_flags;
+
+	mutex_enter(&scn->scn_queue_lock);
+	q = dsl_scan_queue_lookup(scn, DVA_GET_VDEV(&bp->blk_dva[0]), B_TRUE);
+	if (avl_find(&q->q_tree, sio, &where) != NULL) {
+		mutex_exit(&scn->scn_queue_lock);
+		kmem_free(sio, sizeof (scan_io_t));
+		return;
+	}
+	avl_insert(&q->q_tree, sio, where);
+	scn->scn_queued_ios++;
+	scn->scn_queued_bytes += BP_GET_ASIZE(bp);
+	mutex_exit(&scn->scn_queue_lock);
+}
+
+/*
+ * Remove and return the lowest-offset I/O queued on the given top-level
+ * vdev, if any.
+ */
+static scan_io_t *
+dsl_scan_dequeue(dsl_scan_t *scn, uint64_t vdev)
+{
+	dsl_scan_io_queue_t *q;
+	scan_io_t *sio = NULL;
+
+	mutex_enter(&scn->scn_queue_lock);
+	q = dsl_scan_queue_lookup(scn, vdev, B_FALSE);
+	if (q != NULL && (sio = avl_first(&q->q_tree)) != NULL) {
+		avl_remove(&q->q_tree, sio);
+		scn->scn_queued_ios--;
+		scn->scn_queued_bytes -= BP_GET_ASIZE(&sio->sio_bp);
+	}
+	mutex_exit(&scn->scn_queue_lock);
+
+	return (sio);
+}
+
+static void
+dsl_scan_queues_destroy(dsl_scan_t *scn)
+{
+	uint64_t v;
+
+	mutex_enter(&scn->scn_queue_lock);
+	for (v = 0; v < scn->scn_nqueues; v++) {
+		dsl_scan_io_queue_t *q = scn->scn_queues[v];
+		scan_io_t *sio;
+		void *cookie = NULL;
+
+		if (q == NULL)
+			continue;
+		while ((sio = avl_destroy_nodes(&q->q_tree, &cookie)) != NULL)
+			kmem_free(sio, sizeof (scan_io_t));
+		avl_destroy(&q->q_tree);
+		kmem_free(q, sizeof (dsl_scan_io_queue_t));
+	}
+	if (scn->scn_queues != NULL) {
+		kmem_free(scn->scn_queues,
+		    scn->scn_nqueues * sizeof (dsl_scan_io_queue_t *));
+	}
+	scn->scn_queues = NULL;
+	scn->scn_nqueues = 0;
+	scn->scn_queued_ios = 0;
+	scn->scn_queued_bytes = 0;
+	scn->scn_draining = B_FALSE;
+	mutex_exit(&scn->scn_queue_lock);
+}
+
+/*
+ * A block is being freed; if it is waiting in a scan queue, drop it, as
+ * its space may be reallocated before the queue gets to it.
+ */
+void
+dsl_scan_freed(spa_t *spa, const blkptr_t *bp)
+{
+	dsl_pool_t *dp = spa->spa_dsl_pool;
+	dsl_scan_t *scn;
+	dsl_scan_io_queue_t *q;
+	scan_io_t *sio, search;
+
+	if (dp == NULL || (scn = dp->dp_scan) == NULL ||
+	    scn->scn_phys.scn_state != DSS_SCANNING || BP_IS_EMBEDDED(bp))
+		return;
+
+	search.sio_bp = *bp;
+
+	mutex_enter(&scn->scn_queue_lock);
+	q = dsl_scan_queue_lookup(scn, DVA_GET_VDEV(&bp->blk_dva[0]), B_FALSE);
+	if (q != NULL && (sio = avl_find(&q->q_tree, &search, NULL)) != NULL &&
+	    DVA_EQUAL(&sio->sio_bp.blk_dva[0], &bp->blk_dva[0])) {
+		avl_remove(&q->q_tree, sio);
+		scn->scn_queued_ios--;
+		scn->scn_queued_bytes -= BP_GET_ASIZE(&sio->sio_bp);
+		kmem_free(sio, sizeof (scan_io_t));
+	}
+	mutex_exit(&scn->scn_queue_lock);
 }
 
 extern int zfs_vdev_async_write_active_min_dirty_percent;
 
+/*
+ * We yield if:
+ *  - we have scanned for the maximum time: an entire txg
+ *    timeout (default 5 sec)
+ *  or
+ *  - we have scanned for at least the minimum time (default 1 sec
+ *    for scrub, 3 sec for resilver), and either we have sufficient
+ *    dirty data that we are starting to write more quickly
+ *    (default 30%), or someone is explicitly waiting for this txg
+ *    to complete.
+ *  or
+ *  - the spa is shutting down because this pool is being exported
+ *    or the machine is rebooting.
+ */
 static boolean_t
-dsl_scan_check_suspend(dsl_scan_t *scn, const zbookmark_phys_t *zb)
+dsl_scan_should_yield(dsl_scan_t *scn)
 {
 	uint64_t elapsed_nanosecs;
 	int mintime;
 	int dirty_pct;
 
+	mintime = (scn->scn_phys.scn_func == POOL_SCAN_RESILVER) ?
+	    zfs_resilver_min_time_ms : zfs_scan_min_time_ms;
+	elapsed_nanosecs = gethrtime() - scn->scn_sync_start_time;
+	dirty_pct = scn->scn_dp->dp_dirty_total * 100 / zfs_dirty_data_max;
+	return (elapsed_nanosecs / NANOSEC >= zfs_txg_timeout ||
+	    (NSEC2MSEC(elapsed_nanosecs) > mintime &&
+	    (txg_sync_waiting(scn->scn_dp) ||
+	    dirty_pct >= zfs_vdev_async_write_active_min_dirty_percent)) ||
+	    spa_shutting_down(scn->scn_dp->dp_spa));
+}
+
+static boolean_t
+dsl_scan_check_suspend(dsl_scan_t *scn, const zbookmark_phys_t *zb)
+{
 	/* we never skip user/group accounting objects */
 	if (zb && (int64_t)zb->zb_object < 0)
 		return (B_FALSE);
@@ -557,28 +834,13 @@ dsl_scan_check_suspend(dsl_scan_t *scn, const zbookmark_phys_t *zb)
 		return (B_FALSE);
 
 	/*
-	 * We suspend if:
-	 *  - we have scanned for the maximum time: an entire txg
-	 *    timeout (default 5 sec)
-	 *  or
-	 *  - we have scanned for at least the minimum time (default 1 sec
-	 *    for scrub, 3 sec for resilver), and either we have sufficient
-	 *    dirty data that we are starting to write more quickly
-	 *    (default 30%), or someone is explicitly waiting for this txg
-	 *    to complete.
-	 *  or
-	 *  - the spa is shutting down because this pool is being exported
-	 *    or the machine is rebooting.
+	 * Also suspend, and issue what has been queued, once the sorted
+	 * scan's queues reach their memory limit.
 	 */
-	mintime = (scn->scn_phys.scn_func == POOL_SCAN_RESILVER) ?
-	    zfs_resilver_min_time_ms : zfs_scan_min_time_ms;
-	elapsed_nanosecs = gethrtime() - scn->scn_sync_start_time;
-	dirty_pct = scn->scn_dp->dp_dirty_total * 100 / zfs_dirty_data_max;
-	if (elapsed_nanosecs / NANOSEC >= zfs_txg_timeout ||
-	    (NSEC2MSEC(elapsed_nanosecs) > mintime &&
-	    (txg_sync_waiting(scn->scn_dp) ||
-	    dirty_pct >= zfs_vdev_async_write_active_min_dirty_percent)) ||
-	    spa_shutting_down(scn->scn_dp->dp_spa)) {
+	if (scn->scn_is_sorted && dsl_scan_queues_full(scn))
+		scn->scn_draining = B_TRUE;
+
+	if (scn->scn_draining || dsl_scan_should_yield(scn)) {
 		if (zb) {
 			dprintf("suspending at bookmark %llx/%llx/%llx/%llx\n",
 			    (longlong_t)zb->zb_objset,
@@ -811,14 +1073,18 @@ dsl_scan_recurse(dsl_scan_t *scn, dsl_dataset_t *ds, dmu_objset_type_t ostype,
 			scn->scn_phys.scn_errors++;
 			return (err);
 		}
-		for (i = 0, cdnp = buf->b_data; i < epb; i++, cdnp++) {
+		for (i = 0, cdnp = buf->b_data; i < epb;
+		    i += cdnp->dn_extra_slots + 1,
+		    cdnp += cdnp->dn_extra_slots + 1) {
 			for (j = 0; j < cdnp->dn_nblkptr; j++) {
 				blkptr_t *cbp = &cdnp->dn_blkptr[j];
 				dsl_scan_prefetch(scn, buf, cbp,
 				    zb->zb_objset, zb->zb_blkid * epb + i, j);
 			}
 		}
-		for (i = 0, cdnp = buf->b_data; i < epb; i++, cdnp++) {
+		for (i = 0, cdnp = buf->b_data; i < epb;
+		    i += cdnp->dn_extra_slots + 1,
+		    cdnp += cdnp->dn_extra_slots + 1) {
 			dsl_scan_visitdnode(scn, ds, ostype,
 			    cdnp, zb->zb_blkid * epb + i, tx);
 		}
@@ -881,7 +1147,7 @@ dsl_scan_visitdnode(dsl_scan_t *scn, dsl_dataset_t *ds,
 		zbookmark_phys_t czb;
 		SET_BOOKMARK(&czb, ds ? ds->ds_object : 0, object,
 		    0, DMU_SPILL_BLKID);
-		dsl_scan_visitbp(&dnp->dn_spill,
+		dsl_scan_visitbp(DN_SPILL_BLKPTR(dnp),
 		    &czb, dnp, ds, scn, ostype, tx);
 	}
 }
@@ -971,6 +1237,78 @@ dsl_scan_visit_rootbp(dsl_scan_t *scn, dsl_dataset_t *ds, blkptr_t *bp,
 	dprintf_ds(ds, "finished scan%s", "");
 }
 
+/*
+ * The bookmark adjustments below are made to the current traversal state
+ * and, while sorted scan I/Os are queued, to the checkpointed state which
+ * is what gets written to disk (see dsl_scan_sync_state()).
+ */
+static boolean_t
+scan_ds_destroyed_bookmark(dsl_scan_phys_t *phys, dsl_dataset_t *ds)
+{
+	if (phys->scn_bookmark.zb_objset != ds->ds_object)
+		return (B_FALSE);
+
+	if (ds->ds_is_snapshot) {
+		/*
+		 * Note:
+		 *  - scn_cur_{min,max}_txg stays the same.
+		 *  - Setting the flag is not really necessary if
+		 *    scn_cur_max_txg == scn_max_txg, because there
+		 *    is nothing after this snapshot that we care
+		 *    about.  However, we set it anyway and then
+		 *    ignore it when we retraverse it in
+		 *    dsl_scan_visitds().
+		 */
+		phys->scn_bookmark.zb_objset =
+		    dsl_dataset_phys(ds)->ds_next_snap_obj;
+		zfs_dbgmsg("destroying ds %llu; currently traversing; "
+		    "reset zb_objset to %llu",
+		    (u_longlong_t)ds->ds_object,
+		    (u_longlong_t)dsl_dataset_phys(ds)->ds_next_snap_obj);
+		phys->scn_flags |= DSF_VISIT_DS_AGAIN;
+	} else {
+		SET_BOOKMARK(&phys->scn_bookmark,
+		    ZB_DESTROYED_OBJSET, 0, 0, 0);
+		zfs_dbgmsg("destroying ds %llu; currently traversing; "
+		    "reset bookmark to -1,0,0,0",
+		    (u_longlong_t)ds->ds_object);
+	}
+	return (B_TRUE);
+}
+
+static boolean_t
+scan_ds_snapshotted_bookmark(dsl_scan_phys_t *phys, dsl_dataset_t *ds)
+{
+	if (phys->scn_bookmark.zb_objset != ds->ds_object)
+		return (B_FALSE);
+
+	phys->scn_bookmark.zb_objset = dsl_dataset_phys(ds)->ds_prev_snap_obj;
+	zfs_dbgmsg("snapshotting ds %llu; currently traversing; "
+	    "reset zb_objset to %llu",
+	    (u_longlong_t)ds->ds_object,
+	    (u_longlong_t)dsl_dataset_phys(ds)->ds_prev_snap_obj);
+	return (B_TRUE);
+}
+
+static void
+scan_ds_clone_swapped_bookmark(dsl_scan_phys_t *phys, dsl_dataset_t *ds1,
+    dsl_dataset_t *ds2)
+{
+	if (phys->scn_bookmark.zb_objset == ds1->ds_object) {
+		phys->scn_bookmark.zb_objset = ds2->ds_object;
+		zfs_dbgmsg("clone_swap ds %llu; currently traversing; "
+		    "reset zb_objset to %llu",
+		    (u_longlong_t)ds1->ds_object,
+		    (u_longlong_t)ds2->ds_object);
+	} else if (phys->scn_bookmark.zb_objset == ds2->ds_object) {
+		phys->scn_bookmark.zb_objset = ds1->ds_object;
+		zfs_dbgmsg("clone_swap ds %llu; currently traversing; "
+		    "reset zb_objset to %llu",
+		    (u_longlong_t)ds2->ds_object,
+		    (u_longlong_t)ds1->ds_object);
+	}
+}
+
 void
 dsl_scan_ds_destroyed(dsl_dataset_t *ds, dmu_tx_t *tx)
 {
@@ -981,34 +1319,11 @@ dsl_scan_ds_destroyed(dsl_dataset_t *ds, dmu_tx_t *tx)
 	if (scn->scn_phys.scn_state != DSS_SCANNING)
 		return;
 
-	if (scn->scn_phys.scn_bookmark.zb_objset == ds->ds_object) {
-		if (ds->ds_is_snapshot) {
-			/*
-			 * Note:
-			 *  - scn_cur_{min,max}_txg stays the same.
-			 *  - Setting the flag is not really necessary if
-			 *    scn_cur_max_txg == scn_max_txg, because there
-			 *    is nothing after this snapshot that we care
-			 *    about.  However, we set it anyway and then
-			 *    ignore it when we retraverse it in
-			 *    dsl_scan_visitds().
-			 */
-			scn->scn_phys.scn_bookmark.zb_objset =
-			    dsl_dataset_phys(ds)->ds_next_snap_obj;
-			zfs_dbgmsg("destroying ds %llu; currently traversing; "
-			    "reset zb_objset to %llu",
-			    (u_longlong_t)ds->ds_object,
-			    (u_longlong_t)dsl_dataset_phys(ds)->
-			    ds_next_snap_obj);
-			scn->scn_phys.scn_flags |= DSF_VISIT_DS_AGAIN;
-		} else {
-			SET_BOOKMARK(&scn->scn_phys.scn_bookmark,
-			    ZB_DESTROYED_OBJSET, 0, 0, 0);
-			zfs_dbgmsg("destroying ds %llu; currently traversing; "
-			    "reset bookmark to -1,0,0,0",
-			    (u_longlong_t)ds->ds_object);
-		}
-	} else if (zap_lookup_int_key(dp->dp_meta_objset,
+	if (dsl_scan_queues_pending(scn))
+		(void) scan_ds_destroyed_bookmark(&scn->scn_ckpt_phys, ds);
+
+	if (!scan_ds_destroyed_bookmark(&scn->scn_phys, ds) &&
+	    zap_lookup_int_key(dp->dp_meta_objset,
 	    scn->scn_phys.scn_queue_obj, ds->ds_object, &mintxg) == 0) {
 		ASSERT3U(dsl_dataset_phys(ds)->ds_num_children, <=, 1);
 		VERIFY3U(0, ==, zap_remove_int(dp->dp_meta_objset,
@@ -1053,14 +1368,11 @@ dsl_scan_ds_snapshotted(dsl_dataset_t *ds, dmu_tx_t *tx)
 
 	ASSERT(dsl_dataset_phys(ds)->ds_prev_snap_obj != 0);
 
-	if (scn->scn_phys.scn_bookmark.zb_objset == ds->ds_object) {
-		scn->scn_phys.scn_bookmark.zb_objset =
-		    dsl_dataset_phys(ds)->ds_prev_snap_obj;
-		zfs_dbgmsg("snapshotting ds %llu; currently traversing; "
-		    "reset zb_objset to %llu",
-		    (u_longlong_t)ds->ds_object,
-		    (u_longlong_t)dsl_dataset_phys(ds)->ds_prev_snap_obj);
-	} else if (zap_lookup_int_key(dp->dp_meta_objset,
+	if (dsl_scan_queues_pending(scn))
+		(void) scan_ds_snapshotted_bookmark(&scn->scn_ckpt_phys, ds);
+
+	if (!scan_ds_snapshotted_bookmark(&scn->scn_phys, ds) &&
+	    zap_lookup_int_key(dp->dp_meta_objset,
 	    scn->scn_phys.scn_queue_obj, ds->ds_object, &mintxg) == 0) {
 		VERIFY3U(0, ==, zap_remove_int(dp->dp_meta_objset,
 		    scn->scn_phys.scn_queue_obj, ds->ds_object, tx));
@@ -1085,19 +1397,9 @@ dsl_scan_ds_clone_swapped(dsl_dataset_t *ds1, dsl_dataset_t *ds2, dmu_tx_t *tx)
 	if (scn->scn_phys.scn_state != DSS_SCANNING)
 		return;
 
-	if (scn->scn_phys.scn_bookmark.zb_objset == ds1->ds_object) {
-		scn->scn_phys.scn_bookmark.zb_objset = ds2->ds_object;
-		zfs_dbgmsg("clone_swap ds %llu; currently traversing; "
-		    "reset zb_objset to %llu",
-		    (u_longlong_t)ds1->ds_object,
-		    (u_longlong_t)ds2->ds_object);
-	} else if (scn->scn_phys.scn_bookmark.zb_objset == ds2->ds_object) {
-		scn->scn_phys.scn_bookmark.zb_objset = ds1->ds_object;
-		zfs_dbgmsg("clone_swap ds %llu; currently traversing; "
-		    "reset zb_objset to %llu",
-		    (u_longlong_t)ds2->ds_object,
-		    (u_longlong_t)ds1->ds_object);
-	}
+	if (dsl_scan_queues_pending(scn))
+		scan_ds_clone_swapped_bookmark(&scn->scn_ckpt_phys, ds1, ds2);
+	scan_ds_clone_swapped_bookmark(&scn->scn_phys, ds1, ds2);
 
 	if (zap_lookup_int_key(dp->dp_meta_objset, scn->scn_phys.scn_queue_obj,
 	    ds1->ds_object, &mintxg) == 0) {
@@ -1137,6 +1439,23 @@ dsl_scan_ds_clone_swapped(dsl_dataset_t *ds1, dsl_dataset_t *ds2, dmu_tx_t *tx)
 	dsl_scan_sync_state(scn, tx);
 }
 
+/*
+ * Add a dataset to the work queue.  A sorted scan which resumes from its
+ * checkpoint (see dsl_scan_sync_state()) retraverses datasets whose
+ * successors were already queued before the reboot, so finding an entry
+ * already present is not an error.
+ */
+static void
+scan_ds_queue_insert(dsl_scan_t *scn, uint64_t dsobj, uint64_t txg,
+    dmu_tx_t *tx)
+{
+	int err;
+
+	err = zap_add_int_key(scn->scn_dp->dp_meta_objset,
+	    scn->scn_phys.scn_queue_obj, dsobj, txg, tx);
+	VERIFY(err == 0 || err == EEXIST);
+}
+
 struct enqueue_clones_arg {
 	dmu_tx_t *tx;
 	uint64_t originobj;
@@ -1168,9 +1487,8 @@ enqueue_clones_cb(dsl_pool_t *dp, dsl_dataset_t *hds, void *arg)
 			return (err);
 		ds = prev;
 	}
-	VERIFY(zap_add_int_key(dp->dp_meta_objset,
-	    scn->scn_phys.scn_queue_obj, ds->ds_object,
-	    dsl_dataset_phys(ds)->ds_prev_snap_txg, eca->tx) == 0);
+	scan_ds_queue_insert(scn, ds->ds_object,
+	    dsl_dataset_phys(ds)->ds_prev_snap_txg, eca->tx);
 	dsl_dataset_rele(ds, FTAG);
 	return (0);
 }
@@ -1268,9 +1586,8 @@ dsl_scan_visitds(dsl_scan_t *scn, uint64_t dsobj, dmu_tx_t *tx)
 	if (scn->scn_phys.scn_flags & DSF_VISIT_DS_AGAIN) {
 		zfs_dbgmsg("incomplete pass; visiting again");
 		scn->scn_phys.scn_flags &= ~DSF_VISIT_DS_AGAIN;
-		VERIFY(zap_add_int_key(dp->dp_meta_objset,
-		    scn->scn_phys.scn_queue_obj, ds->ds_object,
-		    scn->scn_phys.scn_cur_max_txg, tx) == 0);
+		scan_ds_queue_insert(scn, ds->ds_object,
+		    scn->scn_phys.scn_cur_max_txg, tx);
 		goto out;
 	}
 
@@ -1278,10 +1595,9 @@ dsl_scan_visitds(dsl_scan_t *scn, uint64_t dsobj, dmu_tx_t *tx)
 	 * Add descendent datasets to work queue.
 	 */
 	if (dsl_dataset_phys(ds)->ds_next_snap_obj != 0) {
-		VERIFY(zap_add_int_key(dp->dp_meta_objset,
-		    scn->scn_phys.scn_queue_obj,
+		scan_ds_queue_insert(scn,
 		    dsl_dataset_phys(ds)->ds_next_snap_obj,
-		    dsl_dataset_phys(ds)->ds_creation_txg, tx) == 0);
+		    dsl_dataset_phys(ds)->ds_creation_txg, tx);
 	}
 	if (dsl_dataset_phys(ds)->ds_num_children > 1) {
 		boolean_t usenext = B_FALSE;
@@ -1302,10 +1618,22 @@ dsl_scan_visitds(dsl_scan_t *scn, uint64_t dsobj, dmu_tx_t *tx)
 		}
 
 		if (usenext) {
-			VERIFY0(zap_join_key(dp->dp_meta_objset,
-			    dsl_dataset_phys(ds)->ds_next_clones_obj,
-			    scn->scn_phys.scn_queue_obj,
-			    dsl_dataset_phys(ds)->ds_creation_txg, tx));
+			zap_cursor_t *zc;
+			zap_attribute_t *za;
+
+			zc = kmem_alloc(sizeof (zap_cursor_t), KM_SLEEP);
+			za = kmem_alloc(sizeof (zap_attribute_t), KM_SLEEP);
+			for (zap_cursor_init(zc, dp->dp_meta_objset,
+			    dsl_dataset_phys(ds)->ds_next_clones_obj);
+			    zap_cursor_retrieve(zc, za) == 0;
+			    (void) zap_cursor_advance(zc)) {
+				scan_ds_queue_insert(scn,
+				    strtonum(za->za_name, NULL),
+				    dsl_dataset_phys(ds)->ds_creation_txg, tx);
+			}
+			zap_cursor_fini(zc);
+			kmem_free(za, sizeof (zap_attribute_t));
+			kmem_free(zc, sizeof (zap_cursor_t));
 		} else {
 			struct enqueue_clones_arg eca;
 			eca.tx = tx;
@@ -1354,8 +1682,8 @@ enqueue_cb(dsl_pool_t *dp, dsl_dataset_t *hds, void *arg)
 		ds = prev;
 	}
 
-	VERIFY(zap_add_int_key(dp->dp_meta_objset, scn->scn_phys.scn_queue_obj,
-	    ds->ds_object, dsl_dataset_phys(ds)->ds_prev_snap_txg, tx) == 0);
+	scan_ds_queue_insert(scn, ds->ds_object,
+	    dsl_dataset_phys(ds)->ds_prev_snap_txg, tx);
 	dsl_dataset_rele(ds, FTAG);
 	return (0);
 }
@@ -1522,6 +1850,17 @@ dsl_scan_visit(dsl_scan_t *scn, dmu_tx_t *tx)
 		dsl_dataset_t *ds;
 		uint64_t dsobj;
 
+		/*
+		 * Taking the next dataset off the work queue is persistent,
+		 * so the blocks queued from the last one must be issued
+		 * first.  Stop here, as though the last dataset had been
+		 * destroyed, until they have been.
+		 */
+		if (dsl_scan_queues_pending(scn)) {
+			zap_cursor_fini(zc);
+			goto drain;
+		}
+
 		dsobj = strtonum(za->za_name, NULL);
 		VERIFY3U(0, ==, zap_remove_int(dp->dp_meta_objset,
 		    scn->scn_phys.scn_queue_obj, dsobj, tx));
@@ -1546,6 +1885,14 @@ dsl_scan_visit(dsl_scan_t *scn, dmu_tx_t *tx)
 			goto out;
 	}
 	zap_cursor_fini(zc);
+
+	/* The traversal is not done until everything queued is issued. */
+	if (!dsl_scan_queues_pending(scn))
+		goto out;
+drain:
+	SET_BOOKMARK(&scn->scn_phys.scn_bookmark, ZB_DESTROYED_OBJSET, 0, 0, 0);
+	scn->scn_suspending = B_TRUE;
+	scn->scn_draining = B_TRUE;
 out:
 	kmem_free(za, sizeof (zap_attribute_t));
 	kmem_free(zc, sizeof (zap_cursor_t));
@@ -1810,17 +2157,42 @@ dsl_scan_sync(dsl_pool_t *dp, dmu_tx_t *tx)
 		    (longlong_t)scn->scn_phys.scn_bookmark.zb_blkid);
 	}
 
-	scn->scn_zio_root = zio_root(dp->dp_spa, NULL,
-	    NULL, ZIO_FLAG_CANFAIL);
-	dsl_pool_config_enter(dp, FTAG);
-	dsl_scan_visit(scn, tx);
-	dsl_pool_config_exit(dp, FTAG);
-	(void) zio_wait(scn->scn_zio_root);
-	scn->scn_zio_root = NULL;
+	/*
+	 * The sort mode can only change while nothing is queued.
+	 */
+	if (!dsl_scan_queues_pending(scn))
+		scn->scn_is_sorted = !zfs_scan_legacy;
+
+	if (scn->scn_draining) {
+		/*
+		 * Issue what the traversal queued.  It resumes in a later
+		 * txg, once the queues are empty.
+		 */
+		uint64_t queued = scn->scn_queued_ios;
+
+		dsl_scan_issue(scn);
+		scn->scn_suspending = B_TRUE;
 
-	zfs_dbgmsg("visited %llu blocks in %llums",
-	    (longlong_t)scn->scn_visited_this_txg,
-	    (longlong_t)NSEC2MSEC(gethrtime() - scn->scn_sync_start_time));
+		zfs_dbgmsg("issued %llu queued scan i/os in %llums; %llu left",
+		    (longlong_t)(queued - scn->scn_queued_ios),
+		    (longlong_t)NSEC2MSEC(gethrtime() -
+		    scn->scn_sync_start_time),
+		    (longlong_t)scn->scn_queued_ios);
+	} else {
+		scn->scn_zio_root = zio_root(dp->dp_spa, NULL,
+		    NULL, ZIO_FLAG_CANFAIL);
+		dsl_pool_config_enter(dp, FTAG);
+		dsl_scan_visit(scn, tx);
+		dsl_pool_config_exit(dp, FTAG);
+		(void) zio_wait(scn->scn_zio_root);
+		scn->scn_zio_root = NULL;
+
+		zfs_dbgmsg("visited %llu blocks in %llums; %llu queued",
+		    (longlong_t)scn->scn_visited_this_txg,
+		    (longlong_t)NSEC2MSEC(gethrtime() -
+		    scn->scn_sync_start_time),
+		    (longlong_t)scn->scn_queued_ios);
+	}
 
 	if (!scn->scn_suspending) {
 		scn->scn_done_txg = tx->tx_txg + 1;
@@ -1944,12 +2316,10 @@ dsl_scan_scrub_cb(dsl_pool_t *dp,
     const blkptr_t *bp, const zbookmark_phys_t *zb)
 {
 	dsl_scan_t *scn = dp->dp_scan;
-	size_t size = BP_GET_PSIZE(bp);
 	spa_t *spa = dp->dp_spa;
 	uint64_t phys_birth = BP_PHYSICAL_BIRTH(bp);
 	boolean_t needs_io = B_FALSE;
 	int zio_flags = ZIO_FLAG_SCAN_THREAD | ZIO_FLAG_RAW | ZIO_FLAG_CANFAIL;
-	int scan_delay = 0;
 	int d;
 
 	if (phys_birth <= scn->scn_phys.scn_min_txg ||
@@ -1965,12 +2335,10 @@ dsl_scan_scrub_cb(dsl_pool_t *dp,
 	if (scn->scn_phys.scn_func == POOL_SCAN_SCRUB) {
 		zio_flags |= ZIO_FLAG_SCRUB;
 		needs_io = B_TRUE;
-		scan_delay = zfs_scrub_delay;
 	} else {
 		ASSERT3U(scn->scn_phys.scn_func, ==, POOL_SCAN_RESILVER);
 		zio_flags |= ZIO_FLAG_RESILVER;
 		needs_io = B_FALSE;
-		scan_delay = zfs_resilver_delay;
 	}
 
 	/* If it's an intent log block, failure is expected. */
@@ -2008,31 +2376,87 @@ dsl_scan_scrub_cb(dsl_pool_t *dp,
 	}
 
 	if (needs_io && !zfs_no_scrub_io) {
-		vdev_t *rvd = spa->spa_root_vdev;
-		uint64_t maxinflight = rvd->vdev_children * zfs_top_maxinflight;
-
-		mutex_enter(&spa->spa_scrub_lock);
-		while (spa->spa_scrub_inflight >= maxinflight)
-			cv_wait(&spa->spa_scrub_io_cv, &spa->spa_scrub_lock);
-		spa->spa_scrub_inflight++;
-		mutex_exit(&spa->spa_scrub_lock);
-
 		/*
-		 * If we're seeing recent (zfs_scan_idle) "important" I/Os
-		 * then throttle our workload to limit the impact of a scan.
+		 * Once the traversal is complete (a DDT entry changing class
+		 * can still bring us here) there is nothing left to sort.
 		 */
-		if (ddi_get_lbolt64() - spa->spa_last_io <= zfs_scan_idle)
-			delay(scan_delay);
-
-		zio_nowait(zio_read(NULL, spa, bp,
-		    abd_alloc_for_io(size, B_FALSE), size, dsl_scan_scrub_done,
-		    NULL, ZIO_PRIORITY_SCRUB, zio_flags, zb));
+		if (scn->scn_is_sorted && scn->scn_done_txg == 0)
+			dsl_scan_enqueue(scn, bp, zio_flags, zb);
+		else
+			dsl_scan_exec_io(dp, bp, zio_flags, zb);
 	}
 
 	/* do not relocate this block */
 	return (0);
 }
 
+static void
+dsl_scan_exec_io(dsl_pool_t *dp, const blkptr_t *bp, int zio_flags,
+    const zbookmark_phys_t *zb)
+{
+	dsl_scan_t *scn = dp->dp_scan;
+	spa_t *spa = dp->dp_spa;
+	vdev_t *rvd = spa->spa_root_vdev;
+	uint64_t maxinflight = rvd->vdev_children * zfs_top_maxinflight;
+	size_t size = BP_GET_PSIZE(bp);
+	int scan_delay;
+
+	if (scn->scn_phys.scn_func == POOL_SCAN_SCRUB)
+		scan_delay = zfs_scrub_delay;
+	else
+		scan_delay = zfs_resilver_delay;
+
+	mutex_enter(&spa->spa_scrub_lock);
+	while (spa->spa_scrub_inflight >= maxinflight)
+		cv_wait(&spa->spa_scrub_io_cv, &spa->spa_scrub_lock);
+	spa->spa_scrub_inflight++;
+	mutex_exit(&spa->spa_scrub_lock);
+
+	/*
+	 * If we're seeing recent (zfs_scan_idle) "important" I/Os
+	 * then throttle our workload to limit the impact of a scan.
+	 */
+	if (ddi_get_lbolt64() - spa->spa_last_io <= zfs_scan_idle)
+		delay(scan_delay);
+
+	zio_nowait(zio_read(NULL, spa, bp,
+	    abd_alloc_for_io(size, B_FALSE), size, dsl_scan_scrub_done,
+	    NULL, ZIO_PRIORITY_SCRUB, zio_flags, zb));
+}
+
+/*
+ * Issue the sorted scan's queued I/Os until they run out or it is time to
+ * yield.  Each top-level vdev's queue is issued in offset order, up to
+ * zfs_top_maxinflight at a time before moving on to the next vdev, so
+ * that all devices are kept busy while each is read in a single sweep.
+ */
+static void
+dsl_scan_issue(dsl_scan_t *scn)
+{
+	boolean_t issued;
+	uint64_t v;
+	int i;
+
+	do {
+		issued = B_FALSE;
+		for (v = 0; v < scn->scn_nqueues; v++) {
+			for (i = 0; i < zfs_top_maxinflight; i++) {
+				scan_io_t *sio = dsl_scan_dequeue(scn, v);
+
+				if (sio == NULL)
+					break;
+				dsl_scan_exec_io(scn->scn_dp, &sio->sio_bp,
+				    sio->sio_flags, &sio->sio_zb);
+				kmem_free(sio, sizeof (scan_io_t));
+				issued = B_TRUE;
+			}
+		}
+	} while (issued && !dsl_scan_should_yield(scn));
+
+	if (!dsl_scan_queues_pending(scn))
+		scn->scn_draining = B_FALSE;
+}
+
 /*
  * Called by the ZFS_IOC_POOL_SCAN ioctl to start a scrub or resilver.
  * Can also be called to resume a paused scrub.
@@ -447,6 +447,39 @@ handle_sync_iokit(struct ldi_handle *lhp)
 	return (0);
 }
 
+int
+handle_unmap_iokit(struct ldi_handle *lhp, dkioc_free_t *dfl)
+{
+	IOStorageExtent extent;
+
+	/* Validate arguments */
+	if (!lhp || !dfl) {
+		return (EINVAL);
+	}
+
+#ifdef DEBUG
+	/* Validate IOMedia and client */
+	if (!OSDynamicCast(IOMedia, LH_MEDIA(lhp)) ||
+	    !OSDynamicCast(IOService, LH_CLIENT(lhp))) {
+		dprintf("%s invalid IOMedia or client\n", __func__);
+		return (ENODEV);
+	}
+#endif
+
+	extent.byteStart = dfl->df_start;
+	extent.byteCount = dfl->df_length;
+
+	/* Issue device unmap */
+	if (LH_MEDIA(lhp)->unmap(LH_CLIENT(lhp), &extent, 1, 0) !=
+	    kIOReturnSuccess) {
+		dprintf("%s %s\n", __func__, "IOMedia unmap failed");
+		return (ENOTSUP);
+	}
+
+	/* Success */
+	return (0);
+}
+
 static dev_t
 dev_from_media(IOMedia *media)
 {
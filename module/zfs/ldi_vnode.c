@@ -901,3 +901,58 @@ handle_is_solidstate_vnode(struct ldi_handle *lhp, int *isssd)
 
 	return (error);
 }
+
+int
+handle_unmap_vnode(struct ldi_handle *lhp, dkioc_free_t *dfl)
+{
+	vfs_context_t context;
+	dk_extent_t extent;
+	dk_unmap_t unmap;
+	int error;
+
+	if (!lhp || !dfl) {
+		dprintf("%s missing lhp or invalid extent\n", __func__);
+		return (EINVAL);
+	}
+
+	/* Validate vnode */
+	if (LH_VNODE(lhp) == NULLVP) {
+		dprintf("%s missing vnode\n", __func__);
+		return (ENODEV);
+	}
+
+	/* Allocate and validate context */
+	context = vfs_context_create(spl_vfs_context_kernel());
+	if (!context) {
+		dprintf("%s couldn't create VFS context\n", __func__);
+		return (ENOMEM);
+	}
+
+	/* Take an iocount on devvp vnode. */
+	error = vnode_getwithref(LH_VNODE(lhp));
+	if (error) {
+		dprintf("%s vnode_getwithref error %d\n",
+		    __func__, error);
+		vfs_context_rele(context);
+		return (ENODEV);
+	}
+	/* All code paths from here must vnode_put. */
+
+	bzero(&extent, sizeof (extent));
+	extent.offset = dfl->df_start;
+	extent.length = dfl->df_length;
+
+	bzero(&unmap, sizeof (unmap));
+	unmap.extents = &extent;
+	unmap.extentsCount = 1;
+
+	error = VNOP_IOCTL(LH_VNODE(lhp), DKIOCUNMAP,
+	    (caddr_t)&unmap, 0, context);
+
+	/* Release iocount on vnode (still has usecount) */
+	vnode_put(LH_VNODE(lhp));
+	/* Drop vfs_context */
+	vfs_context_rele(context);
+
+	return (error);
+}
@@ -30,6 +30,7 @@
 #include <sys/space_map.h>
 #include <sys/metaslab_impl.h>
 #include <sys/vdev_impl.h>
+#include <sys/vdev_log_spacemap.h>
 #include <sys/zio.h>
 #include <sys/spa_impl.h>
 #include <sys/zfeature.h>
@@ -143,7 +144,7 @@ int metaslab_load_pct = 50;
 int metaslab_unload_delay = TXG_SIZE * 2;
 
 /*
- * Max number of metaslabs per group to preload.
+ * Max number of metaslabs per group and allocator to preload.
  */
 int metaslab_preload_limit = SPA_DVAS_PER_BP;
 
@@ -200,6 +201,56 @@ static void metaslab_set_fragmentation(metaslab_t *);
 
 kmem_cache_t *metaslab_alloc_trace_cache;
 
+/*
+ * Contention and allocation statistics for the metaslab allocators,
+ * exported as the zfs/metaslab_alloc_stats kstat.  The fail_* counters
+ * are kept whether or not metaslab_trace_enabled is set and count the
+ * individual steps recorded by metaslab_trace_add(), so a single block
+ * allocation may bump several of them before it succeeds.
+ */
+typedef struct metaslab_alloc_stats {
+	kstat_named_t	mas_ms_lock_contended;
+	kstat_named_t	mas_mg_lock_contended;
+	kstat_named_t	mas_activation_races;
+	kstat_named_t	mas_shared_allocations;
+	kstat_named_t	mas_allocations;
+	kstat_named_t	mas_allocation_failures;
+	kstat_named_t	mas_gang_fallbacks;
+	kstat_named_t	mas_fail_metaslab;
+	kstat_named_t	mas_fail_too_small;
+	kstat_named_t	mas_fail_force_gang;
+	kstat_named_t	mas_fail_not_allocatable;
+	kstat_named_t	mas_fail_group;
+	kstat_named_t	mas_fail_enospc;
+	kstat_named_t	mas_fail_condensing;
+	kstat_named_t	mas_fail_vdev_error;
+	kstat_named_t	mas_fail_trimming;
+} metaslab_alloc_stats_t;
+
+static metaslab_alloc_stats_t metaslab_alloc_stats = {
+	{ "ms_lock_contended",		KSTAT_DATA_UINT64 },
+	{ "mg_lock_contended",		KSTAT_DATA_UINT64 },
+	{ "activation_races",		KSTAT_DATA_UINT64 },
+	{ "shared_allocations",		KSTAT_DATA_UINT64 },
+	{ "allocations",		KSTAT_DATA_UINT64 },
+	{ "allocation_failures",	KSTAT_DATA_UINT64 },
+	{ "gang_fallbacks",		KSTAT_DATA_UINT64 },
+	{ "fail_metaslab",		KSTAT_DATA_UINT64 },
+	{ "fail_too_small",		KSTAT_DATA_UINT64 },
+	{ "fail_force_gang",		KSTAT_DATA_UINT64 },
+	{ "fail_not_allocatable",	KSTAT_DATA_UINT64 },
+	{ "fail_group",			KSTAT_DATA_UINT64 },
+	{ "fail_enospc",		KSTAT_DATA_UINT64 },
+	{ "fail_condensing",		KSTAT_DATA_UINT64 },
+	{ "fail_vdev_error",		KSTAT_DATA_UINT64 },
+	{ "fail_trimming",		KSTAT_DATA_UINT64 }
+};
+
+#define	METASLAB_STAT_BUMP(stat)	\
+	atomic_inc_64(&metaslab_alloc_stats.stat.value.ui64)
+
+kstat_t *metaslab_alloc_ksp;
+
 /*
  * ==========================================================================
  * Metaslab classes
@@ -215,6 +266,9 @@ metaslab_class_create(spa_t *spa, metaslab_ops_t *ops)
 	mc->mc_spa = spa;
 	mc->mc_rotor = NULL;
 	mc->mc_ops = ops;
+	mc->mc_allocators = spa->spa_alloc_count;
+	mc->mc_allocator = kmem_zalloc(mc->mc_allocators *
+	    sizeof (metaslab_class_allocator_t), KM_SLEEP);
 	mutex_init(&mc->mc_lock, NULL, MUTEX_DEFAULT, NULL);
 	refcount_create_tracked(&mc->mc_alloc_slots);
 	mutex_init(&mc->mc_fastwrite_lock, NULL, MUTEX_DEFAULT, NULL);
@@ -234,6 +288,8 @@ metaslab_class_destroy(metaslab_class_t *mc)
 	refcount_destroy(&mc->mc_alloc_slots);
 	mutex_destroy(&mc->mc_lock);
 	mutex_destroy(&mc->mc_fastwrite_lock);
+	kmem_free(mc->mc_allocator, mc->mc_allocators *
+	    sizeof (metaslab_class_allocator_t));
 	kmem_free(mc, sizeof (metaslab_class_t));
 }
 
@@ -297,6 +353,12 @@ metaslab_class_get_dspace(metaslab_class_t *mc)
 	return (spa_deflate(mc->mc_spa) ? mc->mc_dspace : mc->mc_space);
 }
 
+uint64_t
+metaslab_class_get_groups(metaslab_class_t *mc)
+{
+	return (mc->mc_groups);
+}
+
 void
 metaslab_class_histogram_verify(metaslab_class_t *mc)
 {
@@ -310,6 +372,12 @@ metaslab_class_histogram_verify(metaslab_class_t *mc)
 	mc_hist = kmem_zalloc(sizeof (uint64_t) * RANGE_TREE_HISTOGRAM_SIZE,
 	    KM_SLEEP);
 
+	/*
+	 * The group histograms are only changed with mc_lock held, so the
+	 * class histogram is consistent with them even while other vdevs
+	 * are being synced.
+	 */
+	mutex_enter(&mc->mc_lock);
 	for (c = 0; c < rvd->vdev_children; c++) {
 		vdev_t *tvd = rvd->vdev_child[c];
 		metaslab_group_t *mg = tvd->vdev_mg;
@@ -329,6 +397,7 @@ metaslab_class_histogram_verify(metaslab_class_t *mc)
 
 	for (i = 0; i < RANGE_TREE_HISTOGRAM_SIZE; i++)
 		VERIFY3U(mc_hist[i], ==, mc->mc_histogram[i]);
+	mutex_exit(&mc->mc_lock);
 
 	kmem_free(mc_hist, sizeof (uint64_t) * RANGE_TREE_HISTOGRAM_SIZE);
 }
@@ -444,6 +513,42 @@ metaslab_compare(const void *x1, const void *x2)
 	return (0);
 }
 
+/*
+ * Returns the space allocated in the metaslab as of the last synced txg,
+ * including the changes that so far only exist in the vdev's log space
+ * maps.
+ */
+uint64_t
+metaslab_allocated_space(metaslab_t *msp)
+{
+	uint64_t space = space_map_allocated(msp->ms_sm);
+
+	if (msp->ms_unflushed_allocs != NULL) {
+		space += range_tree_space(msp->ms_unflushed_allocs);
+		space -= range_tree_space(msp->ms_unflushed_frees);
+	}
+	return (space);
+}
+
+/*
+ * Returns the change in allocated space that the syncing txg has written
+ * so far: to the metaslab's own space map, or to the log. A flush moves
+ * the unflushed changes into the space map, so they are not counted twice.
+ */
+static int64_t
+metaslab_syncing_alloc_delta(metaslab_t *msp, uint64_t txg)
+{
+	int64_t delta = space_map_alloc_delta(msp->ms_sm);
+
+	delta += (int64_t)range_tree_space(msp->ms_logged_allocs) -
+	    (int64_t)range_tree_space(msp->ms_logged_frees);
+	if (msp->ms_flushed_txg == txg) {
+		delta -= (int64_t)range_tree_space(msp->ms_unflushed_allocs) -
+		    (int64_t)range_tree_space(msp->ms_unflushed_frees);
+	}
+	return (delta);
+}
+
 /*
  * Verify that the space accounting on disk matches the in-core range_trees.
  */
@@ -470,8 +575,8 @@ metaslab_verify_space(metaslab_t *msp, uint64_t txg)
 	    !msp->ms_loaded)
 		return;
 
-	sm_free_space = msp->ms_size - space_map_allocated(msp->ms_sm) -
-	    space_map_alloc_delta(msp->ms_sm);
+	sm_free_space = msp->ms_size - metaslab_allocated_space(msp) -
+	    metaslab_syncing_alloc_delta(msp, txg);
 
 	/*
 	 * Account for future allocations since we would have already
@@ -588,6 +693,11 @@ metaslab_group_create(metaslab_class_t *mc, vdev_t *vd)
 	mg->mg_activation_count = 0;
 	mg->mg_initialized = B_FALSE;
 	mg->mg_no_free_space = B_TRUE;
+	mg->mg_allocators = mc->mc_allocators;
+	mg->mg_primaries = kmem_zalloc(mg->mg_allocators *
+	    sizeof (metaslab_t *), KM_SLEEP);
+	mg->mg_secondaries = kmem_zalloc(mg->mg_allocators *
+	    sizeof (metaslab_t *), KM_SLEEP);
 	refcount_create_tracked(&mg->mg_alloc_queue_depth);
 
 	mg->mg_taskq = taskq_create("metaslab_group_taskq", metaslab_load_pct,
@@ -612,6 +722,9 @@ metaslab_group_destroy(metaslab_group_t *mg)
 	avl_destroy(&mg->mg_metaslab_tree);
 	mutex_destroy(&mg->mg_lock);
 	refcount_destroy(&mg->mg_alloc_queue_depth);
+	kmem_free(mg->mg_primaries, mg->mg_allocators * sizeof (metaslab_t *));
+	kmem_free(mg->mg_secondaries, mg->mg_allocators *
+	    sizeof (metaslab_t *));
 	kmem_free(mg, sizeof (metaslab_group_t));
 }
 
@@ -620,6 +733,7 @@ metaslab_group_activate(metaslab_group_t *mg)
 {
 	metaslab_class_t *mc = mg->mg_class;
 	metaslab_group_t *mgprev, *mgnext;
+	int i;
 
 	ASSERT(spa_config_held(mc->mc_spa, SCL_ALLOC, RW_WRITER));
 
@@ -645,6 +759,11 @@ metaslab_group_activate(metaslab_group_t *mg)
 		mgnext->mg_prev = mg;
 	}
 	mc->mc_rotor = mg;
+
+	for (i = 0; i < mc->mc_allocators; i++) {
+		if (mc->mc_allocator[i].mca_rotor == NULL)
+			mc->mc_allocator[i].mca_rotor = mg;
+	}
 }
 
 void
@@ -652,6 +771,7 @@ metaslab_group_passivate(metaslab_group_t *mg)
 {
 	metaslab_class_t *mc = mg->mg_class;
 	metaslab_group_t *mgprev, *mgnext;
+	int i;
 
 	ASSERT(spa_config_held(mc->mc_spa, SCL_ALLOC, RW_WRITER));
 
@@ -677,6 +797,11 @@ metaslab_group_passivate(metaslab_group_t *mg)
 		mgnext->mg_prev = mgprev;
 	}
 
+	for (i = 0; i < mc->mc_allocators; i++) {
+		if (mc->mc_allocator[i].mca_rotor == mg)
+			mc->mc_allocator[i].mca_rotor = mc->mc_rotor;
+	}
+
 	mg->mg_prev = NULL;
 	mg->mg_next = NULL;
 }
@@ -742,12 +867,14 @@ metaslab_group_histogram_add(metaslab_group_t *mg, metaslab_t *msp)
 		return;
 
 	mutex_enter(&mg->mg_lock);
+	mutex_enter(&mc->mc_lock);
 	for (i = 0; i < SPACE_MAP_HISTOGRAM_SIZE; i++) {
 		mg->mg_histogram[i + ashift] +=
 		    msp->ms_sm->sm_phys->smp_histogram[i];
 		mc->mc_histogram[i + ashift] +=
 		    msp->ms_sm->sm_phys->smp_histogram[i];
 	}
+	mutex_exit(&mc->mc_lock);
 	mutex_exit(&mg->mg_lock);
 }
 
@@ -763,6 +890,7 @@ metaslab_group_histogram_remove(metaslab_group_t *mg, metaslab_t *msp)
 		return;
 
 	mutex_enter(&mg->mg_lock);
+	mutex_enter(&mc->mc_lock);
 	for (i = 0; i < SPACE_MAP_HISTOGRAM_SIZE; i++) {
 		ASSERT3U(mg->mg_histogram[i + ashift], >=,
 		    msp->ms_sm->sm_phys->smp_histogram[i]);
@@ -774,9 +902,32 @@ metaslab_group_histogram_remove(metaslab_group_t *mg, metaslab_t *msp)
 		mc->mc_histogram[i + ashift] -=
 		    msp->ms_sm->sm_phys->smp_histogram[i];
 	}
+	mutex_exit(&mc->mc_lock);
 	mutex_exit(&mg->mg_lock);
 }
 
+/*
+ * Release the allocator slot held by an active metaslab, if any.
+ */
+static void
+metaslab_group_release_allocator(metaslab_group_t *mg, metaslab_t *msp)
+{
+	ASSERT(MUTEX_HELD(&mg->mg_lock));
+
+	if (msp->ms_allocator == -1)
+		return;
+
+	ASSERT3S(msp->ms_allocator, <, mg->mg_allocators);
+	if (msp->ms_primary) {
+		ASSERT3P(mg->mg_primaries[msp->ms_allocator], ==, msp);
+		mg->mg_primaries[msp->ms_allocator] = NULL;
+	} else {
+		ASSERT3P(mg->mg_secondaries[msp->ms_allocator], ==, msp);
+		mg->mg_secondaries[msp->ms_allocator] = NULL;
+	}
+	msp->ms_allocator = -1;
+}
+
 static void
 metaslab_group_add(metaslab_group_t *mg, metaslab_t *msp)
 {
@@ -801,13 +952,15 @@ metaslab_group_remove(metaslab_group_t *mg, metaslab_t *msp)
 
 	mutex_enter(&mg->mg_lock);
 	ASSERT(msp->ms_group == mg);
+	metaslab_group_release_allocator(mg, msp);
 	avl_remove(&mg->mg_metaslab_tree, msp);
 	msp->ms_group = NULL;
 	mutex_exit(&mg->mg_lock);
 }
 
 static void
-metaslab_group_sort(metaslab_group_t *mg, metaslab_t *msp, uint64_t weight)
+metaslab_group_sort_impl(metaslab_group_t *mg, metaslab_t *msp,
+    uint64_t weight)
 {
 	/*
 	 * Although in principle the weight can be any value, in
@@ -815,12 +968,21 @@ metaslab_group_sort(metaslab_group_t *mg, metaslab_t *msp, uint64_t weight)
 	 */
 	ASSERT(weight >= SPA_MINBLOCKSIZE || weight == 0);
 	ASSERT(MUTEX_HELD(&msp->ms_lock));
-
-	mutex_enter(&mg->mg_lock);
+	ASSERT(MUTEX_HELD(&mg->mg_lock));
 	ASSERT(msp->ms_group == mg);
+
 	avl_remove(&mg->mg_metaslab_tree, msp);
 	msp->ms_weight = weight;
 	avl_add(&mg->mg_metaslab_tree, msp);
+	if ((weight & METASLAB_ACTIVE_MASK) == 0)
+		metaslab_group_release_allocator(mg, msp);
+}
+
+static void
+metaslab_group_sort(metaslab_group_t *mg, metaslab_t *msp, uint64_t weight)
+{
+	mutex_enter(&mg->mg_lock);
+	metaslab_group_sort_impl(mg, msp, weight);
 	mutex_exit(&mg->mg_lock);
 }
 
@@ -876,11 +1038,12 @@ metaslab_group_allocatable(metaslab_group_t *mg, metaslab_group_t *rotor,
 
 	/*
 	 * We can only consider skipping this metaslab group if it's
-	 * in the normal metaslab class and there are other metaslab
-	 * groups to select from. Otherwise, we always consider it eligible
-	 * for allocations.
+	 * in the normal, special or dedup metaslab class and there are
+	 * other metaslab groups to select from. Otherwise, we always
+	 * consider it eligible for allocations.
 	 */
-	if (mc != spa_normal_class(spa) || mc->mc_groups <= 1)
+	if ((mc != spa_normal_class(spa) && mc != spa_special_class(spa) &&
+	    mc != spa_dedup_class(spa)) || mc->mc_groups <= 1)
 		return (B_TRUE);
 
 	/*
@@ -999,8 +1162,8 @@ metaslab_rt_create(range_tree_t *rt, void *arg)
 	ASSERT3P(rt->rt_arg, ==, msp);
 	ASSERT(msp->ms_tree == NULL);
 
-	avl_create(&msp->ms_size_tree, metaslab_rangesize_compare,
-	    sizeof (range_seg_t), offsetof(range_seg_t, rs_pp_node));
+	zfs_btree_create(&msp->ms_size_tree, metaslab_rangesize_compare,
+	    sizeof (range_seg_t));
 }
 
 /*
@@ -1013,9 +1176,9 @@ metaslab_rt_destroy(range_tree_t *rt, void *arg)
 
 	ASSERT3P(rt->rt_arg, ==, msp);
 	ASSERT3P(msp->ms_tree, ==, rt);
-	ASSERT0(avl_numnodes(&msp->ms_size_tree));
+	ASSERT0(zfs_btree_numnodes(&msp->ms_size_tree));
 
-	avl_destroy(&msp->ms_size_tree);
+	zfs_btree_destroy(&msp->ms_size_tree);
 }
 
 static void
@@ -1026,7 +1189,7 @@ metaslab_rt_add(range_tree_t *rt, range_seg_t *rs, void *arg)
 	ASSERT3P(rt->rt_arg, ==, msp);
 	ASSERT3P(msp->ms_tree, ==, rt);
 	VERIFY(!msp->ms_condensing);
-	avl_add(&msp->ms_size_tree, rs);
+	zfs_btree_add(&msp->ms_size_tree, rs);
 }
 
 static void
@@ -1037,7 +1200,7 @@ metaslab_rt_remove(range_tree_t *rt, range_seg_t *rs, void *arg)
 	ASSERT3P(rt->rt_arg, ==, msp);
 	ASSERT3P(msp->ms_tree, ==, rt);
 	VERIFY(!msp->ms_condensing);
-	avl_remove(&msp->ms_size_tree, rs);
+	zfs_btree_remove(&msp->ms_size_tree, rs);
 }
 
 static void
@@ -1048,14 +1211,7 @@ metaslab_rt_vacate(range_tree_t *rt, void *arg)
 	ASSERT3P(rt->rt_arg, ==, msp);
 	ASSERT3P(msp->ms_tree, ==, rt);
 
-	/*
-	 * Normally one would walk the tree freeing nodes along the way.
-	 * Since the nodes are shared with the range trees we can avoid
-	 * walking all nodes and just reinitialize the avl tree. The nodes
-	 * will be freed by the range tree, so we don't want to free them here.
-	 */
-	avl_create(&msp->ms_size_tree, metaslab_rangesize_compare,
-	    sizeof (range_seg_t), offsetof(range_seg_t, rs_pp_node));
+	zfs_btree_clear(&msp->ms_size_tree);
 }
 
 static range_tree_ops_t metaslab_rt_ops = {
@@ -1078,27 +1234,26 @@ static range_tree_ops_t metaslab_rt_ops = {
 uint64_t
 metaslab_block_maxsize(metaslab_t *msp)
 {
-	avl_tree_t *t = &msp->ms_size_tree;
 	range_seg_t *rs;
 
-	if (t == NULL || (rs = avl_last(t)) == NULL)
+	if ((rs = zfs_btree_last(&msp->ms_size_tree, NULL)) == NULL)
 		return (0ULL);
 
 	return (rs->rs_end - rs->rs_start);
 }
 
 static range_seg_t *
-metaslab_block_find(avl_tree_t *t, uint64_t start, uint64_t size)
+metaslab_block_find(zfs_btree_t *t, uint64_t start, uint64_t size,
+    zfs_btree_index_t *where)
 {
 	range_seg_t *rs, rsearch;
-	avl_index_t where;
 
 	rsearch.rs_start = start;
 	rsearch.rs_end = start + size;
 
-	rs = avl_find(t, &rsearch, &where);
+	rs = zfs_btree_find(t, &rsearch, where);
 	if (rs == NULL) {
-		rs = avl_nearest(t, where, AVL_AFTER);
+		rs = zfs_btree_next(t, where, where);
 	}
 	return (rs);
 }
@@ -1108,14 +1263,15 @@ metaslab_block_find(avl_tree_t *t, uint64_t start, uint64_t size)
     defined(WITH_CF_BLOCK_ALLOCATOR)
 /*
  * This is a helper function that can be used by the allocator to find
- * a suitable block to allocate. This will search the specified AVL
- * tree looking for a block that matches the specified criteria.
+ * a suitable block to allocate. This will search the specified B-tree
+ * looking for a block that matches the specified criteria.
  */
 static uint64_t
-metaslab_block_picker(avl_tree_t *t, uint64_t *cursor, uint64_t size,
+metaslab_block_picker(zfs_btree_t *t, uint64_t *cursor, uint64_t size,
     uint64_t align)
 {
-	range_seg_t *rs = metaslab_block_find(t, *cursor, size);
+	zfs_btree_index_t where;
+	range_seg_t *rs = metaslab_block_find(t, *cursor, size, &where);
 
 	while (rs != NULL) {
 		uint64_t offset = P2ROUNDUP(rs->rs_start, align);
@@ -1124,7 +1280,7 @@ metaslab_block_picker(avl_tree_t *t, uint64_t *cursor, uint64_t size,
 			*cursor = offset + size;
 			return (offset);
 		}
-		rs = AVL_NEXT(t, rs);
+		rs = zfs_btree_next(t, &where, &where);
 	}
 
 	/*
@@ -1157,7 +1313,7 @@ metaslab_ff_alloc(metaslab_t *msp, uint64_t size)
 	 */
 	uint64_t align = size & -size;
 	uint64_t *cursor = &msp->ms_lbas[highbit64(align) - 1];
-	avl_tree_t *t = &msp->ms_tree->rt_root;
+	zfs_btree_t *t = &msp->ms_tree->rt_root;
 
 	return (metaslab_block_picker(t, cursor, size, align));
 }
@@ -1191,19 +1347,20 @@ metaslab_df_alloc(metaslab_t *msp, uint64_t size)
 	uint64_t align = size & -size;
 	uint64_t *cursor = &msp->ms_lbas[highbit64(align) - 1];
 	range_tree_t *rt = msp->ms_tree;
-	avl_tree_t *t = &rt->rt_root;
+	zfs_btree_t *t = &rt->rt_root;
 	uint64_t max_size = metaslab_block_maxsize(msp);
 	int free_pct = range_tree_space(rt) * 100 / msp->ms_size;
 
 	ASSERT(MUTEX_HELD(&msp->ms_lock));
-	ASSERT3U(avl_numnodes(t), ==, avl_numnodes(&msp->ms_size_tree));
+	ASSERT3U(zfs_btree_numnodes(t), ==,
+	    zfs_btree_numnodes(&msp->ms_size_tree));
 
 	if (max_size < size)
 		return (-1ULL);
 
 	/*
 	 * If we're running low on space switch to using the size
-	 * sorted AVL tree (best-fit).
+	 * sorted tree (best-fit).
 	 */
 	if (max_size < metaslab_df_alloc_threshold ||
 	    free_pct < metaslab_df_free_pct) {
@@ -1235,20 +1392,20 @@ static uint64_t
 metaslab_cf_alloc(metaslab_t *msp, uint64_t size)
 {
 	range_tree_t *rt = msp->ms_tree;
-	avl_tree_t *t = &msp->ms_size_tree;
+	zfs_btree_t *t = &msp->ms_size_tree;
 	uint64_t *cursor = &msp->ms_lbas[0];
 	uint64_t *cursor_end = &msp->ms_lbas[1];
 	uint64_t offset = 0;
 
 	ASSERT(MUTEX_HELD(&msp->ms_lock));
-	ASSERT3U(avl_numnodes(t), ==, avl_numnodes(&rt->rt_root));
+	ASSERT3U(zfs_btree_numnodes(t), ==, range_tree_numsegs(rt));
 
 	ASSERT3U(*cursor_end, >=, *cursor);
 
 	if ((*cursor + size) > *cursor_end) {
 		range_seg_t *rs;
 
-		rs = avl_last(&msp->ms_size_tree);
+		rs = zfs_btree_last(t, NULL);
 		if (rs == NULL || (rs->rs_end - rs->rs_start) < size)
 			return (-1ULL);
 
@@ -1288,15 +1445,16 @@ uint64_t metaslab_ndf_clump_shift = 4;
 static uint64_t
 metaslab_ndf_alloc(metaslab_t *msp, uint64_t size)
 {
-	avl_tree_t *t = &msp->ms_tree->rt_root;
-	avl_index_t where;
+	zfs_btree_t *t = &msp->ms_tree->rt_root;
+	zfs_btree_index_t where;
 	range_seg_t *rs, rsearch;
 	uint64_t hbit = highbit64(size);
 	uint64_t *cursor = &msp->ms_lbas[hbit - 1];
 	uint64_t max_size = metaslab_block_maxsize(msp);
 
 	ASSERT(MUTEX_HELD(&msp->ms_lock));
-	ASSERT3U(avl_numnodes(t), ==, avl_numnodes(&msp->ms_size_tree));
+	ASSERT3U(zfs_btree_numnodes(t), ==,
+	    zfs_btree_numnodes(&msp->ms_size_tree));
 
 	if (max_size < size)
 		return (-1ULL);
@@ -1304,16 +1462,16 @@ metaslab_ndf_alloc(metaslab_t *msp, uint64_t size)
 	rsearch.rs_start = *cursor;
 	rsearch.rs_end = *cursor + size;
 
-	rs = avl_find(t, &rsearch, &where);
+	rs = zfs_btree_find(t, &rsearch, &where);
 	if (rs == NULL || (rs->rs_end - rs->rs_start) < size) {
 		t = &msp->ms_size_tree;
 
 		rsearch.rs_start = 0;
 		rsearch.rs_end = MIN(max_size,
 		    1ULL << (hbit + metaslab_ndf_clump_shift));
-		rs = avl_find(t, &rsearch, &where);
+		rs = zfs_btree_find(t, &rsearch, &where);
 		if (rs == NULL)
-			rs = avl_nearest(t, where, AVL_AFTER);
+			rs = zfs_btree_next(t, &where, &where);
 		ASSERT(rs != NULL);
 	}
 
@@ -1382,6 +1540,15 @@ metaslab_load(metaslab_t *msp)
 		ASSERT3P(msp->ms_group, !=, NULL);
 		msp->ms_loaded = B_TRUE;
 
+		/*
+		 * Apply the changes that have been logged but not yet
+		 * flushed to the space map.
+		 */
+		range_tree_walk(msp->ms_unflushed_allocs,
+		    range_tree_remove, msp->ms_tree);
+		range_tree_walk(msp->ms_unflushed_frees,
+		    range_tree_add, msp->ms_tree);
+
 		for (t = 0; t < TXG_DEFER_SIZE; t++) {
 			range_tree_walk(msp->ms_defertree[t],
 			    range_tree_remove, msp->ms_tree);
@@ -1398,8 +1565,20 @@ metaslab_unload(metaslab_t *msp)
 	ASSERT(MUTEX_HELD(&msp->ms_lock));
 	range_tree_vacate(msp->ms_tree, NULL, NULL);
 	msp->ms_loaded = B_FALSE;
-	msp->ms_weight &= ~METASLAB_ACTIVE_MASK;
 	msp->ms_max_size = 0;
+
+	/*
+	 * An unloaded metaslab can't stay active, so it also gives up
+	 * its allocator slot.
+	 */
+	if (msp->ms_group != NULL) {
+		mutex_enter(&msp->ms_group->mg_lock);
+		msp->ms_weight &= ~METASLAB_ACTIVE_MASK;
+		metaslab_group_release_allocator(msp->ms_group, msp);
+		mutex_exit(&msp->ms_group->mg_lock);
+	} else {
+		msp->ms_weight &= ~METASLAB_ACTIVE_MASK;
+	}
 }
 
 int
@@ -1414,9 +1593,11 @@ metaslab_init(metaslab_group_t *mg, uint64_t id, uint64_t object, uint64_t txg,
 	ms = kmem_zalloc(sizeof (metaslab_t), KM_SLEEP);
 	mutex_init(&ms->ms_lock, NULL, MUTEX_DEFAULT, NULL);
 	cv_init(&ms->ms_load_cv, NULL, CV_DEFAULT, NULL);
+	cv_init(&ms->ms_trim_cv, NULL, CV_DEFAULT, NULL);
 	ms->ms_id = id;
 	ms->ms_start = id << vd->vdev_ms_shift;
 	ms->ms_size = 1ULL << vd->vdev_ms_shift;
+	ms->ms_allocator = -1;
 
 	/*
 	 * We only open space map objects that already exist. All others
@@ -1442,6 +1623,7 @@ metaslab_init(metaslab_group_t *mg, uint64_t id, uint64_t object, uint64_t txg,
 	 * data fault on any attempt to use this metaslab before it's ready.
 	 */
 	ms->ms_tree = range_tree_create(&metaslab_rt_ops, ms, &ms->ms_lock);
+	ms->ms_trimtree = range_tree_create(NULL, ms, &ms->ms_lock);
 	metaslab_group_add(mg, ms);
 
 	metaslab_set_fragmentation(ms);
@@ -1490,15 +1672,25 @@ metaslab_fini(metaslab_t *msp)
 
 	mutex_enter(&msp->ms_lock);
 	VERIFY(msp->ms_group == NULL);
-	vdev_space_update(mg->mg_vd, -space_map_allocated(msp->ms_sm),
+	vdev_space_update(mg->mg_vd, -metaslab_allocated_space(msp),
 	    0, -msp->ms_size);
 	space_map_close(msp->ms_sm);
 
 	metaslab_unload(msp);
 	range_tree_destroy(msp->ms_tree);
+	ASSERT(!msp->ms_trimming);
+	range_tree_vacate(msp->ms_trimtree, NULL, NULL);
+	range_tree_destroy(msp->ms_trimtree);
 	range_tree_destroy(msp->ms_freeingtree);
 	range_tree_destroy(msp->ms_freedtree);
 
+	range_tree_vacate(msp->ms_unflushed_allocs, NULL, NULL);
+	range_tree_destroy(msp->ms_unflushed_allocs);
+	range_tree_vacate(msp->ms_unflushed_frees, NULL, NULL);
+	range_tree_destroy(msp->ms_unflushed_frees);
+	range_tree_destroy(msp->ms_logged_allocs);
+	range_tree_destroy(msp->ms_logged_frees);
+
 	for (t = 0; t < TXG_SIZE; t++) {
 		range_tree_destroy(msp->ms_alloctree[t]);
 	}
@@ -1510,6 +1702,7 @@ metaslab_fini(metaslab_t *msp)
 	ASSERT0(msp->ms_deferspace);
 
 	mutex_exit(&msp->ms_lock);
+	cv_destroy(&msp->ms_trim_cv);
 	cv_destroy(&msp->ms_load_cv);
 	mutex_destroy(&msp->ms_lock);
 
@@ -1654,7 +1847,7 @@ metaslab_space_weight(metaslab_t *msp)
 	/*
 	 * The baseline weight is the metaslab's free space.
 	 */
-	space = msp->ms_size - space_map_allocated(msp->ms_sm);
+	space = msp->ms_size - metaslab_allocated_space(msp);
 
 	if (metaslab_fragmentation_factor_enabled &&
 	    msp->ms_fragmentation != ZFS_FRAG_INVALID) {
@@ -1790,7 +1983,7 @@ metaslab_segment_weight(metaslab_t *msp)
 	/*
 	 * The metaslab is completely free.
 	 */
-	if (space_map_allocated(msp->ms_sm) == 0) {
+	if (metaslab_allocated_space(msp) == 0) {
 		int idx = highbit64(msp->ms_size) - 1;
 		int max_idx = SPACE_MAP_HISTOGRAM_SIZE + shift - 1;
 
@@ -1812,7 +2005,7 @@ metaslab_segment_weight(metaslab_t *msp)
 	/*
 	 * If the metaslab is fully allocated then just make the weight 0.
 	 */
-	if (space_map_allocated(msp->ms_sm) == msp->ms_size)
+	if (metaslab_allocated_space(msp) == msp->ms_size)
 		return (0);
 	/*
 	 * If the metaslab is already loaded, then use the range tree to
@@ -1882,7 +2075,7 @@ metaslab_weight(metaslab_t *msp)
 	 * for us to do here.
 	 */
 	if (vd->vdev_removing) {
-		ASSERT0(space_map_allocated(msp->ms_sm));
+		ASSERT0(metaslab_allocated_space(msp));
 		ASSERT0(vd->vdev_ms_shift);
 		return (0);
 	}
@@ -1911,24 +2104,75 @@ metaslab_weight(metaslab_t *msp)
 	return (weight);
 }
 
+/*
+ * Mark a loaded metaslab active and make it the primary or secondary
+ * metaslab of the given allocator. This fails if another thread has
+ * already filled that slot, in which case the caller should go back and
+ * use the metaslab found there. Metaslabs activated to claim intent log
+ * blocks (allocator -1) are not owned by any allocator.
+ */
+static int
+metaslab_activate_allocator(metaslab_group_t *mg, metaslab_t *msp,
+    int allocator, uint64_t activation_weight)
+{
+	metaslab_t **arr = (activation_weight == METASLAB_WEIGHT_PRIMARY) ?
+	    mg->mg_primaries : mg->mg_secondaries;
+
+	ASSERT(MUTEX_HELD(&msp->ms_lock));
+
+	mutex_enter(&mg->mg_lock);
+	if (allocator != -1) {
+		if (arr[allocator] != NULL) {
+			mutex_exit(&mg->mg_lock);
+			METASLAB_STAT_BUMP(mas_activation_races);
+			return (SET_ERROR(EEXIST));
+		}
+		ASSERT3S(msp->ms_allocator, ==, -1);
+		arr[allocator] = msp;
+		msp->ms_allocator = allocator;
+		msp->ms_primary =
+		    (activation_weight == METASLAB_WEIGHT_PRIMARY);
+	}
+	msp->ms_activation_weight = msp->ms_weight;
+	metaslab_group_sort_impl(mg, msp, msp->ms_weight | activation_weight);
+	mutex_exit(&mg->mg_lock);
+
+	return (0);
+}
+
 static int
-metaslab_activate(metaslab_t *msp, uint64_t activation_weight)
+metaslab_activate(metaslab_t *msp, int allocator, uint64_t activation_weight)
 {
 	ASSERT(MUTEX_HELD(&msp->ms_lock));
 
 	if ((msp->ms_weight & METASLAB_ACTIVE_MASK) == 0) {
+		int error;
+
 		metaslab_load_wait(msp);
 		if (!msp->ms_loaded) {
-			int error = metaslab_load(msp);
+			error = metaslab_load(msp);
 			if (error) {
 				metaslab_group_sort(msp->ms_group, msp, 0);
 				return (error);
 			}
+
+			/*
+			 * The space map load drops ms_lock, so another
+			 * allocator may have activated this metaslab in
+			 * the meantime; let the caller reselect.
+			 */
+			if (msp->ms_weight & METASLAB_ACTIVE_MASK) {
+				if (allocator == -1)
+					return (0);
+				METASLAB_STAT_BUMP(mas_activation_races);
+				return (SET_ERROR(EBUSY));
+			}
 		}
 
-		msp->ms_activation_weight = msp->ms_weight;
-		metaslab_group_sort(msp->ms_group, msp,
-		    msp->ms_weight | activation_weight);
+		error = metaslab_activate_allocator(msp->ms_group, msp,
+		    allocator, activation_weight);
+		if (error != 0)
+			return (error);
 	}
 	ASSERT(msp->ms_loaded);
 	ASSERT(msp->ms_weight & METASLAB_ACTIVE_MASK);
@@ -2003,7 +2247,12 @@ metaslab_preload(void *arg)
 	mutex_exit(&msp->ms_lock);
 }
 
-static void
+/*
+ * Load, in the background, the metaslabs of the group that we are going
+ * to allocate from next. This is called after every txg, and when a pool
+ * that is going to be written to is opened.
+ */
+void
 metaslab_group_preload(metaslab_group_t *mg)
 {
 	spa_t *spa = mg->mg_vd->vdev_spa;
@@ -2023,11 +2272,13 @@ metaslab_group_preload(metaslab_group_t *mg)
 	for (msp = avl_first(t); msp != NULL; msp = AVL_NEXT(t, msp)) {
 		/*
 		 * We preload only the maximum number of metaslabs specified
-		 * by metaslab_preload_limit. If a metaslab is being forced
-		 * to condense then we preload it too. This will ensure
-		 * that force condensing happens in the next txg.
+		 * by metaslab_preload_limit for each allocator, since each
+		 * allocator activates its own metaslabs. If a metaslab is
+		 * being forced to condense then we preload it too. This will
+		 * ensure that force condensing happens in the next txg.
 		 */
-		if (++m > metaslab_preload_limit && !msp->ms_condense_wanted) {
+		if (++m > metaslab_preload_limit * mg->mg_allocators &&
+		    !msp->ms_condense_wanted) {
 			continue;
 		}
 
@@ -2086,7 +2337,7 @@ metaslab_should_condense(metaslab_t *msp)
 	 * metaslabs that are empty and metaslabs for which a condense
 	 * request has been made.
 	 */
-	rs = avl_last(&msp->ms_size_tree);
+	rs = zfs_btree_last(&msp->ms_size_tree, NULL);
 	if (rs == NULL || msp->ms_condense_wanted)
 		return (B_TRUE);
 
@@ -2100,7 +2351,7 @@ metaslab_should_condense(metaslab_t *msp)
 	entries = size / (MIN(size, SM_RUN_MAX));
 	segsz = entries * sizeof (uint64_t);
 
-	optimal_size = sizeof (uint64_t) * avl_numnodes(&msp->ms_tree->rt_root);
+	optimal_size = sizeof (uint64_t) * range_tree_numsegs(msp->ms_tree);
 	object_size = space_map_length(msp->ms_sm);
 
 	dmu_object_info_from_db(sm->sm_dbuf, &doi);
@@ -2130,9 +2381,9 @@ metaslab_condense(metaslab_t *msp, uint64_t txg, dmu_tx_t *tx)
 
 
 	spa_dbgmsg(spa, "condensing: txg %llu, msp[%llu] %p, "
-	    "smp size %llu, segments %lu, forcing condense=%s", txg,
+	    "smp size %llu, segments %llu, forcing condense=%s", txg,
 	    msp->ms_id, msp, space_map_length(msp->ms_sm),
-	    avl_numnodes(&msp->ms_tree->rt_root),
+	    range_tree_numsegs(msp->ms_tree),
 	    msp->ms_condense_wanted ? "TRUE" : "FALSE");
 
 	msp->ms_condense_wanted = B_FALSE;
@@ -2197,6 +2448,39 @@ metaslab_condense(metaslab_t *msp, uint64_t txg, dmu_tx_t *tx)
 	msp->ms_condensing = B_FALSE;
 }
 
+/*
+ * When the space map is loaded, we have an accurate histogram in the
+ * range tree. This gives us an opportunity to bring the space map's
+ * histogram up-to-date so we clear it first before updating it.
+ */
+static void
+metaslab_histogram_sync_loaded(metaslab_t *msp, dmu_tx_t *tx)
+{
+	ASSERT(msp->ms_loaded);
+
+	space_map_histogram_clear(msp->ms_sm);
+	space_map_histogram_add(msp->ms_sm, msp->ms_tree, tx);
+
+	/*
+	 * Since we've cleared the histogram we need to add back
+	 * any free space that has already been processed, plus
+	 * any deferred space. This allows the on-disk histogram
+	 * to accurately reflect all free space even if some space
+	 * is not yet available for allocation (i.e. deferred).
+	 */
+	space_map_histogram_add(msp->ms_sm, msp->ms_freedtree, tx);
+
+	/*
+	 * Add back any deferred free space that has not been
+	 * added back into the in-core free tree yet. This will
+	 * ensure that we don't end up with a space map histogram
+	 * that is completely empty unless the metaslab is fully
+	 * allocated.
+	 */
+	for (int t = 0; t < TXG_DEFER_SIZE; t++)
+		space_map_histogram_add(msp->ms_sm, msp->ms_defertree[t], tx);
+}
+
 /*
  * Write a metaslab to disk in the context of the specified transaction group.
  */
@@ -2210,6 +2494,8 @@ metaslab_sync(metaslab_t *msp, uint64_t txg)
 	range_tree_t *alloctree = msp->ms_alloctree[txg & TXG_MASK];
 	dmu_tx_t *tx;
 	uint64_t object = space_map_object(msp->ms_sm);
+	boolean_t log_changes = vdev_log_sm_enabled(vd);
+	boolean_t condense, logged = B_FALSE;
 
 	ASSERT(!vd->vdev_ishole);
 
@@ -2263,69 +2549,66 @@ metaslab_sync(metaslab_t *msp, uint64_t txg)
 		ASSERT(msp->ms_sm != NULL);
 	}
 
-	mutex_enter(&msp->ms_lock);
-
 	/*
-	 * Note: metaslab_condense() clears the space map's histogram.
-	 * Therefore we muse verify and remove this histogram before
-	 * condensing.
+	 * vdev_sync() has opened this txg's log space map.
 	 */
-	metaslab_group_histogram_verify(mg);
-	metaslab_class_histogram_verify(mg->mg_class);
-	metaslab_group_histogram_remove(mg, msp);
+	ASSERT(!log_changes || vd->vdev_log_sm != NULL);
 
-	if (msp->ms_loaded && spa_sync_pass(spa) == 1 &&
-	    metaslab_should_condense(msp)) {
-		metaslab_condense(msp, txg, tx);
-	} else {
-		space_map_write(msp->ms_sm, alloctree, SM_ALLOC, tx);
-		space_map_write(msp->ms_sm, msp->ms_freeingtree, SM_FREE, tx);
-	}
+	mutex_enter(&msp->ms_lock);
 
-	if (msp->ms_loaded) {
-		/*
-		 * When the space map is loaded, we have an accruate
-		 * histogram in the range tree. This gives us an opportunity
-		 * to bring the space map's histogram up-to-date so we clear
-		 * it first before updating it.
-		 */
-		space_map_histogram_clear(msp->ms_sm);
-		space_map_histogram_add(msp->ms_sm, msp->ms_tree, tx);
+	condense = (msp->ms_loaded && spa_sync_pass(spa) == 1 &&
+	    metaslab_should_condense(msp));
 
+	if (log_changes && !condense) {
 		/*
-		 * Since we've cleared the histogram we need to add back
-		 * any free space that has already been processed, plus
-		 * any deferred space. This allows the on-disk histogram
-		 * to accurately reflect all free space even if some space
-		 * is not yet available for allocation (i.e. deferred).
+		 * Append the changes to the vdev's log space map. The
+		 * metaslab's own space map, and its histogram, are brought
+		 * up to date when the metaslab is flushed.
 		 */
-		space_map_histogram_add(msp->ms_sm, msp->ms_freedtree, tx);
-
+		if (range_tree_space(alloctree) != 0 ||
+		    range_tree_space(msp->ms_freeingtree) != 0) {
+			vdev_log_sm_write(vd, msp, alloctree, tx);
+			logged = B_TRUE;
+		}
+	} else {
 		/*
-		 * Add back any deferred free space that has not been
-		 * added back into the in-core free tree yet. This will
-		 * ensure that we don't end up with a space map histogram
-		 * that is completely empty unless the metaslab is fully
-		 * allocated.
+		 * Note: metaslab_condense() clears the space map's histogram.
+		 * Therefore we muse verify and remove this histogram before
+		 * condensing.
 		 */
-		for (int t = 0; t < TXG_DEFER_SIZE; t++) {
-			space_map_histogram_add(msp->ms_sm,
-			    msp->ms_defertree[t], tx);
+		metaslab_group_histogram_verify(mg);
+		metaslab_class_histogram_verify(mg->mg_class);
+		metaslab_group_histogram_remove(mg, msp);
+
+		if (condense) {
+			/*
+			 * Condensing writes out the metaslab's complete
+			 * state, so it also flushes any unflushed changes.
+			 */
+			metaslab_condense(msp, txg, tx);
+			msp->ms_flushed_txg = txg;
+		} else {
+			space_map_write(msp->ms_sm, alloctree, SM_ALLOC, tx);
+			space_map_write(msp->ms_sm, msp->ms_freeingtree,
+			    SM_FREE, tx);
 		}
-	}
 
-	/*
-	 * Always add the free space from this sync pass to the space
-	 * map histogram. We want to make sure that the on-disk histogram
-	 * accounts for all free space. If the space map is not loaded,
-	 * then we will lose some accuracy but will correct it the next
-	 * time we load the space map.
-	 */
-	space_map_histogram_add(msp->ms_sm, msp->ms_freeingtree, tx);
+		if (msp->ms_loaded)
+			metaslab_histogram_sync_loaded(msp, tx);
 
-	metaslab_group_histogram_add(mg, msp);
-	metaslab_group_histogram_verify(mg);
-	metaslab_class_histogram_verify(mg->mg_class);
+		/*
+		 * Always add the free space from this sync pass to the space
+		 * map histogram. We want to make sure that the on-disk
+		 * histogram accounts for all free space. If the space map is
+		 * not loaded, then we will lose some accuracy but will correct
+		 * it the next time we load the space map.
+		 */
+		space_map_histogram_add(msp->ms_sm, msp->ms_freeingtree, tx);
+
+		metaslab_group_histogram_add(mg, msp);
+		metaslab_group_histogram_verify(mg);
+		metaslab_class_histogram_verify(mg->mg_class);
+	}
 
 	/*
 	 * For sync pass 1, we avoid traversing this txg's free range tree
@@ -2352,9 +2635,93 @@ metaslab_sync(metaslab_t *msp, uint64_t txg)
 		dmu_write(mos, vd->vdev_ms_array, sizeof (uint64_t) *
 		    msp->ms_id, sizeof (uint64_t), &object, tx);
 	}
+
+	/*
+	 * Record from which txg on the logs hold changes for this metaslab.
+	 */
+	if (condense && msp->ms_unflushed_txg != 0)
+		vdev_log_sm_set_unflushed(vd, msp, 0, tx);
+	else if (logged && msp->ms_unflushed_txg == 0)
+		vdev_log_sm_set_unflushed(vd, msp, txg, tx);
+
 	dmu_tx_commit(tx);
 }
 
+/*
+ * Write the metaslab's unflushed changes, which so far only exist in the
+ * vdev's log space maps, to its own space map. This must happen before
+ * metaslab_sync() logs anything for the txg; metaslab_sync_done() then
+ * drops the unflushed trees.
+ */
+void
+metaslab_flush(metaslab_t *msp, dmu_tx_t *tx)
+{
+	metaslab_group_t *mg = msp->ms_group;
+	vdev_t *vd = mg->mg_vd;
+	uint64_t txg = dmu_tx_get_txg(tx);
+
+	ASSERT(msp->ms_sm != NULL);
+	ASSERT3U(msp->ms_unflushed_txg, !=, 0);
+	ASSERT3U(msp->ms_unflushed_txg, <, txg);
+
+	mutex_enter(&msp->ms_lock);
+
+	ASSERT0(range_tree_space(msp->ms_logged_allocs));
+	ASSERT0(range_tree_space(msp->ms_logged_frees));
+	ASSERT3U(msp->ms_flushed_txg, <, txg);
+
+	metaslab_group_histogram_verify(mg);
+	metaslab_class_histogram_verify(mg->mg_class);
+	metaslab_group_histogram_remove(mg, msp);
+
+	space_map_write(msp->ms_sm, msp->ms_unflushed_allocs, SM_ALLOC, tx);
+	space_map_write(msp->ms_sm, msp->ms_unflushed_frees, SM_FREE, tx);
+
+	if (msp->ms_loaded) {
+		metaslab_histogram_sync_loaded(msp, tx);
+	} else {
+		space_map_histogram_add(msp->ms_sm, msp->ms_unflushed_frees,
+		    tx);
+	}
+
+	metaslab_group_histogram_add(mg, msp);
+	metaslab_group_histogram_verify(mg);
+	metaslab_class_histogram_verify(mg->mg_class);
+
+	msp->ms_flushed_txg = txg;
+
+	mutex_exit(&msp->ms_lock);
+
+	/*
+	 * The caller is syncing this vdev, so just make sure that
+	 * metaslab_sync_done() gets to see the metaslab.
+	 */
+	(void) txg_list_add(&vd->vdev_ms_list, msp, txg);
+}
+
+/*
+ * Called when a pool is opened, once vdev_log_sm_load() has replayed the
+ * vdev's logs into the metaslab's unflushed trees. Accounts for the space
+ * the logs changed and refreshes the weight (and the free tree, if the
+ * metaslab was already loaded) to match.
+ */
+void
+metaslab_unflushed_replayed(metaslab_t *msp)
+{
+	metaslab_group_t *mg = msp->ms_group;
+
+	mutex_enter(&msp->ms_lock);
+	vdev_space_update(mg->mg_vd,
+	    (int64_t)range_tree_space(msp->ms_unflushed_allocs) -
+	    (int64_t)range_tree_space(msp->ms_unflushed_frees), 0, 0);
+	if (msp->ms_loaded) {
+		metaslab_unload(msp);
+		VERIFY0(metaslab_load(msp));
+	}
+	metaslab_group_sort(mg, msp, metaslab_weight(msp));
+	mutex_exit(&msp->ms_lock);
+}
+
 /*
  * Called after a transaction group has completely synced to mark
  * all of the metaslab's free space as usable.
@@ -2401,9 +2768,25 @@ metaslab_sync_done(metaslab_t *msp, uint64_t txg)
 			    &msp->ms_lock);
 		}
 
+		ASSERT3P(msp->ms_unflushed_allocs, ==, NULL);
+		msp->ms_unflushed_allocs = range_tree_create(NULL, msp,
+		    &msp->ms_lock);
+		msp->ms_unflushed_frees = range_tree_create(NULL, msp,
+		    &msp->ms_lock);
+		msp->ms_logged_allocs = range_tree_create(NULL, msp,
+		    &msp->ms_lock);
+		msp->ms_logged_frees = range_tree_create(NULL, msp,
+		    &msp->ms_lock);
+
 		vdev_space_update(vd, 0, 0, msp->ms_size);
 	}
 
+	/*
+	 * If there's a metaslab_load() in progress, wait for it to complete
+	 * so that we have a consistent view of the in-core space map.
+	 */
+	metaslab_load_wait(msp);
+
 	defer_tree = &msp->ms_defertree[txg % TXG_DEFER_SIZE];
 
 	uint64_t free_space = metaslab_class_get_space(spa_normal_class(spa)) -
@@ -2413,7 +2796,7 @@ metaslab_sync_done(metaslab_t *msp, uint64_t txg)
 	}
 
 	defer_delta = 0;
-	alloc_delta = space_map_alloc_delta(msp->ms_sm);
+	alloc_delta = metaslab_syncing_alloc_delta(msp, txg);
 	if (defer_allowed) {
 		defer_delta = range_tree_space(msp->ms_freedtree) -
 		    range_tree_space(*defer_tree);
@@ -2424,10 +2807,17 @@ metaslab_sync_done(metaslab_t *msp, uint64_t txg)
 	vdev_space_update(vd, alloc_delta + defer_delta, defer_delta, 0);
 
 	/*
-	 * If there's a metaslab_load() in progress, wait for it to complete
-	 * so that we have a consistent view of the in-core space map.
+	 * With autotrim on, queue the space that is about to become
+	 * allocatable again for TRIM. Waiting until it leaves the defer
+	 * tree keeps the blocks of the last few txgs intact for rewind.
 	 */
-	metaslab_load_wait(msp);
+	if (spa->spa_autotrim) {
+		range_tree_walk(*defer_tree, range_tree_add, msp->ms_trimtree);
+		if (!defer_allowed) {
+			range_tree_walk(msp->ms_freedtree, range_tree_add,
+			    msp->ms_trimtree);
+		}
+	}
 
 	/*
 	 * Move the frees from the defer_tree back to the free
@@ -2446,6 +2836,23 @@ metaslab_sync_done(metaslab_t *msp, uint64_t txg)
 
 	space_map_update(msp->ms_sm);
 
+	/*
+	 * If the metaslab was flushed, its space map now has everything
+	 * the unflushed trees had. Then fold in what this txg logged;
+	 * within a txg no space is freed and then reallocated, so the
+	 * allocs can be applied before the frees.
+	 */
+	if (msp->ms_flushed_txg == txg) {
+		range_tree_vacate(msp->ms_unflushed_allocs, NULL, NULL);
+		range_tree_vacate(msp->ms_unflushed_frees, NULL, NULL);
+	}
+	range_tree_remove_xor_add(msp->ms_logged_allocs,
+	    msp->ms_unflushed_frees, msp->ms_unflushed_allocs);
+	range_tree_vacate(msp->ms_logged_allocs, NULL, NULL);
+	range_tree_remove_xor_add(msp->ms_logged_frees,
+	    msp->ms_unflushed_allocs, msp->ms_unflushed_frees);
+	range_tree_vacate(msp->ms_logged_frees, NULL, NULL);
+
 	msp->ms_deferspace += defer_delta;
 	ASSERT3S(msp->ms_deferspace, >=, 0);
 	ASSERT3S(msp->ms_deferspace, <=, msp->ms_size);
@@ -2484,8 +2891,11 @@ metaslab_sync_done(metaslab_t *msp, uint64_t txg)
 void
 metaslab_sync_reassess(metaslab_group_t *mg)
 {
+	spa_t *spa = mg->mg_vd->vdev_spa;
+
 	metaslab_group_alloc_update(mg);
 	mg->mg_fragmentation = metaslab_group_fragmentation(mg);
+	spa_frag_history_add(spa, spa_syncing_txg(spa), mg);
 
 	/*
 	 * Preload the next potential metaslabs
@@ -2533,6 +2943,13 @@ metaslab_alloc_trace_init(void)
 		    "metaslab_trace_over_limit", KSTAT_DATA_UINT64);
 		kstat_install(metaslab_trace_ksp);
 	}
+	metaslab_alloc_ksp = kstat_create("zfs", 0, "metaslab_alloc_stats",
+	    "misc", KSTAT_TYPE_NAMED, sizeof (metaslab_alloc_stats) /
+	    sizeof (kstat_named_t), KSTAT_FLAG_VIRTUAL);
+	if (metaslab_alloc_ksp != NULL) {
+		metaslab_alloc_ksp->ks_data = &metaslab_alloc_stats;
+		kstat_install(metaslab_alloc_ksp);
+	}
 }
 
 void
@@ -2542,10 +2959,63 @@ metaslab_alloc_trace_fini(void)
 		kstat_delete(metaslab_trace_ksp);
 		metaslab_trace_ksp = NULL;
 	}
+	if (metaslab_alloc_ksp != NULL) {
+		kstat_delete(metaslab_alloc_ksp);
+		metaslab_alloc_ksp = NULL;
+	}
 	kmem_cache_destroy(metaslab_alloc_trace_cache);
 	metaslab_alloc_trace_cache = NULL;
 }
 
+/*
+ * Account for a block which could not be allocated whole and is being
+ * written as a gang block instead.
+ */
+void
+metaslab_trace_gang(void)
+{
+	METASLAB_STAT_BUMP(mas_gang_fallbacks);
+}
+
+/*
+ * Bump the zfs/metaslab_alloc_stats counter matching a trace offset.
+ */
+static void
+metaslab_trace_count(uint64_t offset)
+{
+	switch (offset) {
+	case TRACE_ALLOC_FAILURE:
+		METASLAB_STAT_BUMP(mas_fail_metaslab);
+		break;
+	case TRACE_TOO_SMALL:
+		METASLAB_STAT_BUMP(mas_fail_too_small);
+		break;
+	case TRACE_FORCE_GANG:
+		METASLAB_STAT_BUMP(mas_fail_force_gang);
+		break;
+	case TRACE_NOT_ALLOCATABLE:
+		METASLAB_STAT_BUMP(mas_fail_not_allocatable);
+		break;
+	case TRACE_GROUP_FAILURE:
+		METASLAB_STAT_BUMP(mas_fail_group);
+		break;
+	case TRACE_ENOSPC:
+		METASLAB_STAT_BUMP(mas_fail_enospc);
+		break;
+	case TRACE_CONDENSING:
+		METASLAB_STAT_BUMP(mas_fail_condensing);
+		break;
+	case TRACE_VDEV_ERROR:
+		METASLAB_STAT_BUMP(mas_fail_vdev_error);
+		break;
+	case TRACE_TRIMMING:
+		METASLAB_STAT_BUMP(mas_fail_trimming);
+		break;
+	default:
+		break;
+	}
+}
+
 /*
  * Add an allocation trace element to the allocation tracing list.
  */
@@ -2553,6 +3023,8 @@ static void
 metaslab_trace_add(zio_alloc_list_t *zal, metaslab_group_t *mg,
     metaslab_t *msp, uint64_t psize, uint32_t dva_id, uint64_t offset)
 {
+	metaslab_trace_count(offset);
+
 	if (!metaslab_trace_enabled)
 		return;
 
@@ -2674,6 +3146,7 @@ metaslab_block_alloc(metaslab_t *msp, uint64_t size, uint64_t txg)
 	metaslab_class_t *mc = msp->ms_group->mg_class;
 
 	VERIFY(!msp->ms_condensing);
+	VERIFY(!msp->ms_trimming);
 
 	start = mc->mc_ops->msop_alloc(msp, size);
 	if (start != -1ULL) {
@@ -2684,6 +3157,7 @@ metaslab_block_alloc(metaslab_t *msp, uint64_t size, uint64_t txg)
 		VERIFY0(P2PHASE(size, 1ULL << vd->vdev_ashift));
 		VERIFY3U(range_tree_space(rt) - size, <=, msp->ms_size);
 		range_tree_remove(rt, start, size);
+		range_tree_clear(msp->ms_trimtree, start, size);
 
 		if (range_tree_space(msp->ms_alloctree[txg & TXG_MASK]) == 0)
 			vdev_dirty(mg->mg_vd, VDD_METASLAB, msp, txg);
@@ -2705,7 +3179,8 @@ metaslab_block_alloc(metaslab_t *msp, uint64_t size, uint64_t txg)
 
 static uint64_t
 metaslab_group_alloc_normal(metaslab_group_t *mg, zio_alloc_list_t *zal,
-    uint64_t asize, uint64_t txg, uint64_t min_distance, dva_t *dva, int d)
+    uint64_t asize, uint64_t txg, uint64_t min_distance, dva_t *dva, int d,
+    int allocator)
 {
 	metaslab_t *msp = NULL;
 	uint64_t offset = -1ULL;
@@ -2713,6 +3188,14 @@ metaslab_group_alloc_normal(metaslab_group_t *mg, zio_alloc_list_t *zal,
 	uint64_t target_distance;
 	int i;
 
+	/*
+	 * A group with only a handful of metaslabs cannot give every
+	 * allocator one of its own; funnel them all through the first.
+	 */
+	if (avl_numnodes(&mg->mg_metaslab_tree) < mg->mg_allocators * 3)
+		allocator = 0;
+	ASSERT3S(allocator, <, mg->mg_allocators);
+
 	activation_weight = METASLAB_WEIGHT_PRIMARY;
 	for (i = 0; i < d; i++) {
 		if (DVA_GET_VDEV(&dva[i]) == mg->mg_vd->vdev_id) {
@@ -2728,8 +3211,25 @@ metaslab_group_alloc_normal(metaslab_group_t *mg, zio_alloc_list_t *zal,
 		boolean_t was_active;
 		avl_tree_t *t = &mg->mg_metaslab_tree;
 		avl_index_t idx;
+		metaslab_t *shared = NULL;
+
+		if (!mutex_tryenter(&mg->mg_lock)) {
+			METASLAB_STAT_BUMP(mas_mg_lock_contended);
+			mutex_enter(&mg->mg_lock);
+		}
 
-		mutex_enter(&mg->mg_lock);
+		/*
+		 * If this allocator already has an active metaslab of the
+		 * kind we want, keep allocating from it. If it can no longer
+		 * satisfy us it is passivated below, freeing up the slot.
+		 */
+		msp = (activation_weight == METASLAB_WEIGHT_PRIMARY) ?
+		    mg->mg_primaries[allocator] : mg->mg_secondaries[allocator];
+		if (msp != NULL) {
+			was_active = B_TRUE;
+			mutex_exit(&mg->mg_lock);
+			goto selected;
+		}
 
 		/*
 		 * Find the metaslab with the highest weight that is less
@@ -2757,27 +3257,43 @@ metaslab_group_alloc_normal(metaslab_group_t *mg, zio_alloc_list_t *zal,
 			}
 
 			/*
-			 * If the selected metaslab is condensing, skip it.
+			 * If the selected metaslab is condensing or being
+			 * trimmed, skip it.
 			 */
-			if (msp->ms_condensing)
+			if (msp->ms_condensing || msp->ms_trimming)
 				continue;
 
-			was_active = msp->ms_weight & METASLAB_ACTIVE_MASK;
-			if (activation_weight == METASLAB_WEIGHT_PRIMARY)
-				break;
-
-			target_distance = min_distance +
-			    (space_map_allocated(msp->ms_sm) != 0 ? 0 :
-			    min_distance >> 1);
+			if (activation_weight != METASLAB_WEIGHT_PRIMARY) {
+				target_distance = min_distance +
+				    (metaslab_allocated_space(msp) != 0 ? 0 :
+				    min_distance >> 1);
+
+				for (i = 0; i < d; i++) {
+					if (metaslab_distance(msp, &dva[i]) <
+					    target_distance)
+						break;
+				}
+				if (i != d)
+					continue;
+			}
 
-			for (i = 0; i < d; i++) {
-				if (metaslab_distance(msp, &dva[i]) <
-				    target_distance)
-					break;
+			/*
+			 * Leave metaslabs that are active for another
+			 * allocator alone unless there is nothing else.
+			 */
+			if (msp->ms_allocator != -1) {
+				if (shared == NULL)
+					shared = msp;
+				continue;
 			}
-			if (i == d)
-				break;
+			break;
 		}
+		if (msp == NULL && shared != NULL) {
+			METASLAB_STAT_BUMP(mas_shared_allocations);
+			msp = shared;
+		}
+		if (msp != NULL)
+			was_active = msp->ms_weight & METASLAB_ACTIVE_MASK;
 		mutex_exit(&mg->mg_lock);
 		if (msp == NULL) {
 			kmem_free(search, sizeof (*search));
@@ -2786,7 +3302,11 @@ metaslab_group_alloc_normal(metaslab_group_t *mg, zio_alloc_list_t *zal,
 		search->ms_weight = msp->ms_weight;
 		search->ms_start = msp->ms_start + 1;
 
-		mutex_enter(&msp->ms_lock);
+selected:
+		if (!mutex_tryenter(&msp->ms_lock)) {
+			METASLAB_STAT_BUMP(mas_ms_lock_contended);
+			mutex_enter(&msp->ms_lock);
+		}
 
 		/*
 		 * Ensure that the metaslab we have selected is still
@@ -2801,6 +3321,17 @@ metaslab_group_alloc_normal(metaslab_group_t *mg, zio_alloc_list_t *zal,
 			continue;
 		}
 
+		/*
+		 * Likewise, if another allocator has claimed the metaslab
+		 * while we were waiting for it, select a different one.
+		 */
+		if (!was_active && msp->ms_allocator != -1 &&
+		    msp->ms_allocator != allocator) {
+			METASLAB_STAT_BUMP(mas_activation_races);
+			mutex_exit(&msp->ms_lock);
+			continue;
+		}
+
 		if ((msp->ms_weight & METASLAB_WEIGHT_SECONDARY) &&
 		    activation_weight == METASLAB_WEIGHT_PRIMARY) {
 			metaslab_passivate(msp,
@@ -2809,7 +3340,7 @@ metaslab_group_alloc_normal(metaslab_group_t *mg, zio_alloc_list_t *zal,
 			continue;
 		}
 
-		if (metaslab_activate(msp, activation_weight) != 0) {
+		if (metaslab_activate(msp, allocator, activation_weight) != 0) {
 			mutex_exit(&msp->ms_lock);
 			continue;
 		}
@@ -2837,6 +3368,25 @@ metaslab_group_alloc_normal(metaslab_group_t *mg, zio_alloc_list_t *zal,
 		if (msp->ms_condensing) {
 			metaslab_trace_add(zal, mg, msp, asize, d,
 			    TRACE_CONDENSING);
+			if (msp->ms_allocator == allocator) {
+				metaslab_passivate(msp,
+				    msp->ms_weight & ~METASLAB_ACTIVE_MASK);
+			}
+			mutex_exit(&msp->ms_lock);
+			continue;
+		}
+
+		/*
+		 * Likewise, space in a metaslab with a TRIM in flight may be
+		 * part of that TRIM, so it can't be handed out yet.
+		 */
+		if (msp->ms_trimming) {
+			metaslab_trace_add(zal, mg, msp, asize, d,
+			    TRACE_TRIMMING);
+			if (msp->ms_allocator == allocator) {
+				metaslab_passivate(msp,
+				    msp->ms_weight & ~METASLAB_ACTIVE_MASK);
+			}
 			mutex_exit(&msp->ms_lock);
 			continue;
 		}
@@ -2898,13 +3448,14 @@ next:
 
 static uint64_t
 metaslab_group_alloc(metaslab_group_t *mg, zio_alloc_list_t *zal,
-    uint64_t asize, uint64_t txg, uint64_t min_distance, dva_t *dva, int d)
+    uint64_t asize, uint64_t txg, uint64_t min_distance, dva_t *dva, int d,
+    int allocator)
 {
 	uint64_t offset;
 	ASSERT(mg->mg_initialized);
 
 	offset = metaslab_group_alloc_normal(mg, zal, asize, txg,
-	    min_distance, dva, d);
+	    min_distance, dva, d, allocator);
 
 	mutex_enter(&mg->mg_lock);
 	if (offset == -1ULL) {
@@ -2945,8 +3496,9 @@ int ditto_same_vdev_distance_shift = 3;
 static int
 metaslab_alloc_dva(spa_t *spa, metaslab_class_t *mc, uint64_t psize,
     dva_t *dva, int d, dva_t *hintdva, uint64_t txg, int flags,
-    zio_alloc_list_t *zal)
+    zio_alloc_list_t *zal, int allocator)
 {
+	metaslab_class_allocator_t *mca = &mc->mc_allocator[allocator];
 	metaslab_group_t *mg, *fast_mg, *rotor;
 	vdev_t *vd;
 	boolean_t try_hard = B_FALSE;
@@ -2957,6 +3509,7 @@ metaslab_alloc_dva(spa_t *spa, metaslab_class_t *mc, uint64_t psize,
 	 * For testing, make some blocks above a certain size be gang blocks.
 	 */
 	if (psize >= metaslab_gang_bang && (ddi_get_lbolt() & 3) == 0) {
+		metaslab_trace_add(zal, NULL, NULL, psize, d, TRACE_FORCE_GANG);
 		return (SET_ERROR(ENOSPC));
 	}
 
@@ -2964,10 +3517,11 @@ metaslab_alloc_dva(spa_t *spa, metaslab_class_t *mc, uint64_t psize,
 		mutex_enter(&mc->mc_fastwrite_lock);
 
 	/*
-	 * Start at the rotor and loop through all mgs until we find something.
-	 * Note that there's no locking on mc_rotor or mc_aliquot because
-	 * nothing actually breaks if we miss a few updates -- we just won't
-	 * allocate quite as evenly.  It all balances out over time.
+	 * Start at this allocator's rotor and loop through all mgs until we
+	 * find something.  Note that there's no locking on mca_rotor or
+	 * mca_aliquot because nothing actually breaks if we miss a few
+	 * updates -- we just won't allocate quite as evenly.  It all
+	 * balances out over time.
 	 *
 	 * If we are doing ditto or log blocks, try to spread them across
 	 * consecutive vdevs.  If we're forced to reuse a vdev before we've
@@ -3000,22 +3554,40 @@ metaslab_alloc_dva(spa_t *spa, metaslab_class_t *mc, uint64_t psize,
 			    mg->mg_next != NULL)
 				mg = mg->mg_next;
 		} else {
-			mg = mc->mc_rotor;
+			mg = mca->mca_rotor;
+		}
+
+		/*
+		 * Log blocks pass the previous block of their chain as the
+		 * hint.  Several of them are in flight at once, so rather
+		 * than simply moving on to the next vdev, pick the one with
+		 * the fewest log bytes outstanding, starting after the hint
+		 * so that ties still rotate.  This stripes a commit across
+		 * all log vdevs in proportion to how fast they drain.
+		 */
+		if ((flags & METASLAB_FASTWRITE) && mg->mg_class == mc &&
+		    mg->mg_activation_count > 0) {
+			rotor = fast_mg = mg;
+			while ((fast_mg = fast_mg->mg_next) != rotor) {
+				if (fast_mg->mg_vd->vdev_pending_fastwrite <
+				    mg->mg_vd->vdev_pending_fastwrite)
+					mg = fast_mg;
+			}
 		}
 	} else if (d != 0) {
 		vd = vdev_lookup_top(spa, DVA_GET_VDEV(&dva[d - 1]));
 		mg = vd->vdev_mg->mg_next;
 	} else if (flags & METASLAB_FASTWRITE) {
-		mg = fast_mg = mc->mc_rotor;
+		mg = fast_mg = mca->mca_rotor;
 
 		do {
 			if (fast_mg->mg_vd->vdev_pending_fastwrite <
 			    mg->mg_vd->vdev_pending_fastwrite)
 				mg = fast_mg;
-		} while ((fast_mg = fast_mg->mg_next) != mc->mc_rotor);
+		} while ((fast_mg = fast_mg->mg_next) != mca->mca_rotor);
 
 	} else {
-		mg = mc->mc_rotor;
+		mg = mca->mca_rotor;
 	}
 
 	/*
@@ -3023,7 +3595,7 @@ metaslab_alloc_dva(spa_t *spa, metaslab_class_t *mc, uint64_t psize,
 	 * metaslab group that has been passivated, just follow the rotor.
 	 */
 	if (mg->mg_class != mc || mg->mg_activation_count <= 0)
-		mg = mc->mc_rotor;
+		mg = mca->mca_rotor;
 
 	rotor = mg;
 top:
@@ -3097,7 +3669,7 @@ top:
 		ASSERT(P2PHASE(asize, 1ULL << vd->vdev_ashift) == 0);
 
 		uint64_t offset = metaslab_group_alloc(mg, zal, asize, txg,
-		    distance, dva, d);
+		    distance, dva, d, allocator);
 
 		if (offset != -1ULL) {
 			/*
@@ -3109,7 +3681,7 @@ top:
 			 * Bias is also used to compensate for unequally
 			 * sized vdevs so that space is allocated fairly.
 			 */
-			if (mc->mc_aliquot == 0 && metaslab_bias_enabled) {
+			if (mca->mca_aliquot == 0 && metaslab_bias_enabled) {
 				vdev_stat_t *vs = &vd->vdev_stat;
 				int64_t vs_free = vs->vs_space - vs->vs_alloc;
 				int64_t mc_free = mc->mc_space - mc->mc_alloc;
@@ -3147,10 +3719,10 @@ top:
 			}
 
 			if ((flags & METASLAB_FASTWRITE) ||
-			    atomic_add_64_nv(&mc->mc_aliquot, asize) >=
+			    atomic_add_64_nv(&mca->mca_aliquot, asize) >=
 			    mg->mg_aliquot + mg->mg_bias) {
-				mc->mc_rotor = mg->mg_next;
-				mc->mc_aliquot = 0;
+				mca->mca_rotor = mg->mg_next;
+				mca->mca_aliquot = 0;
 			}
 
 			DVA_SET_VDEV(&dva[d], vd->vdev_id);
@@ -3167,8 +3739,8 @@ top:
 			return (0);
 		}
 next:
-		mc->mc_rotor = mg->mg_next;
-		mc->mc_aliquot = 0;
+		mca->mca_rotor = mg->mg_next;
+		mca->mca_aliquot = 0;
 	} while ((mg = mg->mg_next) != rotor);
 
 	/*
@@ -3272,7 +3844,7 @@ metaslab_claim_dva(spa_t *spa, const dva_t *dva, uint64_t txg)
 	mutex_enter(&msp->ms_lock);
 
 	if ((txg != 0 && spa_writeable(spa)) || !msp->ms_loaded)
-		error = metaslab_activate(msp, METASLAB_WEIGHT_SECONDARY);
+		error = metaslab_activate(msp, -1, METASLAB_WEIGHT_SECONDARY);
 
 	if (error == 0 && !range_tree_contains(msp->ms_tree, offset, size))
 		error = SET_ERROR(ENOENT);
@@ -3287,6 +3859,7 @@ metaslab_claim_dva(spa_t *spa, const dva_t *dva, uint64_t txg)
 	VERIFY0(P2PHASE(size, 1ULL << vd->vdev_ashift));
 	VERIFY3U(range_tree_space(msp->ms_tree) - size, <=, msp->ms_size);
 	range_tree_remove(msp->ms_tree, offset, size);
+	range_tree_clear(msp->ms_trimtree, offset, size);
 
 	if (spa_writeable(spa)) {	/* don't dirty if we're zdb(1M) */
 		if (range_tree_space(msp->ms_alloctree[txg & TXG_MASK]) == 0)
@@ -3320,7 +3893,13 @@ metaslab_class_throttle_reserve(metaslab_class_t *mc, int slots, zio_t *zio,
 	if (reserved_slots < mc->mc_alloc_max_slots)
 		available_slots = mc->mc_alloc_max_slots - reserved_slots;
 
-	if (slots <= available_slots || GANG_ALLOCATION(flags)) {
+	/*
+	 * If this is a gang allocation, or the i/o is moving a reservation
+	 * it already holds to another class (METASLAB_MUST_RESERVE), always
+	 * take the slots; otherwise the allocation could deadlock.
+	 */
+	if (slots <= available_slots || GANG_ALLOCATION(flags) ||
+	    (flags & METASLAB_MUST_RESERVE)) {
 		/*
 		 * We reserve the slots individually so that we can unreserve
 		 * them individually when an I/O completes.
@@ -3350,7 +3929,7 @@ metaslab_class_throttle_unreserve(metaslab_class_t *mc, int slots, zio_t *zio)
 int
 metaslab_alloc(spa_t *spa, metaslab_class_t *mc, uint64_t psize, blkptr_t *bp,
     int ndvas, uint64_t txg, blkptr_t *hintbp, int flags,
-    zio_alloc_list_t *zal, zio_t *zio)
+    zio_alloc_list_t *zal, zio_t *zio, int allocator)
 {
 	dva_t *dva = bp->blk_dva;
 	dva_t *hintdva = hintbp->blk_dva;
@@ -3370,11 +3949,16 @@ metaslab_alloc(spa_t *spa, metaslab_class_t *mc, uint64_t psize, blkptr_t *bp,
 	ASSERT(BP_GET_NDVAS(bp) == 0);
 	ASSERT(hintbp == NULL || ndvas <= BP_GET_NDVAS(hintbp));
 	ASSERT3P(zal, !=, NULL);
+	ASSERT3S(allocator, >=, 0);
+	ASSERT3S(allocator, <, mc->mc_allocators);
+
+	METASLAB_STAT_BUMP(mas_allocations);
 
 	for (d = 0; d < ndvas; d++) {
 		error = metaslab_alloc_dva(spa, mc, psize, dva, d, hintdva,
-		    txg, flags, zal);
+		    txg, flags, zal, allocator);
 		if (error != 0) {
+			METASLAB_STAT_BUMP(mas_allocation_failures);
 			for (d--; d >= 0; d--) {
 				metaslab_free_dva(spa, &dva[d], txg, B_TRUE);
 				metaslab_group_alloc_decrement(spa,
@@ -52,6 +52,7 @@
 #include <sys/ddt.h>
 #include <sys/vdev_impl.h>
 #include <sys/vdev_disk.h>
+#include <sys/vdev_trim.h>
 #include <sys/metaslab.h>
 #include <sys/metaslab_impl.h>
 #include <sys/uberblock_impl.h>
@@ -163,6 +164,12 @@ uint_t		zio_taskq_basedc = 80;		/* base duty cycle */
 
 boolean_t	spa_create_process = B_TRUE;	/* no process ==> no sysdc */
 
+/*
+ * Write out the metaslabs of the dirty top-level vdevs concurrently, on
+ * the dp_sync_taskq, rather than one vdev after another in spa_sync().
+ */
+int zfs_sync_vdevs_parallel = 1;
+
 /*
  * This (illegal) pool name is used when temporarily importing a spa_t in order
  * to get the vdev stats associated with the imported devices.
@@ -213,8 +220,14 @@ spa_prop_get_config(spa_t *spa, nvlist_t **nvp)
 	ASSERT(MUTEX_HELD(&spa->spa_props_lock));
 
 	if (rvd != NULL) {
-		alloc = metaslab_class_get_alloc(spa_normal_class(spa));
-		size = metaslab_class_get_space(spa_normal_class(spa));
+		alloc = metaslab_class_get_alloc(mc);
+		alloc += metaslab_class_get_alloc(spa_special_class(spa));
+		alloc += metaslab_class_get_alloc(spa_dedup_class(spa));
+
+		size = metaslab_class_get_space(mc);
+		size += metaslab_class_get_space(spa_special_class(spa));
+		size += metaslab_class_get_space(spa_dedup_class(spa));
+
 		spa_prop_add_list(*nvp, ZPOOL_PROP_NAME, spa_name(spa), 0, src);
 		spa_prop_add_list(*nvp, ZPOOL_PROP_SIZE, NULL, size, src);
 		spa_prop_add_list(*nvp, ZPOOL_PROP_ALLOCATED, NULL, alloc, src);
@@ -472,6 +485,7 @@ spa_prop_validate(spa_t *spa, nvlist_t *props)
 		case ZPOOL_PROP_AUTOREPLACE:
 		case ZPOOL_PROP_LISTSNAPS:
 		case ZPOOL_PROP_AUTOEXPAND:
+		case ZPOOL_PROP_AUTOTRIM:
 			error = nvpair_value_uint64(elem, &intval);
 			if (!error && intval > 1)
 				error = SET_ERROR(EINVAL);
@@ -1096,6 +1110,8 @@ spa_activate(spa_t *spa, int mode)
 
 	spa->spa_normal_class = metaslab_class_create(spa, zfs_metaslab_ops);
 	spa->spa_log_class = metaslab_class_create(spa, zfs_metaslab_ops);
+	spa->spa_special_class = metaslab_class_create(spa, zfs_metaslab_ops);
+	spa->spa_dedup_class = metaslab_class_create(spa, zfs_metaslab_ops);
 
 	/* Try to create a covering process */
 	mutex_enter(&spa->spa_proc_lock);
@@ -1172,6 +1188,13 @@ spa_activate(spa_t *spa, int mode)
 	spa->spa_zvol_taskq = taskq_create("z_zvol", 1, defclsyspri,
 	    1, INT_MAX, 0);
 
+	/*
+	 * Autotrim passes are dispatched from spa_sync() and run one at a
+	 * time; see vdev_trim.c.
+	 */
+	spa->spa_auto_trim_taskq = taskq_create("z_trim", 1, minclsyspri,
+	    1, INT_MAX, 0);
+
 	spa_keystore_init(&spa->spa_keystore);
 }
 
@@ -1196,6 +1219,11 @@ spa_deactivate(spa_t *spa)
 		spa->spa_zvol_taskq = NULL;
 	}
 
+	if (spa->spa_auto_trim_taskq) {
+		taskq_destroy(spa->spa_auto_trim_taskq);
+		spa->spa_auto_trim_taskq = NULL;
+	}
+
 	txg_list_destroy(&spa->spa_vdev_txg_list);
 
 	list_destroy(&spa->spa_config_dirty_list);
@@ -1218,6 +1246,12 @@ spa_deactivate(spa_t *spa)
 	metaslab_class_destroy(spa->spa_log_class);
 	spa->spa_log_class = NULL;
 
+	metaslab_class_destroy(spa->spa_special_class);
+	spa->spa_special_class = NULL;
+
+	metaslab_class_destroy(spa->spa_dedup_class);
+	spa->spa_dedup_class = NULL;
+
 	/*
 	 * If this was part of an import or the open otherwise failed, we may
 	 * still have errors left in the queues.  Empty them just in case.
@@ -1333,6 +1367,14 @@ spa_unload(spa_t *spa)
 		spa->spa_sync_on = B_FALSE;
 	}
 
+	/*
+	 * Stop trimming.  With syncing stopped no new autotrim pass can be
+	 * dispatched.
+	 */
+	(void) spa_trim_stop(spa);
+	if (spa->spa_auto_trim_taskq != NULL)
+		taskq_wait(spa->spa_auto_trim_taskq);
+
 	/*
 	 * Even though vdev_free() also calls vdev_metaslab_fini, we need
 	 * to call it earlier, before we wait for async i/o to complete.
@@ -2850,6 +2892,7 @@ spa_load_impl(spa_t *spa, uint64_t pool_guid, nvlist_t *config,
 		spa_prop_find(spa, ZPOOL_PROP_DELEGATION, &spa->spa_delegation);
 		spa_prop_find(spa, ZPOOL_PROP_FAILUREMODE, &spa->spa_failmode);
 		spa_prop_find(spa, ZPOOL_PROP_AUTOEXPAND, &spa->spa_autoexpand);
+		spa_prop_find(spa, ZPOOL_PROP_AUTOTRIM, &spa->spa_autotrim);
 		spa_prop_find(spa, ZPOOL_PROP_DEDUPDITTO,
 		    &spa->spa_dedup_ditto);
 
@@ -3792,6 +3835,7 @@ spa_create(const char *pool, nvlist_t *nvroot, nvlist_t *props,
 	uint64_t version, obj, root_dsobj = 0;
 	boolean_t has_features;
 	boolean_t has_encryption;
+	boolean_t has_allocation_classes;
 	spa_feature_t feat;
 	char *feat_name;
 	nvpair_t *elem;
@@ -3837,6 +3881,7 @@ spa_create(const char *pool, nvlist_t *nvroot, nvlist_t *props,
 
 	has_features = B_FALSE;
 	has_encryption = B_FALSE;
+	has_allocation_classes = B_FALSE;
 	for (elem = nvlist_next_nvpair(props, NULL);
 	    elem != NULL; elem = nvlist_next_nvpair(props, elem)) {
 		if (zpool_prop_feature(nvpair_name(elem))) {
@@ -3846,6 +3891,8 @@ spa_create(const char *pool, nvlist_t *nvroot, nvlist_t *props,
 			VERIFY0(zfeature_lookup_name(feat_name, &feat));
 			if (feat == SPA_FEATURE_ENCRYPTION)
 				has_encryption = B_TRUE;
+			if (feat == SPA_FEATURE_ALLOCATION_CLASSES)
+				has_allocation_classes = B_TRUE;
 		}
 	}
 
@@ -3896,6 +3943,16 @@ spa_create(const char *pool, nvlist_t *nvroot, nvlist_t *props,
 	if (error == 0 && !zfs_allocatable_devs(nvroot))
 		error = SET_ERROR(EINVAL);
 
+	/*
+	 * Special vdevs can only be used if the allocation_classes feature
+	 * is going to be enabled on the new pool.
+	 */
+	for (c = 0; error == 0 && c < rvd->vdev_children; c++) {
+		if (rvd->vdev_child[c]->vdev_alloc_bias != VDEV_BIAS_NONE &&
+		    !has_allocation_classes)
+			error = SET_ERROR(ENOTSUP);
+	}
+
 	if (error == 0 &&
 	    (error = vdev_create(rvd, txg, B_FALSE)) == 0 &&
 	    (error = spa_validate_aux(spa, nvroot, txg,
@@ -4023,6 +4080,7 @@ spa_create(const char *pool, nvlist_t *nvroot, nvlist_t *props,
 	spa->spa_delegation = zpool_prop_default_numeric(ZPOOL_PROP_DELEGATION);
 	spa->spa_failmode = zpool_prop_default_numeric(ZPOOL_PROP_FAILUREMODE);
 	spa->spa_autoexpand = zpool_prop_default_numeric(ZPOOL_PROP_AUTOEXPAND);
+	spa->spa_autotrim = zpool_prop_default_numeric(ZPOOL_PROP_AUTOTRIM);
 
 	if (props != NULL) {
 		spa_configfile_set(spa, props, B_FALSE);
@@ -6711,6 +6769,9 @@ spa_sync_props(void *arg, dmu_tx_t *tx)
 					spa_async_request(spa,
 					    SPA_ASYNC_AUTOEXPAND);
 				break;
+			case ZPOOL_PROP_AUTOTRIM:
+				spa->spa_autotrim = intval;
+				break;
 			case ZPOOL_PROP_DEDUPDITTO:
 				spa->spa_dedup_ditto = intval;
 				break;
@@ -6811,6 +6872,9 @@ spa_sync(spa_t *spa, uint64_t txg)
 	vdev_t *rvd = spa->spa_root_vdev;
 	vdev_t *vd;
 	dmu_tx_t *tx;
+	taskq_t *vdev_tq;
+	hrtime_t phase_time[SPA_SYNC_PHASES] = { 0 };
+	hrtime_t start;
 	int error;
 	int c;
 	uint32_t max_queue_depth = zfs_vdev_async_write_max_active *
@@ -6825,6 +6889,9 @@ spa_sync(spa_t *spa, uint64_t txg)
 
 	spa->spa_syncing_txg = txg;
 	spa->spa_sync_pass = 0;
+	spa->spa_sm_logged = 0;
+	spa->spa_sm_flushed = 0;
+	spa->spa_sm_saved = 0;
 
 	mutex_enter(&spa->spa_alloc_lock);
 	VERIFY0(avl_numnodes(&spa->spa_alloc_tree));
@@ -6891,13 +6958,29 @@ spa_sync(spa_t *spa, uint64_t txg)
 	 * The max queue depth will not change in the middle of syncing
 	 * out this txg.
 	 */
-	uint64_t queue_depth_total = 0;
+	metaslab_class_t *normal = spa_normal_class(spa);
+	metaslab_class_t *special = spa_special_class(spa);
+	metaslab_class_t *dedup = spa_dedup_class(spa);
+
+	ASSERT0(refcount_count(&normal->mc_alloc_slots));
+	ASSERT0(refcount_count(&special->mc_alloc_slots));
+	ASSERT0(refcount_count(&dedup->mc_alloc_slots));
+	normal->mc_alloc_max_slots = 0;
+	special->mc_alloc_max_slots = 0;
+	dedup->mc_alloc_max_slots = 0;
+
 	for (int c = 0; c < rvd->vdev_children; c++) {
 		vdev_t *tvd = rvd->vdev_child[c];
 		metaslab_group_t *mg = tvd->vdev_mg;
 
-		if (mg == NULL || mg->mg_class != spa_normal_class(spa) ||
-		    !metaslab_group_initialized(mg))
+		if (mg == NULL || !metaslab_group_initialized(mg))
+			continue;
+
+		/*
+		 * The intent log class is not throttled.
+		 */
+		metaslab_class_t *mc = mg->mg_class;
+		if (mc != normal && mc != special && mc != dedup)
 			continue;
 
 		/*
@@ -6907,14 +6990,14 @@ spa_sync(spa_t *spa, uint64_t txg)
 		 */
 		ASSERT0(refcount_count(&mg->mg_alloc_queue_depth));
 		mg->mg_max_alloc_queue_depth = max_queue_depth;
-		queue_depth_total += mg->mg_max_alloc_queue_depth;
+		mc->mc_alloc_max_slots += mg->mg_max_alloc_queue_depth;
 	}
-	metaslab_class_t *mc = spa_normal_class(spa);
-	ASSERT0(refcount_count(&mc->mc_alloc_slots));
-	mc->mc_alloc_max_slots = queue_depth_total;
-	mc->mc_alloc_throttle_enabled = zio_dva_throttle_enabled;
+	normal->mc_alloc_throttle_enabled = zio_dva_throttle_enabled;
+	special->mc_alloc_throttle_enabled = zio_dva_throttle_enabled;
+	dedup->mc_alloc_throttle_enabled = zio_dva_throttle_enabled;
 
-	ASSERT3U(mc->mc_alloc_max_slots, <=,
+	ASSERT3U(normal->mc_alloc_max_slots + special->mc_alloc_max_slots +
+	    dedup->mc_alloc_max_slots, <=,
 	    max_queue_depth * rvd->vdev_children);
 
 	/*
@@ -6929,8 +7012,12 @@ spa_sync(spa_t *spa, uint64_t txg)
 		spa_sync_aux_dev(spa, &spa->spa_l2cache, tx,
 		    ZPOOL_CONFIG_L2CACHE, DMU_POOL_L2CACHE);
 		spa_errlog_sync(spa, txg);
+
+		start = gethrtime();
 		dsl_pool_sync(dp, txg);
+		phase_time[SPA_SYNC_PHASE_DATASETS] += gethrtime() - start;
 
+		start = gethrtime();
 		if (pass < zfs_sync_pass_deferred_free) {
 			spa_sync_frees(spa, free_bpl, tx);
 		} else {
@@ -6942,12 +7029,23 @@ spa_sync(spa_t *spa, uint64_t txg)
 			bplist_iterate(free_bpl, bpobj_enqueue_cb,
 			    &spa->spa_deferred_bpobj, tx);
 		}
+		phase_time[SPA_SYNC_PHASE_FREES] += gethrtime() - start;
 
 		ddt_sync(spa, txg);
 		dsl_scan_sync(dp, tx);
 
+		/*
+		 * The metaslabs of each dirty vdev are written out on the
+		 * dp_sync_taskq, which dsl_pool_sync() has drained.  Wait
+		 * for them before the MOS is checked for dirty data.
+		 */
+		start = gethrtime();
+		vdev_tq = zfs_sync_vdevs_parallel ? dp->dp_sync_taskq : NULL;
 		while ((vd = txg_list_remove(&spa->spa_vdev_txg_list, txg)))
-			vdev_sync(vd, txg);
+			vdev_sync(vd, txg, vdev_tq);
+		if (vdev_tq != NULL)
+			taskq_wait(vdev_tq);
+		phase_time[SPA_SYNC_PHASE_VDEVS] += gethrtime() - start;
 
 		if (pass == 1) {
 			spa_sync_upgrades(spa, tx);
@@ -6978,7 +7076,9 @@ spa_sync(spa_t *spa, uint64_t txg)
 				ASSERT(txg_list_empty(&dp->dp_sync_tasks, txg));
 				break;
 			}
+			start = gethrtime();
 			spa_sync_deferred_frees(spa, tx);
+			phase_time[SPA_SYNC_PHASE_FREES] += gethrtime() - start;
 		}
 
 	} while (dmu_objset_is_dirty(mos, txg));
@@ -7007,7 +7107,7 @@ spa_sync(spa_t *spa, uint64_t txg)
 	 * config cache (see spa_vdev_add() for a complete description).
 	 * If there *are* dirty vdevs, sync the uberblock to all vdevs.
 	 */
-
+	start = gethrtime();
 	for (;;) {
 		/*
 		 * We hold SCL_STATE to prevent vdev open/close/etc.
@@ -7046,6 +7146,7 @@ spa_sync(spa_t *spa, uint64_t txg)
 		zio_resume_wait(spa);
 	}
 	dmu_tx_commit(tx);
+	phase_time[SPA_SYNC_PHASE_CONFIG] = gethrtime() - start;
 
 #ifdef __linux__
 	taskq_cancel_id(system_taskq, spa->spa_deadman_tqid);
@@ -7079,8 +7180,10 @@ spa_sync(spa_t *spa, uint64_t txg)
 	/*
 	 * Update usable space statistics.
 	 */
+	start = gethrtime();
 	while ((vd = txg_list_remove(&spa->spa_vdev_txg_list, TXG_CLEAN(txg))))
 		vdev_sync_done(vd, txg);
+	phase_time[SPA_SYNC_PHASE_DONE] = gethrtime() - start;
 
 	spa_update_dspace(spa);
 
@@ -7092,6 +7195,11 @@ spa_sync(spa_t *spa, uint64_t txg)
 	ASSERT(txg_list_empty(&dp->dp_dirty_dirs, txg));
 	ASSERT(txg_list_empty(&spa->spa_vdev_txg_list, txg));
 
+	spa_txg_history_set_sm(spa, txg, spa->spa_sm_logged,
+	    spa->spa_sm_flushed, spa->spa_sm_saved);
+
+	spa_txg_history_set_sync(spa, txg, spa->spa_sync_pass, phase_time);
+
 	spa->spa_sync_pass = 0;
 
 	spa_config_exit(spa, SCL_CONFIG, FTAG);
@@ -7102,6 +7210,8 @@ spa_sync(spa_t *spa, uint64_t txg)
 	 * If any async tasks have been requested, kick them off.
 	 */
 	spa_async_dispatch(spa);
+
+	spa_auto_trim(spa, txg);
 }
 
 /*
@@ -43,6 +43,7 @@
 #include <sys/uberblock_impl.h>
 #include <sys/txg.h>
 #include <sys/avl.h>
+#include <sys/btree.h>
 #include <sys/unique.h>
 #include <sys/dsl_pool.h>
 #include <sys/dsl_dir.h>
@@ -302,6 +303,22 @@ int spa_asize_inflation = 24;
 int spa_slop_shift = 5;
 uint64_t spa_min_slop = 128 * 1024 * 1024;
 
+/*
+ * Number of allocators per metaslab class. Each allocator keeps its own
+ * rotor position and its own active metaslab in every metaslab group, so
+ * that concurrent writers do not all serialize on one metaslab's ms_lock.
+ * The value is sampled when a pool is opened or created.
+ */
+int spa_allocators = 4;
+
+/*
+ * Percentage of the special class that is kept for metadata.  Once the
+ * special class is this full, small file blocks (see special_small_blocks)
+ * go to the normal class instead, so that metadata can still be placed on
+ * the special vdevs.
+ */
+int zfs_special_class_metadata_reserve_pct = 25;
+
 /*
  * ==========================================================================
  * SPA config locking
@@ -527,13 +544,16 @@ spa_add(const char *name, nvlist_t *config, const char *altroot)
 	mutex_init(&spa->spa_suspend_lock, NULL, MUTEX_DEFAULT, NULL);
 	mutex_init(&spa->spa_vdev_top_lock, NULL, MUTEX_DEFAULT, NULL);
 	mutex_init(&spa->spa_feat_stats_lock, NULL, MUTEX_DEFAULT, NULL);
+	mutex_init(&spa->spa_feat_refcount_lock, NULL, MUTEX_DEFAULT, NULL);
 	mutex_init(&spa->spa_alloc_lock, NULL, MUTEX_DEFAULT, NULL);
+	mutex_init(&spa->spa_trim_lock, NULL, MUTEX_DEFAULT, NULL);
 
 	cv_init(&spa->spa_async_cv, NULL, CV_DEFAULT, NULL);
 	cv_init(&spa->spa_evicting_os_cv, NULL, CV_DEFAULT, NULL);
 	cv_init(&spa->spa_proc_cv, NULL, CV_DEFAULT, NULL);
 	cv_init(&spa->spa_scrub_io_cv, NULL, CV_DEFAULT, NULL);
 	cv_init(&spa->spa_suspend_cv, NULL, CV_DEFAULT, NULL);
+	cv_init(&spa->spa_trim_cv, NULL, CV_DEFAULT, NULL);
 
 	for (t = 0; t < TXG_SIZE; t++)
 		bplist_create(&spa->spa_free_bplist[t]);
@@ -547,6 +567,7 @@ spa_add(const char *name, nvlist_t *config, const char *altroot)
 	spa->spa_proc_state = SPA_PROC_NONE;
 
 	spa->spa_deadman_synctime = MSEC2NSEC(zfs_deadman_synctime_ms);
+	spa->spa_alloc_count = MAX(1, spa_allocators);
 
 	refcount_create(&spa->spa_refcount);
 	spa_config_lock_init(spa);
@@ -663,6 +684,7 @@ spa_remove(spa_t *spa)
 	cv_destroy(&spa->spa_proc_cv);
 	cv_destroy(&spa->spa_scrub_io_cv);
 	cv_destroy(&spa->spa_suspend_cv);
+	cv_destroy(&spa->spa_trim_cv);
 
 	mutex_destroy(&spa->spa_alloc_lock);
 	mutex_destroy(&spa->spa_async_lock);
@@ -677,6 +699,8 @@ spa_remove(spa_t *spa)
 	mutex_destroy(&spa->spa_suspend_lock);
 	mutex_destroy(&spa->spa_vdev_top_lock);
 	mutex_destroy(&spa->spa_feat_stats_lock);
+	mutex_destroy(&spa->spa_feat_refcount_lock);
+	mutex_destroy(&spa->spa_trim_lock);
 
 	kmem_free(spa, sizeof (spa_t));
 }
@@ -1047,6 +1071,8 @@ spa_vdev_config_exit(spa_t *spa, vdev_t *vd, uint64_t txg, int error, char *tag)
 	 */
 	ASSERT(metaslab_class_validate(spa_normal_class(spa)) == 0);
 	ASSERT(metaslab_class_validate(spa_log_class(spa)) == 0);
+	ASSERT(metaslab_class_validate(spa_special_class(spa)) == 0);
+	ASSERT(metaslab_class_validate(spa_dedup_class(spa)) == 0);
 
 	spa_config_exit(spa, SCL_ALL, spa);
 
@@ -1345,6 +1371,28 @@ spa_generate_guid(spa_t *spa)
 	return (guid);
 }
 
+/*
+ * Pick the metaslab allocator for a block. Blocks of the same object that
+ * are close together in the file (within 2^20 blocks) hash to the same
+ * allocator so that they keep being laid out contiguously, while writes
+ * to unrelated objects are spread over all of the pool's allocators.
+ */
+int
+spa_alloc_select(spa_t *spa, uint64_t objset, uint64_t object, uint64_t blkid)
+{
+	uint64_t hash;
+
+	if (spa->spa_alloc_count <= 1)
+		return (0);
+
+	hash = objset * 0x9e3779b97f4a7c15ULL;
+	hash = (hash ^ (hash >> 29) ^ object) * 0xbf58476d1ce4e5b9ULL;
+	hash = (hash ^ (hash >> 32) ^ (blkid >> 20)) * 0x94d049bb133111ebULL;
+	hash ^= hash >> 31;
+
+	return ((int)(hash % spa->spa_alloc_count));
+}
+
 void
 snprintf_blkptr(char *buf, size_t buflen, const blkptr_t *bp)
 {
@@ -1647,6 +1695,61 @@ spa_log_class(spa_t *spa)
 	return (spa->spa_log_class);
 }
 
+metaslab_class_t *
+spa_special_class(spa_t *spa)
+{
+	return (spa->spa_special_class);
+}
+
+metaslab_class_t *
+spa_dedup_class(spa_t *spa)
+{
+	return (spa->spa_dedup_class);
+}
+
+/*
+ * Locate an appropriate allocation class for a block of the given type,
+ * level and size.  Intent log blocks go to the log class, if there is one,
+ * and dedup table blocks to the dedup class, if there is one.  Other
+ * metadata and indirect blocks go to the special class, if there is one,
+ * as do file data blocks no larger than the dataset's special_small_blocks
+ * while the special class has room for them.  Everything else goes to the
+ * normal class.
+ */
+metaslab_class_t *
+spa_preferred_class(spa_t *spa, uint64_t size, dmu_object_type_t objtype,
+    uint_t level, uint_t special_smallblk)
+{
+	metaslab_class_t *special = spa_special_class(spa);
+
+	if (DMU_OT_IS_ZIL(objtype)) {
+		if (spa->spa_log_class->mc_groups != 0)
+			return (spa_log_class(spa));
+		else
+			return (spa_normal_class(spa));
+	}
+
+	if (DMU_OT_IS_DDT(objtype) && spa->spa_dedup_class->mc_groups != 0)
+		return (spa_dedup_class(spa));
+
+	if (special->mc_groups == 0)
+		return (spa_normal_class(spa));
+
+	if (level > 0 || DMU_OT_IS_METADATA(objtype))
+		return (special);
+
+	if (DMU_OT_IS_FILE(objtype) && size <= special_smallblk) {
+		uint64_t space = metaslab_class_get_space(special);
+		uint64_t limit = space * (100 -
+		    MIN(zfs_special_class_metadata_reserve_pct, 100)) / 100;
+
+		if (metaslab_class_get_alloc(special) < limit)
+			return (special);
+	}
+
+	return (spa_normal_class(spa));
+}
+
 void
 spa_evicting_os_register(spa_t *spa, objset_t *os)
 {
@@ -1812,13 +1915,15 @@ spa_init(int mode)
 	fm_init();
 	refcount_init();
 	unique_init();
-	range_tree_init();
+	zfs_btree_init();
 	metaslab_alloc_trace_init();
 	ddt_init();
 	zio_init();
 	dmu_init();
 	zil_init();
 	vdev_cache_stat_init();
+	vdev_queue_cache_init();
+	vdev_queue_stat_init();
 	zfs_prop_init();
 	zpool_prop_init();
 	zpool_feature_init();
@@ -1833,13 +1938,15 @@ spa_fini(void)
 
 	spa_evict_all();
 
+	vdev_queue_stat_fini();
+	vdev_queue_cache_fini();
 	vdev_cache_stat_fini();
 	zil_fini();
 	dmu_fini();
 	zio_fini();
 	ddt_fini();
 	metaslab_alloc_trace_fini();
-	range_tree_fini();
+	zfs_btree_fini();
 	unique_fini();
 	refcount_fini();
 	fm_fini();
@@ -1953,6 +2060,7 @@ int
 spa_scan_get_stats(spa_t *spa, pool_scan_stat_t *ps)
 {
 	dsl_scan_t *scn = spa->spa_dsl_pool ? spa->spa_dsl_pool->dp_scan : NULL;
+	uint64_t queued;
 
 	if (scn == NULL || scn->scn_phys.scn_func == POOL_SCAN_NONE)
 		return (SET_ERROR(ENOENT));
@@ -1975,6 +2083,14 @@ spa_scan_get_stats(spa_t *spa, pool_scan_stat_t *ps)
 	ps->pss_pass_scrub_pause = spa->spa_scan_pass_scrub_pause;
 	ps->pss_pass_scrub_spent_paused = spa->spa_scan_pass_scrub_spent_paused;
 
+	/*
+	 * Everything examined has been issued, except what is still waiting
+	 * in the sorted scan queues.
+	 */
+	queued = scn->scn_queued_bytes;
+	ps->pss_issued = ps->pss_examined - MIN(queued, ps->pss_examined);
+	ps->pss_pass_issued = ps->pss_pass_exam - MIN(queued, ps->pss_pass_exam);
+
 	return (0);
 }
 
@@ -1992,3 +2108,12 @@ spa_maxblocksize(spa_t *spa)
 	else
 		return (SPA_OLD_MAXBLOCKSIZE);
 }
+
+int
+spa_maxdnodesize(spa_t *spa)
+{
+	if (spa_feature_is_enabled(spa, SPA_FEATURE_LARGE_DNODE))
+		return (DNODE_MAX_SIZE);
+	else
+		return (DNODE_MIN_SIZE);
+}
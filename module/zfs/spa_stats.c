@@ -21,6 +21,8 @@
 
 #include <sys/zfs_context.h>
 #include <sys/spa_impl.h>
+#include <sys/metaslab_impl.h>
+#include <sys/vdev_impl.h>
 
 /*
  * Keeps stats on last N reads per spa_t, disabled by default.
@@ -37,6 +39,11 @@ int zfs_read_history_hits = 0;
  */
 int zfs_txg_history = 0;
 
+/*
+ * Keeps the last N metaslab group fragmentation samples, disabled by default.
+ */
+int zfs_frag_history = 0;
+
 /*
  * ==========================================================================
  * SPA Read History Routines
@@ -248,6 +255,11 @@ typedef struct spa_txg_history {
 	uint64_t	reads;		/* number of read operations */
 	uint64_t	writes;		/* number of write operations */
 	uint64_t	ndirty;		/* number of dirty bytes */
+	uint64_t	smlogged;	/* metaslab changes logged */
+	uint64_t	smflushed;	/* metaslabs flushed */
+	int64_t		smsaved;	/* space map bytes not written */
+	uint64_t	passes;		/* sync passes */
+	hrtime_t	phase_times[SPA_SYNC_PHASES]; /* spa_sync() phases */
 	hrtime_t	times[TXG_STATE_COMMITTED]; /* completion times */
 	list_node_t	sth_link;
 } spa_txg_history_t;
@@ -256,9 +268,11 @@ static int
 spa_txg_history_headers(char *buf, size_t size)
 {
 	(void) snprintf(buf, size, "%-8s %-16s %-5s %-12s %-12s %-12s "
-	    "%-8s %-8s %-12s %-12s %-12s %-12s\n", "txg", "birth", "state",
-	    "ndirty", "nread", "nwritten", "reads", "writes",
-	    "otime", "qtime", "wtime", "stime");
+	    "%-8s %-8s %-12s %-12s %-12s %-12s %-10s %-10s %-12s %-6s %-12s "
+	    "%-12s %-12s %-12s %-12s\n", "txg", "birth", "state", "ndirty",
+	    "nread", "nwritten", "reads", "writes", "otime", "qtime", "wtime",
+	    "stime", "smlogged", "smflushed", "smsaved", "passes", "dsltime",
+	    "freetime", "vdevtime", "conftime", "donetime");
 
 	return (0);
 }
@@ -297,13 +311,22 @@ spa_txg_history_data(char *buf, size_t size, void *data)
 		    sth->times[TXG_STATE_WAIT_FOR_SYNC];
 
 	(void) snprintf(buf, size, "%-8llu %-16llu %-5c %-12llu "
-	    "%-12llu %-12llu %-8llu %-8llu %-12llu %-12llu %-12llu %-12llu\n",
+	    "%-12llu %-12llu %-8llu %-8llu %-12llu %-12llu %-12llu %-12llu "
+	    "%-10llu %-10llu %-12lld %-6llu %-12llu %-12llu %-12llu %-12llu "
+	    "%-12llu\n",
 	    (longlong_t)sth->txg, sth->times[TXG_STATE_BIRTH], state,
 	    (u_longlong_t)sth->ndirty,
 	    (u_longlong_t)sth->nread, (u_longlong_t)sth->nwritten,
 	    (u_longlong_t)sth->reads, (u_longlong_t)sth->writes,
 	    (u_longlong_t)open, (u_longlong_t)quiesce, (u_longlong_t)wait,
-	    (u_longlong_t)sync);
+	    (u_longlong_t)sync, (u_longlong_t)sth->smlogged,
+	    (u_longlong_t)sth->smflushed, (longlong_t)sth->smsaved,
+	    (u_longlong_t)sth->passes,
+	    (u_longlong_t)sth->phase_times[SPA_SYNC_PHASE_DATASETS],
+	    (u_longlong_t)sth->phase_times[SPA_SYNC_PHASE_FREES],
+	    (u_longlong_t)sth->phase_times[SPA_SYNC_PHASE_VDEVS],
+	    (u_longlong_t)sth->phase_times[SPA_SYNC_PHASE_CONFIG],
+	    (u_longlong_t)sth->phase_times[SPA_SYNC_PHASE_DONE]);
 
 	return (0);
 }
@@ -505,6 +528,70 @@ spa_txg_history_set_io(spa_t *spa, uint64_t txg, uint64_t nread,
 	return (error);
 }
 
+/*
+ * Set txg log space map stats: the number of metaslab updates written to
+ * the vdevs' log space maps, the number of metaslabs flushed, and the
+ * space map bytes that logging saved writing (negative when the logs and
+ * flushes cost more than they saved).
+ */
+int
+spa_txg_history_set_sm(spa_t *spa, uint64_t txg, uint64_t smlogged,
+    uint64_t smflushed, uint64_t smsaved)
+{
+	spa_stats_history_t *ssh = &spa->spa_stats.txg_history;
+	spa_txg_history_t *sth;
+	int error = ENOENT;
+
+	if (zfs_txg_history == 0)
+		return (0);
+
+	mutex_enter(&ssh->lock);
+	for (sth = list_head(&ssh->list); sth != NULL;
+	    sth = list_next(&ssh->list, sth)) {
+		if (sth->txg == txg) {
+			sth->smlogged = smlogged;
+			sth->smflushed = smflushed;
+			sth->smsaved = (int64_t)smsaved;
+			error = 0;
+			break;
+		}
+	}
+	mutex_exit(&ssh->lock);
+
+	return (error);
+}
+
+/*
+ * Set txg sync stats: the number of sync passes and the time spa_sync()
+ * spent in each of its phases (see spa_sync_phase_t).
+ */
+int
+spa_txg_history_set_sync(spa_t *spa, uint64_t txg, uint64_t passes,
+    const hrtime_t *phase_time)
+{
+	spa_stats_history_t *ssh = &spa->spa_stats.txg_history;
+	spa_txg_history_t *sth;
+	int error = ENOENT;
+
+	if (zfs_txg_history == 0)
+		return (0);
+
+	mutex_enter(&ssh->lock);
+	for (sth = list_head(&ssh->list); sth != NULL;
+	    sth = list_next(&ssh->list, sth)) {
+		if (sth->txg == txg) {
+			sth->passes = passes;
+			bcopy(phase_time, sth->phase_times,
+			    sizeof (sth->phase_times));
+			error = 0;
+			break;
+		}
+	}
+	mutex_exit(&ssh->lock);
+
+	return (error);
+}
+
 /*
  * ==========================================================================
  * SPA TX Assign Histogram Routines
@@ -513,7 +600,16 @@ spa_txg_history_set_io(spa_t *spa, uint64_t txg, uint64_t nread,
 
 /*
  * Tx statistics - Information exported regarding dmu_tx_assign time.
+ *
+ * The kstat holds SPA_TXA_HISTS power-of-two histograms laid out back to
+ * back, each SPA_TX_ASSIGN_BUCKETS long.  The first keeps its historical
+ * "<n> ns" names; the rest are prefixed with the histogram name.
  */
+#define	SPA_TX_ASSIGN_BUCKETS	42	/* 1ns to 2,199s */
+
+static const char *spa_tx_assign_hist_names[SPA_TXA_HISTS] = {
+	"", "assign ", "dirty ", "suspended ", "dnode ", "open "
+};
 
 /*
  * When the kstat is written zero all buckets.  When the kstat is read
@@ -553,7 +649,7 @@ spa_tx_assign_init(spa_t *spa)
 
 	mutex_init(&ssh->lock, NULL, MUTEX_DEFAULT, NULL);
 
-	ssh->count = 42; /* power of two buckets for 1ns to 2,199s */
+	ssh->count = SPA_TXA_HISTS * SPA_TX_ASSIGN_BUCKETS;
 	ssh->size = ssh->count * sizeof (kstat_named_t);
 	ssh->_private = kmem_alloc(ssh->size, KM_SLEEP);
 
@@ -563,8 +659,9 @@ spa_tx_assign_init(spa_t *spa)
 		ks = &((kstat_named_t *)ssh->_private)[i];
 		ks->data_type = KSTAT_DATA_UINT64;
 		ks->value.ui64 = 0;
-		(void) snprintf(ks->name, KSTAT_STRLEN, "%llu ns",
-		    (u_longlong_t)1 << i);
+		(void) snprintf(ks->name, KSTAT_STRLEN, "%s%llu ns",
+		    spa_tx_assign_hist_names[i / SPA_TX_ASSIGN_BUCKETS],
+		    (u_longlong_t)1 << (i % SPA_TX_ASSIGN_BUCKETS));
 	}
 
 	ksp = kstat_create(name, 0, "dmu_tx_assign", "misc",
@@ -597,17 +694,450 @@ spa_tx_assign_destroy(spa_t *spa)
 }
 
 void
-spa_tx_assign_add_nsecs(spa_t *spa, uint64_t nsecs)
+spa_tx_assign_add_nsecs(spa_t *spa, spa_tx_assign_hist_t hist, uint64_t nsecs)
 {
 	spa_stats_history_t *ssh = &spa->spa_stats.tx_assign_histogram;
 	uint64_t idx = 0;
 
-	while (((1 << idx) < nsecs) && (idx < ssh->size - 1))
+	ASSERT3U(hist, <, SPA_TXA_HISTS);
+
+	while (((1ULL << idx) < nsecs) && (idx < SPA_TX_ASSIGN_BUCKETS - 1))
 		idx++;
 
+	idx += hist * SPA_TX_ASSIGN_BUCKETS;
 	atomic_inc_64(&((kstat_named_t *)ssh->_private)[idx].value.ui64);
 }
 
+/*
+ * ==========================================================================
+ * SPA ZIL Commit Histogram Routines
+ * ==========================================================================
+ */
+
+/*
+ * ZIL statistics - Information exported regarding zil_commit() latency.
+ *
+ * Laid out like the dmu_tx_assign kstat: SPA_ZCH_HISTS power-of-two
+ * histograms back to back, each SPA_ZIL_COMMIT_BUCKETS long and prefixed
+ * with the histogram name.
+ */
+#define	SPA_ZIL_COMMIT_BUCKETS	42	/* 1ns to 2,199s */
+
+static const char *spa_zil_commit_hist_names[SPA_ZCH_HISTS] = {
+	"commit ", "wait ", "lwb "
+};
+
+static int
+spa_zil_commit_update(kstat_t *ksp, int rw)
+{
+	spa_t *spa = ksp->ks_private;
+	spa_stats_history_t *ssh = &spa->spa_stats.zil_commit_histogram;
+	int i;
+
+	if (rw == KSTAT_WRITE) {
+		for (i = 0; i < ssh->count; i++)
+			((kstat_named_t *)ssh->_private)[i].value.ui64 = 0;
+	}
+
+	for (i = ssh->count; i > 0; i--)
+		if (((kstat_named_t *)ssh->_private)[i-1].value.ui64 != 0)
+			break;
+
+	ksp->ks_ndata = i;
+	ksp->ks_data_size = i * sizeof (kstat_named_t);
+
+	return (0);
+}
+
+static void
+spa_zil_commit_init(spa_t *spa)
+{
+	spa_stats_history_t *ssh = &spa->spa_stats.zil_commit_histogram;
+	char name[KSTAT_STRLEN];
+	kstat_named_t *ks;
+	kstat_t *ksp;
+	int i;
+
+	mutex_init(&ssh->lock, NULL, MUTEX_DEFAULT, NULL);
+
+	ssh->count = SPA_ZCH_HISTS * SPA_ZIL_COMMIT_BUCKETS;
+	ssh->size = ssh->count * sizeof (kstat_named_t);
+	ssh->_private = kmem_alloc(ssh->size, KM_SLEEP);
+
+	(void) snprintf(name, KSTAT_STRLEN, "zfs/%s", spa_name(spa));
+
+	for (i = 0; i < ssh->count; i++) {
+		ks = &((kstat_named_t *)ssh->_private)[i];
+		ks->data_type = KSTAT_DATA_UINT64;
+		ks->value.ui64 = 0;
+		(void) snprintf(ks->name, KSTAT_STRLEN, "%s%llu ns",
+		    spa_zil_commit_hist_names[i / SPA_ZIL_COMMIT_BUCKETS],
+		    (u_longlong_t)1 << (i % SPA_ZIL_COMMIT_BUCKETS));
+	}
+
+	ksp = kstat_create(name, 0, "zil_commit", "misc",
+	    KSTAT_TYPE_NAMED, 0, KSTAT_FLAG_VIRTUAL);
+	ssh->kstat = ksp;
+
+	if (ksp) {
+		ksp->ks_lock = &ssh->lock;
+		ksp->ks_data = ssh->_private;
+		ksp->ks_ndata = ssh->count;
+		ksp->ks_data_size = ssh->size;
+		ksp->ks_private = spa;
+		ksp->ks_update = spa_zil_commit_update;
+		kstat_install(ksp);
+	}
+}
+
+static void
+spa_zil_commit_destroy(spa_t *spa)
+{
+	spa_stats_history_t *ssh = &spa->spa_stats.zil_commit_histogram;
+	kstat_t *ksp;
+
+	ksp = ssh->kstat;
+	if (ksp)
+		kstat_delete(ksp);
+
+	kmem_free(ssh->_private, ssh->size);
+	mutex_destroy(&ssh->lock);
+}
+
+void
+spa_zil_commit_add_nsecs(spa_t *spa, spa_zil_commit_hist_t hist,
+    uint64_t nsecs)
+{
+	spa_stats_history_t *ssh = &spa->spa_stats.zil_commit_histogram;
+	uint64_t idx = 0;
+
+	ASSERT3U(hist, <, SPA_ZCH_HISTS);
+
+	while (((1ULL << idx) < nsecs) && (idx < SPA_ZIL_COMMIT_BUCKETS - 1))
+		idx++;
+
+	idx += hist * SPA_ZIL_COMMIT_BUCKETS;
+	atomic_inc_64(&((kstat_named_t *)ssh->_private)[idx].value.ui64);
+}
+
+/*
+ * ==========================================================================
+ * SPA ZIL Log Block Histogram Routines
+ * ==========================================================================
+ */
+
+/*
+ * ZIL statistics - Information exported regarding the log blocks (lwbs)
+ * written by the ZIL: a power-of-two histogram of the allocated block
+ * sizes (4K to 16M), followed by a histogram of how full each block was
+ * when issued, in 10% steps.
+ */
+#define	SPA_ZIL_LWB_SIZE_SHIFT		12	/* 4K */
+#define	SPA_ZIL_LWB_SIZE_BUCKETS	13	/* 4K to 16M */
+#define	SPA_ZIL_LWB_FILL_BUCKETS	10	/* 10% to 100% */
+
+static int
+spa_zil_lwb_update(kstat_t *ksp, int rw)
+{
+	spa_t *spa = ksp->ks_private;
+	spa_stats_history_t *ssh = &spa->spa_stats.zil_lwb_histogram;
+	int i;
+
+	if (rw == KSTAT_WRITE) {
+		for (i = 0; i < ssh->count; i++)
+			((kstat_named_t *)ssh->_private)[i].value.ui64 = 0;
+	}
+
+	return (0);
+}
+
+static void
+spa_zil_lwb_init(spa_t *spa)
+{
+	spa_stats_history_t *ssh = &spa->spa_stats.zil_lwb_histogram;
+	char name[KSTAT_STRLEN];
+	kstat_named_t *ks;
+	kstat_t *ksp;
+	int i;
+
+	mutex_init(&ssh->lock, NULL, MUTEX_DEFAULT, NULL);
+
+	ssh->count = SPA_ZIL_LWB_SIZE_BUCKETS + SPA_ZIL_LWB_FILL_BUCKETS;
+	ssh->size = ssh->count * sizeof (kstat_named_t);
+	ssh->_private = kmem_alloc(ssh->size, KM_SLEEP);
+
+	(void) snprintf(name, KSTAT_STRLEN, "zfs/%s", spa_name(spa));
+
+	for (i = 0; i < ssh->count; i++) {
+		ks = &((kstat_named_t *)ssh->_private)[i];
+		ks->data_type = KSTAT_DATA_UINT64;
+		ks->value.ui64 = 0;
+		if (i < SPA_ZIL_LWB_SIZE_BUCKETS) {
+			(void) snprintf(ks->name, KSTAT_STRLEN, "size %llu",
+			    (u_longlong_t)1 << (i + SPA_ZIL_LWB_SIZE_SHIFT));
+		} else {
+			(void) snprintf(ks->name, KSTAT_STRLEN, "fill %d%%",
+			    (i - SPA_ZIL_LWB_SIZE_BUCKETS + 1) * 10);
+		}
+	}
+
+	ksp = kstat_create(name, 0, "zil_lwb", "misc",
+	    KSTAT_TYPE_NAMED, 0, KSTAT_FLAG_VIRTUAL);
+	ssh->kstat = ksp;
+
+	if (ksp) {
+		ksp->ks_lock = &ssh->lock;
+		ksp->ks_data = ssh->_private;
+		ksp->ks_ndata = ssh->count;
+		ksp->ks_data_size = ssh->size;
+		ksp->ks_private = spa;
+		ksp->ks_update = spa_zil_lwb_update;
+		kstat_install(ksp);
+	}
+}
+
+static void
+spa_zil_lwb_destroy(spa_t *spa)
+{
+	spa_stats_history_t *ssh = &spa->spa_stats.zil_lwb_histogram;
+	kstat_t *ksp;
+
+	ksp = ssh->kstat;
+	if (ksp)
+		kstat_delete(ksp);
+
+	kmem_free(ssh->_private, ssh->size);
+	mutex_destroy(&ssh->lock);
+}
+
+/*
+ * Account for an lwb being issued: "size" is the allocated block size,
+ * "fill" the percentage of it holding log records.
+ */
+void
+spa_zil_lwb_add(spa_t *spa, uint64_t size, uint64_t fill)
+{
+	spa_stats_history_t *ssh = &spa->spa_stats.zil_lwb_histogram;
+	uint64_t idx = 0;
+
+	while (((1ULL << (idx + SPA_ZIL_LWB_SIZE_SHIFT)) < size) &&
+	    (idx < SPA_ZIL_LWB_SIZE_BUCKETS - 1))
+		idx++;
+	atomic_inc_64(&((kstat_named_t *)ssh->_private)[idx].value.ui64);
+
+	idx = (MIN(fill, 100) + 9) / 10;
+	idx = SPA_ZIL_LWB_SIZE_BUCKETS + MAX(idx, 1) - 1;
+	atomic_inc_64(&((kstat_named_t *)ssh->_private)[idx].value.ui64);
+}
+
+/*
+ * ==========================================================================
+ * SPA Fragmentation History Routines
+ * ==========================================================================
+ */
+
+/*
+ * Fragmentation statistics - A sample of each top-level vdev's metaslab
+ * group taken when the group is reassessed at the end of a txg sync.
+ */
+typedef struct spa_frag_history {
+	uint64_t	txg;		/* txg id */
+	hrtime_t	time;		/* time of the sample */
+	uint64_t	vdev;		/* top-level vdev id */
+	const char	*class;		/* allocation class */
+	uint64_t	frag;		/* group fragmentation percentage */
+	uint64_t	free;		/* group free capacity percentage */
+	uint64_t	alloc;		/* allocated bytes */
+	uint64_t	space;		/* total bytes */
+	uint64_t	allocs;		/* group allocation attempts */
+	uint64_t	fails;		/* group allocation failures */
+	list_node_t	sfh_link;
+} spa_frag_history_t;
+
+static int
+spa_frag_history_headers(char *buf, size_t size)
+{
+	(void) snprintf(buf, size, "%-8s %-16s %-6s %-8s %-5s %-5s %-14s "
+	    "%-14s %-12s %-12s\n", "txg", "time", "vdev", "class", "frag",
+	    "free", "alloc", "size", "allocs", "fails");
+
+	return (0);
+}
+
+static int
+spa_frag_history_data(char *buf, size_t size, void *data)
+{
+	spa_frag_history_t *sfh = (spa_frag_history_t *)data;
+	char frag[8];
+
+	if (sfh->frag == ZFS_FRAG_INVALID)
+		(void) strlcpy(frag, "-", sizeof (frag));
+	else
+		(void) snprintf(frag, sizeof (frag), "%llu",
+		    (u_longlong_t)sfh->frag);
+
+	(void) snprintf(buf, size, "%-8llu %-16llu %-6llu %-8s %-5s %-5llu "
+	    "%-14llu %-14llu %-12llu %-12llu\n",
+	    (u_longlong_t)sfh->txg, (u_longlong_t)sfh->time,
+	    (u_longlong_t)sfh->vdev, sfh->class, frag,
+	    (u_longlong_t)sfh->free, (u_longlong_t)sfh->alloc,
+	    (u_longlong_t)sfh->space, (u_longlong_t)sfh->allocs,
+	    (u_longlong_t)sfh->fails);
+
+	return (0);
+}
+
+/*
+ * Calculate the address for the next spa_stats_history_t entry.  The
+ * ssh->lock will be held until ksp->ks_ndata entries are processed.
+ */
+static void *
+spa_frag_history_addr(kstat_t *ksp, off_t n)
+{
+	spa_t *spa = ksp->ks_private;
+	spa_stats_history_t *ssh = &spa->spa_stats.frag_history;
+
+	ASSERT(MUTEX_HELD(&ssh->lock));
+
+	if (n == 0)
+		ssh->_private = list_tail(&ssh->list);
+	else if (ssh->_private)
+		ssh->_private = list_prev(&ssh->list, ssh->_private);
+
+	return (ssh->_private);
+}
+
+/*
+ * When the kstat is written discard all spa_frag_history_t entries.  The
+ * ssh->lock will be held until ksp->ks_ndata entries are processed.
+ */
+static int
+spa_frag_history_update(kstat_t *ksp, int rw)
+{
+	spa_t *spa = ksp->ks_private;
+	spa_stats_history_t *ssh = &spa->spa_stats.frag_history;
+
+	ASSERT(MUTEX_HELD(&ssh->lock));
+
+	if (rw == KSTAT_WRITE) {
+		spa_frag_history_t *sfh;
+
+		while ((sfh = list_remove_head(&ssh->list))) {
+			ssh->size--;
+			kmem_free(sfh, sizeof (spa_frag_history_t));
+		}
+
+		ASSERT3U(ssh->size, ==, 0);
+	}
+
+	ksp->ks_ndata = ssh->size;
+	ksp->ks_data_size = ssh->size * sizeof (spa_frag_history_t);
+
+	return (0);
+}
+
+static void
+spa_frag_history_init(spa_t *spa)
+{
+	spa_stats_history_t *ssh = &spa->spa_stats.frag_history;
+	char name[KSTAT_STRLEN];
+	kstat_t *ksp;
+
+	mutex_init(&ssh->lock, NULL, MUTEX_DEFAULT, NULL);
+	list_create(&ssh->list, sizeof (spa_frag_history_t),
+	    offsetof(spa_frag_history_t, sfh_link));
+
+	ssh->count = 0;
+	ssh->size = 0;
+	ssh->_private = NULL;
+
+	(void) snprintf(name, KSTAT_STRLEN, "zfs/%s", spa_name(spa));
+
+	ksp = kstat_create(name, 0, "fragmentation", "misc",
+	    KSTAT_TYPE_RAW, 0, KSTAT_FLAG_VIRTUAL);
+	ssh->kstat = ksp;
+
+	if (ksp) {
+		ksp->ks_lock = &ssh->lock;
+		ksp->ks_data = NULL;
+		ksp->ks_private = spa;
+		ksp->ks_update = spa_frag_history_update;
+		kstat_set_raw_ops(ksp, spa_frag_history_headers,
+		    spa_frag_history_data, spa_frag_history_addr);
+		kstat_install(ksp);
+	}
+}
+
+static void
+spa_frag_history_destroy(spa_t *spa)
+{
+	spa_stats_history_t *ssh = &spa->spa_stats.frag_history;
+	spa_frag_history_t *sfh;
+	kstat_t *ksp;
+
+	ksp = ssh->kstat;
+	if (ksp)
+		kstat_delete(ksp);
+
+	mutex_enter(&ssh->lock);
+	while ((sfh = list_remove_head(&ssh->list))) {
+		ssh->size--;
+		kmem_free(sfh, sizeof (spa_frag_history_t));
+	}
+
+	ASSERT3U(ssh->size, ==, 0);
+	list_destroy(&ssh->list);
+	mutex_exit(&ssh->lock);
+
+	mutex_destroy(&ssh->lock);
+}
+
+/*
+ * Record the state of a metaslab group after it was reassessed in "txg".
+ */
+void
+spa_frag_history_add(spa_t *spa, uint64_t txg, metaslab_group_t *mg)
+{
+	spa_stats_history_t *ssh = &spa->spa_stats.frag_history;
+	spa_frag_history_t *sfh, *rm;
+	vdev_t *vd = mg->mg_vd;
+
+	if (zfs_frag_history == 0 && ssh->size == 0)
+		return;
+
+	sfh = kmem_zalloc(sizeof (spa_frag_history_t), KM_SLEEP);
+	sfh->txg = txg;
+	sfh->time = gethrtime();
+	sfh->vdev = vd->vdev_id;
+	if (mg->mg_class == spa_log_class(spa))
+		sfh->class = "log";
+	else if (mg->mg_class == spa_special_class(spa))
+		sfh->class = "special";
+	else if (mg->mg_class == spa_dedup_class(spa))
+		sfh->class = "dedup";
+	else
+		sfh->class = "normal";
+	sfh->frag = mg->mg_fragmentation;
+	sfh->free = mg->mg_free_capacity;
+	sfh->alloc = vd->vdev_stat.vs_alloc;
+	sfh->space = vd->vdev_stat.vs_space;
+	sfh->allocs = mg->mg_allocations;
+	sfh->fails = mg->mg_failed_allocations;
+
+	mutex_enter(&ssh->lock);
+
+	list_insert_head(&ssh->list, sfh);
+	ssh->size++;
+
+	while (ssh->size > zfs_frag_history) {
+		ssh->size--;
+		rm = list_remove_tail(&ssh->list);
+		kmem_free(rm, sizeof (spa_frag_history_t));
+	}
+
+	mutex_exit(&ssh->lock);
+}
+
 /*
  * ==========================================================================
  * SPA IO History Routines
@@ -661,14 +1191,20 @@ spa_stats_init(spa_t *spa)
 	spa_read_history_init(spa);
 	spa_txg_history_init(spa);
 	spa_tx_assign_init(spa);
+	spa_zil_commit_init(spa);
+	spa_zil_lwb_init(spa);
 	spa_io_history_init(spa);
+	spa_frag_history_init(spa);
 }
 
 void
 spa_stats_destroy(spa_t *spa)
 {
+	spa_zil_lwb_destroy(spa);
+	spa_zil_commit_destroy(spa);
 	spa_tx_assign_destroy(spa);
 	spa_txg_history_destroy(spa);
 	spa_read_history_destroy(spa);
 	spa_io_history_destroy(spa);
+	spa_frag_history_destroy(spa);
 }
@@ -32,6 +32,7 @@
 #include <sys/dmu.h>
 #include <sys/dmu_tx.h>
 #include <sys/vdev_impl.h>
+#include <sys/vdev_log_spacemap.h>
 #include <sys/uberblock_impl.h>
 #include <sys/metaslab.h>
 #include <sys/metaslab_impl.h>
@@ -42,6 +43,7 @@
 #include <sys/fs/zfs.h>
 #include <sys/arc.h>
 #include <sys/zil.h>
+#include <sys/zfeature.h>
 #include <sys/dsl_scan.h>
 #include <sys/zvol.h>
 #include <sys/zfs_context.h>
@@ -355,6 +357,8 @@ vdev_alloc_common(spa_t *spa, uint_t id, uint64_t guid, vdev_ops_t *ops)
 	mutex_init(&vd->vdev_stat_lock, NULL, MUTEX_DEFAULT, NULL);
 	mutex_init(&vd->vdev_probe_lock, NULL, MUTEX_DEFAULT, NULL);
 	mutex_init(&vd->vdev_queue_lock, NULL, MUTEX_DEFAULT, NULL);
+	mutex_init(&vd->vdev_flush_lock, NULL, MUTEX_DEFAULT, NULL);
+	vdev_log_sm_create(vd);
 	for (t = 0; t < DTL_TYPES; t++) {
 		vd->vdev_dtl[t] = range_tree_create(NULL, NULL,
 		    &vd->vdev_dtl_lock);
@@ -370,6 +374,19 @@ vdev_alloc_common(spa_t *spa, uint_t id, uint64_t guid, vdev_ops_t *ops)
 	return (vd);
 }
 
+static vdev_alloc_bias_t
+vdev_derive_alloc_bias(const char *bias)
+{
+	vdev_alloc_bias_t alloc_bias = VDEV_BIAS_NONE;
+
+	if (strcmp(bias, VDEV_ALLOC_BIAS_SPECIAL) == 0)
+		alloc_bias = VDEV_BIAS_SPECIAL;
+	else if (strcmp(bias, VDEV_ALLOC_BIAS_DEDUP) == 0)
+		alloc_bias = VDEV_BIAS_DEDUP;
+
+	return (alloc_bias);
+}
+
 /*
  * Allocate a new vdev.  The 'alloctype' is used to control whether we are
  * creating a new vdev or loading an existing one - the behavior is slightly
@@ -380,8 +397,9 @@ vdev_alloc(spa_t *spa, vdev_t **vdp, nvlist_t *nv, vdev_t *parent, uint_t id,
     int alloctype)
 {
 	vdev_ops_t *ops;
-	char *type;
+	char *type, *bias;
 	uint64_t guid = 0, islog, nparity;
+	vdev_alloc_bias_t alloc_bias = VDEV_BIAS_NONE;
 	vdev_t *vd;
 
 	ASSERT(spa_config_held(spa, SCL_ALL, RW_WRITER) == SCL_ALL);
@@ -433,6 +451,26 @@ vdev_alloc(spa_t *spa, vdev_t **vdp, nvlist_t *nv, vdev_t *parent, uint_t id,
 	if (ops == &vdev_hole_ops && spa_version(spa) < SPA_VERSION_HOLES)
 		return (SET_ERROR(ENOTSUP));
 
+	/*
+	 * Determine the allocation class of a top-level vdev.  Adding a vdev
+	 * to a class other than the normal one needs the allocation_classes
+	 * feature; spa_create() checks for it itself, as the feature is only
+	 * enabled once the pool exists.
+	 */
+	if (parent != NULL && parent->vdev_parent == NULL &&
+	    alloctype != VDEV_ALLOC_ATTACH &&
+	    nvlist_lookup_string(nv, ZPOOL_CONFIG_ALLOCATION_BIAS,
+	    &bias) == 0) {
+		alloc_bias = vdev_derive_alloc_bias(bias);
+		if (alloc_bias == VDEV_BIAS_NONE || islog)
+			return (SET_ERROR(EINVAL));
+		if (alloctype == VDEV_ALLOC_ADD &&
+		    spa->spa_load_state != SPA_LOAD_CREATE &&
+		    !spa_feature_is_enabled(spa,
+		    SPA_FEATURE_ALLOCATION_CLASSES))
+			return (SET_ERROR(ENOTSUP));
+	}
+
 	/*
 	 * Set the nparity property for RAID-Z vdevs.
 	 */
@@ -472,6 +510,7 @@ vdev_alloc(spa_t *spa, vdev_t **vdp, nvlist_t *nv, vdev_t *parent, uint_t id,
 	vd = vdev_alloc_common(spa, id, guid, ops);
 
 	vd->vdev_islog = islog;
+	vd->vdev_alloc_bias = alloc_bias;
 	vd->vdev_nparity = nparity;
 
 	if (nvlist_lookup_string(nv, ZPOOL_CONFIG_PATH, &vd->vdev_path) == 0)
@@ -534,8 +573,15 @@ vdev_alloc(spa_t *spa, vdev_t **vdp, nvlist_t *nv, vdev_t *parent, uint_t id,
 		    alloctype == VDEV_ALLOC_ADD ||
 		    alloctype == VDEV_ALLOC_SPLIT ||
 		    alloctype == VDEV_ALLOC_ROOTPOOL);
-		vd->vdev_mg = metaslab_group_create(islog ?
-		    spa_log_class(spa) : spa_normal_class(spa), vd);
+		metaslab_class_t *mc = spa_normal_class(spa);
+
+		if (islog)
+			mc = spa_log_class(spa);
+		else if (alloc_bias == VDEV_BIAS_SPECIAL)
+			mc = spa_special_class(spa);
+		else if (alloc_bias == VDEV_BIAS_DEDUP)
+			mc = spa_dedup_class(spa);
+		vd->vdev_mg = metaslab_group_create(mc, vd);
 	}
 
 	if (vd->vdev_ops->vdev_op_leaf &&
@@ -689,6 +735,8 @@ vdev_free(vdev_t *vd)
 	mutex_destroy(&vd->vdev_dtl_lock);
 	mutex_destroy(&vd->vdev_stat_lock);
 	mutex_destroy(&vd->vdev_probe_lock);
+	mutex_destroy(&vd->vdev_flush_lock);
+	vdev_log_sm_destroy(vd);
 
 	if (vd == spa->spa_root_vdev)
 		spa->spa_root_vdev = NULL;
@@ -720,6 +768,8 @@ vdev_top_transfer(vdev_t *svd, vdev_t *tvd)
 	svd->vdev_ms_count = 0;
 	svd->vdev_top_zap = 0;
 
+	vdev_log_sm_transfer(svd, tvd);
+
 	if (tvd->vdev_mg)
 		ASSERT3P(tvd->vdev_mg, ==, svd->vdev_mg);
 	tvd->vdev_mg = svd->vdev_mg;
@@ -763,6 +813,9 @@ vdev_top_transfer(vdev_t *svd, vdev_t *tvd)
 
 	tvd->vdev_islog = svd->vdev_islog;
 	svd->vdev_islog = 0;
+
+	tvd->vdev_alloc_bias = svd->vdev_alloc_bias;
+	svd->vdev_alloc_bias = VDEV_BIAS_NONE;
 }
 
 static void
@@ -948,6 +1001,8 @@ vdev_metaslab_fini(vdev_t *vd)
 	uint64_t m;
 	uint64_t count = vd->vdev_ms_count;
 
+	vdev_log_sm_fini(vd);
+
 	if (vd->vdev_ms != NULL) {
 		metaslab_group_passivate(vd->vdev_mg);
 		for (m = 0; m < count; m++) {
@@ -1796,7 +1851,7 @@ vdev_dtl_min(vdev_t *vd)
 	ASSERT3U(range_tree_space(vd->vdev_dtl[DTL_MISSING]), !=, 0);
 	ASSERT0(vd->vdev_children);
 
-	rs = avl_first(&vd->vdev_dtl[DTL_MISSING]->rt_root);
+	rs = range_tree_first(vd->vdev_dtl[DTL_MISSING]);
 	return (rs->rs_start - 1);
 }
 
@@ -1812,7 +1867,7 @@ vdev_dtl_max(vdev_t *vd)
 	ASSERT3U(range_tree_space(vd->vdev_dtl[DTL_MISSING]), !=, 0);
 	ASSERT0(vd->vdev_children);
 
-	rs = avl_last(&vd->vdev_dtl[DTL_MISSING]->rt_root);
+	rs = range_tree_last(vd->vdev_dtl[DTL_MISSING]);
 	return (rs->rs_end);
 }
 
@@ -2049,6 +2104,14 @@ vdev_construct_zaps(vdev_t *vd, dmu_tx_t *tx)
 		}
 		if (vd == vd->vdev_top && vd->vdev_top_zap == 0) {
 			vd->vdev_top_zap = vdev_create_link_zap(vd, tx);
+			/*
+			 * The allocation_classes feature counts the vdevs
+			 * in classes other than normal and log.
+			 */
+			if (vd->vdev_alloc_bias != VDEV_BIAS_NONE) {
+				spa_feature_incr(vd->vdev_spa,
+				    SPA_FEATURE_ALLOCATION_CLASSES, tx);
+			}
 		}
 	}
 	for (uint64_t i = 0; i < vd->vdev_children; i++) {
@@ -2217,25 +2280,95 @@ vdev_resilver_needed(vdev_t *vd, uint64_t *minp, uint64_t *maxp)
 	return (needed);
 }
 
-void
-vdev_load(vdev_t *vd)
+/*
+ * Initialize the metaslabs of a top-level vdev and replay the changes
+ * logged for them. If the pool is going to be written to, start loading
+ * the metaslabs we are going to allocate from in the background.
+ */
+static int
+vdev_load_metaslabs(vdev_t *vd)
+{
+	int error;
+
+	ASSERT(vd == vd->vdev_top);
+	ASSERT(!vd->vdev_ishole);
+
+	if (vd->vdev_ashift == 0 || vd->vdev_asize == 0)
+		return (SET_ERROR(ENXIO));
+
+	error = vdev_metaslab_init(vd, 0);
+	if (error == 0)
+		error = vdev_log_sm_load(vd);
+	if (error == 0 && vd->vdev_mg != NULL && spa_writeable(vd->vdev_spa))
+		metaslab_group_preload(vd->vdev_mg);
+
+	return (error);
+}
+
+static void
+vdev_load_metaslabs_child(void *arg)
 {
+	vdev_t *vd = arg;
+
+	vd->vdev_load_error = vdev_load_metaslabs(vd);
+}
+
+/*
+ * Reading the metaslab arrays and space maps is most of the work of
+ * loading a pool, and the top-level vdevs don't share any of it, so load
+ * them in parallel. Everything else, including setting the vdev states,
+ * is left to vdev_load() in the calling thread.
+ */
+static void
+vdev_load_metaslabs_children(vdev_t *vd)
+{
+	taskq_t *tq;
+	int children = vd->vdev_children;
 	int c;
 
+	tq = taskq_create("vdev_load", metaslab_load_pct, minclsyspri,
+	    children, children, TASKQ_THREADS_CPU_PCT | TASKQ_PREPOPULATE);
+
+	for (c = 0; c < children; c++) {
+		vdev_t *cvd = vd->vdev_child[c];
+
+		if (cvd->vdev_ishole)
+			continue;
+		VERIFY(taskq_dispatch(tq, vdev_load_metaslabs_child, cvd,
+		    TQ_SLEEP) != 0);
+	}
+
+	taskq_destroy(tq);
+}
+
+static void
+vdev_load_impl(vdev_t *vd, boolean_t ms_loaded)
+{
+	int c;
+
+	if (!ms_loaded && vd == vd->vdev_spa->spa_root_vdev &&
+	    vd->vdev_children > 1) {
+		vdev_load_metaslabs_children(vd);
+		ms_loaded = B_TRUE;
+	}
+
 	/*
 	 * Recursively load all children.
 	 */
 	for (c = 0; c < vd->vdev_children; c++)
-		vdev_load(vd->vdev_child[c]);
+		vdev_load_impl(vd->vdev_child[c], ms_loaded);
 
 	/*
-	 * If this is a top-level vdev, initialize its metaslabs.
+	 * If this is a top-level vdev, initialize its metaslabs, unless
+	 * vdev_load_metaslabs_children() already has.
 	 */
-	if (vd == vd->vdev_top && !vd->vdev_ishole &&
-	    (vd->vdev_ashift == 0 || vd->vdev_asize == 0 ||
-	    vdev_metaslab_init(vd, 0) != 0))
-		vdev_set_state(vd, B_FALSE, VDEV_STATE_CANT_OPEN,
-		    VDEV_AUX_CORRUPT_DATA);
+	if (vd == vd->vdev_top && !vd->vdev_ishole) {
+		if (!ms_loaded)
+			vd->vdev_load_error = vdev_load_metaslabs(vd);
+		if (vd->vdev_load_error != 0)
+			vdev_set_state(vd, B_FALSE, VDEV_STATE_CANT_OPEN,
+			    VDEV_AUX_CORRUPT_DATA);
+	}
 
 	/*
 	 * If this is a leaf vdev, load its DTL.
@@ -2245,6 +2378,12 @@ vdev_load(vdev_t *vd)
 		    VDEV_AUX_CORRUPT_DATA);
 }
 
+void
+vdev_load(vdev_t *vd)
+{
+	vdev_load_impl(vd, B_FALSE);
+}
+
 /*
  * The special vdev case is used for hot spares and l2cache devices.  Its
  * sole purpose it to set the vdev state for the associated vdev.  To do this,
@@ -2358,19 +2497,52 @@ vdev_sync_done(vdev_t *vd, uint64_t txg)
 	while ((msp = txg_list_remove(&vd->vdev_ms_list, TXG_CLEAN(txg))))
 		metaslab_sync_done(msp, txg);
 
+	vdev_log_sm_sync_done(vd, txg);
+
 	if (reassess)
 		metaslab_sync_reassess(vd->vdev_mg);
 }
 
+/*
+ * Write out the dirty metaslabs of a top-level vdev, which is the bulk of
+ * vdev_sync(): the space map writes and any condensing.  Outside of the
+ * vdev this touches the metaslab class histogram, which is protected by
+ * mc_lock, and the spacemap_histogram feature refcount when a space map
+ * is allocated or reallocated, which feature_do_action() serializes, so
+ * it may run for several vdevs at once.
+ */
+static void
+vdev_sync_metaslabs(void *arg)
+{
+	vdev_t *vd = arg;
+	spa_t *spa = vd->vdev_spa;
+	uint64_t txg = spa_syncing_txg(spa);
+	metaslab_t *msp;
+
+	while ((msp = txg_list_remove(&vd->vdev_ms_list, txg)) != NULL) {
+		metaslab_sync(msp, txg);
+		(void) txg_list_add(&vd->vdev_ms_list, msp, TXG_CLEAN(txg));
+	}
+
+	(void) txg_list_add(&spa->spa_vdev_txg_list, vd, TXG_CLEAN(txg));
+}
+
+/*
+ * Sync a dirty top-level vdev.  If a taskq is given, the metaslabs are
+ * written out by a task on it and the caller must wait for the taskq
+ * before the vdev is synced again or vdev_sync_done() is called for it.
+ * The config dirty list and the vdev's log space maps are updated here,
+ * in the calling thread.
+ */
 void
-vdev_sync(vdev_t *vd, uint64_t txg)
+vdev_sync(vdev_t *vd, uint64_t txg, taskq_t *tq)
 {
 	spa_t *spa = vd->vdev_spa;
 	vdev_t *lvd;
-	metaslab_t *msp;
 	dmu_tx_t *tx;
 
 	ASSERT(!vd->vdev_ishole);
+	ASSERT3U(txg, ==, spa_syncing_txg(spa));
 
 	if (vd->vdev_ms_array == 0 && vd->vdev_ms_shift != 0) {
 		ASSERT(vd == vd->vdev_top);
@@ -2388,15 +2560,29 @@ vdev_sync(vdev_t *vd, uint64_t txg)
 	if (vd->vdev_stat.vs_alloc == 0 && vd->vdev_removing)
 		vdev_remove(vd, txg);
 
-	while ((msp = txg_list_remove(&vd->vdev_ms_list, txg)) != NULL) {
-		metaslab_sync(msp, txg);
-		(void) txg_list_add(&vd->vdev_ms_list, msp, TXG_CLEAN(txg));
+	/*
+	 * Flush old log space map changes before this txg's are logged, and
+	 * open this txg's log for metaslab_sync().  Creating a vdev's first
+	 * log bumps the vdev_log_spacemap feature refcount, so it is done here
+	 * rather than by the metaslabs.
+	 */
+	vdev_log_sm_sync(vd, txg);
+	if (vdev_log_sm_enabled(vd) && txg <= spa_final_dirty_txg(spa) &&
+	    !txg_list_empty(&vd->vdev_ms_list, txg)) {
+		tx = dmu_tx_create_assigned(spa->spa_dsl_pool, txg);
+		vdev_log_sm_open(vd, tx);
+		dmu_tx_commit(tx);
 	}
 
 	while ((lvd = txg_list_remove(&vd->vdev_dtl_list, txg)) != NULL)
 		vdev_dtl_sync(lvd, txg);
 
-	(void) txg_list_add(&spa->spa_vdev_txg_list, vd, TXG_CLEAN(txg));
+	if (tq != NULL) {
+		VERIFY(taskq_dispatch(tq, vdev_sync_metaslabs, vd,
+		    TQ_SLEEP) != 0);
+	} else {
+		vdev_sync_metaslabs(vd);
+	}
 }
 
 uint64_t
@@ -2786,6 +2972,52 @@ vdev_accessible(vdev_t *vd, zio_t *zio)
 	return (B_TRUE);
 }
 
+/*
+ * Returns B_TRUE if a cache flush to this vdev can make a difference,
+ * i.e. some leaf below it may be holding writes in a volatile cache.
+ * Leaves whose flush has been rejected as unsupported (vdev_nowritecache)
+ * either have no write cache or one that is power-loss protected.
+ */
+boolean_t
+vdev_has_volatile_cache(vdev_t *vd)
+{
+	int c;
+
+	if (vd->vdev_ops->vdev_op_leaf)
+		return (!vd->vdev_nowritecache);
+
+	for (c = 0; c < vd->vdev_children; c++) {
+		if (vdev_has_volatile_cache(vd->vdev_child[c]))
+			return (B_TRUE);
+	}
+
+	return (B_FALSE);
+}
+
+/*
+ * Returns B_TRUE if a TRIM of vd can still reach a device, i.e. some
+ * writeable leaf below it has not refused a TRIM (vdev_notrim).  Only
+ * leaves ever get vdev_notrim set; zio_trim() skips the ones that have.
+ */
+boolean_t
+vdev_can_trim(vdev_t *vd)
+{
+	int c;
+
+	if (!vdev_writeable(vd))
+		return (B_FALSE);
+
+	if (vd->vdev_ops->vdev_op_leaf)
+		return (!vd->vdev_notrim);
+
+	for (c = 0; c < vd->vdev_children; c++) {
+		if (vdev_can_trim(vd->vdev_child[c]))
+			return (B_TRUE);
+	}
+
+	return (B_FALSE);
+}
+
 static void
 vdev_get_child_stat(vdev_t *cvd, vdev_stat_t *vs, vdev_stat_t *cvs)
 {
@@ -2828,6 +3060,8 @@ vdev_get_child_stat_ex(vdev_t *cvd, vdev_stat_ex_t *vsx, vdev_stat_ex_t *cvsx)
 
 		for (b = 0; b < ARRAY_SIZE(vsx->vsx_agg_histo[0]); b++)
 			vsx->vsx_agg_histo[t][b] += cvsx->vsx_agg_histo[t][b];
+
+		vsx->vsx_deadline_missed[t] += cvsx->vsx_deadline_missed[t];
 	}
 
 }
@@ -2879,6 +3113,7 @@ vdev_get_stats_ex_impl(vdev_t *vd, vdev_stat_t *vs, vdev_stat_ex_t *vsx)
 			vsx->vsx_pend_queue[t] = avl_numnodes(
 			    &vd->vdev_queue.vq_class[t].vqc_queued_tree);
 		}
+		vsx->vsx_read_ewma = vdev_queue_read_latency(vd);
 	}
 }
 
@@ -3013,6 +3248,15 @@ vdev_stat_update(zio_t *zio, uint64_t psize)
 			vs->vs_ops[type]++;
 			vs->vs_bytes[type] += psize;
 
+			/*
+			 * Unqueued i/o (cache flushes, TRIMs) has no
+			 * per-priority histograms.
+			 */
+			if (zio->io_priority >= ZIO_PRIORITY_NUM_QUEUEABLE) {
+				mutex_exit(&vd->vdev_stat_lock);
+				return;
+			}
+
 			if (flags & ZIO_FLAG_DELEGATED) {
 				vsx->vsx_agg_histo[zio->io_priority]
 				    [RQ_HISTO(zio->io_size)]++;
@@ -3029,6 +3273,13 @@ vdev_stat_update(zio_t *zio, uint64_t psize)
 				vsx->vsx_total_histo[type]
 				    [L_HISTO(zio->io_delta)]++;
 			}
+
+			/* see vdev_queue_class_deadline() */
+			if (zio->io_deadline != 0 && zio->io_delta != 0 &&
+			    zio->io_timestamp + zio->io_delta >
+			    zio->io_deadline) {
+				vsx->vsx_deadline_missed[zio->io_priority]++;
+			}
 		}
 
 		mutex_exit(&vd->vdev_stat_lock);
@@ -3142,7 +3393,7 @@ vdev_space_update(vdev_t *vd, int64_t alloc_delta, int64_t defer_delta,
 	vd->vdev_stat.vs_dspace += dspace_delta;
 	mutex_exit(&vd->vdev_stat_lock);
 
-	if (mc == spa_normal_class(spa)) {
+	if (mc != NULL && mc != spa_log_class(spa)) {
 		mutex_enter(&rvd->vdev_stat_lock);
 		rvd->vdev_stat.vs_alloc += alloc_delta;
 		rvd->vdev_stat.vs_space += space_delta;
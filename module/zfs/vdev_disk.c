@@ -540,6 +540,9 @@ skip_open:
 	 */
 	vd->vdev_nowritecache = B_FALSE;
 
+	/* Likewise for TRIM. */
+	vd->vdev_notrim = B_FALSE;
+
 #ifdef __APPLE__
 	/* Inform the ZIO pipeline that we are non-rotational */
 	vd->vdev_nonrot = B_FALSE;
@@ -737,6 +740,7 @@ vdev_disk_io_start(zio_t *zio)
 	vdev_disk_t *dvd = vd->vdev_tsd;
 	vdev_buf_t *vb;
 	struct dk_callback *dkc;
+	dkioc_free_t dfl;
 #ifdef illumos
 	buf_t *bp;
 #else
@@ -797,6 +801,24 @@ vdev_disk_io_start(zio_t *zio)
 
 			break;
 
+		case DKIOCFREE:
+
+			if (vd->vdev_notrim) {
+				zio->io_error = SET_ERROR(ENOTSUP);
+				break;
+			}
+
+			/* The unmap is synchronous. */
+			dfl.df_flags = 0;
+			dfl.df_reserved = 0;
+			dfl.df_start = zio->io_offset;
+			dfl.df_length = zio->io_size;
+
+			zio->io_error = ldi_ioctl(dvd->vd_lh, zio->io_cmd,
+			    (uintptr_t)&dfl, FKIOCTL, kcred, NULL);
+
+			break;
+
 		default:
 			zio->io_error = SET_ERROR(ENOTSUP);
 		} /* io_cmd */
@@ -73,6 +73,9 @@ vdev_file_open(vdev_t *vd, uint64_t *psize, uint64_t *max_psize,
 	/* Rotational optimizations only make sense on block devices */
 	vd->vdev_nonrot = B_TRUE;
 
+	/* Assume the file system can punch holes until it says otherwise */
+	vd->vdev_notrim = B_FALSE;
+
 	/*
 	 * We must have a pathname, and it must be absolute.
 	 */
@@ -273,6 +276,29 @@ vdev_file_io_strategy(void *arg)
 	zio_delay_interrupt(zio);
 }
 
+/*
+ * Give the space of a trimmed range back to the file system holding the
+ * file by punching a hole in it.
+ */
+static int
+vdev_file_trim(vdev_file_t *vf, uint64_t offset, uint64_t size)
+{
+#ifdef _KERNEL
+#ifdef F_PUNCHHOLE
+	fpunchhole_t fp = { 0 };
+
+	fp.fp_offset = offset;
+	fp.fp_length = size;
+	return (VNOP_IOCTL(vf->vf_vnode, F_PUNCHHOLE, (caddr_t)&fp, 0,
+	    vfs_context_current()));
+#else
+	return (SET_ERROR(ENOTSUP));
+#endif
+#else
+	return (vn_trim(vf->vf_vnode, offset, size));
+#endif
+}
+
 static void
 vdev_file_io_start(zio_t *zio)
 {
@@ -295,6 +321,13 @@ vdev_file_io_start(zio_t *zio)
                 vnode_put(vf->vf_vnode);
             }
             break;
+        case DKIOCFREE:
+            if (!vnode_getwithvid(vf->vf_vnode, vf->vf_vid)) {
+                zio->io_error = vdev_file_trim(vf, zio->io_offset,
+                                               zio->io_size);
+                vnode_put(vf->vf_vnode);
+            }
+            break;
         default:
             zio->io_error = SET_ERROR(ENOTSUP);
         }
@@ -141,6 +141,7 @@
 #include <sys/zap.h>
 #include <sys/vdev.h>
 #include <sys/vdev_impl.h>
+#include <sys/vdev_trim.h>
 #include <sys/uberblock_impl.h>
 #include <sys/metaslab.h>
 #include <sys/zio.h>
@@ -343,6 +344,26 @@ vdev_config_generate_stats(vdev_t *vd, nvlist_t *nv)
 	    vsx->vsx_agg_histo[ZIO_PRIORITY_SCRUB],
 	    ARRAY_SIZE(vsx->vsx_agg_histo[ZIO_PRIORITY_SCRUB]));
 
+	/* Deadline misses */
+	fnvlist_add_uint64(nvx, ZPOOL_CONFIG_VDEV_SYNC_R_DEADLINE_MISSED,
+	    vsx->vsx_deadline_missed[ZIO_PRIORITY_SYNC_READ]);
+
+	fnvlist_add_uint64(nvx, ZPOOL_CONFIG_VDEV_SYNC_W_DEADLINE_MISSED,
+	    vsx->vsx_deadline_missed[ZIO_PRIORITY_SYNC_WRITE]);
+
+	fnvlist_add_uint64(nvx, ZPOOL_CONFIG_VDEV_ASYNC_R_DEADLINE_MISSED,
+	    vsx->vsx_deadline_missed[ZIO_PRIORITY_ASYNC_READ]);
+
+	fnvlist_add_uint64(nvx, ZPOOL_CONFIG_VDEV_ASYNC_W_DEADLINE_MISSED,
+	    vsx->vsx_deadline_missed[ZIO_PRIORITY_ASYNC_WRITE]);
+
+	fnvlist_add_uint64(nvx, ZPOOL_CONFIG_VDEV_SCRUB_DEADLINE_MISSED,
+	    vsx->vsx_deadline_missed[ZIO_PRIORITY_SCRUB]);
+
+	/* Read latency average */
+	fnvlist_add_uint64(nvx, ZPOOL_CONFIG_VDEV_READ_LAT_EWMA,
+	    vsx->vsx_read_ewma);
+
 	/* Add extended stats nvlist to main nvlist */
 	fnvlist_add_nvlist(nv, ZPOOL_CONFIG_VDEV_STATS_EX, nvx);
 
@@ -420,6 +441,13 @@ vdev_config_generate(spa_t *spa, vdev_t *vd, boolean_t getstats,
 		fnvlist_add_uint64(nv, ZPOOL_CONFIG_ASIZE,
 		    vd->vdev_asize);
 		fnvlist_add_uint64(nv, ZPOOL_CONFIG_IS_LOG, vd->vdev_islog);
+		if (vd->vdev_alloc_bias == VDEV_BIAS_SPECIAL) {
+			fnvlist_add_string(nv, ZPOOL_CONFIG_ALLOCATION_BIAS,
+			    VDEV_ALLOC_BIAS_SPECIAL);
+		} else if (vd->vdev_alloc_bias == VDEV_BIAS_DEDUP) {
+			fnvlist_add_string(nv, ZPOOL_CONFIG_ALLOCATION_BIAS,
+			    VDEV_ALLOC_BIAS_DEDUP);
+		}
 		if (vd->vdev_removing)
 			fnvlist_add_uint64(nv, ZPOOL_CONFIG_REMOVING,
 			    vd->vdev_removing);
@@ -458,6 +486,17 @@ vdev_config_generate(spa_t *spa, vdev_t *vd, boolean_t getstats,
 			    ZPOOL_CONFIG_SCAN_STATS, (uint64_t *)&ps,
 			    sizeof (pool_scan_stat_t) / sizeof (uint64_t));
 		}
+
+		if (vd == spa->spa_root_vdev) {
+			pool_trim_stat_t pts;
+
+			if (spa_trim_get_stats(spa, &pts) == 0) {
+				fnvlist_add_uint64_array(nv,
+				    ZPOOL_CONFIG_TRIM_STATS, (uint64_t *)&pts,
+				    sizeof (pool_trim_stat_t) /
+				    sizeof (uint64_t));
+			}
+		}
 	}
 
 	if (!vd->vdev_ops->vdev_op_leaf) {
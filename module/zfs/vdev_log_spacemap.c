@@ -0,0 +1,563 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/dmu.h>
+#include <sys/dmu_tx.h>
+#include <sys/metaslab_impl.h>
+#include <sys/range_tree.h>
+#include <sys/space_map.h>
+#include <sys/spa_impl.h>
+#include <sys/vdev_impl.h>
+#include <sys/vdev_log_spacemap.h>
+#include <sys/zap.h>
+#include <sys/zfeature.h>
+
+/*
+ * Log space maps
+ *
+ * Without the vdev_log_spacemap feature every metaslab that is allocated from
+ * or freed to in a txg appends those changes to its own space map, so a
+ * txg that touches many metaslabs dirties (at least) one space map block
+ * per metaslab. On large pools with random frees that is a great deal of
+ * metadata I/O for very little data.
+ *
+ * With the feature enabled, metaslab_sync() instead appends the changes
+ * of every metaslab of a top-level vdev to a single space map, the vdev's
+ * log for that txg. The changes are also kept in memory, in each
+ * metaslab's ms_unflushed_allocs and ms_unflushed_frees trees, and the
+ * txg of the oldest change not yet in the metaslab's own space map is its
+ * ms_unflushed_txg.
+ *
+ * In pass 1 of each txg, before anything is logged, vdev_log_sm_sync()
+ * flushes the metaslabs with the oldest unflushed changes: it writes the
+ * unflushed trees to their own space maps, which makes them up to date.
+ * It flushes enough metaslabs that none of them stays unflushed for more
+ * than zfs_unflushed_max_txgs txgs, plus the vdev's share of
+ * zfs_min_metaslabs_to_flush. Logs older than the oldest ms_unflushed_txg
+ * are no longer needed by any metaslab and are freed.
+ *
+ * On disk, the vdev's top-level ZAP names a ZAP that maps the txg of each
+ * log to its space map object, and an object array holding the
+ * ms_unflushed_txg of each metaslab. When the pool is opened,
+ * vdev_log_sm_load() replays every log into the unflushed trees of the
+ * metaslabs that had not been flushed by the time it was written.
+ *
+ * The logs belong to a top-level vdev rather than to the pool because
+ * space map entries carry no vdev id. Intent log devices don't use logs
+ * at all: their metaslabs hold short-lived blocks that are freed again
+ * within a few txgs, so logging would only delay the inevitable write.
+ */
+
+/*
+ * The maximum number of txgs for which a metaslab may have changes that
+ * have not been flushed to its own space map. This bounds both the size
+ * of the logs and the time it takes to replay them at import.
+ */
+int zfs_unflushed_max_txgs = 64;
+
+/*
+ * The minimum number of metaslabs flushed by the whole pool each txg, so
+ * that the logs keep shrinking even on pools with few metaslabs. It is
+ * spread over the top-level vdevs, rotating with the txg, so that a
+ * lightly loaded pool doesn't write more space map blocks than it would
+ * without the logs.
+ */
+int zfs_min_metaslabs_to_flush = 1;
+
+/*
+ * Bytes of the space map blocks dirtied by a write that grew the space map
+ * from "start" to "end" bytes.
+ */
+static uint64_t
+vdev_log_sm_dirtied(uint64_t start, uint64_t end, uint64_t blksz)
+{
+	if (end <= start)
+		return (0);
+	return (((end - 1) / blksz - start / blksz + 1) * blksz);
+}
+
+/*
+ * The share of zfs_min_metaslabs_to_flush that vd must flush in txg.
+ */
+static uint64_t
+vdev_log_sm_min_flush(vdev_t *vd, uint64_t txg)
+{
+	uint64_t children = vd->vdev_spa->spa_root_vdev->vdev_children;
+	uint64_t min = MAX(zfs_min_metaslabs_to_flush, 0);
+
+	return (min / children +
+	    ((txg + vd->vdev_id) % children < min % children ? 1 : 0));
+}
+
+static int
+vdev_log_sm_compare(const void *x1, const void *x2)
+{
+	const vdev_log_sm_entry_t *e1 = x1;
+	const vdev_log_sm_entry_t *e2 = x2;
+
+	if (e1->vlse_txg < e2->vlse_txg)
+		return (-1);
+	if (e1->vlse_txg > e2->vlse_txg)
+		return (1);
+	return (0);
+}
+
+static int
+vdev_unflushed_ms_compare(const void *x1, const void *x2)
+{
+	const metaslab_t *m1 = x1;
+	const metaslab_t *m2 = x2;
+
+	if (m1->ms_unflushed_txg < m2->ms_unflushed_txg)
+		return (-1);
+	if (m1->ms_unflushed_txg > m2->ms_unflushed_txg)
+		return (1);
+	if (m1->ms_id < m2->ms_id)
+		return (-1);
+	if (m1->ms_id > m2->ms_id)
+		return (1);
+	return (0);
+}
+
+void
+vdev_log_sm_create(vdev_t *vd)
+{
+	mutex_init(&vd->vdev_log_sm_lock, NULL, MUTEX_DEFAULT, NULL);
+	avl_create(&vd->vdev_log_sms, vdev_log_sm_compare,
+	    sizeof (vdev_log_sm_entry_t),
+	    offsetof(vdev_log_sm_entry_t, vlse_node));
+	avl_create(&vd->vdev_unflushed_ms, vdev_unflushed_ms_compare,
+	    sizeof (metaslab_t), offsetof(metaslab_t, ms_unflushed_node));
+}
+
+void
+vdev_log_sm_destroy(vdev_t *vd)
+{
+	ASSERT3P(vd->vdev_log_sm, ==, NULL);
+
+	avl_destroy(&vd->vdev_log_sms);
+	avl_destroy(&vd->vdev_unflushed_ms);
+	mutex_destroy(&vd->vdev_log_sm_lock);
+}
+
+/*
+ * Called by vdev_top_transfer(): the metaslabs, and with them the logs,
+ * move from svd to tvd.
+ */
+void
+vdev_log_sm_transfer(vdev_t *svd, vdev_t *tvd)
+{
+	ASSERT3P(svd->vdev_log_sm, ==, NULL);
+	ASSERT3P(tvd->vdev_log_sm, ==, NULL);
+	ASSERT0(avl_numnodes(&tvd->vdev_log_sms));
+	ASSERT0(avl_numnodes(&tvd->vdev_unflushed_ms));
+
+	tvd->vdev_log_sm_zap = svd->vdev_log_sm_zap;
+	tvd->vdev_unflushed_array = svd->vdev_unflushed_array;
+	svd->vdev_log_sm_zap = 0;
+	svd->vdev_unflushed_array = 0;
+
+	avl_swap(&svd->vdev_log_sms, &tvd->vdev_log_sms);
+	avl_swap(&svd->vdev_unflushed_ms, &tvd->vdev_unflushed_ms);
+}
+
+boolean_t
+vdev_log_sm_enabled(vdev_t *vd)
+{
+	ASSERT3P(vd, ==, vd->vdev_top);
+
+	return (vd->vdev_top_zap != 0 && !vd->vdev_islog &&
+	    spa_feature_is_enabled(vd->vdev_spa, SPA_FEATURE_LOG_SPACEMAP));
+}
+
+static space_map_t *
+vdev_log_sm_hold(vdev_t *vd, uint64_t object)
+{
+	space_map_t *sm = NULL;
+
+	VERIFY0(space_map_open(&sm, spa_meta_objset(vd->vdev_spa), object,
+	    0, vd->vdev_ms_count << vd->vdev_ms_shift, vd->vdev_ashift,
+	    &vd->vdev_log_sm_lock));
+	return (sm);
+}
+
+/*
+ * Open the vdev's log for this txg, creating it (and the on-disk objects
+ * that track the logs) if this is the first metaslab to log anything.
+ */
+void
+vdev_log_sm_open(vdev_t *vd, dmu_tx_t *tx)
+{
+	spa_t *spa = vd->vdev_spa;
+	objset_t *mos = spa_meta_objset(spa);
+	uint64_t txg = dmu_tx_get_txg(tx);
+	vdev_log_sm_entry_t *vlse;
+
+	ASSERT(vdev_log_sm_enabled(vd));
+	ASSERT(dmu_tx_is_syncing(tx));
+
+	mutex_enter(&vd->vdev_log_sm_lock);
+	if (vd->vdev_log_sm != NULL) {
+		vlse = avl_last(&vd->vdev_log_sms);
+		ASSERT3U(vlse->vlse_txg, ==, txg);
+		mutex_exit(&vd->vdev_log_sm_lock);
+		return;
+	}
+
+	if (vd->vdev_log_sm_zap == 0) {
+		ASSERT0(vd->vdev_unflushed_array);
+
+		vd->vdev_log_sm_zap = zap_create(mos, DMU_OTN_ZAP_METADATA,
+		    DMU_OT_NONE, 0, tx);
+		vd->vdev_unflushed_array = dmu_object_alloc(mos,
+		    DMU_OT_OBJECT_ARRAY, 0, DMU_OT_NONE, 0, tx);
+		VERIFY0(zap_add(mos, vd->vdev_top_zap,
+		    VDEV_TOP_ZAP_LOG_SPACEMAPS, sizeof (uint64_t), 1,
+		    &vd->vdev_log_sm_zap, tx));
+		VERIFY0(zap_add(mos, vd->vdev_top_zap,
+		    VDEV_TOP_ZAP_UNFLUSHED_TXGS, sizeof (uint64_t), 1,
+		    &vd->vdev_unflushed_array, tx));
+		spa_feature_incr(spa, SPA_FEATURE_LOG_SPACEMAP, tx);
+	}
+
+	vlse = kmem_zalloc(sizeof (vdev_log_sm_entry_t), KM_SLEEP);
+	vlse->vlse_txg = txg;
+	vlse->vlse_object = space_map_alloc(mos, tx);
+	VERIFY0(zap_add_int_key(mos, vd->vdev_log_sm_zap, txg,
+	    vlse->vlse_object, tx));
+	avl_add(&vd->vdev_log_sms, vlse);
+
+	vd->vdev_log_sm = vdev_log_sm_hold(vd, vlse->vlse_object);
+	mutex_exit(&vd->vdev_log_sm_lock);
+}
+
+/*
+ * Append the metaslab's allocations and frees of this txg to the vdev's
+ * log instead of its own space map.
+ */
+void
+vdev_log_sm_write(vdev_t *vd, metaslab_t *msp, range_tree_t *alloctree,
+    dmu_tx_t *tx)
+{
+	space_map_t *sm = msp->ms_sm;
+	uint64_t start, len;
+
+	ASSERT(MUTEX_HELD(&msp->ms_lock));
+	ASSERT(sm != NULL);
+
+	mutex_enter(&vd->vdev_log_sm_lock);
+	ASSERT(vd->vdev_log_sm != NULL);
+	start = vd->vdev_log_sm->sm_phys->smp_objsize;
+	space_map_write(vd->vdev_log_sm, alloctree, SM_ALLOC, tx);
+	space_map_write(vd->vdev_log_sm, msp->ms_freeingtree, SM_FREE, tx);
+	len = vd->vdev_log_sm->sm_phys->smp_objsize - start;
+	mutex_exit(&vd->vdev_log_sm_lock);
+
+	/*
+	 * Without the log, the same entries would have been appended to
+	 * the metaslab's own space map.  The cost of the log itself is
+	 * charged when it is closed, in vdev_log_sm_sync_done().
+	 */
+	start = sm->sm_phys->smp_objsize;
+	atomic_add_64(&vd->vdev_spa->spa_sm_saved,
+	    vdev_log_sm_dirtied(start, start + len, sm->sm_blksz));
+
+	range_tree_walk(alloctree, range_tree_add, msp->ms_logged_allocs);
+	range_tree_walk(msp->ms_freeingtree, range_tree_add,
+	    msp->ms_logged_frees);
+
+	atomic_inc_64(&vd->vdev_spa->spa_sm_logged);
+}
+
+/*
+ * Record the txg of the metaslab's oldest unflushed change, or zero if it
+ * has none.
+ */
+void
+vdev_log_sm_set_unflushed(vdev_t *vd, metaslab_t *msp, uint64_t txg,
+    dmu_tx_t *tx)
+{
+	ASSERT(vd->vdev_unflushed_array != 0);
+
+	mutex_enter(&vd->vdev_log_sm_lock);
+	if (msp->ms_unflushed_txg != 0)
+		avl_remove(&vd->vdev_unflushed_ms, msp);
+	msp->ms_unflushed_txg = txg;
+	if (txg != 0)
+		avl_add(&vd->vdev_unflushed_ms, msp);
+	mutex_exit(&vd->vdev_log_sm_lock);
+
+	dmu_write(spa_meta_objset(vd->vdev_spa), vd->vdev_unflushed_array,
+	    msp->ms_id * sizeof (uint64_t), sizeof (uint64_t), &txg, tx);
+}
+
+/*
+ * Flush the metaslabs with the oldest unflushed changes, and free the
+ * logs that no metaslab needs any more. This runs in the first pass of
+ * each txg that syncs the vdev, before any metaslab logs its changes.
+ */
+void
+vdev_log_sm_sync(vdev_t *vd, uint64_t txg)
+{
+	spa_t *spa = vd->vdev_spa;
+	objset_t *mos = spa_meta_objset(spa);
+	vdev_log_sm_entry_t *vlse;
+	metaslab_t *msp;
+	uint64_t nflush, maxtxgs, mintxg, start;
+	dmu_tx_t *tx;
+
+	if (vd->vdev_log_sm_zap == 0 || vd->vdev_log_sm != NULL ||
+	    spa_sync_pass(spa) != 1 || txg > spa_final_dirty_txg(spa))
+		return;
+
+	tx = dmu_tx_create_assigned(spa_get_dsl(spa), txg);
+
+	maxtxgs = MAX(zfs_unflushed_max_txgs, 1);
+
+	mutex_enter(&vd->vdev_log_sm_lock);
+	nflush = MAX(vdev_log_sm_min_flush(vd, txg),
+	    howmany(avl_numnodes(&vd->vdev_unflushed_ms), maxtxgs));
+	while ((msp = avl_first(&vd->vdev_unflushed_ms)) != NULL &&
+	    msp->ms_unflushed_txg < txg) {
+		/*
+		 * Once we've flushed our share for this txg, only keep
+		 * going for metaslabs that have been unflushed too long.
+		 */
+		if (nflush == 0 && msp->ms_unflushed_txg + maxtxgs > txg)
+			break;
+		mutex_exit(&vd->vdev_log_sm_lock);
+
+		start = msp->ms_sm->sm_phys->smp_objsize;
+		metaslab_flush(msp, tx);
+		atomic_add_64(&spa->spa_sm_saved, -vdev_log_sm_dirtied(start,
+		    msp->ms_sm->sm_phys->smp_objsize, msp->ms_sm->sm_blksz));
+		vdev_log_sm_set_unflushed(vd, msp, 0, tx);
+		atomic_inc_64(&spa->spa_sm_flushed);
+		if (nflush != 0)
+			nflush--;
+
+		mutex_enter(&vd->vdev_log_sm_lock);
+	}
+
+	msp = avl_first(&vd->vdev_unflushed_ms);
+	mintxg = (msp != NULL) ? msp->ms_unflushed_txg : txg;
+	while ((vlse = avl_first(&vd->vdev_log_sms)) != NULL &&
+	    vlse->vlse_txg < mintxg) {
+		space_map_t *sm = vdev_log_sm_hold(vd, vlse->vlse_object);
+
+		space_map_free(sm, tx);
+		space_map_close(sm);
+		VERIFY0(zap_remove_int(mos, vd->vdev_log_sm_zap,
+		    vlse->vlse_txg, tx));
+		avl_remove(&vd->vdev_log_sms, vlse);
+		kmem_free(vlse, sizeof (vdev_log_sm_entry_t));
+	}
+	mutex_exit(&vd->vdev_log_sm_lock);
+
+	dmu_tx_commit(tx);
+}
+
+void
+vdev_log_sm_sync_done(vdev_t *vd, uint64_t txg)
+{
+	boolean_t unflushed;
+
+	mutex_enter(&vd->vdev_log_sm_lock);
+	if (vd->vdev_log_sm != NULL) {
+		space_map_t *sm = vd->vdev_log_sm;
+
+		atomic_add_64(&vd->vdev_spa->spa_sm_saved,
+		    -vdev_log_sm_dirtied(0, sm->sm_phys->smp_objsize,
+		    sm->sm_blksz));
+		space_map_close(sm);
+		vd->vdev_log_sm = NULL;
+	}
+	unflushed = (avl_numnodes(&vd->vdev_unflushed_ms) != 0);
+	mutex_exit(&vd->vdev_log_sm_lock);
+
+	/*
+	 * Keep syncing the vdev while any of its metaslabs has unflushed
+	 * changes, so that the logs drain even once the pool goes idle.
+	 */
+	if (unflushed && txg < spa_final_dirty_txg(vd->vdev_spa))
+		vdev_dirty(vd, 0, NULL, txg + 1);
+}
+
+typedef struct vdev_log_sm_replay_arg {
+	vdev_t		*vlra_vd;
+	uint64_t	vlra_txg;
+} vdev_log_sm_replay_arg_t;
+
+static int
+vdev_log_sm_replay_cb(maptype_t type, uint64_t offset, uint64_t size,
+    void *arg)
+{
+	vdev_log_sm_replay_arg_t *vlra = arg;
+	vdev_t *vd = vlra->vlra_vd;
+	metaslab_t *msp = vd->vdev_ms[offset >> vd->vdev_ms_shift];
+
+	ASSERT3U((offset + size - 1) >> vd->vdev_ms_shift, ==, msp->ms_id);
+
+	/*
+	 * Skip changes that the metaslab's own space map already has.
+	 */
+	if (msp->ms_unflushed_txg == 0 ||
+	    vlra->vlra_txg < msp->ms_unflushed_txg)
+		return (0);
+
+	mutex_enter(&msp->ms_lock);
+	if (type == SM_ALLOC) {
+		range_tree_remove_xor_add_segment(offset, offset + size,
+		    msp->ms_unflushed_frees, msp->ms_unflushed_allocs);
+	} else {
+		range_tree_remove_xor_add_segment(offset, offset + size,
+		    msp->ms_unflushed_allocs, msp->ms_unflushed_frees);
+	}
+	mutex_exit(&msp->ms_lock);
+
+	return (0);
+}
+
+/*
+ * Called when the pool is opened, after vdev_metaslab_init(): read the
+ * unflushed txg of every metaslab and replay the logs, oldest first, into
+ * the unflushed trees.
+ */
+int
+vdev_log_sm_load(vdev_t *vd)
+{
+	spa_t *spa = vd->vdev_spa;
+	objset_t *mos = spa_meta_objset(spa);
+	vdev_log_sm_replay_arg_t vlra;
+	vdev_log_sm_entry_t *vlse;
+	zap_cursor_t zc;
+	zap_attribute_t za;
+	kmutex_t lock;
+	uint64_t m;
+	int error;
+
+	ASSERT3P(vd, ==, vd->vdev_top);
+
+	if (vd->vdev_top_zap == 0 || vd->vdev_ms_count == 0)
+		return (0);
+
+	/*
+	 * A vdev that has never logged anything has no log objects.  Logs
+	 * written in the layout of com.delphix:log_spacemap are not looked
+	 * for here; a pool with that feature active is unsupported and so
+	 * can only be imported read-only.
+	 */
+	error = zap_lookup(mos, vd->vdev_top_zap, VDEV_TOP_ZAP_LOG_SPACEMAPS,
+	    sizeof (uint64_t), 1, &vd->vdev_log_sm_zap);
+	if (error == ENOENT)
+		return (0);
+	if (error != 0)
+		return (error);
+	error = zap_lookup(mos, vd->vdev_top_zap, VDEV_TOP_ZAP_UNFLUSHED_TXGS,
+	    sizeof (uint64_t), 1, &vd->vdev_unflushed_array);
+	if (error != 0)
+		return (error);
+
+	for (m = 0; m < vd->vdev_ms_count; m++) {
+		metaslab_t *msp = vd->vdev_ms[m];
+		uint64_t txg;
+
+		/*
+		 * The array is only written as metaslabs log changes, so
+		 * it may be shorter than vdev_ms_count; reading past its
+		 * end returns zeros.
+		 */
+		error = dmu_read(mos, vd->vdev_unflushed_array,
+		    m * sizeof (uint64_t), sizeof (uint64_t), &txg,
+		    DMU_READ_PREFETCH);
+		if (error != 0)
+			return (error);
+		if (txg == 0)
+			continue;
+
+		msp->ms_unflushed_txg = txg;
+		avl_add(&vd->vdev_unflushed_ms, msp);
+	}
+
+	for (zap_cursor_init(&zc, mos, vd->vdev_log_sm_zap);
+	    (error = zap_cursor_retrieve(&zc, &za)) == 0;
+	    zap_cursor_advance(&zc)) {
+		vlse = kmem_zalloc(sizeof (vdev_log_sm_entry_t), KM_SLEEP);
+		vlse->vlse_txg = strtonum(za.za_name, NULL);
+		vlse->vlse_object = za.za_first_integer;
+		avl_add(&vd->vdev_log_sms, vlse);
+	}
+	zap_cursor_fini(&zc);
+	if (error != ENOENT)
+		return (error);
+	error = 0;
+
+	mutex_init(&lock, NULL, MUTEX_DEFAULT, NULL);
+	vlra.vlra_vd = vd;
+	for (vlse = avl_first(&vd->vdev_log_sms); vlse != NULL && error == 0;
+	    vlse = AVL_NEXT(&vd->vdev_log_sms, vlse)) {
+		space_map_t *sm = NULL;
+
+		error = space_map_open(&sm, mos, vlse->vlse_object, 0,
+		    vd->vdev_ms_count << vd->vdev_ms_shift, vd->vdev_ashift,
+		    &lock);
+		if (error != 0)
+			break;
+
+		vlra.vlra_txg = vlse->vlse_txg;
+		mutex_enter(&lock);
+		space_map_update(sm);
+		error = space_map_iterate(sm, vdev_log_sm_replay_cb, &vlra);
+		mutex_exit(&lock);
+		space_map_close(sm);
+	}
+	mutex_destroy(&lock);
+	if (error != 0)
+		return (error);
+
+	for (m = 0; m < vd->vdev_ms_count; m++) {
+		if (vd->vdev_ms[m]->ms_unflushed_txg != 0)
+			metaslab_unflushed_replayed(vd->vdev_ms[m]);
+	}
+
+	return (0);
+}
+
+/*
+ * Forget the in-core state of the logs; called before the metaslabs are
+ * torn down.
+ */
+void
+vdev_log_sm_fini(vdev_t *vd)
+{
+	vdev_log_sm_entry_t *vlse;
+	metaslab_t *msp;
+
+	ASSERT3P(vd->vdev_log_sm, ==, NULL);
+
+	mutex_enter(&vd->vdev_log_sm_lock);
+	while ((msp = avl_first(&vd->vdev_unflushed_ms)) != NULL) {
+		avl_remove(&vd->vdev_unflushed_ms, msp);
+		msp->ms_unflushed_txg = 0;
+	}
+	while ((vlse = avl_first(&vd->vdev_log_sms)) != NULL) {
+		avl_remove(&vd->vdev_log_sms, vlse);
+		kmem_free(vlse, sizeof (vdev_log_sm_entry_t));
+	}
+	vd->vdev_log_sm_zap = 0;
+	vd->vdev_unflushed_array = 0;
+	mutex_exit(&vd->vdev_log_sm_lock);
+}
@@ -78,6 +78,16 @@ uint64_t zfs_vdev_mirror_rotating_seek_offset = 1 * 1024 * 1024;
 uint64_t zfs_vdev_mirror_non_rotating_inc = 0;
 uint64_t zfs_vdev_mirror_non_rotating_seek_inc = 1;
 
+/*
+ * Compare children by the expected time to complete the read rather than
+ * by queue length alone: the load above, plus one for the read itself, is
+ * scaled by each child's average read service time (see
+ * vdev_queue_read_latency()).  This steers reads away from the slower side
+ * of a mirror of unlike devices, or from a failing disk which has become
+ * slow, in proportion to how much slower it is.
+ */
+int zfs_vdev_mirror_latency_select = 1;
+
 static inline size_t
 vdev_mirror_map_size(int children)
 {
@@ -113,6 +123,20 @@ static const zio_vsd_ops_t vdev_mirror_vsd_ops = {
 	zio_vsd_default_cksum_report
 };
 
+/*
+ * Scale a load (in queued i/os) to the expected time in microseconds for
+ * the child to complete a read issued now.  A child which has not yet
+ * completed a read is taken to be fast, so that it gets one.
+ */
+static int
+vdev_mirror_expected_latency(vdev_t *vd, int load)
+{
+	uint64_t us = MAX(vdev_queue_read_latency(vd) /
+	    (NANOSEC / MICROSEC), 1);
+
+	return (MIN((uint64_t)(load + 1) * us, INT_MAX - 1));
+}
+
 static int
 vdev_mirror_load(mirror_map_t *mm, vdev_t *vd, uint64_t zio_offset)
 {
@@ -135,33 +159,37 @@ vdev_mirror_load(mirror_map_t *mm, vdev_t *vd, uint64_t zio_offset)
 
 	if (vd->vdev_nonrot) {
 		/* Non-rotating media. */
-		if (lastoffset == zio_offset)
-			return (load + zfs_vdev_mirror_non_rotating_inc);
-
+		if (lastoffset == zio_offset) {
+			load += zfs_vdev_mirror_non_rotating_inc;
+		} else {
+			/*
+			 * Apply a seek penalty even for non-rotating devices
+			 * as sequential I/O's can be aggregated into fewer
+			 * operations on the device, thus avoiding unnecessary
+			 * per-command overhead and boosting performance.
+			 */
+			load += zfs_vdev_mirror_non_rotating_seek_inc;
+		}
+	} else if (lastoffset == zio_offset) {
+		/* Rotating media I/O's which directly follow the last I/O. */
+		load += zfs_vdev_mirror_rotating_inc;
+	} else if (ABS(lastoffset - zio_offset) <
+	    zfs_vdev_mirror_rotating_seek_offset) {
 		/*
-		 * Apply a seek penalty even for non-rotating devices as
-		 * sequential I/O's can be aggregated into fewer operations on
-		 * the device, thus avoiding unnecessary per-command overhead
-		 * and boosting performance.
+		 * Apply half the seek increment to I/O's within seek offset
+		 * of the last I/O queued to this vdev as they should incure
+		 * less of a seek increment.
 		 */
-		return (load + zfs_vdev_mirror_non_rotating_seek_inc);
+		load += (zfs_vdev_mirror_rotating_seek_inc / 2);
+	} else {
+		/* Apply the full seek increment to all other I/O's. */
+		load += zfs_vdev_mirror_rotating_seek_inc;
 	}
 
-	/* Rotating media I/O's which directly follow the last I/O. */
-	if (lastoffset == zio_offset)
-		return (load + zfs_vdev_mirror_rotating_inc);
-
-	/*
-	 * Apply half the seek increment to I/O's within seek offset
-	 * of the last I/O queued to this vdev as they should incure less
-	 * of a seek increment.
-	 */
-	if (ABS(lastoffset - zio_offset) <
-	    zfs_vdev_mirror_rotating_seek_offset)
-		return (load + (zfs_vdev_mirror_rotating_seek_inc / 2));
+	if (zfs_vdev_mirror_latency_select)
+		return (vdev_mirror_expected_latency(vd, load));
 
-	/* Apply the full seek increment to all other I/O's. */
-	return (load + zfs_vdev_mirror_rotating_seek_inc);
+	return (load);
 }
 
 /*
@@ -119,6 +119,41 @@
  * maximum percentage, this indicates that the rate of incoming data is
  * greater than the rate that the backend storage can handle. In this case, we
  * must further throttle incoming writes (see dmu_tx_delay() for details).
+ *
+ * Weighted-Fair Queueing
+ *
+ * Within a class, i/os from all datasets normally compete equally.  The
+ * ioweight dataset property (carried to the leaf zios as io_weight, see
+ * zio_prop_t) gives a dataset a larger or smaller share of the class.  Each
+ * queued i/o is stamped with a virtual finish time: the later of the class's
+ * virtual time and the finish time of the previous i/o queued by the same
+ * dataset, plus its size scaled by ZFS_IOWEIGHT_DEFAULT / weight.  The class's
+ * virtual time advances to the finish time of each i/o issued.
+ *
+ * As long as every queued i/o in a class has the default weight, the class is
+ * dispatched in LBA or FIFO order as described above.  Once a dataset with a
+ * non-default weight has i/o queued, the class is dispatched in virtual finish
+ * time order instead, so a heavily weighted dataset keeps its latency while
+ * lower weighted batch work is queued behind it.  Aggregation is unaffected.
+ * Setting zfs_vdev_fair_queue to 0 always uses LBA or FIFO order.
+ *
+ * Deadlines
+ *
+ * The class limits bound how much of the device each class may use, but no
+ * i/o has a deadline: on a rotating disk a sync read may wait behind a deep
+ * queue of async writes for as long as the disk takes to work through them.
+ * When zfs_vdev_deadline is set, each queued i/o is given a deadline of its
+ * arrival time plus its class's target latency
+ * (zfs_vdev_<class>_deadline_ms).  A class whose oldest i/o has passed its
+ * deadline is served first, as long as it is below its maximum, and that
+ * oldest i/o is issued ahead of LBA or weighted-fair order.  While any class
+ * has expired i/o queued, classes without expired i/o are held to their
+ * minimum so the device queue drains in favour of the late class.
+ *
+ * The vdev_queue_deadline kstat counts, per class, the i/os issued early
+ * because they expired ("promoted") and the i/os that completed after their
+ * deadline ("missed").  Misses are counted whether or not zfs_vdev_deadline
+ * is set, so the targets can be evaluated before enabling it.
  */
 
 /*
@@ -191,6 +226,59 @@ uint64_t zfs_vdev_queue_depth_pct = 1000;
 uint64_t zfs_vdev_queue_depth_pct = 300;
 #endif
 
+/*
+ * Dispatch a class in weighted-fair order while it has i/o queued with a
+ * non-default ioweight.
+ */
+int zfs_vdev_fair_queue = 1;
+
+static kmem_cache_t *vdev_queue_flow_cache;
+
+/*
+ * Promote i/os which have waited longer than their class's target latency,
+ * see "Deadlines" above.
+ */
+int zfs_vdev_deadline = 0;
+uint32_t zfs_vdev_sync_read_deadline_ms = 100;
+uint32_t zfs_vdev_sync_write_deadline_ms = 100;
+uint32_t zfs_vdev_async_read_deadline_ms = 500;
+uint32_t zfs_vdev_async_write_deadline_ms = 2000;
+uint32_t zfs_vdev_scrub_deadline_ms = 5000;
+
+static kstat_t *vdq_ksp = NULL;
+
+typedef struct vdq_stats {
+	kstat_named_t vdq_promoted[ZIO_PRIORITY_NUM_QUEUEABLE];
+	kstat_named_t vdq_missed[ZIO_PRIORITY_NUM_QUEUEABLE];
+} vdq_stats_t;
+
+static vdq_stats_t vdq_stats = {
+	{
+		{ "sync_read_promoted",		KSTAT_DATA_UINT64 },
+		{ "sync_write_promoted",	KSTAT_DATA_UINT64 },
+		{ "async_read_promoted",	KSTAT_DATA_UINT64 },
+		{ "async_write_promoted",	KSTAT_DATA_UINT64 },
+		{ "scrub_promoted",		KSTAT_DATA_UINT64 },
+	},
+	{
+		{ "sync_read_missed",		KSTAT_DATA_UINT64 },
+		{ "sync_write_missed",		KSTAT_DATA_UINT64 },
+		{ "async_read_missed",		KSTAT_DATA_UINT64 },
+		{ "async_write_missed",		KSTAT_DATA_UINT64 },
+		{ "scrub_missed",		KSTAT_DATA_UINT64 },
+	}
+};
+
+#define	VDQSTAT_BUMP(stat, p)	atomic_inc_64(&vdq_stats.stat[p].value.ui64);
+
+/*
+ * Weight of each completed read in the device's average read service time
+ * (vq_read_ewma), as a shift: a new sample counts for 1/2^shift.  The
+ * average is used by vdev_mirror_load() to compare mirror children.  Values
+ * outside 1 to 30 are clamped when read.
+ */
+int zfs_vdev_read_ewma_shift = 3;
+
 int
 vdev_queue_offset_compare(const void *x1, const void *x2)
 {
@@ -245,6 +333,180 @@ vdev_queue_timestamp_compare(const void *x1, const void *x2)
 	return (0);
 }
 
+static int
+vdev_queue_vtime_compare(const void *x1, const void *x2)
+{
+	const zio_t *z1 = x1;
+	const zio_t *z2 = x2;
+
+	if (z1->io_vtime < z2->io_vtime)
+		return (-1);
+	if (z1->io_vtime > z2->io_vtime)
+		return (1);
+
+	if (z1 < z2)
+		return (-1);
+	if (z1 > z2)
+		return (1);
+
+	return (0);
+}
+
+static int
+vdev_queue_flow_compare(const void *x1, const void *x2)
+{
+	const vdev_queue_flow_t *f1 = x1;
+	const vdev_queue_flow_t *f2 = x2;
+
+	if (f1->vqf_objset < f2->vqf_objset)
+		return (-1);
+	if (f1->vqf_objset > f2->vqf_objset)
+		return (1);
+
+	return (0);
+}
+
+static inline uint16_t
+vdev_queue_io_weight(const zio_t *zio)
+{
+	return (zio->io_weight != 0 ? zio->io_weight : ZFS_IOWEIGHT_DEFAULT);
+}
+
+/*
+ * Stamp the i/o with its virtual finish time and queue it in the class's
+ * weighted-fair tree.  A flow that can't be allocated without sleeping
+ * (we hold vq_lock) is charged to the class's spill flow instead.
+ */
+static void
+vdev_queue_fair_insert(vdev_queue_class_t *vqc, zio_t *zio)
+{
+	uint16_t weight = vdev_queue_io_weight(zio);
+	vdev_queue_flow_t search, *vqf;
+	avl_index_t where;
+
+	search.vqf_objset = zio->io_bookmark.zb_objset;
+	vqf = avl_find(&vqc->vqc_flow_tree, &search, &where);
+	if (vqf == NULL) {
+		vqf = kmem_cache_alloc(vdev_queue_flow_cache, KM_NOSLEEP);
+		if (vqf != NULL) {
+			vqf->vqf_objset = search.vqf_objset;
+			vqf->vqf_finish = 0;
+			vqf->vqf_queued = 0;
+			avl_insert(&vqc->vqc_flow_tree, vqf, where);
+		} else {
+			vqf = &vqc->vqc_spill_flow;
+		}
+	}
+
+	zio->io_vtime = MAX(vqc->vqc_vtime, vqf->vqf_finish) +
+	    MAX(zio->io_size, 1) * ZFS_IOWEIGHT_DEFAULT / weight;
+	zio->io_flow = vqf;
+	vqf->vqf_finish = zio->io_vtime;
+	vqf->vqf_queued++;
+
+	avl_add(&vqc->vqc_fair_tree, zio);
+	if (weight != ZFS_IOWEIGHT_DEFAULT)
+		vqc->vqc_weighted++;
+}
+
+static void
+vdev_queue_fair_unlink(vdev_queue_class_t *vqc, zio_t *zio)
+{
+	vdev_queue_flow_t *vqf = zio->io_flow;
+
+	avl_remove(&vqc->vqc_fair_tree, zio);
+	if (vdev_queue_io_weight(zio) != ZFS_IOWEIGHT_DEFAULT) {
+		ASSERT3U(vqc->vqc_weighted, >, 0);
+		vqc->vqc_weighted--;
+	}
+	zio->io_flow = NULL;
+
+	ASSERT3U(vqf->vqf_queued, >, 0);
+	if (--vqf->vqf_queued == 0) {
+		/* An idle dataset keeps no credit. */
+		if (vqf == &vqc->vqc_spill_flow) {
+			vqf->vqf_finish = 0;
+		} else {
+			avl_remove(&vqc->vqc_flow_tree, vqf);
+			kmem_cache_free(vdev_queue_flow_cache, vqf);
+		}
+	}
+}
+
+/*
+ * The weighted-fair tree is only kept while the class has i/o with a
+ * non-default weight queued.  The first such i/o stamps everything already
+ * queued, in arrival order, so that the tree holds the whole class while it
+ * is used for dispatch; once the last one leaves the tree is emptied again.
+ */
+static void
+vdev_queue_fair_add(vdev_queue_t *vq, zio_t *zio)
+{
+	vdev_queue_class_t *vqc = &vq->vq_class[zio->io_priority];
+	zio_t *qzio;
+
+	if (vqc->vqc_weighted == 0) {
+		if (!zfs_vdev_fair_queue ||
+		    vdev_queue_io_weight(zio) == ZFS_IOWEIGHT_DEFAULT)
+			return;
+
+		ASSERT(avl_is_empty(&vqc->vqc_fair_tree));
+		for (qzio = list_head(&vqc->vqc_deadline_list); qzio != NULL;
+		    qzio = list_next(&vqc->vqc_deadline_list, qzio))
+			vdev_queue_fair_insert(vqc, qzio);
+	}
+
+	vdev_queue_fair_insert(vqc, zio);
+}
+
+static void
+vdev_queue_fair_remove(vdev_queue_t *vq, zio_t *zio)
+{
+	vdev_queue_class_t *vqc = &vq->vq_class[zio->io_priority];
+
+	if (zio->io_flow == NULL)
+		return;
+
+	vdev_queue_fair_unlink(vqc, zio);
+	if (vqc->vqc_weighted == 0) {
+		while ((zio = avl_first(&vqc->vqc_fair_tree)) != NULL)
+			vdev_queue_fair_unlink(vqc, zio);
+	}
+}
+
+static hrtime_t
+vdev_queue_class_deadline(zio_priority_t p)
+{
+	switch (p) {
+	case ZIO_PRIORITY_SYNC_READ:
+		return (MSEC2NSEC(zfs_vdev_sync_read_deadline_ms));
+	case ZIO_PRIORITY_SYNC_WRITE:
+		return (MSEC2NSEC(zfs_vdev_sync_write_deadline_ms));
+	case ZIO_PRIORITY_ASYNC_READ:
+		return (MSEC2NSEC(zfs_vdev_async_read_deadline_ms));
+	case ZIO_PRIORITY_ASYNC_WRITE:
+		return (MSEC2NSEC(zfs_vdev_async_write_deadline_ms));
+	case ZIO_PRIORITY_SCRUB:
+		return (MSEC2NSEC(zfs_vdev_scrub_deadline_ms));
+	default:
+		panic("invalid priority %u", p);
+		return (0);
+	}
+}
+
+/*
+ * Return the class's oldest queued i/o if it has passed its deadline.
+ */
+static inline zio_t *
+vdev_queue_class_expired(vdev_queue_t *vq, zio_priority_t p, hrtime_t now)
+{
+	zio_t *zio = list_head(&vq->vq_class[p].vqc_deadline_list);
+
+	if (zio != NULL && zio->io_deadline < now)
+		return (zio);
+	return (NULL);
+}
+
 static int
 vdev_queue_class_min_active(zio_priority_t p)
 {
@@ -332,11 +594,26 @@ static zio_priority_t
 vdev_queue_class_to_issue(vdev_queue_t *vq)
 {
 	spa_t *spa = vq->vq_vdev->vdev_spa;
+	boolean_t late = B_FALSE;
+	hrtime_t now;
 	zio_priority_t p;
 
 	if (avl_numnodes(&vq->vq_active_tree) >= zfs_vdev_max_active)
 		return (ZIO_PRIORITY_NUM_QUEUEABLE);
 
+	/* serve a class whose oldest i/o has missed its deadline */
+	if (zfs_vdev_deadline) {
+		now = gethrtime();
+		for (p = 0; p < ZIO_PRIORITY_NUM_QUEUEABLE; p++) {
+			if (vdev_queue_class_expired(vq, p, now) == NULL)
+				continue;
+			late = B_TRUE;
+			if (vq->vq_class[p].vqc_active <
+			    vdev_queue_class_max_active(spa, p))
+				return (p);
+		}
+	}
+
 	/* find a queue that has not reached its minimum # outstanding i/os */
 	for (p = 0; p < ZIO_PRIORITY_NUM_QUEUEABLE; p++) {
 		if (avl_numnodes(vdev_queue_class_tree(vq, p)) > 0 &&
@@ -347,8 +624,12 @@ vdev_queue_class_to_issue(vdev_queue_t *vq)
 
 	/*
 	 * If we haven't found a queue, look for one that hasn't reached its
-	 * maximum # outstanding i/os.
+	 * maximum # outstanding i/os.  While some class is late, the others
+	 * get no more than their minimum.
 	 */
+	if (late)
+		return (ZIO_PRIORITY_NUM_QUEUEABLE);
+
 	for (p = 0; p < ZIO_PRIORITY_NUM_QUEUEABLE; p++) {
 		if (avl_numnodes(vdev_queue_class_tree(vq, p)) > 0 &&
 		    vq->vq_class[p].vqc_active <
@@ -393,6 +674,16 @@ vdev_queue_init(vdev_t *vd)
 			compfn = vdev_queue_offset_compare;
 		avl_create(vdev_queue_class_tree(vq, p), compfn,
 			sizeof (zio_t), offsetof(struct zio, io_queue_node));
+		avl_create(&vq->vq_class[p].vqc_fair_tree,
+		    vdev_queue_vtime_compare, sizeof (zio_t),
+		    offsetof(struct zio, io_fair_node));
+		avl_create(&vq->vq_class[p].vqc_flow_tree,
+		    vdev_queue_flow_compare, sizeof (vdev_queue_flow_t),
+		    offsetof(vdev_queue_flow_t, vqf_node));
+		list_create(&vq->vq_class[p].vqc_deadline_list,
+		    sizeof (zio_t), offsetof(struct zio, io_deadline_node));
+		bzero(&vq->vq_class[p].vqc_spill_flow,
+		    sizeof (vdev_queue_flow_t));
 	}
 
 	vq->vq_lastoffset = 0;
@@ -404,8 +695,12 @@ vdev_queue_fini(vdev_t *vd)
 	vdev_queue_t *vq = &vd->vdev_queue;
 	zio_priority_t p;
 
-	for (p = 0; p < ZIO_PRIORITY_NUM_QUEUEABLE; p++)
+	for (p = 0; p < ZIO_PRIORITY_NUM_QUEUEABLE; p++) {
 		avl_destroy(vdev_queue_class_tree(vq, p));
+		avl_destroy(&vq->vq_class[p].vqc_fair_tree);
+		avl_destroy(&vq->vq_class[p].vqc_flow_tree);
+		list_destroy(&vq->vq_class[p].vqc_deadline_list);
+	}
 	avl_destroy(&vq->vq_active_tree);
 	avl_destroy(vdev_queue_type_tree(vq, ZIO_TYPE_READ));
 	avl_destroy(vdev_queue_type_tree(vq, ZIO_TYPE_WRITE));
@@ -424,6 +719,11 @@ vdev_queue_io_add(vdev_queue_t *vq, zio_t *zio)
 	ASSERT3U(zio->io_priority, <, ZIO_PRIORITY_NUM_QUEUEABLE);
 	avl_add(vdev_queue_class_tree(vq, zio->io_priority), zio);
 	avl_add(vdev_queue_type_tree(vq, zio->io_type), zio);
+	vdev_queue_fair_add(vq, zio);
+	zio->io_deadline = zio->io_timestamp +
+	    vdev_queue_class_deadline(zio->io_priority);
+	list_insert_tail(&vq->vq_class[zio->io_priority].vqc_deadline_list,
+	    zio);
 
 #ifdef LINUX
     if (ssh->kstat != NULL) {
@@ -445,6 +745,8 @@ vdev_queue_io_remove(vdev_queue_t *vq, zio_t *zio)
 	ASSERT3U(zio->io_priority, <, ZIO_PRIORITY_NUM_QUEUEABLE);
 	avl_remove(vdev_queue_class_tree(vq, zio->io_priority), zio);
 	avl_remove(vdev_queue_type_tree(vq, zio->io_type), zio);
+	vdev_queue_fair_remove(vq, zio);
+	list_remove(&vq->vq_class[zio->io_priority].vqc_deadline_list, zio);
 
 #ifdef LINUX
 	if (ssh->kstat != NULL) {
@@ -690,6 +992,7 @@ vdev_queue_aggregate(vdev_queue_t *vq, zio_t *zio)
 static zio_t *
 vdev_queue_io_to_issue(vdev_queue_t *vq)
 {
+	vdev_queue_class_t *vqc;
 	zio_t *zio, *aio;
 	zio_priority_t p;
 	avl_index_t idx;
@@ -706,26 +1009,43 @@ again:
 	}
 
 	/*
-	 * For LBA-ordered queues (async / scrub), issue the i/o which follows
-	 * the most recently issued i/o in LBA (offset) order.
+	 * An i/o which has passed its deadline is issued first.
+	 *
+	 * Otherwise, if datasets with different weights have i/o queued,
+	 * issue the i/o with the earliest virtual finish time.
+	 *
+	 * Otherwise, for LBA-ordered queues (async / scrub), issue the i/o
+	 * which follows the most recently issued i/o in LBA (offset) order.
 	 *
 	 * For FIFO queues (sync), issue the i/o with the lowest timestamp.
 	 */
-	tree = vdev_queue_class_tree(vq, p);
-	vq->vq_io_search.io_timestamp = 0;
-	vq->vq_io_search.io_offset = vq->vq_last_offset + 1;
-	VERIFY3P(avl_find(tree, &vq->vq_io_search,
-	    &idx), ==, NULL);
-	zio = avl_nearest(tree, idx, AVL_AFTER);
-	if (zio == NULL)
-		zio = avl_first(tree);
+	vqc = &vq->vq_class[p];
+	if (zfs_vdev_deadline &&
+	    (zio = vdev_queue_class_expired(vq, p, gethrtime())) != NULL) {
+		VDQSTAT_BUMP(vdq_promoted, p);
+	} else if (zfs_vdev_fair_queue && vqc->vqc_weighted != 0) {
+		zio = avl_first(&vqc->vqc_fair_tree);
+	} else {
+		tree = vdev_queue_class_tree(vq, p);
+		vq->vq_io_search.io_timestamp = 0;
+		vq->vq_io_search.io_offset = vq->vq_last_offset + 1;
+		VERIFY3P(avl_find(tree, &vq->vq_io_search,
+		    &idx), ==, NULL);
+		zio = avl_nearest(tree, idx, AVL_AFTER);
+		if (zio == NULL)
+			zio = avl_first(tree);
+	}
 	ASSERT3U(zio->io_priority, ==, p);
+	if (zio->io_flow != NULL)
+		vqc->vqc_vtime = MAX(vqc->vqc_vtime, zio->io_vtime);
 
 	aio = vdev_queue_aggregate(vq, zio);
-	if (aio != NULL)
+	if (aio != NULL) {
+		aio->io_deadline = zio->io_deadline;
 		zio = aio;
-	else
+	} else {
 		vdev_queue_io_remove(vq, zio);
+	}
 
 	/*
 	 * If the I/O is or was optional and therefore has no data, we need to
@@ -805,6 +1125,21 @@ vdev_queue_io_done(zio_t *zio)
 	vq->vq_io_complete_ts = gethrtime();
 	vq->vq_io_delta_ts = vq->vq_io_complete_ts - zio->io_timestamp;
 
+	if (zio->io_deadline != 0 && vq->vq_io_complete_ts > zio->io_deadline)
+		VDQSTAT_BUMP(vdq_missed, zio->io_priority);
+
+	if (zio->io_type == ZIO_TYPE_READ && zio->io_error == 0 &&
+	    zio->io_delay != 0) {
+		int shift = MIN(MAX(zfs_vdev_read_ewma_shift, 1), 30);
+
+		if (vq->vq_read_ewma == 0) {
+			vq->vq_read_ewma = zio->io_delay;
+		} else {
+			vq->vq_read_ewma += (zio->io_delay - vq->vq_read_ewma) /
+			    (1 << shift);
+		}
+	}
+
 	while ((nio = vdev_queue_io_to_issue(vq)) != NULL) {
 		mutex_exit(&vq->vq_lock);
 		if (nio->io_done == vdev_queue_agg_io_done) {
@@ -820,7 +1155,7 @@ vdev_queue_io_done(zio_t *zio)
 }
 
 /*
- * As these three methods are only used for load calculations we're not
+ * As these four methods are only used for load calculations we're not
  * concerned if we get an incorrect value on 32bit platforms due to lack of
  * vq_lock mutex use here, instead we prefer to keep it lock free for
  * performance.
@@ -831,6 +1166,12 @@ vdev_queue_length(vdev_t *vd)
 	return (avl_numnodes(&vd->vdev_queue.vq_active_tree));
 }
 
+hrtime_t
+vdev_queue_read_latency(vdev_t *vd)
+{
+	return (vd->vdev_queue.vq_read_ewma);
+}
+
 uint64_t
 vdev_queue_lastoffset(vdev_t *vd)
 {
@@ -842,3 +1183,38 @@ vdev_queue_register_lastoffset(vdev_t *vd, zio_t *zio)
 {
 	vd->vdev_queue.vq_lastoffset = zio->io_offset + zio->io_size;
 }
+
+void
+vdev_queue_cache_init(void)
+{
+	vdev_queue_flow_cache = kmem_cache_create("vdev_queue_flow_t",
+	    sizeof (vdev_queue_flow_t), 0, NULL, NULL, NULL, NULL, NULL, 0);
+}
+
+void
+vdev_queue_cache_fini(void)
+{
+	kmem_cache_destroy(vdev_queue_flow_cache);
+	vdev_queue_flow_cache = NULL;
+}
+
+void
+vdev_queue_stat_init(void)
+{
+	vdq_ksp = kstat_create("zfs", 0, "vdev_queue_deadline", "misc",
+	    KSTAT_TYPE_NAMED, sizeof (vdq_stats) / sizeof (kstat_named_t),
+	    KSTAT_FLAG_VIRTUAL);
+	if (vdq_ksp != NULL) {
+		vdq_ksp->ks_data = &vdq_stats;
+		kstat_install(vdq_ksp);
+	}
+}
+
+void
+vdev_queue_stat_fini(void)
+{
+	if (vdq_ksp != NULL) {
+		kstat_delete(vdq_ksp);
+		vdq_ksp = NULL;
+	}
+}
@@ -1893,6 +1893,35 @@ vdev_raidz_asize(vdev_t *vd, uint64_t psize)
 	return (asize);
 }
 
+/*
+ * Translate a range of a RAID-Z vdev into the range of child cvd that holds
+ * its sectors.  Sector b of the RAID-Z vdev lives in column b % width at
+ * row b / width, so the child range spans the rows whose sector in that
+ * column falls inside [start, end).  Used to turn a TRIM of free space on
+ * the RAID-Z vdev into TRIMs of its children.
+ */
+void
+vdev_raidz_xlate(vdev_t *cvd, uint64_t *start, uint64_t *end)
+{
+	vdev_t *vd = cvd->vdev_parent;
+	uint64_t width = vd->vdev_children;
+	uint64_t tgt_col = cvd->vdev_id;
+	uint64_t ashift = vd->vdev_top->vdev_ashift;
+	uint64_t b_start = *start >> ashift;
+	uint64_t b_end = *end >> ashift;
+	uint64_t start_row = 0, end_row = 0;
+
+	ASSERT3P(vd->vdev_ops, ==, &vdev_raidz_ops);
+
+	if (b_start > tgt_col)
+		start_row = ((b_start - tgt_col - 1) / width) + 1;
+	if (b_end > tgt_col)
+		end_row = ((b_end - tgt_col - 1) / width) + 1;
+
+	*start = start_row << ashift;
+	*end = end_row << ashift;
+}
+
 static void
 vdev_raidz_child_done(zio_t *zio)
 {
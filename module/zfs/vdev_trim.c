@@ -0,0 +1,519 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/btree.h>
+#include <sys/metaslab_impl.h>
+#include <sys/range_tree.h>
+#include <sys/spa_impl.h>
+#include <sys/vdev_impl.h>
+#include <sys/vdev_trim.h>
+#include <sys/zio.h>
+
+/*
+ * TRIM
+ *
+ * Once ZFS frees space, the data in it is of no further use, but unless
+ * the device underneath is told so an SSD keeps copying it around during
+ * garbage collection and a thinly provisioned LUN keeps it allocated. A
+ * TRIM tells the device that a range no longer holds anything.
+ *
+ * TRIMs are issued a metaslab at a time. A batch of free ranges is copied
+ * out of the metaslab and ms_trimming is set, which keeps allocations away
+ * from the metaslab (as ms_condensing does) until the TRIMs complete; the
+ * ranges stay in ms_tree throughout, so nothing else about the metaslab
+ * changes. zio_trim() carries each range down to the leaves of the
+ * top-level vdev, translating it for RAID-Z children, and the leaves
+ * issue it as a DKIOCFREE ioctl: an UNMAP for disks, a punched hole for
+ * files. Leaves that reject it are marked vdev_notrim and left alone.
+ *
+ * There are two ways to trim a pool:
+ *
+ * - With the autotrim property on, metaslab_sync_done() queues space in
+ *   the metaslab's ms_trimtree as it leaves the defer trees, when it can
+ *   no longer be needed to rewind the pool; allocating space takes it
+ *   back out. Every zfs_trim_txg_batch txgs spa_sync() dispatches a pass
+ *   that trims what has been queued.
+ *
+ * - "zpool trim" starts a thread that trims all of the pool's free space,
+ *   loading each metaslab in turn to find it. It works in slices of at
+ *   most zfs_trim_extent_bytes_max bytes, or a second's worth at the
+ *   requested rate, so that allocations are only held off briefly, and
+ *   sleeps between slices to keep to the rate.
+ *
+ * Neither is persistent: queued ranges and the progress of "zpool trim"
+ * are lost when the pool is exported.
+ *
+ * Both hold SCL_CONFIG, which keeps the vdevs and metaslabs in place, and
+ * SCL_STATE, which zio_create() requires, while trimming a metaslab; not
+ * SCL_ZIO, which loading a metaslab takes again for its reads.
+ */
+#define	TRIM_LOCKS	(SCL_CONFIG | SCL_STATE)
+
+/*
+ * The largest range sent to a device in a single TRIM; larger free ranges
+ * are split.
+ */
+int zfs_trim_extent_bytes_max = 128 * 1024 * 1024;
+
+/*
+ * Autotrim skips free ranges smaller than this: devices often ignore
+ * small TRIMs, and those they honor cost nearly as much as a write.
+ */
+int zfs_trim_extent_bytes_min = 32 * 1024;
+
+/*
+ * The number of txgs of freed space autotrim collects before it trims.
+ */
+int zfs_trim_txg_batch = 32;
+
+typedef struct vdev_trim_arg {
+	vdev_t		*vta_vd;
+	zio_t		*vta_zio;
+	uint64_t	vta_min;	/* smallest range worth trimming */
+	uint64_t	vta_bytes;	/* bytes trimmed */
+} vdev_trim_arg_t;
+
+static void
+vdev_trim_range(void *arg, uint64_t start, uint64_t size)
+{
+	vdev_trim_arg_t *vta = arg;
+	vdev_t *vd = vta->vta_vd;
+	uint64_t max = MAX(P2ALIGN((uint64_t)zfs_trim_extent_bytes_max,
+	    1ULL << vd->vdev_ashift), 1ULL << vd->vdev_ashift);
+
+	if (size < vta->vta_min)
+		return;
+
+	while (size != 0) {
+		uint64_t len = MIN(size, max);
+
+		zio_nowait(zio_trim(vta->vta_zio, vd->vdev_spa, vd, start, len,
+		    ZIO_FLAG_CANFAIL | ZIO_FLAG_DONT_PROPAGATE |
+		    ZIO_FLAG_DONT_RETRY));
+		vta->vta_bytes += len;
+		start += len;
+		size -= len;
+	}
+}
+
+/*
+ * TRIM the ranges of rt, a private copy of some of msp's free space, and
+ * then let the metaslab be allocated from again. The caller has set
+ * ms_trimming. Returns the number of bytes trimmed.
+ */
+static uint64_t
+metaslab_trim_tree(metaslab_t *msp, range_tree_t *rt, uint64_t min)
+{
+	vdev_t *vd = msp->ms_group->mg_vd;
+	vdev_trim_arg_t vta;
+
+	ASSERT(msp->ms_trimming);
+	ASSERT(spa_config_held(vd->vdev_spa, TRIM_LOCKS, RW_READER) ==
+	    TRIM_LOCKS);
+
+	vta.vta_vd = vd;
+	vta.vta_zio = zio_root(vd->vdev_spa, NULL, NULL, ZIO_FLAG_CANFAIL);
+	vta.vta_min = min;
+	vta.vta_bytes = 0;
+
+	mutex_enter(rt->rt_lock);
+	range_tree_walk(rt, vdev_trim_range, &vta);
+	range_tree_vacate(rt, NULL, NULL);
+	mutex_exit(rt->rt_lock);
+
+	/* A failed TRIM costs nothing but the space it didn't release. */
+	(void) zio_wait(vta.vta_zio);
+
+	mutex_enter(&msp->ms_lock);
+	msp->ms_trimming = B_FALSE;
+	cv_broadcast(&msp->ms_trim_cv);
+	mutex_exit(&msp->ms_lock);
+
+	return (vta.vta_bytes);
+}
+
+/*
+ * Autotrim: TRIM the space queued in msp's ms_trimtree.
+ */
+static uint64_t
+metaslab_trim_queued(metaslab_t *msp)
+{
+	vdev_t *vd = msp->ms_group->mg_vd;
+	range_tree_t *rt;
+	kmutex_t lock;
+	uint64_t bytes;
+
+	if (!vdev_writeable(vd))
+		return (0);
+
+	mutex_enter(&msp->ms_lock);
+	/* Nothing below vd can TRIM any more; drop what was queued. */
+	if (!vdev_can_trim(vd))
+		range_tree_vacate(msp->ms_trimtree, NULL, NULL);
+	if (msp->ms_trimming || range_tree_space(msp->ms_trimtree) == 0) {
+		mutex_exit(&msp->ms_lock);
+		return (0);
+	}
+
+	mutex_init(&lock, NULL, MUTEX_DEFAULT, NULL);
+	rt = range_tree_create(NULL, NULL, &lock);
+
+	mutex_enter(&lock);
+	range_tree_vacate(msp->ms_trimtree, range_tree_add, rt);
+	mutex_exit(&lock);
+	msp->ms_trimming = B_TRUE;
+	mutex_exit(&msp->ms_lock);
+
+	bytes = metaslab_trim_tree(msp, rt, zfs_trim_extent_bytes_min);
+
+	range_tree_destroy(rt);
+	mutex_destroy(&lock);
+
+	return (bytes);
+}
+
+/*
+ * Unload a metaslab that "zpool trim" loaded, once it is done with it.
+ * metaslab_sync_done() only unloads metaslabs that were synced, so one
+ * that nothing allocates from would otherwise keep its free tree in
+ * memory.  A metaslab that has been activated, or has allocations that
+ * are not synced yet, is left for metaslab_sync_done() as usual.
+ */
+static void
+metaslab_trim_unload(metaslab_t *msp)
+{
+	int t;
+
+	mutex_enter(&msp->ms_lock);
+	while (msp->ms_trimming)
+		cv_wait(&msp->ms_trim_cv, &msp->ms_lock);
+
+	if (!msp->ms_loaded || metaslab_debug_unload || msp->ms_condensing ||
+	    (msp->ms_weight & METASLAB_ACTIVE_MASK)) {
+		mutex_exit(&msp->ms_lock);
+		return;
+	}
+	for (t = 0; t < TXG_SIZE; t++) {
+		if (range_tree_space(msp->ms_alloctree[t]) != 0) {
+			mutex_exit(&msp->ms_lock);
+			return;
+		}
+	}
+
+	metaslab_unload(msp);
+	mutex_exit(&msp->ms_lock);
+}
+
+/*
+ * "zpool trim": TRIM up to limit bytes of msp's free space at or after
+ * *cursor, and move the cursor past them. Returns the number of bytes
+ * trimmed, which is zero once the end of the metaslab has been reached.
+ * *loaded is set on the first call for the metaslab (*cursor is zero) if
+ * the metaslab had to be loaded; the caller then passes it to
+ * metaslab_trim_unload() when it is done with the metaslab.
+ */
+static uint64_t
+metaslab_trim_free(metaslab_t *msp, uint64_t *cursor, uint64_t limit,
+    boolean_t *loaded)
+{
+	vdev_t *vd = msp->ms_group->mg_vd;
+	zfs_btree_t *t = &msp->ms_tree->rt_root;
+	zfs_btree_index_t where;
+	range_seg_t search, *rs;
+	range_tree_t *rt;
+	kmutex_t lock;
+	uint64_t bytes = 0;
+
+	if (!vdev_can_trim(vd))
+		return (0);
+
+	limit = MAX(P2ALIGN(limit, 1ULL << vd->vdev_ashift),
+	    1ULL << vd->vdev_ashift);
+
+	mutex_enter(&msp->ms_lock);
+	while (msp->ms_trimming)
+		cv_wait(&msp->ms_trim_cv, &msp->ms_lock);
+
+	/*
+	 * A metaslab that is still being added to the pool has no free
+	 * space yet.
+	 */
+	metaslab_load_wait(msp);
+	if (msp->ms_freedtree == NULL) {
+		mutex_exit(&msp->ms_lock);
+		return (0);
+	}
+	if (!msp->ms_loaded) {
+		if (metaslab_load(msp) != 0) {
+			mutex_exit(&msp->ms_lock);
+			return (0);
+		}
+		if (*cursor == 0)
+			*loaded = B_TRUE;
+	}
+
+	/* Whatever autotrim has queued is about to be trimmed anyway. */
+	if (*cursor == 0)
+		range_tree_vacate(msp->ms_trimtree, NULL, NULL);
+
+	mutex_init(&lock, NULL, MUTEX_DEFAULT, NULL);
+	rt = range_tree_create(NULL, NULL, &lock);
+
+	mutex_enter(&lock);
+	search.rs_start = *cursor;
+	search.rs_end = *cursor + 1;
+	if ((rs = zfs_btree_find(t, &search, &where)) == NULL)
+		rs = zfs_btree_next(t, &where, &where);
+	for (; rs != NULL && bytes < limit;
+	    rs = zfs_btree_next(t, &where, &where)) {
+		uint64_t start = MAX(rs->rs_start, *cursor);
+		uint64_t size = MIN(rs->rs_end - start, limit - bytes);
+
+		range_tree_add(rt, start, size);
+		bytes += size;
+		*cursor = start + size;
+	}
+	mutex_exit(&lock);
+
+	if (bytes != 0)
+		msp->ms_trimming = B_TRUE;
+	mutex_exit(&msp->ms_lock);
+
+	if (bytes != 0)
+		(void) metaslab_trim_tree(msp, rt, 0);
+
+	range_tree_destroy(rt);
+	mutex_destroy(&lock);
+
+	return (bytes);
+}
+
+static void
+spa_auto_trim_task(void *arg)
+{
+	spa_t *spa = arg;
+	vdev_t *rvd = spa->spa_root_vdev;
+	uint64_t c = 0, m = 0, bytes = 0;
+
+	while (spa->spa_autotrim) {
+		vdev_t *vd;
+
+		spa_config_enter(spa, TRIM_LOCKS, FTAG, RW_READER);
+		if (c >= rvd->vdev_children) {
+			spa_config_exit(spa, TRIM_LOCKS, FTAG);
+			break;
+		}
+		vd = rvd->vdev_child[c];
+		if (m < vd->vdev_ms_count) {
+			bytes += metaslab_trim_queued(vd->vdev_ms[m++]);
+		} else {
+			c++;
+			m = 0;
+		}
+		spa_config_exit(spa, TRIM_LOCKS, FTAG);
+	}
+
+	mutex_enter(&spa->spa_trim_lock);
+	spa->spa_trim_stats.pts_auto_bytes += bytes;
+	spa->spa_auto_trimming = B_FALSE;
+	mutex_exit(&spa->spa_trim_lock);
+}
+
+/*
+ * Called at the end of each txg: every zfs_trim_txg_batch txgs, start an
+ * autotrim pass unless the previous one is still running.
+ */
+void
+spa_auto_trim(spa_t *spa, uint64_t txg)
+{
+	if (!spa->spa_autotrim || zfs_trim_txg_batch <= 0 ||
+	    txg % zfs_trim_txg_batch != 0)
+		return;
+
+	mutex_enter(&spa->spa_trim_lock);
+	if (!spa->spa_auto_trimming) {
+		spa->spa_auto_trimming = B_TRUE;
+		VERIFY(taskq_dispatch(spa->spa_auto_trim_taskq,
+		    spa_auto_trim_task, spa, TQ_SLEEP) != 0);
+	}
+	mutex_exit(&spa->spa_trim_lock);
+}
+
+static void
+spa_trim_thread(void *arg)
+{
+	spa_t *spa = arg;
+	vdev_t *rvd = spa->spa_root_vdev;
+	pool_trim_stat_t *pts = &spa->spa_trim_stats;
+	uint64_t rate, limit = zfs_trim_extent_bytes_max;
+	uint64_t c = 0, m = 0, cursor = 0, issued = 0;
+	hrtime_t start = gethrtime();
+	boolean_t done = B_FALSE, loaded = B_FALSE;
+
+	mutex_enter(&spa->spa_trim_lock);
+	rate = pts->pts_rate;
+	if (rate != 0)
+		limit = MIN(limit, rate);
+
+	while (!spa->spa_trim_stop && !done) {
+		uint64_t bytes = 0;
+		boolean_t ms_done = B_FALSE;
+
+		mutex_exit(&spa->spa_trim_lock);
+
+		spa_config_enter(spa, TRIM_LOCKS, FTAG, RW_READER);
+		if (c >= rvd->vdev_children) {
+			done = B_TRUE;
+		} else if (m >= rvd->vdev_child[c]->vdev_ms_count) {
+			c++;
+			m = 0;
+		} else {
+			metaslab_t *msp = rvd->vdev_child[c]->vdev_ms[m];
+
+			bytes = metaslab_trim_free(msp, &cursor, limit,
+			    &loaded);
+			if (bytes == 0) {
+				if (loaded)
+					metaslab_trim_unload(msp);
+				loaded = B_FALSE;
+				ms_done = B_TRUE;
+				cursor = 0;
+				m++;
+			}
+		}
+		spa_config_exit(spa, TRIM_LOCKS, FTAG);
+
+		mutex_enter(&spa->spa_trim_lock);
+		pts->pts_bytes += bytes;
+		if (ms_done)
+			pts->pts_examined++;
+
+		/*
+		 * Keep to the rate by sleeping until the time it allows for
+		 * all the bytes trimmed so far has passed.
+		 */
+		issued += bytes;
+		if (rate != 0 && bytes != 0) {
+			hrtime_t target = start + MSEC2NSEC(issued / rate *
+			    MILLISEC + issued % rate * MILLISEC / rate);
+			hrtime_t now;
+
+			while (!spa->spa_trim_stop &&
+			    (now = gethrtime()) < target) {
+				(void) cv_timedwait_hires(&spa->spa_trim_cv,
+				    &spa->spa_trim_lock, target - now,
+				    MSEC2NSEC(1), 0);
+			}
+		}
+	}
+
+	/*
+	 * Don't leave the metaslab we stopped in loaded.
+	 */
+	if (loaded) {
+		mutex_exit(&spa->spa_trim_lock);
+		spa_config_enter(spa, TRIM_LOCKS, FTAG, RW_READER);
+		if (c < rvd->vdev_children &&
+		    m < rvd->vdev_child[c]->vdev_ms_count)
+			metaslab_trim_unload(rvd->vdev_child[c]->vdev_ms[m]);
+		spa_config_exit(spa, TRIM_LOCKS, FTAG);
+		mutex_enter(&spa->spa_trim_lock);
+	}
+
+	pts->pts_state = done ? POOL_TRIM_FINISHED : POOL_TRIM_CANCELED;
+	pts->pts_end_time = gethrestime_sec();
+	spa->spa_trim_thread = NULL;
+	cv_broadcast(&spa->spa_trim_cv);
+	mutex_exit(&spa->spa_trim_lock);
+
+	thread_exit();
+}
+
+/*
+ * Start trimming all the free space of the pool, at no more than rate
+ * bytes per second (0 for no limit).
+ */
+int
+spa_trim(spa_t *spa, uint64_t rate)
+{
+	vdev_t *rvd = spa->spa_root_vdev;
+	pool_trim_stat_t *pts = &spa->spa_trim_stats;
+	uint64_t ms_count = 0;
+	int c;
+
+	if (!spa_writeable(spa))
+		return (SET_ERROR(EROFS));
+
+	spa_config_enter(spa, SCL_CONFIG, FTAG, RW_READER);
+	for (c = 0; c < rvd->vdev_children; c++)
+		ms_count += rvd->vdev_child[c]->vdev_ms_count;
+	spa_config_exit(spa, SCL_CONFIG, FTAG);
+
+	mutex_enter(&spa->spa_trim_lock);
+	if (spa->spa_trim_thread != NULL) {
+		mutex_exit(&spa->spa_trim_lock);
+		return (SET_ERROR(EBUSY));
+	}
+
+	pts->pts_state = POOL_TRIM_ACTIVE;
+	pts->pts_start_time = gethrestime_sec();
+	pts->pts_end_time = 0;
+	pts->pts_rate = rate;
+	pts->pts_to_examine = ms_count;
+	pts->pts_examined = 0;
+	pts->pts_bytes = 0;
+
+	spa->spa_trim_stop = B_FALSE;
+	spa->spa_trim_thread = thread_create(NULL, 0, spa_trim_thread, spa,
+	    0, &p0, TS_RUN, minclsyspri);
+	mutex_exit(&spa->spa_trim_lock);
+
+	return (0);
+}
+
+/*
+ * Stop a "zpool trim" and wait for its thread to exit.
+ */
+int
+spa_trim_stop(spa_t *spa)
+{
+	mutex_enter(&spa->spa_trim_lock);
+	if (spa->spa_trim_thread == NULL) {
+		mutex_exit(&spa->spa_trim_lock);
+		return (SET_ERROR(ENOENT));
+	}
+
+	spa->spa_trim_stop = B_TRUE;
+	cv_broadcast(&spa->spa_trim_cv);
+	while (spa->spa_trim_thread != NULL)
+		cv_wait(&spa->spa_trim_cv, &spa->spa_trim_lock);
+	mutex_exit(&spa->spa_trim_lock);
+
+	return (0);
+}
+
+int
+spa_trim_get_stats(spa_t *spa, pool_trim_stat_t *pts)
+{
+	mutex_enter(&spa->spa_trim_lock);
+	*pts = spa->spa_trim_stats;
+	mutex_exit(&spa->spa_trim_lock);
+
+	if (pts->pts_state == POOL_TRIM_NONE && pts->pts_auto_bytes == 0)
+		return (SET_ERROR(ENOENT));
+
+	return (0);
+}
@@ -392,6 +392,14 @@ feature_do_action(spa_t *spa, spa_feature_t fid, feature_action_t action,
 	ASSERT(dmu_tx_is_syncing(tx));
 	ASSERT3U(spa_version(spa), >=, SPA_VERSION_FEATURES);
 
+	/*
+	 * The metaslabs of several top-level vdevs may be synced at once
+	 * (see vdev_sync()), and allocating or freeing their space maps
+	 * updates the spacemap_histogram refcount, so the read-modify-write
+	 * below must be serialized.
+	 */
+	mutex_enter(&spa->spa_feat_refcount_lock);
+
 	VERIFY3U(feature_get_refcount(spa, feature, &refcount), !=, ENOTSUP);
 
 	switch (action) {
@@ -409,6 +417,8 @@ feature_do_action(spa_t *spa, spa_feature_t fid, feature_action_t action,
 	}
 
 	feature_sync(spa, feature, refcount, tx);
+
+	mutex_exit(&spa->spa_feat_refcount_lock);
 }
 
 void
@@ -102,6 +102,13 @@ osx_kstat_t osx_kstat = {
 	{ "aggregation_limit",			KSTAT_DATA_INT64  },
 	{ "read_gap_limit",				KSTAT_DATA_INT64  },
 	{ "write_gap_limit",			KSTAT_DATA_INT64  },
+	{ "fair_queue",				KSTAT_DATA_INT64  },
+	{ "deadline",				KSTAT_DATA_INT64  },
+	{ "sync_read_deadline_ms",			KSTAT_DATA_UINT64 },
+	{ "sync_write_deadline_ms",		KSTAT_DATA_UINT64 },
+	{ "async_read_deadline_ms",		KSTAT_DATA_UINT64 },
+	{ "async_write_deadline_ms",		KSTAT_DATA_UINT64 },
+	{ "scrub_deadline_ms",			KSTAT_DATA_UINT64 },
 
 	{"arc_reduce_dnlc_percent",		KSTAT_DATA_INT64  },
 	{"arc_lotsfree_percent",		KSTAT_DATA_INT64  },
@@ -110,7 +117,15 @@ osx_kstat_t osx_kstat = {
 	{"zfs_delay_max_ns",			KSTAT_DATA_INT64  },
 	{"zfs_delay_min_dirty_percent",	KSTAT_DATA_INT64  },
 	{"zfs_delay_scale",				KSTAT_DATA_INT64  },
+	{"zfs_dirty_data_fair",			KSTAT_DATA_INT64  },
 	{"spa_asize_inflation",			KSTAT_DATA_INT64  },
+	{"spa_allocators",			KSTAT_DATA_INT64  },
+	{"zfs_special_class_metadata_reserve_pct",	KSTAT_DATA_INT64  },
+	{"zfs_sync_vdevs_parallel",		KSTAT_DATA_INT64  },
+	{"zfs_trim_extent_bytes_max",		KSTAT_DATA_INT64  },
+	{"zfs_trim_extent_bytes_min",		KSTAT_DATA_INT64  },
+	{"zfs_trim_txg_batch",			KSTAT_DATA_INT64  },
+	{"zfs_frag_history",			KSTAT_DATA_INT64  },
 	{"zfs_mdcomp_disable",			KSTAT_DATA_INT64  },
 	{"zfs_prefetch_disable",		KSTAT_DATA_INT64  },
 	{"zfetch_max_streams",			KSTAT_DATA_INT64  },
@@ -135,9 +150,15 @@ osx_kstat_t osx_kstat = {
 	{"zfs_read_chunk_size",			KSTAT_DATA_INT64  },
 	{"zfs_nocacheflush",			KSTAT_DATA_INT64  },
 	{"zil_replay_disable",			KSTAT_DATA_INT64  },
+	{"zil_replay_threads",			KSTAT_DATA_INT64  },
+	{"zfs_commit_timeout_pct",		KSTAT_DATA_INT64  },
+	{"zil_lwb_decay_shift",			KSTAT_DATA_INT64  },
 	{"metaslab_gang_bang",			KSTAT_DATA_INT64  },
 	{"metaslab_df_alloc_threshold",	KSTAT_DATA_INT64  },
 	{"metaslab_df_free_pct",		KSTAT_DATA_INT64  },
+	{"metaslab_preload_limit",		KSTAT_DATA_INT64  },
+	{"zfs_unflushed_max_txgs",		KSTAT_DATA_INT64  },
+	{"zfs_min_metaslabs_to_flush",	KSTAT_DATA_INT64  },
 	{"zio_injection_enabled",		KSTAT_DATA_INT64  },
 	{"zvol_immediate_write_sz",		KSTAT_DATA_INT64  },
 
@@ -149,6 +170,8 @@ osx_kstat_t osx_kstat = {
 	{"zfs_resilver_delay",			KSTAT_DATA_INT64  },
 	{"zfs_scrub_delay",				KSTAT_DATA_INT64  },
 	{"zfs_scan_idle",				KSTAT_DATA_INT64  },
+	{"zfs_scan_legacy",				KSTAT_DATA_INT64  },
+	{"zfs_scan_mem_lim_fact",		KSTAT_DATA_INT64  },
 
 	{"zfs_recover",					KSTAT_DATA_INT64  },
 
@@ -164,6 +187,8 @@ osx_kstat_t osx_kstat = {
 	{"zfs_vdev_mirror_rotating_seek_offset",KSTAT_DATA_UINT64  },
 	{"zfs_vdev_mirror_non_rotating_inc",	KSTAT_DATA_UINT64  },
 	{"zfs_vdev_mirror_non_rotating_seek_inc",KSTAT_DATA_UINT64  },
+	{"zfs_vdev_mirror_latency_select",	KSTAT_DATA_INT64  },
+	{"zfs_vdev_read_ewma_shift",		KSTAT_DATA_INT64  },
 
 	{"zvol_inhibit_dev",KSTAT_DATA_UINT64  },
 	{"zfs_send_set_freerecords_bit",KSTAT_DATA_UINT64  },
@@ -253,6 +278,20 @@ static int osx_kstat_update(kstat_t *ksp, int rw)
 			ks->zfs_vdev_read_gap_limit.value.i64;
 		zfs_vdev_write_gap_limit =
 			ks->zfs_vdev_write_gap_limit.value.i64;
+		zfs_vdev_fair_queue =
+			ks->zfs_vdev_fair_queue.value.i64;
+		zfs_vdev_deadline =
+			ks->zfs_vdev_deadline.value.i64;
+		zfs_vdev_sync_read_deadline_ms =
+			ks->zfs_vdev_sync_read_deadline_ms.value.ui64;
+		zfs_vdev_sync_write_deadline_ms =
+			ks->zfs_vdev_sync_write_deadline_ms.value.ui64;
+		zfs_vdev_async_read_deadline_ms =
+			ks->zfs_vdev_async_read_deadline_ms.value.ui64;
+		zfs_vdev_async_write_deadline_ms =
+			ks->zfs_vdev_async_write_deadline_ms.value.ui64;
+		zfs_vdev_scrub_deadline_ms =
+			ks->zfs_vdev_scrub_deadline_ms.value.ui64;
 
 		arc_reduce_dnlc_percent =
 			ks->arc_reduce_dnlc_percent.value.i64;
@@ -268,8 +307,24 @@ static int osx_kstat_update(kstat_t *ksp, int rw)
 			ks->zfs_delay_min_dirty_percent.value.i64;
 		zfs_delay_scale =
 			ks->zfs_delay_scale.value.i64;
+		zfs_dirty_data_fair =
+			ks->zfs_dirty_data_fair.value.i64;
 		spa_asize_inflation =
 			ks->spa_asize_inflation.value.i64;
+		spa_allocators =
+			ks->spa_allocators.value.i64;
+		zfs_special_class_metadata_reserve_pct =
+			ks->zfs_special_class_metadata_reserve_pct.value.i64;
+		zfs_sync_vdevs_parallel =
+			ks->zfs_sync_vdevs_parallel.value.i64;
+		zfs_trim_extent_bytes_max =
+			ks->zfs_trim_extent_bytes_max.value.i64;
+		zfs_trim_extent_bytes_min =
+			ks->zfs_trim_extent_bytes_min.value.i64;
+		zfs_trim_txg_batch =
+			ks->zfs_trim_txg_batch.value.i64;
+		zfs_frag_history =
+			ks->zfs_frag_history.value.i64;
 		zfs_mdcomp_disable =
 			ks->zfs_mdcomp_disable.value.i64;
 		zfs_prefetch_disable =
@@ -312,12 +367,24 @@ static int osx_kstat_update(kstat_t *ksp, int rw)
 			ks->zfs_nocacheflush.value.i64;
 		zil_replay_disable =
 			ks->zil_replay_disable.value.i64;
+		zil_replay_threads =
+			ks->zil_replay_threads.value.i64;
+		zfs_commit_timeout_pct =
+			ks->zfs_commit_timeout_pct.value.i64;
+		zil_lwb_decay_shift =
+			ks->zil_lwb_decay_shift.value.i64;
 		metaslab_gang_bang =
 			ks->metaslab_gang_bang.value.i64;
 		metaslab_df_alloc_threshold =
 			ks->metaslab_df_alloc_threshold.value.i64;
 		metaslab_df_free_pct =
 			ks->metaslab_df_free_pct.value.i64;
+		metaslab_preload_limit =
+			ks->metaslab_preload_limit.value.i64;
+		zfs_unflushed_max_txgs =
+			ks->zfs_unflushed_max_txgs.value.i64;
+		zfs_min_metaslabs_to_flush =
+			ks->zfs_min_metaslabs_to_flush.value.i64;
 		zio_injection_enabled =
 			ks->zio_injection_enabled.value.i64;
 		zvol_immediate_write_sz =
@@ -331,6 +398,10 @@ static int osx_kstat_update(kstat_t *ksp, int rw)
 			ks->zfs_scrub_delay.value.i64;
 		zfs_scan_idle =
 			ks->zfs_scan_idle.value.i64;
+		zfs_scan_legacy =
+			ks->zfs_scan_legacy.value.i64;
+		zfs_scan_mem_lim_fact =
+			ks->zfs_scan_mem_lim_fact.value.i64;
 		zfs_recover =
 			ks->zfs_recover.value.i64;
 
@@ -356,6 +427,10 @@ static int osx_kstat_update(kstat_t *ksp, int rw)
 			ks->zfs_vdev_mirror_non_rotating_inc.value.ui64;
 		zfs_vdev_mirror_non_rotating_seek_inc =
 			ks->zfs_vdev_mirror_non_rotating_seek_inc.value.ui64;
+		zfs_vdev_mirror_latency_select =
+			ks->zfs_vdev_mirror_latency_select.value.i64;
+		zfs_vdev_read_ewma_shift =
+			ks->zfs_vdev_read_ewma_shift.value.i64;
 
 		zvol_inhibit_dev =
 			ks->zvol_inhibit_dev.value.ui64;
@@ -441,6 +516,20 @@ static int osx_kstat_update(kstat_t *ksp, int rw)
 			zfs_vdev_read_gap_limit ;
 		ks->zfs_vdev_write_gap_limit.value.i64 =
 			zfs_vdev_write_gap_limit;
+		ks->zfs_vdev_fair_queue.value.i64 =
+			zfs_vdev_fair_queue;
+		ks->zfs_vdev_deadline.value.i64 =
+			zfs_vdev_deadline;
+		ks->zfs_vdev_sync_read_deadline_ms.value.ui64 =
+			zfs_vdev_sync_read_deadline_ms;
+		ks->zfs_vdev_sync_write_deadline_ms.value.ui64 =
+			zfs_vdev_sync_write_deadline_ms;
+		ks->zfs_vdev_async_read_deadline_ms.value.ui64 =
+			zfs_vdev_async_read_deadline_ms;
+		ks->zfs_vdev_async_write_deadline_ms.value.ui64 =
+			zfs_vdev_async_write_deadline_ms;
+		ks->zfs_vdev_scrub_deadline_ms.value.ui64 =
+			zfs_vdev_scrub_deadline_ms;
 
 		ks->arc_reduce_dnlc_percent.value.i64 =
 			arc_reduce_dnlc_percent;
@@ -456,8 +545,24 @@ static int osx_kstat_update(kstat_t *ksp, int rw)
 			zfs_delay_min_dirty_percent;
 		ks->zfs_delay_scale.value.i64 =
 			zfs_delay_scale;
+		ks->zfs_dirty_data_fair.value.i64 =
+			zfs_dirty_data_fair;
 		ks->spa_asize_inflation.value.i64 =
 			spa_asize_inflation;
+		ks->spa_allocators.value.i64 =
+			spa_allocators;
+		ks->zfs_special_class_metadata_reserve_pct.value.i64 =
+			zfs_special_class_metadata_reserve_pct;
+		ks->zfs_sync_vdevs_parallel.value.i64 =
+			zfs_sync_vdevs_parallel;
+		ks->zfs_trim_extent_bytes_max.value.i64 =
+			zfs_trim_extent_bytes_max;
+		ks->zfs_trim_extent_bytes_min.value.i64 =
+			zfs_trim_extent_bytes_min;
+		ks->zfs_trim_txg_batch.value.i64 =
+			zfs_trim_txg_batch;
+		ks->zfs_frag_history.value.i64 =
+			zfs_frag_history;
 		ks->zfs_mdcomp_disable.value.i64 =
 			zfs_mdcomp_disable;
 		ks->zfs_prefetch_disable.value.i64 =
@@ -500,12 +605,24 @@ static int osx_kstat_update(kstat_t *ksp, int rw)
 			zfs_nocacheflush;
 		ks->zil_replay_disable.value.i64 =
 			zil_replay_disable;
+		ks->zil_replay_threads.value.i64 =
+			zil_replay_threads;
+		ks->zfs_commit_timeout_pct.value.i64 =
+			zfs_commit_timeout_pct;
+		ks->zil_lwb_decay_shift.value.i64 =
+			zil_lwb_decay_shift;
 		ks->metaslab_gang_bang.value.i64 =
 			metaslab_gang_bang;
 		ks->metaslab_df_alloc_threshold.value.i64 =
 			metaslab_df_alloc_threshold;
 		ks->metaslab_df_free_pct.value.i64 =
 			metaslab_df_free_pct;
+		ks->metaslab_preload_limit.value.i64 =
+			metaslab_preload_limit;
+		ks->zfs_unflushed_max_txgs.value.i64 =
+			zfs_unflushed_max_txgs;
+		ks->zfs_min_metaslabs_to_flush.value.i64 =
+			zfs_min_metaslabs_to_flush;
 		ks->zio_injection_enabled.value.i64 =
 			zio_injection_enabled;
 		ks->zvol_immediate_write_sz.value.i64 =
@@ -519,6 +636,10 @@ static int osx_kstat_update(kstat_t *ksp, int rw)
 			zfs_scrub_delay;
 		ks->zfs_scan_idle.value.i64 =
 			zfs_scan_idle;
+		ks->zfs_scan_legacy.value.i64 =
+			zfs_scan_legacy;
+		ks->zfs_scan_mem_lim_fact.value.i64 =
+			zfs_scan_mem_lim_fact;
 
 		ks->zfs_recover.value.i64 =
 			zfs_recover;
@@ -545,6 +666,10 @@ static int osx_kstat_update(kstat_t *ksp, int rw)
 			zfs_vdev_mirror_non_rotating_inc;
 		ks->zfs_vdev_mirror_non_rotating_seek_inc.value.ui64 =
 			zfs_vdev_mirror_non_rotating_seek_inc;
+		ks->zfs_vdev_mirror_latency_select.value.i64 =
+			zfs_vdev_mirror_latency_select;
+		ks->zfs_vdev_read_ewma_shift.value.i64 =
+			zfs_vdev_read_ewma_shift;
 
 		ks->zvol_inhibit_dev.value.ui64 =
 			zvol_inhibit_dev;
@@ -42,6 +42,7 @@
 #include <sys/spa.h>
 #include <sys/zfs_fuid.h>
 #include <sys/dsl_dataset.h>
+#include <sys/dnode.h>
 
 /*
  * These zfs_log_* functions must be called within a dmu tx, in one
@@ -250,6 +251,7 @@ zfs_log_create(zilog_t *zilog, dmu_tx_t *tx, uint64_t txtype,
 	size_t lrsize;
 	size_t namesize = strlen(name) + 1;
 	size_t fuidsz = 0;
+	int dnodesize;
 
 	if (zil_replaying(zilog, tx))
 		return;
@@ -283,6 +285,9 @@ zfs_log_create(zilog_t *zilog, dmu_tx_t *tx, uint64_t txtype,
 	lr = (lr_create_t *)&itx->itx_lr;
 	lr->lr_doid = dzp->z_id;
 	lr->lr_foid = zp->z_id;
+	/* Store dnode slot count in 8 bits above object id. */
+	dmu_object_dnsize_from_db(sa_get_db(zp->z_sa_hdl), &dnodesize);
+	LR_FOID_SET_SLOTS(lr->lr_foid, dnodesize >> DNODE_SHIFT);
 	lr->lr_mode = zp->z_mode;
 	if (!IS_EPHEMERAL(zp->z_uid)) {
 		lr->lr_uid = (uint64_t)zp->z_uid;
@@ -521,6 +526,7 @@ zfs_log_write(zilog_t *zilog, dmu_tx_t *tx, int txtype,
 
 		itx->itx_callback = callback;
 		itx->itx_callback_data = callback_data;
+		zil_itx_logged(zilog, wr_state, len);
 		zil_itx_assign(zilog, itx, tx);
 
 		off += len;
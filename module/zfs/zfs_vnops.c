@@ -1134,10 +1134,12 @@ zfs_write(vnode_t *vp, uio_t *uio, int ioflag, cred_t *cr, caller_context_t *ct)
 
 		/*
 		 * If we are replaying and eof is non zero then force
-		 * the file size to the specified eof. Note, there's no
-		 * concurrency during replay.
+		 * the file size to the specified eof. Writes to other
+		 * objects may be replayed concurrently, so only honor it
+		 * for the object zfs_replay_write() set it up for.
 		 */
-		if (zfsvfs->z_replay && zfsvfs->z_replay_eof != 0)
+		if (zfsvfs->z_replay && zfsvfs->z_replay_eof != 0 &&
+		    zfsvfs->z_replay_eof_obj == zp->z_id)
 			zp->z_size = zfsvfs->z_replay_eof;
 
 		error = sa_bulk_update(zp->z_sa_hdl, bulk, count, tx);
@@ -1215,7 +1217,7 @@ zfs_get_done(zgd_t *zgd, int error)
 	}
 #endif
 	if (error == 0 && zgd->zgd_bp)
-		zil_add_block(zgd->zgd_zilog, zgd->zgd_bp);
+		zil_lwb_add_block(zgd->zgd_lwb, zgd->zgd_bp);
 
 	kmem_free(zgd, sizeof (zgd_t));
 }
@@ -1228,8 +1230,8 @@ static int zil_fault_io = 0;
  * Get data to generate a TX_WRITE intent log record.
  */
 int
-zfs_get_data(void *arg, lr_write_t *lr, char *buf, zio_t *zio,
-			 znode_t *zp, rl_t *rl)
+zfs_get_data(void *arg, lr_write_t *lr, char *buf, struct lwb *lwb,
+    zio_t *zio, znode_t *zp, rl_t *rl)
 {
 	zfsvfs_t *zfsvfs = arg;
 	objset_t *os = zfsvfs->z_os;
@@ -1240,8 +1242,9 @@ zfs_get_data(void *arg, lr_write_t *lr, char *buf, zio_t *zio,
 	zgd_t *zgd;
 	int error = 0;
 
-	ASSERT(zio != NULL);
-	ASSERT(size != 0);
+	ASSERT3P(lwb, !=, NULL);
+	ASSERT3P(zio, !=, NULL);
+	ASSERT3U(size, !=, 0);
 
 #ifndef __APPLE__
 	/*
@@ -1261,7 +1264,7 @@ zfs_get_data(void *arg, lr_write_t *lr, char *buf, zio_t *zio,
 #endif
 
 	zgd = (zgd_t *)kmem_zalloc(sizeof (zgd_t), KM_SLEEP);
-	zgd->zgd_zilog = zfsvfs->z_log;
+	zgd->zgd_lwb = lwb;
 	zgd->zgd_private = zp;
 	zgd->zgd_rl = rl;
 
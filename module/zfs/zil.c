@@ -92,10 +92,46 @@ zil_stats_t zil_stats = {
 	{ "zil_itx_metaslab_normal_bytes",	KSTAT_DATA_UINT64 },
 	{ "zil_itx_metaslab_slog_count",	KSTAT_DATA_UINT64 },
 	{ "zil_itx_metaslab_slog_bytes",	KSTAT_DATA_UINT64 },
+	{ "zil_flush_issued",			KSTAT_DATA_UINT64 },
+	{ "zil_flush_skipped",			KSTAT_DATA_UINT64 },
+	{ "zil_replay_count",			KSTAT_DATA_UINT64 },
+	{ "zil_replay_blocks",			KSTAT_DATA_UINT64 },
+	{ "zil_replay_records",			KSTAT_DATA_UINT64 },
+	{ "zil_replay_records_concurrent",	KSTAT_DATA_UINT64 },
+	{ "zil_replay_records_inflight",	KSTAT_DATA_UINT64 },
+	{ "zil_replay_barriers",		KSTAT_DATA_UINT64 },
+	{ "zil_replay_bytes",			KSTAT_DATA_UINT64 },
+	{ "zil_replay_errors",			KSTAT_DATA_UINT64 },
+	{ "zil_replay_time_ms",			KSTAT_DATA_UINT64 },
+	{ "zil_replay_last_ms",			KSTAT_DATA_UINT64 },
 };
 
 static kstat_t *zil_ksp;
 
+static const zil_ds_stats_t zil_ds_stats_template = {
+	{ "commit_count",			KSTAT_DATA_UINT64 },
+	{ "commit_writer_count",		KSTAT_DATA_UINT64 },
+	{ "logged_indirect_count",		KSTAT_DATA_UINT64 },
+	{ "logged_indirect_bytes",		KSTAT_DATA_UINT64 },
+	{ "logged_copied_count",		KSTAT_DATA_UINT64 },
+	{ "logged_copied_bytes",		KSTAT_DATA_UINT64 },
+	{ "logged_needcopy_count",		KSTAT_DATA_UINT64 },
+	{ "logged_needcopy_bytes",		KSTAT_DATA_UINT64 },
+	{ "itx_count",				KSTAT_DATA_UINT64 },
+	{ "itx_bytes",				KSTAT_DATA_UINT64 },
+	{ "itx_write_count",			KSTAT_DATA_UINT64 },
+	{ "itx_truncate_count",			KSTAT_DATA_UINT64 },
+	{ "itx_setattr_count",			KSTAT_DATA_UINT64 },
+	{ "itx_create_count",			KSTAT_DATA_UINT64 },
+	{ "itx_remove_count",			KSTAT_DATA_UINT64 },
+	{ "itx_rename_count",			KSTAT_DATA_UINT64 },
+	{ "lwb_count",				KSTAT_DATA_UINT64 },
+	{ "lwb_bytes",				KSTAT_DATA_UINT64 },
+	{ "lwb_write_errors",			KSTAT_DATA_UINT64 },
+	{ "flush_count",			KSTAT_DATA_UINT64 },
+	{ "flush_skipped",			KSTAT_DATA_UINT64 },
+};
+
 /*
  * Disable intent logging replay.  This global ZIL switch affects all pools.
  */
@@ -111,11 +147,31 @@ int zfs_nocacheflush = 0;
 /*
  * Limit SLOG write size per commit executed with synchronous priority.
  * Any writes above that will be executed with lower (asynchronous) priority
- * to limit potential SLOG device abuse by single active ZIL writer.
+ * to limit potential SLOG device abuse by single active ZIL writer.  The
+ * limit applies per log vdev, since a commit's lwbs are striped across
+ * all of them (see metaslab_alloc_dva()).
  */
 uint64_t zil_slog_bulk = 768 * 1024;
 
+/*
+ * This controls the amount of time that a ZIL block (lwb) will remain
+ * "open" when it isn't "full", and it has a thread waiting for it to be
+ * committed to stable storage.  It is expressed as a percentage of the
+ * latency of the last lwb that completed; see zil_commit_waiter() for
+ * more details.
+ */
+int zfs_commit_timeout_pct = 5;
+
+/*
+ * Controls how quickly the commit size estimate used to size new log
+ * blocks decays after a burst of large commits; each smaller commit moves
+ * the estimate 1/2^zil_lwb_decay_shift of the way towards its own size.
+ * Larger commits raise the estimate immediately.  See zil_commit_size().
+ */
+int zil_lwb_decay_shift = 2;
+
 static kmem_cache_t *zil_lwb_cache;
+static kmem_cache_t *zil_zcw_cache;
 
 static void zil_async_to_sync(zilog_t *zilog, uint64_t foid);
 
@@ -509,10 +565,14 @@ zil_alloc_lwb(zilog_t *zilog, blkptr_t *bp, boolean_t slog,
 	lwb->lwb_blk = *bp;
 	lwb->lwb_fastwrite = fastwrite;
 	lwb->lwb_slog = slog;
+	lwb->lwb_state = LWB_STATE_CLOSED;
 	lwb->lwb_buf = zio_buf_alloc(BP_GET_LSIZE(bp));
 	lwb->lwb_max_txg = txg;
-	lwb->lwb_zio = NULL;
+	lwb->lwb_write_zio = NULL;
+	lwb->lwb_root_zio = NULL;
 	lwb->lwb_tx = NULL;
+	lwb->lwb_issued_timestamp = 0;
+	lwb->lwb_written_timestamp = 0;
 	if (BP_GET_CHECKSUM(bp) == ZIO_CHECKSUM_ZILOG2) {
 		lwb->lwb_nused = sizeof (zil_chain_t);
 		lwb->lwb_sz = BP_GET_LSIZE(bp);
@@ -525,9 +585,35 @@ zil_alloc_lwb(zilog_t *zilog, blkptr_t *bp, boolean_t slog,
 	list_insert_tail(&zilog->zl_lwb_list, lwb);
 	mutex_exit(&zilog->zl_lock);
 
+	ASSERT(avl_is_empty(&lwb->lwb_vdev_tree));
+	VERIFY(list_is_empty(&lwb->lwb_waiters));
+	VERIFY(list_is_empty(&lwb->lwb_itxs));
+
 	return (lwb);
 }
 
+static void
+zil_free_lwb(zilog_t *zilog, lwb_t *lwb)
+{
+	ASSERT(MUTEX_HELD(&zilog->zl_lock));
+	VERIFY(list_is_empty(&lwb->lwb_waiters));
+	VERIFY(list_is_empty(&lwb->lwb_itxs));
+	ASSERT(avl_is_empty(&lwb->lwb_vdev_tree));
+	ASSERT3P(lwb->lwb_write_zio, ==, NULL);
+	ASSERT3P(lwb->lwb_root_zio, ==, NULL);
+	ASSERT(lwb->lwb_state == LWB_STATE_CLOSED ||
+	    lwb->lwb_state == LWB_STATE_DONE);
+
+	/*
+	 * Clear the zilog's field to indicate this lwb is no longer
+	 * valid, and prevent use-after-free errors.
+	 */
+	if (zilog->zl_last_lwb_opened == lwb)
+		zilog->zl_last_lwb_opened = NULL;
+
+	kmem_cache_free(zil_lwb_cache, lwb);
+}
+
 /*
  * Called when we create in-memory log transactions so that we know
  * to cleanup the itxs at the end of spa_sync().
@@ -544,6 +630,8 @@ zilog_dirty(zilog_t *zilog, uint64_t txg)
 	if (txg_list_add(&dp->dp_dirty_zilogs, zilog, txg)) {
 		/* up the hold count until we can be written out */
 		dmu_buf_add_ref(ds->ds_dbuf, zilog);
+
+		zilog->zl_dirty_max_txg = MAX(txg, zilog->zl_dirty_max_txg);
 	}
 }
 
@@ -672,7 +760,7 @@ zil_destroy(zilog_t *zilog, boolean_t keep_first)
 		ASSERT(zh->zh_claim_txg == 0);
 		VERIFY(!keep_first);
 		while ((lwb = list_head(&zilog->zl_lwb_list)) != NULL) {
-			ASSERT(lwb->lwb_zio == NULL);
+			ASSERT3P(lwb->lwb_write_zio, ==, NULL);
 			if (lwb->lwb_fastwrite)
 				metaslab_fastwrite_unmark(zilog->zl_spa,
 				    &lwb->lwb_blk);
@@ -680,7 +768,7 @@ zil_destroy(zilog_t *zilog, boolean_t keep_first)
 			if (lwb->lwb_buf != NULL)
 				zio_buf_free(lwb->lwb_buf, lwb->lwb_sz);
 			zio_free_zil(zilog->zl_spa, txg, &lwb->lwb_blk);
-			kmem_cache_free(zil_lwb_cache, lwb);
+			zil_free_lwb(zilog, lwb);
 		}
 	} else if (!keep_first) {
 		zil_destroy_sync(zilog, tx);
@@ -823,7 +911,7 @@ zil_check_log_chain(dsl_pool_t *dp, dsl_dataset_t *ds, void *tx)
 }
 
 static int
-zil_vdev_compare(const void *x1, const void *x2)
+zil_lwb_vdev_compare(const void *x1, const void *x2)
 {
 	const uint64_t v1 = ((zil_vdev_node_t *)x1)->zv_vdev;
 	const uint64_t v2 = ((zil_vdev_node_t *)x2)->zv_vdev;
@@ -836,84 +924,361 @@ zil_vdev_compare(const void *x1, const void *x2)
 	return (0);
 }
 
+/*
+ * Record the vdevs a block was written to, so that the lwb which
+ * references it flushes their write caches once its own write is done.
+ * The block must already be written; the time is remembered so that a
+ * flush which has covered it in the meantime need not be repeated.
+ */
 void
-zil_add_block(zilog_t *zilog, const blkptr_t *bp)
+zil_lwb_add_block(lwb_t *lwb, const blkptr_t *bp)
 {
-	avl_tree_t *t = &zilog->zl_vdev_tree;
+	avl_tree_t *t = &lwb->lwb_vdev_tree;
 	avl_index_t where;
 	zil_vdev_node_t *zv, zvsearch;
 	int ndvas = BP_GET_NDVAS(bp);
+	hrtime_t now;
 	int i;
 
 	if (zfs_nocacheflush)
 		return;
 
-	ASSERT(zilog->zl_writer);
+	now = gethrtime();
 
 	/*
-	 * Even though we're zl_writer, we still need a lock because the
-	 * zl_get_data() callbacks may have dmu_sync() done callbacks
-	 * that will run concurrently.
+	 * The lwb is only modified by the zl_issuer_lock holder, but we
+	 * still need a lock because the zl_get_data() callbacks may have
+	 * dmu_sync() done callbacks that will run concurrently.
 	 */
-	mutex_enter(&zilog->zl_vdev_lock);
+	mutex_enter(&lwb->lwb_vdev_lock);
 	for (i = 0; i < ndvas; i++) {
 		zvsearch.zv_vdev = DVA_GET_VDEV(&bp->blk_dva[i]);
-		if (avl_find(t, &zvsearch, &where) == NULL) {
+		if ((zv = avl_find(t, &zvsearch, &where)) == NULL) {
 			zv = kmem_alloc(sizeof (*zv), KM_SLEEP);
 			zv->zv_vdev = zvsearch.zv_vdev;
+			zv->zv_flushed = 0;
+			zv->zv_flush_failed = B_FALSE;
 			avl_insert(t, zv, where);
 		}
+		zv->zv_written = now;
 	}
-	mutex_exit(&zilog->zl_vdev_lock);
+	mutex_exit(&lwb->lwb_vdev_lock);
 }
 
+/*
+ * Per-dataset statistics; see zil_ds_stats_t.
+ */
 static void
-zil_flush_vdevs(zilog_t *zilog)
+zil_ds_hist_add(kstat_named_t *hist, hrtime_t nsecs)
 {
-	spa_t *spa = zilog->zl_spa;
-	avl_tree_t *t = &zilog->zl_vdev_tree;
-	void *cookie = NULL;
-	zil_vdev_node_t *zv;
-	zio_t *zio;
+	int idx = 0;
+
+	while (((1LL << (idx + ZIL_DS_HIST_SHIFT)) < nsecs) &&
+	    (idx < ZIL_DS_HIST_BUCKETS - 1))
+		idx++;
+
+	atomic_inc_64(&hist[idx].value.ui64);
+}
+
+static void
+zil_lwb_commit_stats(zilog_t *zilog, itx_t *itx, uint64_t size)
+{
+	uint64_t txtype = itx->itx_lr.lrc_txtype & ~TX_CI;
+	lr_write_t *lrw = (lr_write_t *)&itx->itx_lr;
+
+	ZIL_STAT_BUMP(zil_itx_count);
+	ZIL_DS_STAT_BUMP(zilog, zds_itx_count);
+	ZIL_DS_STAT_INCR(zilog, zds_itx_bytes, size);
+
+	switch (txtype) {
+	case TX_WRITE:
+		switch (itx->itx_wr_state) {
+		case WR_INDIRECT:
+			ZIL_STAT_BUMP(zil_itx_indirect_count);
+			ZIL_STAT_INCR(zil_itx_indirect_bytes,
+			    lrw->lr_length);
+			break;
+		case WR_COPIED:
+			ZIL_STAT_BUMP(zil_itx_copied_count);
+			ZIL_STAT_INCR(zil_itx_copied_bytes, lrw->lr_length);
+			break;
+		case WR_NEED_COPY:
+			ZIL_STAT_BUMP(zil_itx_needcopy_count);
+			ZIL_STAT_INCR(zil_itx_needcopy_bytes,
+			    lrw->lr_length);
+			break;
+		default:
+			break;
+		}
+		/* FALLTHROUGH */
+	case TX_WRITE2:
+		ZIL_DS_STAT_BUMP(zilog, zds_itx_write_count);
+		break;
+	case TX_TRUNCATE:
+		ZIL_DS_STAT_BUMP(zilog, zds_itx_truncate_count);
+		break;
+	case TX_SETATTR:
+	case TX_ACL_V0:
+	case TX_ACL:
+		ZIL_DS_STAT_BUMP(zilog, zds_itx_setattr_count);
+		break;
+	case TX_REMOVE:
+	case TX_RMDIR:
+		ZIL_DS_STAT_BUMP(zilog, zds_itx_remove_count);
+		break;
+	case TX_RENAME:
+		ZIL_DS_STAT_BUMP(zilog, zds_itx_rename_count);
+		break;
+	default:
+		/* TX_CREATE*, TX_MKDIR*, TX_MKXATTR, TX_SYMLINK, TX_LINK */
+		ZIL_DS_STAT_BUMP(zilog, zds_itx_create_count);
+		break;
+	}
+}
+
+/*
+ * Account for a write being logged with the given write state; called
+ * by the log functions once they have chosen how to log the data.
+ */
+void
+zil_itx_logged(zilog_t *zilog, itx_wr_state_t state, uint64_t len)
+{
+	switch (state) {
+	case WR_INDIRECT:
+		ZIL_DS_STAT_BUMP(zilog, zds_logged_indirect_count);
+		ZIL_DS_STAT_INCR(zilog, zds_logged_indirect_bytes, len);
+		break;
+	case WR_COPIED:
+		ZIL_DS_STAT_BUMP(zilog, zds_logged_copied_count);
+		ZIL_DS_STAT_INCR(zilog, zds_logged_copied_bytes, len);
+		break;
+	case WR_NEED_COPY:
+		ZIL_DS_STAT_BUMP(zilog, zds_logged_needcopy_count);
+		ZIL_DS_STAT_INCR(zilog, zds_logged_needcopy_bytes, len);
+		break;
+	default:
+		break;
+	}
+}
+
+static void
+zil_ds_kstat_init(zilog_t *zilog)
+{
+	zil_ds_stats_t *zds = &zilog->zl_stats;
+	dsl_dataset_t *ds = dmu_objset_ds(zilog->zl_os);
+	char module[KSTAT_STRLEN];
+	char name[KSTAT_STRLEN];
+	kstat_t *ksp;
+	int i;
+
+	*zds = zil_ds_stats_template;
+	for (i = 0; i < ZIL_DS_HIST_BUCKETS; i++) {
+		zds->zds_write_hist[i].data_type = KSTAT_DATA_UINT64;
+		(void) snprintf(zds->zds_write_hist[i].name, KSTAT_STRLEN,
+		    "write %llu ns",
+		    (u_longlong_t)1 << (i + ZIL_DS_HIST_SHIFT));
+		zds->zds_flush_hist[i].data_type = KSTAT_DATA_UINT64;
+		(void) snprintf(zds->zds_flush_hist[i].name, KSTAT_STRLEN,
+		    "flush %llu ns",
+		    (u_longlong_t)1 << (i + ZIL_DS_HIST_SHIFT));
+	}
+
+	if (ds == NULL)
+		return;
+
+	(void) snprintf(module, KSTAT_STRLEN, "zfs/%s",
+	    spa_name(zilog->zl_spa));
+	(void) snprintf(name, KSTAT_STRLEN, "zil-0x%llx",
+	    (u_longlong_t)ds->ds_object);
+
+	ksp = kstat_create(module, 0, name, "misc", KSTAT_TYPE_NAMED,
+	    sizeof (zil_ds_stats_t) / sizeof (kstat_named_t),
+	    KSTAT_FLAG_VIRTUAL);
+	if (ksp != NULL) {
+		ksp->ks_data = zds;
+		kstat_install(ksp);
+	}
+	zilog->zl_ksp = ksp;
+}
+
+/*
+ * This function is a called after all vdevs associated with a given lwb
+ * write have completed their DKIOCFLUSHWRITECACHE command; or as soon
+ * as the lwb write completes, if "zfs_nocacheflush" is set.
+ *
+ * The intention is for this function to be called as soon as the
+ * contents of an lwb are considered "stable" on disk, and will survive
+ * any sudden loss of power. At this point, any threads waiting for the
+ * lwb to reach this state are signalled, and the "waiter" structures
+ * are marked "done".
+ */
+static void
+zil_lwb_flush_vdevs_done(zio_t *zio)
+{
+	lwb_t *lwb = zio->io_private;
+	zilog_t *zilog = lwb->lwb_zilog;
+	dmu_tx_t *tx = lwb->lwb_tx;
+	zil_commit_waiter_t *zcw;
+	itx_t *itx;
+	hrtime_t latency;
+
+	spa_config_exit(zilog->zl_spa, SCL_STATE, lwb);
+
+	zio_buf_free(lwb->lwb_buf, lwb->lwb_sz);
 
-	ASSERT(zilog->zl_writer);
+	mutex_enter(&zilog->zl_lock);
 
 	/*
-	 * We don't need zl_vdev_lock here because we're the zl_writer,
-	 * and all zl_get_data() callbacks are done.
+	 * Ensure the lwb buffer pointer is cleared before releasing the
+	 * txg. If we have had an allocation failure and the txg is
+	 * waiting to sync then we want zil_sync() to remove the lwb so
+	 * that it's not picked up as the next new one in
+	 * zil_process_commit_list(). zil_sync() will only remove the
+	 * lwb if lwb_buf is null.
 	 */
-	if (avl_numnodes(t) == 0)
-		return;
+	lwb->lwb_buf = NULL;
+	lwb->lwb_tx = NULL;
 
-	spa_config_enter(spa, SCL_STATE, FTAG, RW_READER);
+	ASSERT3U(lwb->lwb_issued_timestamp, >, 0);
+	latency = gethrtime() - lwb->lwb_issued_timestamp;
+	zilog->zl_last_lwb_latency = latency;
+	spa_zil_commit_add_nsecs(zilog->zl_spa, SPA_ZCH_LWB, latency);
+	if (lwb->lwb_written_timestamp != 0) {
+		zil_ds_hist_add(zilog->zl_stats.zds_flush_hist,
+		    gethrtime() - lwb->lwb_written_timestamp);
+	}
 
-	zio = zio_root(spa, NULL, NULL, ZIO_FLAG_CANFAIL);
+	lwb->lwb_root_zio = NULL;
+	lwb->lwb_state = LWB_STATE_DONE;
 
-	while ((zv = avl_destroy_nodes(t, &cookie)) != NULL) {
-		vdev_t *vd = vdev_lookup_top(spa, zv->zv_vdev);
-		if (vd != NULL)
-			zio_flush(zio, vd);
-		kmem_free(zv, sizeof (*zv));
+	if (zilog->zl_last_lwb_opened == lwb) {
+		/*
+		 * Remember the highest committed log sequence number
+		 * for ztest. We only update this value when all the log
+		 * writes succeeded, because ztest wants to ASSERT that
+		 * it got the whole log chain.
+		 */
+		zilog->zl_commit_lr_seq = zilog->zl_lr_seq;
+	}
+
+	while ((itx = list_head(&lwb->lwb_itxs)) != NULL) {
+		list_remove(&lwb->lwb_itxs, itx);
+		zil_itx_destroy(itx);
+	}
+
+	while ((zcw = list_head(&lwb->lwb_waiters)) != NULL) {
+		mutex_enter(&zcw->zcw_lock);
+
+		ASSERT(list_link_active(&zcw->zcw_node));
+		list_remove(&lwb->lwb_waiters, zcw);
+
+		ASSERT3P(zcw->zcw_lwb, ==, lwb);
+		zcw->zcw_lwb = NULL;
+
+		zcw->zcw_zio_error = zio->io_error;
+
+		ASSERT(!zcw->zcw_done);
+		zcw->zcw_done = B_TRUE;
+		cv_broadcast(&zcw->zcw_cv);
+
+		mutex_exit(&zcw->zcw_lock);
 	}
 
+	mutex_exit(&zilog->zl_lock);
+
 	/*
-	 * Wait for all the flushes to complete.  Not all devices actually
-	 * support the DKIOCFLUSHWRITECACHE ioctl, so it's OK if it fails.
+	 * Now that we've written this log block, we have a stable pointer
+	 * to the next block in the chain, so it's OK to let the txg in
+	 * which we allocated the next block sync.
 	 */
-	(void) zio_wait(zio);
+	dmu_tx_commit(tx);
+}
+
+/*
+ * Decide whether the writes recorded in "zv" still need a cache flush of
+ * top-level vdev "vd", and if so stamp the flush we are about to issue.
+ *
+ * Each top-level vdev remembers, in vdev_flush_covered, the issue time of
+ * the latest ZIL flush that has completed; every write that was complete
+ * before that time is stable.  These stamps act as flush generations
+ * shared by all lwbs (and all datasets) writing to the vdev, so that, for
+ * example, the pool vdevs holding dmu_sync()ed data are not flushed again
+ * by every lwb when another lwb's flush has already covered them.
+ *
+ * A covering flush that is still in flight is not waited for; we issue
+ * our own.  The lwb's root zio ignores flush errors, but a flush that
+ * failed on any leaf made nothing stable, so it doesn't count as covering.
+ */
+static boolean_t
+zil_lwb_flush_needed(vdev_t *vd, zil_vdev_node_t *zv)
+{
+	boolean_t needed;
+
+	if (!vdev_has_volatile_cache(vd))
+		return (B_FALSE);
+
+	mutex_enter(&vd->vdev_flush_lock);
+	needed = (vd->vdev_flush_covered <= zv->zv_written);
+	mutex_exit(&vd->vdev_flush_lock);
+
+	if (needed)
+		zv->zv_flushed = gethrtime();
+
+	return (needed);
+}
+
+/*
+ * Called for each leaf's DKIOCFLUSHWRITECACHE.  A leaf without a write
+ * cache to flush (ENOTSUP) has nothing volatile, so only other errors
+ * count.
+ */
+static void
+zil_lwb_flush_leaf_done(zio_t *zio)
+{
+	zil_vdev_node_t *zv = zio->io_private;
+
+	if (zio->io_error != 0 && zio->io_error != ENOTSUP)
+		zv->zv_flush_failed = B_TRUE;
+}
+
+static void
+zil_lwb_flush_vdev_done(zio_t *zio)
+{
+	zil_vdev_node_t *zv = zio->io_private;
+	vdev_t *vd = vdev_lookup_top(zio->io_spa, zv->zv_vdev);
+
+	ASSERT3P(vd, !=, NULL);
 
-	spa_config_exit(spa, SCL_STATE, FTAG);
+	mutex_enter(&vd->vdev_flush_lock);
+	if (!zv->zv_flush_failed && vd->vdev_flush_covered < zv->zv_flushed)
+		vd->vdev_flush_covered = zv->zv_flushed;
+	mutex_exit(&vd->vdev_flush_lock);
+
+	kmem_free(zv, sizeof (*zv));
 }
 
 /*
- * Function called when a log block write completes
+ * This is called when an lwb write completes. This means, this specific
+ * lwb was written to disk, and all dependent lwb have also been
+ * written to disk.
+ *
+ * At this point, a DKIOCFLUSHWRITECACHE command hasn't been issued to
+ * the VDEVs involved in writing out this specific lwb. The lwb will be
+ * "done" once zil_lwb_flush_vdevs_done() is called, which occurs in the
+ * zio completion callback for the lwb's root zio.
  */
 static void
 zil_lwb_write_done(zio_t *zio)
 {
 	lwb_t *lwb = zio->io_private;
+	spa_t *spa = zio->io_spa;
 	zilog_t *zilog = lwb->lwb_zilog;
-	dmu_tx_t *tx = lwb->lwb_tx;
+	avl_tree_t *t = &lwb->lwb_vdev_tree;
+	void *cookie = NULL;
+	zil_vdev_node_t *zv;
+	zio_t *fio;
+
+	ASSERT3S(spa_config_held(spa, SCL_STATE, RW_READER), !=, 0);
 
 	ASSERT(BP_GET_COMPRESS(zio->io_bp) == ZIO_COMPRESS_OFF);
 	ASSERT(BP_GET_TYPE(zio->io_bp) == DMU_OT_INTENT_LOG);
@@ -923,70 +1288,158 @@ zil_lwb_write_done(zio_t *zio)
 	ASSERT(!BP_IS_HOLE(zio->io_bp));
 	ASSERT(BP_GET_FILL(zio->io_bp) == 0);
 
-	/*
-	 * Ensure the lwb buffer pointer is cleared before releasing
-	 * the txg. If we have had an allocation failure and
-	 * the txg is waiting to sync then we want want zil_sync()
-	 * to remove the lwb so that it's not picked up as the next new
-	 * one in zil_commit_writer(). zil_sync() will only remove
-	 * the lwb if lwb_buf is null.
-	 */
 	abd_put(zio->io_abd);
-	zio_buf_free(lwb->lwb_buf, lwb->lwb_sz);
+
+	ASSERT3S(lwb->lwb_state, ==, LWB_STATE_ISSUED);
+
 	mutex_enter(&zilog->zl_lock);
-	lwb->lwb_zio = NULL;
+	lwb->lwb_write_zio = NULL;
 	lwb->lwb_fastwrite = FALSE;
-	lwb->lwb_buf = NULL;
-	lwb->lwb_tx = NULL;
 	mutex_exit(&zilog->zl_lock);
 
+	zil_ds_hist_add(zilog->zl_stats.zds_write_hist,
+	    gethrtime() - lwb->lwb_issued_timestamp);
+	if (zio->io_error != 0) {
+		ZIL_DS_STAT_BUMP(zilog, zds_lwb_write_errors);
+	} else {
+		zil_lwb_add_block(lwb, zio->io_bp);
+	}
+
+	if (avl_numnodes(t) == 0)
+		return;
+
 	/*
-	 * Now that we've written this log block, we have a stable pointer
-	 * to the next block in the chain, so it's OK to let the txg in
-	 * which we allocated the next block sync.
+	 * If there was an IO error, we're not going to call zio_flush()
+	 * on these vdevs, so we simply empty the tree and free the
+	 * nodes. We avoid calling zio_flush() since there isn't any
+	 * good reason for doing so, after the lwb block failed to be
+	 * written out.
 	 */
-	dmu_tx_commit(tx);
+	if (zio->io_error != 0) {
+		while ((zv = avl_destroy_nodes(t, &cookie)) != NULL)
+			kmem_free(zv, sizeof (*zv));
+		return;
+	}
+
+	/*
+	 * Not all devices actually support the DKIOCFLUSHWRITECACHE
+	 * ioctl, so the flushes are issued with the flags of zio_flush()
+	 * and any error is ignored by the root zio.  Each leaf's result is
+	 * still seen by zil_lwb_flush_leaf_done(), so that a failed flush
+	 * doesn't advance vdev_flush_covered.
+	 */
+	while ((zv = avl_destroy_nodes(t, &cookie)) != NULL) {
+		vdev_t *vd = vdev_lookup_top(spa, zv->zv_vdev);
+
+		if (vd == NULL || !zil_lwb_flush_needed(vd, zv)) {
+			ZIL_STAT_BUMP(zil_flush_skipped);
+			ZIL_DS_STAT_BUMP(zilog, zds_flush_skipped);
+			kmem_free(zv, sizeof (*zv));
+			continue;
+		}
+
+		if (lwb->lwb_written_timestamp == 0)
+			lwb->lwb_written_timestamp = gethrtime();
+		ZIL_STAT_BUMP(zil_flush_issued);
+		ZIL_DS_STAT_BUMP(zilog, zds_flush_count);
+		fio = zio_null(lwb->lwb_root_zio, spa, NULL,
+		    zil_lwb_flush_vdev_done, zv, ZIO_FLAG_CANFAIL);
+		zio_nowait(zio_ioctl(fio, spa, vd, DKIOCFLUSHWRITECACHE,
+		    zil_lwb_flush_leaf_done, zv, ZIO_FLAG_CANFAIL |
+		    ZIO_FLAG_DONT_PROPAGATE | ZIO_FLAG_DONT_RETRY));
+		zio_nowait(fio);
+	}
 }
 
 /*
- * Initialize the io for a log block.
+ * This function's purpose is to "open" an lwb such that it is ready to
+ * accept new itxs being committed to it. To do this, the lwb's zio
+ * structures are created, and linked to the lwb. This function is
+ * idempotent; if the passed in lwb has already been opened, this
+ * function is essentially a no-op.
  */
 static void
-zil_lwb_write_init(zilog_t *zilog, lwb_t *lwb)
+zil_lwb_write_open(zilog_t *zilog, lwb_t *lwb)
 {
 	zbookmark_phys_t zb;
 	zio_priority_t prio;
+	uint64_t slog_bulk;
+
+	ASSERT(MUTEX_HELD(&zilog->zl_issuer_lock));
+	ASSERT3P(lwb, !=, NULL);
+	EQUIV(lwb->lwb_root_zio == NULL, lwb->lwb_state == LWB_STATE_CLOSED);
+	EQUIV(lwb->lwb_root_zio != NULL, lwb->lwb_state == LWB_STATE_OPENED);
 
 	SET_BOOKMARK(&zb, lwb->lwb_blk.blk_cksum.zc_word[ZIL_ZC_OBJSET],
 	    ZB_ZIL_OBJECT, ZB_ZIL_LEVEL,
 	    lwb->lwb_blk.blk_cksum.zc_word[ZIL_ZC_SEQ]);
 
-	if (zilog->zl_root_zio == NULL) {
-		zilog->zl_root_zio = zio_root(zilog->zl_spa, NULL, NULL,
-		    ZIO_FLAG_CANFAIL);
-	}
-
 	/* Lock so zil_sync() doesn't fastwrite_unmark after zio is created */
 	mutex_enter(&zilog->zl_lock);
-	if (lwb->lwb_zio == NULL) {
+	if (lwb->lwb_root_zio == NULL) {
 		abd_t *lwb_abd = abd_get_from_buf(lwb->lwb_buf,
 		    BP_GET_LSIZE(&lwb->lwb_blk));
+		lwb_t *last_lwb_opened;
 
 		if (!lwb->lwb_fastwrite) {
 			metaslab_fastwrite_mark(zilog->zl_spa, &lwb->lwb_blk);
 			lwb->lwb_fastwrite = 1;
 		}
-		if (!lwb->lwb_slog || zilog->zl_cur_used <= zil_slog_bulk)
+
+		slog_bulk = zil_slog_bulk * MAX(1,
+		    metaslab_class_get_groups(spa_log_class(zilog->zl_spa)));
+		if (!lwb->lwb_slog || zilog->zl_cur_used <= slog_bulk)
 			prio = ZIO_PRIORITY_SYNC_WRITE;
 		else
 			prio = ZIO_PRIORITY_ASYNC_WRITE;
-		lwb->lwb_zio = zio_rewrite(zilog->zl_root_zio, zilog->zl_spa,
-		    0, &lwb->lwb_blk, lwb_abd, BP_GET_LSIZE(&lwb->lwb_blk),
-		    zil_lwb_write_done, lwb, prio,
-		    ZIO_FLAG_CANFAIL | ZIO_FLAG_DONT_PROPAGATE |
-			ZIO_FLAG_FASTWRITE, &zb);
+
+		lwb->lwb_root_zio = zio_root(zilog->zl_spa,
+		    zil_lwb_flush_vdevs_done, lwb, ZIO_FLAG_CANFAIL);
+		lwb->lwb_root_zio->io_weight = zilog->zl_os->os_ioweight;
+
+		/*
+		 * The write error must reach the root zio (and through it
+		 * every later lwb, see below) so that the waiters know the
+		 * log chain is broken and fall back to txg_wait_synced().
+		 */
+		lwb->lwb_write_zio = zio_rewrite(lwb->lwb_root_zio,
+		    zilog->zl_spa, 0, &lwb->lwb_blk, lwb_abd,
+		    BP_GET_LSIZE(&lwb->lwb_blk), zil_lwb_write_done, lwb,
+		    prio, ZIO_FLAG_CANFAIL | ZIO_FLAG_FASTWRITE, &zb);
+
+		lwb->lwb_state = LWB_STATE_OPENED;
+
+		/*
+		 * The zilog's "zl_last_lwb_opened" field is used to
+		 * build the lwb/zio dependency chain, which is used to
+		 * preserve the ordering of lwb completions that is
+		 * required by the semantics of the ZIL. Each new lwb
+		 * zio becomes a parent of the "previous" lwb zio, such
+		 * that the new lwb's zio cannot complete until the
+		 * "previous" lwb's zio completes.
+		 *
+		 * This is required by the semantics of zil_commit();
+		 * the commit waiters attached to the lwbs will be woken
+		 * in the lwb zio's completion callback, so this zio
+		 * dependency graph ensures the waiters are woken in the
+		 * correct order (the same order the lwbs were created).
+		 */
+		last_lwb_opened = zilog->zl_last_lwb_opened;
+		if (last_lwb_opened != NULL &&
+		    last_lwb_opened->lwb_state != LWB_STATE_DONE) {
+			ASSERT(last_lwb_opened->lwb_state == LWB_STATE_OPENED ||
+			    last_lwb_opened->lwb_state == LWB_STATE_ISSUED);
+			ASSERT3P(last_lwb_opened->lwb_root_zio, !=, NULL);
+			zio_add_child(lwb->lwb_root_zio,
+			    last_lwb_opened->lwb_root_zio);
+		}
+		zilog->zl_last_lwb_opened = lwb;
 	}
 	mutex_exit(&zilog->zl_lock);
+
+	ASSERT3P(lwb->lwb_root_zio, !=, NULL);
+	ASSERT3P(lwb->lwb_write_zio, !=, NULL);
+	ASSERT3S(lwb->lwb_state, ==, LWB_STATE_OPENED);
 }
 
 /*
@@ -1003,12 +1456,36 @@ uint64_t zil_block_buckets[] = {
     UINT64_MAX
 };
 
+/*
+ * Fold the amount of log data written by one pass of
+ * zil_process_commit_list() into the zilog's commit size estimate.
+ * Growth is taken at once, since an undersized lwb costs an extra log
+ * write (and another round trip for the waiters) within the same commit;
+ * shrinkage is applied gradually, so a stream that alternates between
+ * small and large commits keeps getting blocks big enough for the large
+ * ones while a burst followed by small fsyncs stops over-allocating after
+ * a few commits.
+ */
+static void
+zil_commit_size(zilog_t *zilog, uint64_t size)
+{
+	uint64_t est = zilog->zl_commit_est;
+	int shift = MIN(MAX(zil_lwb_decay_shift, 0), 63);
+
+	ASSERT(MUTEX_HELD(&zilog->zl_issuer_lock));
+
+	if (size >= est)
+		zilog->zl_commit_est = size;
+	else
+		zilog->zl_commit_est = est - ((est - size) >> shift);
+}
+
 /*
  * Start a log block write and advance to the next log block.
- * Calls are serialized.
+ * Calls are serialized by the zl_issuer_lock.
  */
 static lwb_t *
-zil_lwb_write_start(zilog_t *zilog, lwb_t *lwb)
+zil_lwb_write_issue(zilog_t *zilog, lwb_t *lwb)
 {
 	lwb_t *nlwb = NULL;
 	zil_chain_t *zilc;
@@ -1020,6 +1497,11 @@ zil_lwb_write_start(zilog_t *zilog, lwb_t *lwb)
 	int i, error;
 	boolean_t slog;
 
+	ASSERT(MUTEX_HELD(&zilog->zl_issuer_lock));
+	ASSERT3P(lwb->lwb_root_zio, !=, NULL);
+	ASSERT3P(lwb->lwb_write_zio, !=, NULL);
+	ASSERT3S(lwb->lwb_state, ==, LWB_STATE_OPENED);
+
 	if (BP_GET_CHECKSUM(&lwb->lwb_blk) == ZIO_CHECKSUM_ZILOG2) {
 		zilc = (zil_chain_t *)lwb->lwb_buf;
 		bp = &zilc->zc_next_blk;
@@ -1035,7 +1517,8 @@ zil_lwb_write_start(zilog_t *zilog, lwb_t *lwb)
 	 * before writing it in order to establish the log chain.
 	 * Note that if the allocation of nlwb synced before we wrote
 	 * the block that points at it (lwb), we'd leak it if we crashed.
-	 * Therefore, we don't do dmu_tx_commit() until zil_lwb_write_done().
+	 * Therefore, we don't do dmu_tx_commit() until
+	 * zil_lwb_flush_vdevs_done().
 	 * We dirty the dataset to ensure that zil_sync() will be called
 	 * to clean up in the event of allocation failure or I/O failure.
 	 */
@@ -1047,16 +1530,17 @@ zil_lwb_write_start(zilog_t *zilog, lwb_t *lwb)
 	 * to the dirty data based delays.
 	 * We (ab)use TXG_WAITED to bypass the delay mechanism.
 	 * One side effect from using TXG_WAITED is that dmu_tx_assign() can
-	 * fail if the pool is suspended.  Those are dramatic circumstances,
-	 * so we return NULL to signal that the normal ZIL processing is not
-	 * possible and txg_wait_synced() should be used to ensure that the data
-	 * is on disk.
+	 * fail if the pool is suspended.  The lwb is already open and may
+	 * have commit waiters linked to it, so it has to be issued no matter
+	 * what; in that case we simply wait for the pool to resume, just as
+	 * the txg_wait_synced() fallback would have.
 	 */
 	error = dmu_tx_assign(tx, TXG_WAITED);
 	if (error != 0) {
 		ASSERT3S(error, ==, EIO);
 		dmu_tx_abort(tx);
-		return (NULL);
+		tx = dmu_tx_create(zilog->zl_os);
+		VERIFY0(dmu_tx_assign(tx, TXG_WAIT));
 	}
 	dsl_dataset_dirty(dmu_objset_ds(zilog->zl_os), tx);
 	txg = dmu_tx_get_txg(tx);
@@ -1065,30 +1549,24 @@ zil_lwb_write_start(zilog_t *zilog, lwb_t *lwb)
 
 	/*
 	 * Log blocks are pre-allocated. Here we select the size of the next
-	 * block, based on size used in the last block.
-	 * - first find the smallest bucket that will fit the block from a
-	 *   limited set of block sizes. This is because it's faster to write
-	 *   blocks allocated from the same metaslab as they are adjacent or
-	 *   close.
-	 * - next find the maximum from the new suggested size and an array of
-	 *   previous sizes. This lessens a picket fence effect of wrongly
-	 *   guesssing the size if we have a stream of say 2k, 64k, 2k, 64k
-	 *   requests.
+	 * block from the decaying commit size estimate (zl_commit_est, see
+	 * zil_commit_size()), or from the size of the commit in progress if
+	 * that has already outgrown the estimate, and then find the smallest
+	 * bucket that will fit it from a limited set of block sizes. This is
+	 * because it's faster to write blocks allocated from the same
+	 * metaslab as they are adjacent or close.
 	 *
 	 * Note we only write what is used, but we can't just allocate
 	 * the maximum block size because we can exhaust the available
 	 * pool log space.
 	 */
-	zil_blksz = zilog->zl_cur_used + sizeof (zil_chain_t);
+	zil_blksz = MAX(zilog->zl_cur_used, zilog->zl_commit_est) +
+	    sizeof (zil_chain_t);
 	for (i = 0; zil_blksz > zil_block_buckets[i]; i++)
 		continue;
 	zil_blksz = zil_block_buckets[i];
 	if (zil_blksz == UINT64_MAX)
 		zil_blksz = SPA_OLD_MAXBLOCKSIZE;
-	zilog->zl_prev_blks[zilog->zl_prev_rotor] = zil_blksz;
-	for (i = 0; i < ZIL_PREV_BLKS; i++)
-		zil_blksz = MAX(zil_blksz, zilog->zl_prev_blks[i]);
-	zilog->zl_prev_rotor = (zilog->zl_prev_rotor + 1) & (ZIL_PREV_BLKS - 1);
 
 	BP_ZERO(bp);
 	/* pass the old blkptr in order to spread log blocks across devs */
@@ -1103,16 +1581,13 @@ zil_lwb_write_start(zilog_t *zilog, lwb_t *lwb)
 		 * Allocate a new log write buffer (lwb).
 		 */
 		nlwb = zil_alloc_lwb(zilog, bp, slog, TRUE, txg);
-
-		/* Record the block for later vdev flushing */
-		zil_add_block(zilog, &lwb->lwb_blk);
 	}
 
 	if (BP_GET_CHECKSUM(&lwb->lwb_blk) == ZIO_CHECKSUM_ZILOG2) {
 		/* For Slim ZIL only write what is used. */
 		wsz = P2ROUNDUP_TYPED(lwb->lwb_nused, ZIL_MIN_BLKSZ, uint64_t);
 		ASSERT3U(wsz, <=, lwb->lwb_sz);
-		zio_shrink(lwb->lwb_zio, wsz);
+		zio_shrink(lwb->lwb_write_zio, wsz);
 
 	} else {
 		wsz = lwb->lwb_sz;
@@ -1127,7 +1602,25 @@ zil_lwb_write_start(zilog_t *zilog, lwb_t *lwb)
 	 */
 	bzero(lwb->lwb_buf + lwb->lwb_nused, wsz - lwb->lwb_nused);
 
-	zio_nowait(lwb->lwb_zio); /* Kick off the write for the old log block */
+	spa_zil_lwb_add(spa, BP_GET_LSIZE(&lwb->lwb_blk),
+	    lwb->lwb_nused * 100 / lwb->lwb_sz);
+	ZIL_DS_STAT_BUMP(zilog, zds_lwb_count);
+	ZIL_DS_STAT_INCR(zilog, zds_lwb_bytes, wsz);
+	if (lwb->lwb_slog) {
+		ZIL_STAT_BUMP(zil_itx_metaslab_slog_count);
+		ZIL_STAT_INCR(zil_itx_metaslab_slog_bytes, lwb->lwb_nused);
+	} else {
+		ZIL_STAT_BUMP(zil_itx_metaslab_normal_count);
+		ZIL_STAT_INCR(zil_itx_metaslab_normal_bytes, lwb->lwb_nused);
+	}
+
+	spa_config_enter(zilog->zl_spa, SCL_STATE, lwb, RW_READER);
+
+	lwb->lwb_issued_timestamp = gethrtime();
+	lwb->lwb_state = LWB_STATE_ISSUED;
+
+	zio_nowait(lwb->lwb_root_zio);
+	zio_nowait(lwb->lwb_write_zio);
 
 	/*
 	 * If there was an allocation failure then nlwb will be null which
@@ -1136,7 +1629,61 @@ zil_lwb_write_start(zilog_t *zilog, lwb_t *lwb)
 	return (nlwb);
 }
 
+/*
+ * Mark a commit waiter "done" without it having been linked to an lwb;
+ * used when there is nothing left for it to wait on.
+ */
+static void
+zil_commit_waiter_skip(zil_commit_waiter_t *zcw)
+{
+	mutex_enter(&zcw->zcw_lock);
+	ASSERT(!zcw->zcw_done);
+	zcw->zcw_done = B_TRUE;
+	cv_broadcast(&zcw->zcw_cv);
+	mutex_exit(&zcw->zcw_lock);
+}
+
+/*
+ * This function is used when the given waiter is to be linked into an
+ * lwb's "lwb_waiter" list; i.e. when the itx is committed to the lwb.
+ * At this point, the waiter will no longer be referenced by the itx,
+ * and instead, will be referenced by the lwb.
+ */
+static void
+zil_commit_waiter_link_lwb(zil_commit_waiter_t *zcw, lwb_t *lwb)
+{
+	/*
+	 * The lwb_waiters field of the lwb is protected by the zilog's
+	 * zl_lock, thus it must be held when calling this function.
+	 */
+	ASSERT(MUTEX_HELD(&lwb->lwb_zilog->zl_lock));
+
+	mutex_enter(&zcw->zcw_lock);
+	ASSERT(!list_link_active(&zcw->zcw_node));
+	ASSERT3P(zcw->zcw_lwb, ==, NULL);
+	ASSERT3P(lwb, !=, NULL);
+	ASSERT(lwb->lwb_state == LWB_STATE_OPENED ||
+	    lwb->lwb_state == LWB_STATE_ISSUED);
+
+	list_insert_tail(&lwb->lwb_waiters, zcw);
+	zcw->zcw_lwb = lwb;
+	mutex_exit(&zcw->zcw_lock);
+}
 
+/*
+ * This function is used when zio_alloc_zil() fails to allocate a ZIL
+ * block, and the given waiter must be linked to the "nolwb waiters"
+ * list inside of zil_process_commit_list().
+ */
+static void
+zil_commit_waiter_link_nolwb(zil_commit_waiter_t *zcw, list_t *nolwb)
+{
+	mutex_enter(&zcw->zcw_lock);
+	ASSERT(!list_link_active(&zcw->zcw_node));
+	ASSERT3P(zcw->zcw_lwb, ==, NULL);
+	list_insert_tail(nolwb, zcw);
+	mutex_exit(&zcw->zcw_lock);
+}
 
 static lwb_t *
 zil_lwb_commit(zilog_t *zilog, itx_t *itx, lwb_t *lwb)
@@ -1152,10 +1699,31 @@ zil_lwb_commit(zilog_t *zilog, itx_t *itx, lwb_t *lwb)
 	rl_t *rl = NULL;
 #endif
 
-	if (lwb == NULL)
-		return (NULL);
+	ASSERT(MUTEX_HELD(&zilog->zl_issuer_lock));
+	ASSERT3P(lwb, !=, NULL);
+	ASSERT3P(lwb->lwb_buf, !=, NULL);
 
-	ASSERT(lwb->lwb_buf != NULL);
+	zil_lwb_write_open(zilog, lwb);
+
+	/*
+	 * A commit itx doesn't represent any on-disk state; instead
+	 * it's simply used as a place holder on the commit list, and
+	 * provides a mechanism for attaching a "commit waiter" onto the
+	 * correct lwb (such that the waiter can be signalled upon
+	 * completion of that lwb). Thus, we don't process this itx's
+	 * log record if it's a commit itx (these itx's don't have log
+	 * records), and instead link the itx's waiter onto the lwb's
+	 * list of waiters.
+	 *
+	 * For more details, see the comment above zil_commit().
+	 */
+	if (lrc->lrc_txtype == TX_COMMIT) {
+		mutex_enter(&zilog->zl_lock);
+		zil_commit_waiter_link_lwb(itx->itx_private, lwb);
+		itx->itx_private = NULL;
+		mutex_exit(&zilog->zl_lock);
+		return (lwb);
+	}
 
 	if (lrc->lrc_txtype == TX_WRITE && itx->itx_wr_state == WR_NEED_COPY)
 		dlen = P2ROUNDUP_TYPED(
@@ -1163,16 +1731,14 @@ zil_lwb_commit(zilog_t *zilog, itx_t *itx, lwb_t *lwb)
 
 	zilog->zl_cur_used += (reclen + dlen);
 
-	zil_lwb_write_init(zilog, lwb);
-
 	/*
 	 * If this record won't fit in the current log block, start a new one.
 	 */
 	if (lwb->lwb_nused + reclen + dlen > lwb->lwb_sz) {
-		lwb = zil_lwb_write_start(zilog, lwb);
+		lwb = zil_lwb_write_issue(zilog, lwb);
 		if (lwb == NULL)
 			return (NULL);
-		zil_lwb_write_init(zilog, lwb);
+		zil_lwb_write_open(zilog, lwb);
 		ASSERT(LWB_EMPTY(lwb));
 		if (lwb->lwb_nused + reclen + dlen > lwb->lwb_sz) {
 			txg_wait_synced(zilog->zl_dmu_pool, txg);
@@ -1258,11 +1824,12 @@ zil_lwb_commit(zilog_t *zilog, itx_t *itx, lwb_t *lwb)
 				 * no need to proceed */
 
 #if defined (__APPLE__) && defined (_KERNEL)
-				error = zilog->zl_get_data(
-					itx->itx_private, lrw, dbuf, lwb->lwb_zio, zp, rl);
+				error = zilog->zl_get_data(itx->itx_private,
+				    lrw, dbuf, lwb, lwb->lwb_write_zio, zp, rl);
 #else
-				error = zilog->zl_get_data(
-					itx->itx_private, lrw, dbuf, lwb->lwb_zio, NULL, NULL);
+				error = zilog->zl_get_data(itx->itx_private,
+				    lrw, dbuf, lwb, lwb->lwb_write_zio,
+				    NULL, NULL);
 #endif
 			}
 
@@ -1286,12 +1853,14 @@ zil_lwb_commit(zilog_t *zilog, itx_t *itx, lwb_t *lwb)
 	 * equal to the itx sequence number because not all transactions
 	 * are synchronous, and sometimes spa_sync() gets there first.
 	 */
-	lrc->lrc_seq = ++zilog->zl_lr_seq; /* we are single threaded */
+	lrc->lrc_seq = ++zilog->zl_lr_seq; /* zl_issuer_lock is held */
 	lwb->lwb_nused += reclen + dlen;
 	lwb->lwb_max_txg = MAX(lwb->lwb_max_txg, txg);
 	ASSERT3U(lwb->lwb_nused, <=, lwb->lwb_sz);
 	ASSERT0(P2PHASE(lwb->lwb_nused, sizeof (uint64_t)));
 
+	zil_lwb_commit_stats(zilog, itx, reclen + dlen);
+
 	return (lwb);
 }
 
@@ -1317,6 +1886,11 @@ zil_itx_create(uint64_t txtype, size_t lrsize)
 void
 zil_itx_destroy(itx_t *itx)
 {
+	IMPLY(itx->itx_lr.lrc_txtype == TX_COMMIT, itx->itx_callback == NULL);
+
+	if (itx->itx_callback != NULL)
+		itx->itx_callback(itx->itx_callback_data);
+
 	zio_data_buf_free(itx, offsetof(itx_t, itx_lr)+itx->itx_lr.lrc_reclen);
 }
 
@@ -1335,8 +1909,28 @@ zil_itxg_clean(itxs_t *itxs)
 
 	list = &itxs->i_sync_list;
 	while ((itx = list_head(list)) != NULL) {
-		if (itx->itx_callback != NULL)
-			itx->itx_callback(itx->itx_callback_data);
+		/*
+		 * In the general case, commit itxs will not be found
+		 * here, as they'll be committed to an lwb via
+		 * zil_lwb_commit(), and free'd in that function. Having
+		 * said that, it is still possible for commit itxs to be
+		 * found here, due to the following race:
+		 *
+		 *	- a thread calls zil_commit() which assigns the
+		 *	  commit itx to a per-txg i_sync_list
+		 *	- zil_itxg_clean() is called (e.g. via spa_sync())
+		 *	  while the waiter is still on the i_sync_list
+		 *
+		 * There's nothing to prevent syncing the txg while the
+		 * waiter is on the i_sync_list. This normally doesn't
+		 * happen because spa_sync() is slower than zil_commit(),
+		 * but if zil_commit() calls txg_wait_synced() (e.g.
+		 * because zil_create() or zil_commit_writer_stall() is
+		 * called) we will hit this case.
+		 */
+		if (itx->itx_lr.lrc_txtype == TX_COMMIT)
+			zil_commit_waiter_skip(itx->itx_private);
+
 		list_remove(list, itx);
 		zil_itx_destroy(itx);
 	}
@@ -1346,8 +1940,8 @@ zil_itxg_clean(itxs_t *itxs)
 	while ((ian = avl_destroy_nodes(t, &cookie)) != NULL) {
 		list = &ian->ia_list;
 		while ((itx = list_head(list)) != NULL) {
-			if (itx->itx_callback != NULL)
-				itx->itx_callback(itx->itx_callback_data);
+			/* commit itxs should never be on the async lists. */
+			ASSERT3U(itx->itx_lr.lrc_txtype, !=, TX_COMMIT);
 			list_remove(list, itx);
 			zil_itx_destroy(itx);
 		}
@@ -1413,8 +2007,8 @@ zil_remove_async(zilog_t *zilog, uint64_t oid)
 		mutex_exit(&itxg->itxg_lock);
 	}
 	while ((itx = list_head(&clean_list)) != NULL) {
-		if (itx->itx_callback != NULL)
-			itx->itx_callback(itx->itx_callback_data);
+		/* commit itxs should never be on the async lists. */
+		ASSERT3U(itx->itx_lr.lrc_txtype, !=, TX_COMMIT);
 		list_remove(&clean_list, itx);
 		zil_itx_destroy(itx);
 	}
@@ -1619,151 +2213,747 @@ zil_async_to_sync(zilog_t *zilog, uint64_t foid)
 	}
 }
 
+/*
+ * This function will prune commit itxs that are at the head of the
+ * commit list (it won't prune past the first non-commit itx), and
+ * either: a) attach them to the last lwb that's still pending
+ * completion, or b) skip them altogether.
+ *
+ * This is used as a performance optimization to prevent commit itxs
+ * from generating new lwbs when it's unnecessary to do so.
+ */
 static void
-zil_commit_writer(zilog_t *zilog)
+zil_prune_commit_list(zilog_t *zilog)
 {
-	uint64_t txg;
 	itx_t *itx;
-	lwb_t *lwb;
-	spa_t *spa = zilog->zl_spa;
-	int error = 0;
 
-	ASSERT(zilog->zl_root_zio == NULL);
+	ASSERT(MUTEX_HELD(&zilog->zl_issuer_lock));
 
-	mutex_exit(&zilog->zl_lock);
+	while ((itx = list_head(&zilog->zl_itx_commit_list)) != NULL) {
+		lr_t *lrc = &itx->itx_lr;
+		lwb_t *last_lwb;
 
-	zil_get_commit_list(zilog);
+		if (lrc->lrc_txtype != TX_COMMIT)
+			break;
 
-	/*
-	 * Return if there's nothing to commit before we dirty the fs by
-	 * calling zil_create().
-	 */
-	if (list_head(&zilog->zl_itx_commit_list) == NULL) {
 		mutex_enter(&zilog->zl_lock);
-		return;
-	}
 
-	if (zilog->zl_suspend) {
-		lwb = NULL;
-	} else {
-		lwb = list_tail(&zilog->zl_lwb_list);
-		if (lwb == NULL)
-			lwb = zil_create(zilog);
-	}
+		last_lwb = zilog->zl_last_lwb_opened;
+		if (last_lwb == NULL || last_lwb->lwb_state == LWB_STATE_DONE) {
+			/*
+			 * All of the itxs this waiter was waiting on
+			 * must have already completed (or there were
+			 * never any itx's for it to wait on), so it's
+			 * safe to skip this waiter and mark it done.
+			 */
+			zil_commit_waiter_skip(itx->itx_private);
+		} else {
+			zil_commit_waiter_link_lwb(itx->itx_private, last_lwb);
+			itx->itx_private = NULL;
+		}
 
-	DTRACE_PROBE1(zil__cw1, zilog_t *, zilog);
-	for (itx = list_head(&zilog->zl_itx_commit_list); itx != NULL;
-	    itx = list_next(&zilog->zl_itx_commit_list, itx)) {
-		txg = itx->itx_lr.lrc_txg;
-		ASSERT(txg);
+		mutex_exit(&zilog->zl_lock);
 
-		if (txg > spa_last_synced_txg(spa) || txg > spa_freeze_txg(spa))
-			lwb = zil_lwb_commit(zilog, itx, lwb);
+		list_remove(&zilog->zl_itx_commit_list, itx);
+		zil_itx_destroy(itx);
 	}
-	DTRACE_PROBE1(zil__cw2, zilog_t *, zilog);
 
-	/* write the last block out */
-	if (lwb != NULL && lwb->lwb_zio != NULL)
-		lwb = zil_lwb_write_start(zilog, lwb);
-
-	zilog->zl_cur_used = 0;
+	IMPLY(itx != NULL, itx->itx_lr.lrc_txtype != TX_COMMIT);
+}
 
-	/*
-	 * Wait if necessary for the log blocks to be on stable storage.
+static void
+zil_commit_writer_stall(zilog_t *zilog)
+{
+	/*
+	 * When zio_alloc_zil() fails to allocate the next lwb block on
+	 * disk, we must call txg_wait_synced() to ensure all of the
+	 * lwbs in the zilog's zl_lwb_list are synced and then freed (in
+	 * zil_sync()), such that any subsequent ZIL writer (i.e. a call
+	 * to zil_process_commit_list()) will have to call zil_create(),
+	 * and start a new ZIL chain.
+	 *
+	 * Since zil_alloc_zil() failed, the lwb that was previously
+	 * issued does not have a pointer to the "next" lwb on disk.
+	 * Thus, if another ZIL writer thread was to allocate the "next"
+	 * on-disk lwb, that block could be leaked in the event of a
+	 * crash (because the previous lwb on-disk would not point to
+	 * it).
+	 *
+	 * We must hold the zilog's zl_issuer_lock while we do this, to
+	 * ensure no new threads enter zil_process_commit_list() until
+	 * all lwb's in the zl_lwb_list have been synced and freed
+	 * (which is achieved via the txg_wait_synced() call).
 	 */
-	if (zilog->zl_root_zio) {
-		error = zio_wait(zilog->zl_root_zio);
-		zilog->zl_root_zio = NULL;
-		zil_flush_vdevs(zilog);
+	ASSERT(MUTEX_HELD(&zilog->zl_issuer_lock));
+	txg_wait_synced(zilog->zl_dmu_pool, 0);
+	ASSERT3P(list_tail(&zilog->zl_lwb_list), ==, NULL);
+}
+
+/*
+ * This function will traverse the commit list, creating new lwbs as
+ * needed, and committing the itxs from the commit list to these newly
+ * created lwbs. Additionally, as a new lwb is created, the previous
+ * lwb will be issued to the zio layer to be written to disk.
+ */
+static void
+zil_process_commit_list(zilog_t *zilog)
+{
+	spa_t *spa = zilog->zl_spa;
+	list_t nolwb_itxs;
+	list_t nolwb_waiters;
+	lwb_t *lwb;
+	itx_t *itx;
+
+	ASSERT(MUTEX_HELD(&zilog->zl_issuer_lock));
+
+	/*
+	 * Return if there's nothing to commit before we dirty the fs by
+	 * calling zil_create().
+	 */
+	if (list_head(&zilog->zl_itx_commit_list) == NULL)
+		return;
+
+	list_create(&nolwb_itxs, sizeof (itx_t), offsetof(itx_t, itx_node));
+	list_create(&nolwb_waiters, sizeof (zil_commit_waiter_t),
+	    offsetof(zil_commit_waiter_t, zcw_node));
+
+	/*
+	 * zl_cur_used accumulates the log data committed by this pass;
+	 * it is folded into the commit size estimate once the pass is done.
+	 */
+	zilog->zl_cur_used = 0;
+
+	lwb = list_tail(&zilog->zl_lwb_list);
+	if (lwb == NULL) {
+		lwb = zil_create(zilog);
+	} else {
+		ASSERT3S(lwb->lwb_state, !=, LWB_STATE_ISSUED);
+		ASSERT3S(lwb->lwb_state, !=, LWB_STATE_DONE);
 	}
 
-	if (error || lwb == NULL)
-		txg_wait_synced(zilog->zl_dmu_pool, 0);
+	DTRACE_PROBE1(zil__cw1, zilog_t *, zilog);
+	while ((itx = list_head(&zilog->zl_itx_commit_list)) != NULL) {
+		lr_t *lrc = &itx->itx_lr;
+		uint64_t txg = lrc->lrc_txg;
+		boolean_t synced, frozen;
 
-	while ((itx = list_head(&zilog->zl_itx_commit_list))) {
-		txg = itx->itx_lr.lrc_txg;
-		ASSERT(txg);
+		ASSERT3U(txg, !=, 0);
 
-		if (itx->itx_callback != NULL)
-			itx->itx_callback(itx->itx_callback_data);
 		list_remove(&zilog->zl_itx_commit_list, itx);
-		zil_itx_destroy(itx);
+
+		synced = txg <= spa_last_synced_txg(spa);
+		frozen = txg > spa_freeze_txg(spa);
+
+		/*
+		 * If the txg of this itx has already been synced out, then
+		 * we don't need to commit this itx to an lwb. This is
+		 * because the data of this itx will have already been
+		 * written to the main pool. This is inherently racy, and
+		 * it's still ok to commit an itx whose txg has already
+		 * been synced; this will result in a write that's
+		 * unnecessary, but will do no harm.
+		 *
+		 * With that said, we always want to commit TX_COMMIT itxs
+		 * to an lwb, regardless of whether or not that itx's txg
+		 * has been synced out. We do this to ensure any OPENED lwb
+		 * will always have at least one zil_commit_waiter_t linked
+		 * to the lwb; otherwise an lwb that only holds itxs whose
+		 * txg synced while we were filling it could remain in the
+		 * OPENED state indefinitely, with nobody to issue it.
+		 *
+		 * Finally, if the pool is frozen, we _always_ commit the
+		 * itx.  The point of freezing the pool is to prevent data
+		 * from being written to the main pool via spa_sync, and
+		 * instead rely solely on the ZIL to persistently store the
+		 * data; i.e.  when the pool is frozen, the last synced txg
+		 * value can't be trusted.
+		 */
+		if (frozen || !synced || lrc->lrc_txtype == TX_COMMIT) {
+			if (lwb != NULL) {
+				lwb = zil_lwb_commit(zilog, itx, lwb);
+
+				if (lwb == NULL)
+					list_insert_tail(&nolwb_itxs, itx);
+				else
+					list_insert_tail(&lwb->lwb_itxs, itx);
+			} else {
+				if (lrc->lrc_txtype == TX_COMMIT) {
+					zil_commit_waiter_link_nolwb(
+					    itx->itx_private, &nolwb_waiters);
+				}
+
+				list_insert_tail(&nolwb_itxs, itx);
+			}
+		} else {
+			ASSERT3S(lrc->lrc_txtype, !=, TX_COMMIT);
+			zil_itx_destroy(itx);
+		}
 	}
+	DTRACE_PROBE1(zil__cw2, zilog_t *, zilog);
 
-	mutex_enter(&zilog->zl_lock);
+	if (zilog->zl_cur_used != 0)
+		zil_commit_size(zilog, zilog->zl_cur_used);
+
+	if (lwb == NULL) {
+		zil_commit_waiter_t *zcw;
+
+		/*
+		 * This indicates zio_alloc_zil() failed to allocate the
+		 * "next" lwb on-disk. When this happens, we must stall
+		 * the ZIL write pipeline; see the comment within
+		 * zil_commit_writer_stall() for more details.
+		 */
+		zil_commit_writer_stall(zilog);
+
+		/*
+		 * Additionally, we have to signal and mark the "nolwb"
+		 * waiters as "done" here, since without an lwb, we
+		 * can't do this via zil_lwb_flush_vdevs_done() like
+		 * normal.
+		 */
+		while ((zcw = list_head(&nolwb_waiters)) != NULL) {
+			list_remove(&nolwb_waiters, zcw);
+			zil_commit_waiter_skip(zcw);
+		}
+
+		/*
+		 * And finally, we have to destroy the itx's that
+		 * couldn't be committed to an lwb; this will also call
+		 * the itx's callback if one exists for the itx.
+		 */
+		while ((itx = list_head(&nolwb_itxs)) != NULL) {
+			list_remove(&nolwb_itxs, itx);
+			zil_itx_destroy(itx);
+		}
+	} else {
+		ASSERT(list_is_empty(&nolwb_waiters));
+		ASSERT3S(lwb->lwb_state, !=, LWB_STATE_ISSUED);
+		ASSERT3S(lwb->lwb_state, !=, LWB_STATE_DONE);
+
+		/*
+		 * At this point, the ZIL block pointed at by the "lwb"
+		 * variable is either "closed" or "open".
+		 *
+		 * If it's "closed", then no itxs have been committed to
+		 * it, so there's no point in issuing its zio (i.e.
+		 * it's "empty").
+		 *
+		 * If it's "open", then it contains one or more itxs that
+		 * eventually need to be committed to stable storage. In
+		 * this case we intentionally do not issue the lwb's zio
+		 * to disk yet, and instead rely on one of the following
+		 * two mechanisms for issuing the zio:
+		 *
+		 * 1. Ideally, there will be more ZIL activity occurring
+		 * on the system, such that this function will be
+		 * immediately called again (not necessarily by the same
+		 * thread) and this lwb's zio will be issued via
+		 * zil_lwb_commit(). This way, the lwb is guaranteed to
+		 * be "full" when it is issued to disk, and we'll make
+		 * use of the lwb's size the best we can.
+		 *
+		 * 2. If there isn't sufficient ZIL activity occurring on
+		 * the system, zil_commit_waiter() will issue the lwb's
+		 * zio once its timeout expires. If this occurs, the lwb
+		 * was "too large" given the amount of ZIL activity
+		 * occurring on the system at that time.
+		 *
+		 * This packs as many itxs into as few lwbs as possible,
+		 * reducing the number of IOPs needed to write the same
+		 * number of itxs, without significantly impacting the
+		 * latency of each individual itx.
+		 */
+	}
+
+	list_destroy(&nolwb_waiters);
+	list_destroy(&nolwb_itxs);
+}
+
+/*
+ * This function is responsible for ensuring the passed in commit waiter
+ * (and associated commit itx) is committed to an lwb. If the waiter is
+ * not already committed to an lwb, all itxs in the zilog's queue of
+ * itxs will be processed. The assumption is the passed in waiter's
+ * commit itx will found in the queue just like the other non-commit
+ * itxs, such that when the entire queue is processed, the waiter will
+ * have been commited to an lwb.
+ *
+ * The lwb associated with the passed in waiter is not guaranteed to
+ * have been issued by the time this function completes. If the lwb is
+ * not issued, we rely on future calls to zil_commit_writer() to issue
+ * the lwb, or the timeout mechanism found in zil_commit_waiter().
+ */
+static void
+zil_commit_writer(zilog_t *zilog, zil_commit_waiter_t *zcw)
+{
+	ASSERT(!MUTEX_HELD(&zilog->zl_lock));
+	ASSERT(spa_writeable(zilog->zl_spa));
+
+	mutex_enter(&zilog->zl_issuer_lock);
+
+	if (zcw->zcw_lwb != NULL || zcw->zcw_done) {
+		/*
+		 * It's possible that, while we were waiting to acquire
+		 * the "zl_issuer_lock", another thread committed this
+		 * waiter to an lwb. If that occurs, we bail out early,
+		 * without processing any of the zilog's queue of itxs.
+		 *
+		 * On certain workloads and system configurations, the
+		 * "zl_issuer_lock" can become highly contended. In an
+		 * attempt to reduce this contention, we immediately drop
+		 * the lock if the waiter has already been processed.
+		 */
+		goto out;
+	}
+
+	ZIL_STAT_BUMP(zil_commit_writer_count);
+	ZIL_DS_STAT_BUMP(zilog, zds_commit_writer_count);
+
+	zil_get_commit_list(zilog);
+	zil_prune_commit_list(zilog);
+	zil_process_commit_list(zilog);
+
+out:
+	mutex_exit(&zilog->zl_issuer_lock);
+}
+
+static void
+zil_commit_waiter_timeout(zilog_t *zilog, zil_commit_waiter_t *zcw)
+{
+	lwb_t *lwb, *nlwb;
+
+	ASSERT(!MUTEX_HELD(&zilog->zl_issuer_lock));
+	ASSERT(MUTEX_HELD(&zcw->zcw_lock));
+	ASSERT(!zcw->zcw_done);
+
+	lwb = zcw->zcw_lwb;
+	ASSERT3P(lwb, !=, NULL);
+	ASSERT3S(lwb->lwb_state, !=, LWB_STATE_CLOSED);
 
 	/*
-	 * Remember the highest committed log sequence number for ztest.
-	 * We only update this value when all the log writes succeeded,
-	 * because ztest wants to ASSERT that it got the whole log chain.
+	 * If the lwb has already been issued by another thread, we can
+	 * immediately return since there's no work to be done (the
+	 * point of this function is to issue the lwb). Additionally, we
+	 * do this prior to acquiring the zl_issuer_lock, to avoid
+	 * acquiring it when it's not necessary to do so.
 	 */
-	if (error == 0 && lwb != NULL)
-		zilog->zl_commit_lr_seq = zilog->zl_lr_seq;
+	if (lwb->lwb_state == LWB_STATE_ISSUED ||
+	    lwb->lwb_state == LWB_STATE_DONE)
+		return;
+
+	/*
+	 * In order to call zil_lwb_write_issue() we must hold the
+	 * zilog's "zl_issuer_lock". We can't simply acquire that lock,
+	 * since we're already holding the commit waiter's "zcw_lock",
+	 * and those two locks are aquired in the opposite order
+	 * elsewhere.
+	 */
+	mutex_exit(&zcw->zcw_lock);
+	mutex_enter(&zilog->zl_issuer_lock);
+	mutex_enter(&zcw->zcw_lock);
+
+	/*
+	 * Since we just dropped and re-acquired the commit waiter's
+	 * lock, we have to re-check to see if the waiter was marked
+	 * "done" during that process. If the waiter was marked "done",
+	 * the "lwb" pointer is no longer valid (it can be free'd after
+	 * the waiter is marked "done"), so without this check we could
+	 * wind up with a use-after-free error below.
+	 */
+	if (zcw->zcw_done)
+		goto out;
+
+	ASSERT3P(lwb, ==, zcw->zcw_lwb);
+
+	/*
+	 * We've already checked this above, but since we hadn't acquired
+	 * the zilog's zl_issuer_lock, we have to perform this check a
+	 * second time while holding the lock. The lwb cannot transition
+	 * from OPENED to ISSUED while we hold the zl_issuer_lock; it _can_
+	 * transition from ISSUED to DONE, but we treat both states the
+	 * same here.
+	 *
+	 * See the comment above the lwb_state_t structure definition for
+	 * more details on the lwb states, and locking requirements.
+	 */
+	if (lwb->lwb_state == LWB_STATE_ISSUED ||
+	    lwb->lwb_state == LWB_STATE_DONE)
+		goto out;
+
+	ASSERT3S(lwb->lwb_state, ==, LWB_STATE_OPENED);
+
+	/*
+	 * Since the lwb's zio hadn't been issued by the time this thread
+	 * reached its timeout, the lwb was too large given the incoming
+	 * throughput of itxs.  Before the next lwb is allocated, pull the
+	 * commit size estimate down to what actually arrived, and reset
+	 * the zilog's "zl_cur_used" field, so the block size selection
+	 * algorithm picks a block sized for that instead.
+	 */
+	zilog->zl_commit_est = MIN(zilog->zl_commit_est, lwb->lwb_nused);
+	zilog->zl_cur_used = 0;
+
+	/*
+	 * As described in the comments above zil_commit_waiter() and
+	 * zil_process_commit_list(), we need to issue this lwb's zio
+	 * since we've reached the commit waiter's timeout and it still
+	 * hasn't been issued.
+	 */
+	nlwb = zil_lwb_write_issue(zilog, lwb);
+
+	IMPLY(nlwb != NULL, lwb->lwb_state != LWB_STATE_OPENED);
+
+	if (nlwb == NULL) {
+		/*
+		 * When zil_lwb_write_issue() returns NULL, this
+		 * indicates zio_alloc_zil() failed to allocate the
+		 * "next" lwb on-disk. When this occurs, the ZIL write
+		 * pipeline must be stalled; see the comment within the
+		 * zil_commit_writer_stall() function for more details.
+		 *
+		 * We must drop the commit waiter's lock prior to
+		 * calling zil_commit_writer_stall() or else we can wind
+		 * up with the following deadlock:
+		 *
+		 * - This thread is waiting for the txg to sync while
+		 *   holding the waiter's lock; txg_wait_synced() is
+		 *   used within txg_commit_writer_stall().
+		 *
+		 * - The txg can't sync because it is waiting for this
+		 *   lwb's zio callback to call dmu_tx_commit().
+		 *
+		 * - The lwb's zio callback can't call dmu_tx_commit()
+		 *   because it's blocked trying to acquire the waiter's
+		 *   lock, which occurs prior to calling dmu_tx_commit()
+		 */
+		mutex_exit(&zcw->zcw_lock);
+		zil_commit_writer_stall(zilog);
+		mutex_enter(&zcw->zcw_lock);
+	}
+
+out:
+	mutex_exit(&zilog->zl_issuer_lock);
+	ASSERT(MUTEX_HELD(&zcw->zcw_lock));
 }
 
 /*
- * Commit zfs transactions to stable storage.
- * If foid is 0 push out all transactions, otherwise push only those
- * for that object or might reference that object.
+ * This function is responsible for performing the following two tasks:
  *
- * itxs are committed in batches. In a heavily stressed zil there will be
- * a commit writer thread who is writing out a bunch of itxs to the log
- * for a set of committing threads (cthreads) in the same batch as the writer.
- * Those cthreads are all waiting on the same cv for that batch.
+ * 1. its primary responsibility is to block until the given "commit
+ *    waiter" is considered "done".
  *
- * There will also be a different and growing batch of threads that are
- * waiting to commit (qthreads). When the committing batch completes
- * a transition occurs such that the cthreads exit and the qthreads become
- * cthreads. One of the new cthreads becomes the writer thread for the
- * batch. Any new threads arriving become new qthreads.
+ * 2. its secondary responsibility is to issue the zio for the lwb that
+ *    the given "commit waiter" is waiting on, if this function has
+ *    waited "long enough" and the lwb is still in the "open" state.
  *
- * Only 2 condition variables are needed and there's no transition
- * between the two cvs needed. They just flip-flop between qthreads
- * and cthreads.
+ * Given a sufficient amount of itxs being generated and written using
+ * the ZIL, the lwb's zio will be issued via the zil_lwb_commit()
+ * function. If this does not occur, this secondary responsibility will
+ * ensure the lwb is issued even if there is not other synchronous
+ * activity on the system.
  *
- * Using this scheme we can efficiently wakeup up only those threads
- * that have been committed.
+ * For more details, see zil_process_commit_list(); more specifically,
+ * the comment at the bottom of that function.
+ */
+static void
+zil_commit_waiter(zilog_t *zilog, zil_commit_waiter_t *zcw)
+{
+	hrtime_t start = gethrtime();
+	hrtime_t sleep, wakeup;
+	int pct;
+
+	ASSERT(!MUTEX_HELD(&zilog->zl_lock));
+	ASSERT(!MUTEX_HELD(&zilog->zl_issuer_lock));
+	ASSERT(spa_writeable(zilog->zl_spa));
+
+	mutex_enter(&zcw->zcw_lock);
+
+	/*
+	 * The timeout is scaled based on the lwb latency to avoid
+	 * significantly impacting the latency of each individual itx.
+	 * For more details, see the comment at the bottom of the
+	 * zil_process_commit_list() function.
+	 */
+	pct = MAX(zfs_commit_timeout_pct, 1);
+	sleep = (zilog->zl_last_lwb_latency * pct) / 100;
+	wakeup = start + sleep;
+
+	while (!zcw->zcw_done) {
+		lwb_t *lwb = zcw->zcw_lwb;
+
+		ASSERT(MUTEX_HELD(&zcw->zcw_lock));
+
+		/*
+		 * Usually, the waiter will have a non-NULL lwb field here,
+		 * but it's possible for it to be NULL as a result of
+		 * zil_commit() racing with spa_sync().
+		 *
+		 * When zil_clean() is called, it's possible for the itxg
+		 * list (which may be cleaned via a taskq) to contain
+		 * commit itxs. When this occurs, the commit waiters linked
+		 * off of these commit itxs will not be committed to an
+		 * lwb.  Additionally, these commit waiters will not be
+		 * marked done until zil_commit_waiter_skip() is called via
+		 * zil_itxg_clean().
+		 *
+		 * Thus, it's possible for this commit waiter (i.e. the
+		 * "zcw" variable) to be found in this "in between" state;
+		 * where it's "zcw_lwb" field is NULL, and it hasn't yet
+		 * been skipped, so it's "zcw_done" field is still B_FALSE.
+		 */
+		IMPLY(lwb != NULL, lwb->lwb_state != LWB_STATE_CLOSED);
+
+		if (lwb != NULL && lwb->lwb_state == LWB_STATE_OPENED) {
+			hrtime_t now = gethrtime();
+
+			/*
+			 * If the lwb hasn't been issued yet, then we
+			 * need to wait with a timeout, in case this
+			 * function needs to issue the lwb after the
+			 * timeout is reached; responsibility (2) from
+			 * the comment above this function.
+			 */
+			if (now < wakeup) {
+				(void) cv_timedwait_hires(&zcw->zcw_cv,
+				    &zcw->zcw_lock, wakeup - now, USEC2NSEC(1),
+				    0);
+				continue;
+			}
+
+			zil_commit_waiter_timeout(zilog, zcw);
+
+			if (!zcw->zcw_done) {
+				/*
+				 * If the commit waiter has already been
+				 * marked "done", it's possible for the
+				 * waiter's lwb structure to have already
+				 * been freed.  Thus, we can only reliably
+				 * make these assertions if the waiter
+				 * isn't done.
+				 */
+				ASSERT3P(lwb, ==, zcw->zcw_lwb);
+				ASSERT3S(lwb->lwb_state, !=, LWB_STATE_OPENED);
+			}
+		} else {
+			/*
+			 * If the lwb isn't open, then it must have already
+			 * been issued. In that case, there's no need to
+			 * use a timeout when waiting for the lwb to
+			 * complete.
+			 *
+			 * Additionally, if the lwb is NULL, the waiter
+			 * will soon be signalled and marked done via
+			 * zil_clean() and zil_itxg_clean(), so no timeout
+			 * is required.
+			 */
+			IMPLY(lwb != NULL,
+			    lwb->lwb_state == LWB_STATE_ISSUED ||
+			    lwb->lwb_state == LWB_STATE_DONE);
+			cv_wait(&zcw->zcw_cv, &zcw->zcw_lock);
+		}
+	}
+
+	mutex_exit(&zcw->zcw_lock);
+
+	spa_zil_commit_add_nsecs(zilog->zl_spa, SPA_ZCH_WAIT,
+	    gethrtime() - start);
+}
+
+static zil_commit_waiter_t *
+zil_alloc_commit_waiter(void)
+{
+	zil_commit_waiter_t *zcw = kmem_cache_alloc(zil_zcw_cache, KM_SLEEP);
+
+	cv_init(&zcw->zcw_cv, NULL, CV_DEFAULT, NULL);
+	mutex_init(&zcw->zcw_lock, NULL, MUTEX_DEFAULT, NULL);
+	list_link_init(&zcw->zcw_node);
+	zcw->zcw_lwb = NULL;
+	zcw->zcw_done = B_FALSE;
+	zcw->zcw_zio_error = 0;
+
+	return (zcw);
+}
+
+static void
+zil_free_commit_waiter(zil_commit_waiter_t *zcw)
+{
+	ASSERT(!list_link_active(&zcw->zcw_node));
+	ASSERT3P(zcw->zcw_lwb, ==, NULL);
+	ASSERT(zcw->zcw_done);
+	mutex_destroy(&zcw->zcw_lock);
+	cv_destroy(&zcw->zcw_cv);
+	kmem_cache_free(zil_zcw_cache, zcw);
+}
+
+/*
+ * This function is used to create a TX_COMMIT itx and assign it. This
+ * way, it will be linked into the ZIL's list of synchronous itxs, and
+ * then later committed to an lwb (or skipped) when
+ * zil_process_commit_list() is called.
+ */
+static void
+zil_commit_itx_assign(zilog_t *zilog, zil_commit_waiter_t *zcw)
+{
+	dmu_tx_t *tx = dmu_tx_create(zilog->zl_os);
+	itx_t *itx;
+
+	VERIFY0(dmu_tx_assign(tx, TXG_WAIT));
+
+	itx = zil_itx_create(TX_COMMIT, sizeof (lr_t));
+	itx->itx_sync = B_TRUE;
+	itx->itx_private = zcw;
+
+	zil_itx_assign(zilog, itx, tx);
+
+	dmu_tx_commit(tx);
+}
+
+/*
+ * Commit ZFS Intent Log transactions (itxs) to stable storage.
+ *
+ * When writing ZIL transactions to the on-disk representation of the
+ * ZIL, the itxs are committed to a Log Write Block (lwb). Multiple
+ * itxs can be committed to a single lwb. Once a lwb is written and
+ * committed to stable storage (i.e. the lwb is written, and vdevs have
+ * been flushed), each itx that was committed to that lwb is also
+ * considered to be committed to stable storage.
+ *
+ * When an itx is committed to an lwb, the log record (lr_t) contained
+ * by the itx is copied into the lwb's zio buffer, and once this buffer
+ * is written to disk, it becomes an on-disk ZIL block.
+ *
+ * As itxs are generated, they're inserted into the ZIL's queue of
+ * uncommitted itxs. The semantics of zil_commit() are such that it will
+ * block until all itxs that were generated prior to the zil_commit()
+ * call, are committed to stable storage.
+ *
+ * To achieve this, zil_commit() allocates a "commit waiter" and
+ * assigns a TX_COMMIT itx carrying it to the same queue; that itx has
+ * no on-disk state, it merely marks a position in the queue. A single
+ * thread at a time (the zl_issuer_lock holder) then walks the queue,
+ * copying each record into the current lwb. When an lwb fills up it is
+ * issued immediately and the next one is opened, so new itxs keep being
+ * committed into the next lwb while the previous one is in flight; when
+ * a commit itx is reached, its waiter is linked to the lwb that holds
+ * everything ahead of it.
+ *
+ * Each lwb's zio is made a child of the next lwb's root zio, so lwbs
+ * complete in the order they were opened. Once an lwb has been written
+ * and the vdevs it touched have been flushed, zil_lwb_flush_vdevs_done()
+ * wakes exactly the waiters linked to it; threads whose records went
+ * into a later lwb keep sleeping.
+ *
+ * An lwb that isn't full is not issued right away; instead the waiter
+ * sleeps for a fraction (zfs_commit_timeout_pct) of the latency of the
+ * last lwb, giving other threads a chance to add more records to it.
+ * If nobody issues the lwb by then, the waiter issues it itself; see
+ * zil_commit_waiter().
+ *
+ * If foid is 0 push out all transactions, otherwise push only those
+ * for that object or might reference that object.
  */
 void
 zil_commit(zilog_t *zilog, uint64_t foid)
 {
-	uint64_t mybatch;
+	// OSX often has NULL zil for some reason
+	if (!zilog)
+		return;
 
-    // OSX often has NULL zil for some reason
-    if (!zilog) return;
+	/*
+	 * Snapshots are read-only and never have anything to commit, and
+	 * assigning the commit itx below would try to dirty them.
+	 */
+	if (dmu_objset_is_snapshot(zilog->zl_os))
+		return;
 
 	if (zilog->zl_sync == ZFS_SYNC_DISABLED)
 		return;
 
+	if (!spa_writeable(zilog->zl_spa)) {
+		/*
+		 * If the SPA is not writable, there should never be any
+		 * pending itxs waiting to be committed to disk. If that
+		 * weren't true, we'd skip writing those itxs out, and
+		 * would break the sematics of zil_commit(); thus, we're
+		 * verifying that truth before we return to the caller.
+		 */
+		ASSERT(list_is_empty(&zilog->zl_lwb_list));
+		ASSERT3P(zilog->zl_last_lwb_opened, ==, NULL);
+		return;
+	}
+
+	/*
+	 * If the ZIL is suspended, we don't want to dirty it by calling
+	 * zil_commit_itx_assign() below, nor can we write out
+	 * lwbs like would be done in zil_commit_write(). Thus, we
+	 * simply rely on txg_wait_synced() to maintain the necessary
+	 * semantics, and avoid calling those functions altogether.
+	 */
+	if (zilog->zl_suspend > 0) {
+		txg_wait_synced(zilog->zl_dmu_pool, 0);
+		return;
+	}
+
+	zil_commit_impl(zilog, foid);
+}
+
+void
+zil_commit_impl(zilog_t *zilog, uint64_t foid)
+{
+	hrtime_t start = gethrtime();
+	zil_commit_waiter_t *zcw;
+
 	ZIL_STAT_BUMP(zil_commit_count);
+	ZIL_DS_STAT_BUMP(zilog, zds_commit_count);
 
-	/* move the async itxs for the foid to the sync queues */
+	/*
+	 * Move the "async" itxs for the specified foid to the "sync"
+	 * queues, such that they will be later committed (or skipped)
+	 * to an lwb when zil_process_commit_list() is called.
+	 *
+	 * Since these "async" itxs must be committed prior to this
+	 * call to zil_commit returning, we must perform this operation
+	 * before we call zil_commit_itx_assign().
+	 */
 	zil_async_to_sync(zilog, foid);
 
-	mutex_enter(&zilog->zl_lock);
-	mybatch = zilog->zl_next_batch;
-	while (zilog->zl_writer) {
-		cv_wait(&zilog->zl_cv_batch[mybatch & 1], &zilog->zl_lock);
-		if (mybatch <= zilog->zl_com_batch) {
-			mutex_exit(&zilog->zl_lock);
-			return;
-		}
-	}
+	/*
+	 * We allocate a new "waiter" structure which will initially be
+	 * linked to the commit itx using the itx's "itx_private" field.
+	 * Since the commit itx doesn't represent any on-disk state,
+	 * when it's committed to an lwb, rather than copying the its
+	 * lr_t into the lwb's buffer, the commit itx's "waiter" will be
+	 * added to the lwb's list of waiters. Then, when the lwb is
+	 * committed to stable storage, each waiter in the lwb's list of
+	 * waiters will be marked "done", and signalled.
+	 *
+	 * We must create the waiter and assign the commit itx prior to
+	 * calling zil_commit_writer(), or else our specific commit itx
+	 * is not guaranteed to be committed to an lwb prior to calling
+	 * zil_commit_waiter().
+	 */
+	zcw = zil_alloc_commit_waiter();
+	zil_commit_itx_assign(zilog, zcw);
 
-	zilog->zl_next_batch++;
-	zilog->zl_writer = B_TRUE;
-	ZIL_STAT_BUMP(zil_commit_writer_count);
-	zil_commit_writer(zilog);
-	zilog->zl_com_batch = mybatch;
-	zilog->zl_writer = B_FALSE;
-	mutex_exit(&zilog->zl_lock);
+	zil_commit_writer(zilog, zcw);
+	zil_commit_waiter(zilog, zcw);
 
-	/* wake up one thread to become the next writer */
-	cv_signal(&zilog->zl_cv_batch[(mybatch+1) & 1]);
+	if (zcw->zcw_zio_error != 0) {
+		/*
+		 * If there was an error writing out the ZIL blocks that
+		 * this thread is waiting on, then we fallback to
+		 * relying on spa_sync() to write out the data this
+		 * thread is waiting on. Obviously this has performance
+		 * implications, but the expectation is for this to be
+		 * an exceptional case, and shouldn't occur often.
+		 */
+		txg_wait_synced(zilog->zl_dmu_pool, 0);
+	}
 
-	/* wake up all threads waiting for this batch to be committed */
-	cv_broadcast(&zilog->zl_cv_batch[mybatch & 1]);
+	zil_free_commit_waiter(zcw);
 
+	spa_zil_commit_add_nsecs(zilog->zl_spa, SPA_ZCH_COMMIT,
+	    gethrtime() - start);
 }
 
 /*
@@ -1790,7 +2980,7 @@ zil_sync(zilog_t *zilog, dmu_tx_t *tx)
 	ASSERT(zilog->zl_stop_sync == 0);
 
 	if (*replayed_seq != 0) {
-		ASSERT(zh->zh_replay_seq < *replayed_seq);
+		ASSERT(zh->zh_replay_seq <= *replayed_seq);
 		zh->zh_replay_seq = *replayed_seq;
 		*replayed_seq = 0;
 	}
@@ -1822,11 +3012,11 @@ zil_sync(zilog_t *zilog, dmu_tx_t *tx)
 		if (lwb->lwb_buf != NULL || lwb->lwb_max_txg > txg)
 			break;
 
-		ASSERT(lwb->lwb_zio == NULL);
+		ASSERT3P(lwb->lwb_write_zio, ==, NULL);
 
 		list_remove(&zilog->zl_lwb_list, lwb);
 		zio_free_zil(spa, txg, &lwb->lwb_blk);
-		kmem_cache_free(zil_lwb_cache, lwb);
+		zil_free_lwb(zilog, lwb);
 
 		/*
 		 * If we don't have anything left in the lwb list then
@@ -1844,7 +3034,7 @@ zil_sync(zilog_t *zilog, dmu_tx_t *tx)
 	 * unused, long-lived LWBs.
 	 */
 	for (; lwb != NULL; lwb = list_next(&zilog->zl_lwb_list, lwb)) {
-		if (lwb->lwb_fastwrite && !lwb->lwb_zio) {
+		if (lwb->lwb_fastwrite && !lwb->lwb_write_zio) {
 			metaslab_fastwrite_unmark(zilog->zl_spa, &lwb->lwb_blk);
 			lwb->lwb_fastwrite = 0;
 		}
@@ -1853,11 +3043,43 @@ zil_sync(zilog_t *zilog, dmu_tx_t *tx)
 	mutex_exit(&zilog->zl_lock);
 }
 
+/* ARGSUSED */
+static int
+zil_lwb_cons(void *vbuf, void *unused, int kmflag)
+{
+	lwb_t *lwb = vbuf;
+
+	list_create(&lwb->lwb_waiters, sizeof (zil_commit_waiter_t),
+	    offsetof(zil_commit_waiter_t, zcw_node));
+	list_create(&lwb->lwb_itxs, sizeof (itx_t),
+	    offsetof(itx_t, itx_node));
+	avl_create(&lwb->lwb_vdev_tree, zil_lwb_vdev_compare,
+	    sizeof (zil_vdev_node_t), offsetof(zil_vdev_node_t, zv_node));
+	mutex_init(&lwb->lwb_vdev_lock, NULL, MUTEX_DEFAULT, NULL);
+
+	return (0);
+}
+
+/* ARGSUSED */
+static void
+zil_lwb_dest(void *vbuf, void *unused)
+{
+	lwb_t *lwb = vbuf;
+
+	mutex_destroy(&lwb->lwb_vdev_lock);
+	avl_destroy(&lwb->lwb_vdev_tree);
+	list_destroy(&lwb->lwb_waiters);
+	list_destroy(&lwb->lwb_itxs);
+}
+
 void
 zil_init(void)
 {
 	zil_lwb_cache = kmem_cache_create("zil_lwb_cache",
-	    sizeof (struct lwb), 0, NULL, NULL, NULL, NULL, NULL, 0);
+	    sizeof (lwb_t), 0, zil_lwb_cons, zil_lwb_dest, NULL, NULL, NULL, 0);
+
+	zil_zcw_cache = kmem_cache_create("zil_zcw_cache",
+	    sizeof (zil_commit_waiter_t), 0, NULL, NULL, NULL, NULL, NULL, 0);
 
 	zil_ksp = kstat_create("zfs", 0, "zil", "misc",
 	    KSTAT_TYPE_NAMED, sizeof (zil_stats) / sizeof (kstat_named_t),
@@ -1872,6 +3094,7 @@ zil_init(void)
 void
 zil_fini(void)
 {
+	kmem_cache_destroy(zil_zcw_cache);
 	kmem_cache_destroy(zil_lwb_cache);
 
 	if (zil_ksp != NULL) {
@@ -1907,9 +3130,12 @@ zil_alloc(objset_t *os, zil_header_t *zh_phys)
 	zilog->zl_destroy_txg = TXG_INITIAL - 1;
 	zilog->zl_logbias = dmu_objset_logbias(os);
 	zilog->zl_sync = dmu_objset_syncprop(os);
-	zilog->zl_next_batch = 1;
+	zilog->zl_dirty_max_txg = 0;
+	zilog->zl_last_lwb_opened = NULL;
+	zilog->zl_last_lwb_latency = 0;
 
 	mutex_init(&zilog->zl_lock, NULL, MUTEX_DEFAULT, NULL);
+	mutex_init(&zilog->zl_issuer_lock, NULL, MUTEX_DEFAULT, NULL);
 
 	for (i = 0; i < TXG_SIZE; i++) {
 		mutex_init(&zilog->zl_itxg[i].itxg_lock, NULL,
@@ -1922,15 +3148,7 @@ zil_alloc(objset_t *os, zil_header_t *zh_phys)
 	list_create(&zilog->zl_itx_commit_list, sizeof (itx_t),
 	    offsetof(itx_t, itx_node));
 
-	mutex_init(&zilog->zl_vdev_lock, NULL, MUTEX_DEFAULT, NULL);
-
-	avl_create(&zilog->zl_vdev_tree, zil_vdev_compare,
-	    sizeof (zil_vdev_node_t), offsetof(zil_vdev_node_t, zv_node));
-
-	cv_init(&zilog->zl_cv_writer, NULL, CV_DEFAULT, NULL);
 	cv_init(&zilog->zl_cv_suspend, NULL, CV_DEFAULT, NULL);
-	cv_init(&zilog->zl_cv_batch[0], NULL, CV_DEFAULT, NULL);
-	cv_init(&zilog->zl_cv_batch[1], NULL, CV_DEFAULT, NULL);
 
 	return (zilog);
 }
@@ -1948,9 +3166,6 @@ zil_free(zilog_t *zilog)
 	ASSERT(list_is_empty(&zilog->zl_lwb_list));
 	list_destroy(&zilog->zl_lwb_list);
 
-	avl_destroy(&zilog->zl_vdev_tree);
-	mutex_destroy(&zilog->zl_vdev_lock);
-
 	ASSERT(list_is_empty(&zilog->zl_itx_commit_list));
 	list_destroy(&zilog->zl_itx_commit_list);
 
@@ -1967,12 +3182,10 @@ zil_free(zilog_t *zilog)
 		mutex_destroy(&zilog->zl_itxg[i].itxg_lock);
 	}
 
+	mutex_destroy(&zilog->zl_issuer_lock);
 	mutex_destroy(&zilog->zl_lock);
 
-	cv_destroy(&zilog->zl_cv_writer);
 	cv_destroy(&zilog->zl_cv_suspend);
-	cv_destroy(&zilog->zl_cv_batch[0]);
-	cv_destroy(&zilog->zl_cv_batch[1]);
 
 	kmem_free(zilog, sizeof (zilog_t));
 }
@@ -1993,6 +3206,8 @@ zil_open(objset_t *os, zil_get_data_t *get_data)
 	zilog->zl_clean_taskq = taskq_create("zil_clean", 1, defclsyspri,
 	    2, 2, TASKQ_PREPOPULATE);
 
+	zil_ds_kstat_init(zilog);
+
 	return (zilog);
 }
 
@@ -2003,22 +3218,26 @@ void
 zil_close(zilog_t *zilog)
 {
 	lwb_t *lwb;
-	uint64_t txg = 0;
+	uint64_t txg;
 
 	zil_commit(zilog, 0); /* commit all itx */
 
 	/*
 	 * The lwb_max_txg for the stubby lwb will reflect the last activity
-	 * for the zil.  After a txg_wait_synced() on the txg we know all the
+	 * for the zil, and zl_dirty_max_txg covers any itxs (including the
+	 * commit itxs) that were never written to an lwb.  After a
+	 * txg_wait_synced() on the later of the two we know all the
 	 * callbacks have occurred that may clean the zil.  Only then can we
 	 * destroy the zl_clean_taskq.
 	 */
 	mutex_enter(&zilog->zl_lock);
 	lwb = list_tail(&zilog->zl_lwb_list);
-	if (lwb != NULL)
-		txg = lwb->lwb_max_txg;
+	if (lwb == NULL)
+		txg = zilog->zl_dirty_max_txg;
+	else
+		txg = MAX(zilog->zl_dirty_max_txg, lwb->lwb_max_txg);
 	mutex_exit(&zilog->zl_lock);
-	if (txg)
+	if (txg != 0)
 		txg_wait_synced(zilog->zl_dmu_pool, txg);
 	ASSERT(!zilog_is_dirty(zilog));
 
@@ -2026,6 +3245,11 @@ zil_close(zilog_t *zilog)
 	zilog->zl_clean_taskq = NULL;
 	zilog->zl_get_data = NULL;
 
+	if (zilog->zl_ksp != NULL) {
+		kstat_delete(zilog->zl_ksp);
+		zilog->zl_ksp = NULL;
+	}
+
 	/*
 	 * We should have only one LWB left on the list; remove it now.
 	 */
@@ -2033,12 +3257,12 @@ zil_close(zilog_t *zilog)
 	lwb = list_head(&zilog->zl_lwb_list);
 	if (lwb != NULL) {
 		ASSERT(lwb == list_tail(&zilog->zl_lwb_list));
-		ASSERT(lwb->lwb_zio == NULL);
+		ASSERT3S(lwb->lwb_state, !=, LWB_STATE_ISSUED);
 		if (lwb->lwb_fastwrite)
 			metaslab_fastwrite_unmark(zilog->zl_spa, &lwb->lwb_blk);
 		list_remove(&zilog->zl_lwb_list, lwb);
 		zio_buf_free(lwb->lwb_buf, lwb->lwb_sz);
-		kmem_cache_free(zil_lwb_cache, lwb);
+		zil_free_lwb(zilog, lwb);
 	}
 	mutex_exit(&zilog->zl_lock);
 }
@@ -2140,7 +3364,23 @@ zil_suspend(const char *osname, void **cookiep)
 	zilog->zl_suspending = B_TRUE;
 	mutex_exit(&zilog->zl_lock);
 
-	zil_commit(zilog, 0);
+	/*
+	 * We need to use zil_commit_impl to ensure we wait for all
+	 * LWB_STATE_OPENED and LWB_STATE_ISSUED lwb's to be committed
+	 * to disk before proceeding. If we used zil_commit instead, it
+	 * would just call txg_wait_synced(), because zl_suspend is set.
+	 * txg_wait_synced() doesn't wait for these lwb's to be
+	 * LWB_STATE_DONE before returning.
+	 */
+	zil_commit_impl(zilog, 0);
+
+	/*
+	 * Now that we've ensured all lwb's are LWB_STATE_DONE,
+	 * txg_wait_synced() will ensure the data from the zilog has
+	 * migrated to the main pool, and zil_sync() has freed the lwbs,
+	 * before zil_destroy() runs.
+	 */
+	txg_wait_synced(zilog->zl_dmu_pool, 0);
 
 	zil_destroy(zilog, B_FALSE);
 
@@ -2170,19 +3410,76 @@ zil_resume(void *cookie)
 	dsl_dataset_rele(dmu_objset_ds(os), suspend_tag);
 }
 
+/*
+ * Records of these types only touch the contents of a single, already
+ * existing object (lr_foid) and replaying them a second time leaves the
+ * object in the same state.  zil_replay() hands them to a per-object lane
+ * so that records for different objects are applied concurrently, while
+ * records for the same object are still applied in log order.  Every other
+ * record type (the namespace operations, plus TX_SETATTR and the ACL types
+ * which share the per-filesystem FUID replay state) acts as a barrier: all
+ * lanes are drained and the record is replayed by the parsing thread alone.
+ */
+#define	ZIL_REPLAY_CONCURRENT(txtype)	\
+	((txtype) == TX_WRITE ||	\
+	(txtype) == TX_WRITE2 ||	\
+	(txtype) == TX_TRUNCATE)
+
+/*
+ * Number of lanes used to replay independent records concurrently.
+ * Zero replays every record from the parsing thread, in log order.
+ */
+int zil_replay_threads = 8;
+
+/*
+ * Upper bound on the memory held by records (and the data of indirect
+ * writes) that have been handed to a lane but not yet replayed.
+ */
+#define	ZIL_REPLAY_INFLIGHT_MAX	(64ULL << 20)
+
 typedef struct zil_replay_arg {
 	zil_replay_func_t *zr_replay;
 	void		*zr_arg;
 	boolean_t	zr_byteswap;
 	char		*zr_lr;
+	zilog_t		*zr_zilog;
+	taskq_t		**zr_lanes;	/* single-threaded, one per lane */
+	int		zr_nlanes;
+	kmutex_t	zr_lock;	/* protects the fields below */
+	kcondvar_t	zr_cv;
+	uint64_t	zr_inflight;	/* records handed to a lane */
+	uint64_t	zr_inflight_bytes;
+	list_t		zr_inflight_list; /* those records, in seq order */
+	uint64_t	zr_parsed_seq;	/* highest seq seen by the parser */
+	uint64_t	zr_error_seq;	/* seq of the first failed record */
+	int		zr_error;
 } zil_replay_arg_t;
 
+typedef struct zil_replay_rec {
+	zil_replay_arg_t *zrr_zr;
+	list_node_t	zrr_node;	/* on zr_inflight_list */
+	uint64_t	zrr_seq;
+	uint64_t	zrr_txtype;
+	size_t		zrr_size;	/* allocated size of zrr_lr */
+	char		*zrr_lr;	/* copy of the record, plus data */
+} zil_replay_rec_t;
+
 static int
-zil_replay_error(zilog_t *zilog, lr_t *lr, int error)
+zil_replay_error(zil_replay_arg_t *zr, lr_t *lr, int error)
 {
+	zilog_t *zilog = zr->zr_zilog;
 	char name[ZFS_MAX_DATASET_NAME_LEN];
 
-	zilog->zl_replaying_seq--;	/* didn't actually replay this one */
+	/*
+	 * Remember the earliest failed record; replay stops there, and
+	 * zil_replay_drain() moves zl_replaying_seq back to just before it.
+	 */
+	mutex_enter(&zr->zr_lock);
+	if (zr->zr_error == 0 || lr->lrc_seq < zr->zr_error_seq) {
+		zr->zr_error = error;
+		zr->zr_error_seq = lr->lrc_seq;
+	}
+	mutex_exit(&zr->zr_lock);
 
 	dmu_objset_name(zilog->zl_os, name);
 
@@ -2192,9 +3489,223 @@ zil_replay_error(zilog_t *zilog, lr_t *lr, int error)
 	    (u_longlong_t)(lr->lrc_txtype & ~TX_CI),
 	    (lr->lrc_txtype & TX_CI) ? "CI" : "");
 
+	ZIL_STAT_BUMP(zil_replay_errors);
+
 	return (error);
 }
 
+/*
+ * Apply a private copy of a log record, fetching the data of an indirect
+ * TX_WRITE first.  The copy must still be in the byte order the parser
+ * saw; it is returned to the order the replay vector expects here.
+ */
+static int
+zil_replay_apply(zil_replay_arg_t *zr, lr_t *lr, char *lrbuf,
+    uint64_t txtype)
+{
+	zilog_t *zilog = zr->zr_zilog;
+	uint64_t reclen = lr->lrc_reclen;
+	int error;
+
+	/*
+	 * If this is a TX_WRITE with a blkptr, suck in the data.
+	 */
+	if (txtype == TX_WRITE && reclen == sizeof (lr_write_t)) {
+		error = zil_read_log_data(zilog, (lr_write_t *)lrbuf,
+		    lrbuf + reclen);
+		if (error != 0)
+			return (zil_replay_error(zr, lr, error));
+	}
+
+	/*
+	 * The log block containing this lr may have been byteswapped
+	 * so that we can easily examine common fields like lrc_txtype.
+	 * However, the log is a mix of different record types, and only the
+	 * replay vectors know how to byteswap their records.  Therefore, if
+	 * the lr was byteswapped, undo it before invoking the replay vector.
+	 */
+	if (zr->zr_byteswap)
+		byteswap_uint64_array(lrbuf, reclen);
+
+	/*
+	 * We must now do two things atomically: replay this log record,
+	 * and update the log header sequence number to reflect the fact that
+	 * we did so. At the end of each replay function the sequence number
+	 * is updated if we are in replay mode.
+	 */
+	error = zr->zr_replay[txtype](zr->zr_arg, lrbuf, zr->zr_byteswap);
+	if (error != 0) {
+		/*
+		 * The DMU's dnode layer doesn't see removes until the txg
+		 * commits, so a subsequent claim can spuriously fail with
+		 * EEXIST. So if we receive any error we try syncing out
+		 * any removes then retry the transaction.  Note that we
+		 * specify B_FALSE for byteswap now, so we don't do it twice.
+		 */
+		txg_wait_synced(spa_get_dsl(zilog->zl_spa), 0);
+		error = zr->zr_replay[txtype](zr->zr_arg, lrbuf, B_FALSE);
+		if (error != 0)
+			return (zil_replay_error(zr, lr, error));
+	}
+
+	ZIL_STAT_BUMP(zil_replay_records);
+	ZIL_STAT_INCR(zil_replay_bytes, reclen);
+
+	return (0);
+}
+
+/*
+ * While records are in flight, only the prefix of the log below the oldest
+ * of them is known to be applied: a record dispatched earlier may still be
+ * waiting in its lane while a later one in another lane has already run.
+ * Publish that prefix as zl_replaying_seq, so that no transaction records
+ * a sequence number whose changes may not have reached a txg yet.  Called
+ * with zr_lock held, after zr_inflight_list changed.
+ */
+static void
+zil_replay_publish(zil_replay_arg_t *zr)
+{
+	zilog_t *zilog = zr->zr_zilog;
+	zil_replay_rec_t *zrr;
+	uint64_t seq;
+
+	ASSERT(MUTEX_HELD(&zr->zr_lock));
+
+	if ((zrr = list_head(&zr->zr_inflight_list)) == NULL)
+		return;
+
+	seq = zrr->zrr_seq - 1;
+	if (zr->zr_error != 0)
+		seq = MIN(seq, zr->zr_error_seq - 1);
+	zilog->zl_replaying_seq = seq;
+}
+
+/*
+ * Lane task: replay one concurrent record.  The lane taskqs have a single
+ * thread, so records dispatched to the same lane run in dispatch order.
+ */
+static void
+zil_replay_rec_task(void *arg)
+{
+	zil_replay_rec_t *zrr = arg;
+	zil_replay_arg_t *zr = zrr->zrr_zr;
+	lr_t *lr = (lr_t *)zrr->zrr_lr;
+
+	/*
+	 * Once any record has failed, the records queued behind it are
+	 * dropped: as in the serial case the parser stops at the error and
+	 * zil_replay() destroys the log, so they are never replayed.
+	 */
+	if (zr->zr_error == 0) {
+		lr_t lrc = *lr;
+
+		if (zil_replay_apply(zr, &lrc, zrr->zrr_lr,
+		    zrr->zrr_txtype) == 0)
+			ZIL_STAT_BUMP(zil_replay_records_concurrent);
+	}
+
+	mutex_enter(&zr->zr_lock);
+	ASSERT3U(zr->zr_inflight, >, 0);
+	ASSERT3U(zr->zr_inflight_bytes, >=, zrr->zrr_size);
+	zr->zr_inflight--;
+	zr->zr_inflight_bytes -= zrr->zrr_size;
+	list_remove(&zr->zr_inflight_list, zrr);
+	zil_replay_publish(zr);
+	cv_broadcast(&zr->zr_cv);
+	mutex_exit(&zr->zr_lock);
+
+	ZIL_STAT_INCR(zil_replay_records_inflight, -1);
+
+	kmem_free(zrr->zrr_lr, zrr->zrr_size);
+	kmem_free(zrr, sizeof (zil_replay_rec_t));
+}
+
+/*
+ * Wait for every record handed to a lane to be replayed, and return the
+ * error of the first one that failed.  While records are in flight their
+ * transactions record the prefix published by zil_replay_publish() (the
+ * records are idempotent, so a crash part way through merely replays the
+ * rest again); once the lanes are drained everything parsed so far has
+ * been applied.
+ */
+static int
+zil_replay_drain(zil_replay_arg_t *zr)
+{
+	zilog_t *zilog = zr->zr_zilog;
+	int error;
+
+	mutex_enter(&zr->zr_lock);
+	while (zr->zr_inflight != 0)
+		cv_wait(&zr->zr_cv, &zr->zr_lock);
+	error = zr->zr_error;
+	if (error != 0)
+		zilog->zl_replaying_seq = zr->zr_error_seq - 1;
+	else
+		zilog->zl_replaying_seq = zr->zr_parsed_seq;
+	mutex_exit(&zr->zr_lock);
+
+	return (error);
+}
+
+static int
+zil_replay_dispatch(zil_replay_arg_t *zr, lr_t *lr, uint64_t txtype)
+{
+	zil_replay_rec_t *zrr;
+	uint64_t reclen = lr->lrc_reclen;
+	uint64_t foid = ((lr_ooo_t *)lr)->lr_foid;
+	size_t size = reclen;
+	int error;
+
+	if (txtype == TX_WRITE && reclen == sizeof (lr_write_t)) {
+		lr_write_t *lrw = (lr_write_t *)lr;
+
+		size += MAX(BP_GET_LSIZE(&lrw->lr_blkptr), lrw->lr_length);
+	}
+
+	/*
+	 * Throttle the parser so the copies waiting in the lanes stay
+	 * bounded; a single record larger than the limit is still let
+	 * through on its own.
+	 */
+	mutex_enter(&zr->zr_lock);
+	while (zr->zr_error == 0 && zr->zr_inflight_bytes != 0 &&
+	    zr->zr_inflight_bytes + size > ZIL_REPLAY_INFLIGHT_MAX)
+		cv_wait(&zr->zr_cv, &zr->zr_lock);
+	error = zr->zr_error;
+	if (error == 0) {
+		zr->zr_inflight++;
+		zr->zr_inflight_bytes += size;
+	}
+	mutex_exit(&zr->zr_lock);
+
+	if (error != 0)
+		return (error);
+
+	zrr = kmem_alloc(sizeof (zil_replay_rec_t), KM_SLEEP);
+	zrr->zrr_zr = zr;
+	zrr->zrr_seq = lr->lrc_seq;
+	zrr->zrr_txtype = txtype;
+	zrr->zrr_size = size;
+	zrr->zrr_lr = kmem_alloc(size, KM_SLEEP);
+	bcopy(lr, zrr->zrr_lr, reclen);
+
+	/*
+	 * The parser hands out records in seq order, so the list stays
+	 * sorted and its head is the oldest record not yet applied.
+	 */
+	mutex_enter(&zr->zr_lock);
+	list_insert_tail(&zr->zr_inflight_list, zrr);
+	zil_replay_publish(zr);
+	mutex_exit(&zr->zr_lock);
+
+	ZIL_STAT_INCR(zil_replay_records_inflight, 1);
+
+	(void) taskq_dispatch(zr->zr_lanes[foid % zr->zr_nlanes],
+	    zil_replay_rec_task, zrr, TQ_SLEEP);
+
+	return (0);
+}
+
 static int
 zil_replay_log_record(zilog_t *zilog, lr_t *lr, void *zra, uint64_t claim_txg)
 {
@@ -2204,7 +3715,11 @@ zil_replay_log_record(zilog_t *zilog, lr_t *lr, void *zra, uint64_t claim_txg)
 	uint64_t txtype = lr->lrc_txtype;
 	int error = 0;
 
-	zilog->zl_replaying_seq = lr->lrc_seq;
+	mutex_enter(&zr->zr_lock);
+	zr->zr_parsed_seq = lr->lrc_seq;
+	if (zr->zr_inflight == 0)
+		zilog->zl_replaying_seq = lr->lrc_seq;
+	mutex_exit(&zr->zr_lock);
 
 	if (lr->lrc_seq <= zh->zh_replay_seq)	/* already replayed */
 		return (0);
@@ -2216,11 +3731,13 @@ zil_replay_log_record(zilog_t *zilog, lr_t *lr, void *zra, uint64_t claim_txg)
 	txtype &= ~TX_CI;
 
 	if (txtype == 0 || txtype >= TX_MAX_TYPE)
-		return (zil_replay_error(zilog, lr, EINVAL));
+		return (zil_replay_error(zr, lr, EINVAL));
 
 	/*
 	 * If this record type can be logged out of order, the object
 	 * (lr_foid) may no longer exist.  That's legitimate, not an error.
+	 * Objects are only created and removed by barrier records, so the
+	 * answer cannot change while concurrent records are in flight.
 	 */
 	if (TX_OOO(txtype)) {
 		error = dmu_object_info(zilog->zl_os,
@@ -2229,52 +3746,25 @@ zil_replay_log_record(zilog_t *zilog, lr_t *lr, void *zra, uint64_t claim_txg)
 			return (0);
 	}
 
-	/*
-	 * Make a copy of the data so we can revise and extend it.
-	 */
-	bcopy(lr, zr->zr_lr, reclen);
+	if (zr->zr_nlanes != 0 && ZIL_REPLAY_CONCURRENT(txtype))
+		return (zil_replay_dispatch(zr, lr, txtype));
 
 	/*
-	 * If this is a TX_WRITE with a blkptr, suck in the data.
+	 * This record is a barrier: everything logged before it must be
+	 * in place first, and its own transaction records its sequence
+	 * number as replayed.
 	 */
-	if (txtype == TX_WRITE && reclen == sizeof (lr_write_t)) {
-		error = zil_read_log_data(zilog, (lr_write_t *)lr,
-		    zr->zr_lr + reclen);
-		if (error != 0)
-			return (zil_replay_error(zilog, lr, error));
-	}
+	error = zil_replay_drain(zr);
+	if (error != 0)
+		return (error);
+	ZIL_STAT_BUMP(zil_replay_barriers);
 
 	/*
-	 * The log block containing this lr may have been byteswapped
-	 * so that we can easily examine common fields like lrc_txtype.
-	 * However, the log is a mix of different record types, and only the
-	 * replay vectors know how to byteswap their records.  Therefore, if
-	 * the lr was byteswapped, undo it before invoking the replay vector.
+	 * Make a copy of the data so we can revise and extend it.
 	 */
-	if (zr->zr_byteswap)
-		byteswap_uint64_array(zr->zr_lr, reclen);
+	bcopy(lr, zr->zr_lr, reclen);
 
-	/*
-	 * We must now do two things atomically: replay this log record,
-	 * and update the log header sequence number to reflect the fact that
-	 * we did so. At the end of each replay function the sequence number
-	 * is updated if we are in replay mode.
-	 */
-	error = zr->zr_replay[txtype](zr->zr_arg, zr->zr_lr, zr->zr_byteswap);
-	if (error != 0) {
-		/*
-		 * The DMU's dnode layer doesn't see removes until the txg
-		 * commits, so a subsequent claim can spuriously fail with
-		 * EEXIST. So if we receive any error we try syncing out
-		 * any removes then retry the transaction.  Note that we
-		 * specify B_FALSE for byteswap now, so we don't do it twice.
-		 */
-		txg_wait_synced(spa_get_dsl(zilog->zl_spa), 0);
-		error = zr->zr_replay[txtype](zr->zr_arg, zr->zr_lr, B_FALSE);
-		if (error != 0)
-			return (zil_replay_error(zilog, lr, error));
-	}
-	return (0);
+	return (zil_replay_apply(zr, lr, zr->zr_lr, txtype));
 }
 
 /* ARGSUSED */
@@ -2282,6 +3772,7 @@ static int
 zil_incr_blks(zilog_t *zilog, blkptr_t *bp, void *arg, uint64_t claim_txg)
 {
 	zilog->zl_replay_blks++;
+	ZIL_STAT_BUMP(zil_replay_blocks);
 
 	return (0);
 }
@@ -2295,16 +3786,37 @@ zil_replay(objset_t *os, void *arg, zil_replay_func_t replay_func[TX_MAX_TYPE])
 	zilog_t *zilog = dmu_objset_zil(os);
 	const zil_header_t *zh = zilog->zl_header;
 	zil_replay_arg_t zr;
+	hrtime_t start;
+	uint64_t ms;
+	int i;
 
 	if ((zh->zh_flags & ZIL_REPLAY_NEEDED) == 0) {
 		zil_destroy(zilog, B_TRUE);
 		return;
 	}
 
+	start = gethrtime();
+
+	bzero(&zr, sizeof (zr));
 	zr.zr_replay = replay_func;
 	zr.zr_arg = arg;
 	zr.zr_byteswap = BP_SHOULD_BYTESWAP(&zh->zh_log);
 	zr.zr_lr = kmem_alloc(2 * SPA_MAXBLOCKSIZE, KM_SLEEP);
+	zr.zr_zilog = zilog;
+	mutex_init(&zr.zr_lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&zr.zr_cv, NULL, CV_DEFAULT, NULL);
+	list_create(&zr.zr_inflight_list, sizeof (zil_replay_rec_t),
+	    offsetof(zil_replay_rec_t, zrr_node));
+
+	zr.zr_nlanes = MAX(zil_replay_threads, 0);
+	if (zr.zr_nlanes != 0) {
+		zr.zr_lanes = kmem_alloc(zr.zr_nlanes * sizeof (taskq_t *),
+		    KM_SLEEP);
+		for (i = 0; i < zr.zr_nlanes; i++) {
+			zr.zr_lanes[i] = taskq_create("zil_replay", 1,
+			    defclsyspri, 1, INT_MAX, TASKQ_PREPOPULATE);
+		}
+	}
 
 	/*
 	 * Wait for in-progress removes to sync before starting replay.
@@ -2314,15 +3826,36 @@ zil_replay(objset_t *os, void *arg, zil_replay_func_t replay_func[TX_MAX_TYPE])
 	zilog->zl_replay = B_TRUE;
 	zilog->zl_replay_time = ddi_get_lbolt();
 	ASSERT(zilog->zl_replay_blks == 0);
+	ZIL_STAT_BUMP(zil_replay_count);
 	(void) zil_parse(zilog, zil_incr_blks, zil_replay_log_record, &zr,
 	    zh->zh_claim_txg, B_TRUE);
+	(void) zil_replay_drain(&zr);
+
+	for (i = 0; i < zr.zr_nlanes; i++)
+		taskq_destroy(zr.zr_lanes[i]);
+	if (zr.zr_nlanes != 0)
+		kmem_free(zr.zr_lanes, zr.zr_nlanes * sizeof (taskq_t *));
+	list_destroy(&zr.zr_inflight_list);
+	cv_destroy(&zr.zr_cv);
+	mutex_destroy(&zr.zr_lock);
 	kmem_free(zr.zr_lr, 2 * SPA_MAXBLOCKSIZE);
 
 	zil_destroy(zilog, B_FALSE);
 	txg_wait_synced(zilog->zl_dmu_pool, zilog->zl_destroy_txg);
 	zilog->zl_replay = B_FALSE;
+
+	ms = NSEC2MSEC(gethrtime() - start);
+	ZIL_STAT_INCR(zil_replay_time_ms, ms);
+	zil_stats.zil_replay_last_ms.value.ui64 = ms;
 }
 
+/*
+ * Called by the replay vectors (and the logging functions they reach) from
+ * inside the transaction that applies a record.  The sequence number stored
+ * here becomes zh_replay_seq once the txg syncs, so it must never cover a
+ * record whose changes are not part of this or an earlier txg; see
+ * zil_replay_drain().
+ */
 boolean_t
 zil_replaying(zilog_t *zilog, dmu_tx_t *tx)
 {
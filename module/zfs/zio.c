@@ -47,6 +47,7 @@
 #include <sys/time.h>
 #include <sys/abd.h>
 #include <sys/dsl_crypt.h>
+#include <sys/dsl_scan.h>
 
 /*
  * ==========================================================================
@@ -816,6 +817,7 @@ zio_create(zio_t *pio, spa_t *spa, uint64_t txg, const blkptr_t *bp,
 		zio->io_bookmark = *zb;
 
 	if (pio != NULL) {
+		zio->io_weight = pio->io_weight;
 		if (zio->io_logical == NULL)
 			zio->io_logical = pio->io_logical;
 		if (zio->io_child_type == ZIO_CHILD_GANG)
@@ -989,6 +991,8 @@ zio_write(zio_t *pio, spa_t *spa, uint64_t txg, blkptr_t *bp,
 	zio->io_children_ready = children_ready;
 	zio->io_physdone = physdone;
 	zio->io_prop = *zp;
+	if (zp->zp_ioweight != 0)
+		zio->io_weight = zp->zp_ioweight;
 
 	/*
 	 * Data can be NULL if we are going to call zio_write_override() to
@@ -1083,6 +1087,7 @@ zio_free_sync(zio_t *pio, spa_t *spa, uint64_t txg, const blkptr_t *bp,
 
 	metaslab_check_free(spa, bp);
 	arc_freed(spa, bp);
+	dsl_scan_freed(spa, bp);
 
 	/*
 	 * GANG and DEDUP blocks can induce a read (for the gang block header,
@@ -1158,6 +1163,58 @@ zio_ioctl(zio_t *pio, spa_t *spa, vdev_t *vd, int cmd,
 	return (zio);
 }
 
+/*
+ * TRIM the range [offset, offset + size) of vd's address space.  Interior
+ * vdevs hand the range on to each child, translated into the child's
+ * address space; leaves issue it as a DKIOCFREE ioctl.  Leaves that have
+ * already refused a TRIM (vdev_notrim) are skipped.
+ */
+zio_t *
+zio_trim(zio_t *pio, spa_t *spa, vdev_t *vd, uint64_t offset, uint64_t size,
+    enum zio_flag flags)
+{
+	zio_t *zio;
+	int c;
+
+	ASSERT3U(size, !=, 0);
+
+	if (vd->vdev_children == 0) {
+		/*
+		 * The ioctl carries no data, so the zio is created empty and
+		 * given its size afterwards: a TRIM may be larger than any
+		 * block zio_create() would accept.
+		 */
+		zio = zio_create(pio, spa, 0, NULL, NULL, 0, 0, NULL, NULL,
+		    ZIO_TYPE_IOCTL, ZIO_PRIORITY_NOW, flags, vd,
+		    offset + VDEV_LABEL_START_SIZE, NULL, ZIO_STAGE_OPEN,
+		    ZIO_IOCTL_PIPELINE);
+
+		zio->io_cmd = DKIOCFREE;
+		zio->io_size = size;
+	} else {
+		zio = zio_null(pio, spa, NULL, NULL, NULL, flags);
+
+		for (c = 0; c < vd->vdev_children; c++) {
+			vdev_t *cvd = vd->vdev_child[c];
+			uint64_t start = offset;
+			uint64_t end = offset + size;
+
+			if (cvd->vdev_notrim || !vdev_writeable(cvd))
+				continue;
+
+			if (vd->vdev_ops == &vdev_raidz_ops)
+				vdev_raidz_xlate(cvd, &start, &end);
+
+			if (start < end) {
+				zio_nowait(zio_trim(zio, spa, cvd, start,
+				    end - start, flags));
+			}
+		}
+	}
+
+	return (zio);
+}
+
 zio_t *
 zio_read_phys(zio_t *pio, vdev_t *vd, uint64_t offset, uint64_t size,
     abd_t *data, int checksum, zio_done_func_t *done, void *private,
@@ -1258,9 +1315,8 @@ zio_vdev_child_io(zio_t *pio, blkptr_t *bp, vdev_t *vd, uint64_t offset,
 	 */
 	if (flags & ZIO_FLAG_IO_ALLOCATING &&
 	    (vd != vd->vdev_top || (flags & ZIO_FLAG_IO_RETRY))) {
-		ASSERTV(metaslab_class_t *mc = spa_normal_class(pio->io_spa));
-
-		ASSERT(mc->mc_alloc_throttle_enabled);
+		ASSERT(pio->io_metaslab_class != NULL);
+		ASSERT(pio->io_metaslab_class->mc_alloc_throttle_enabled);
 		ASSERT(type == ZIO_TYPE_WRITE);
 		ASSERT(priority == ZIO_PRIORITY_ASYNC_WRITE);
 		ASSERT(!(flags & ZIO_FLAG_IO_REPAIR));
@@ -1276,6 +1332,7 @@ zio_vdev_child_io(zio_t *pio, blkptr_t *bp, vdev_t *vd, uint64_t offset,
 	ASSERT3U(zio->io_child_type, ==, ZIO_CHILD_VDEV);
 
 	zio->io_physdone = pio->io_physdone;
+	zio->io_metaslab_class = pio->io_metaslab_class;
 	if (vd->vdev_ops->vdev_op_leaf && zio->io_logical != NULL)
 		zio->io_logical->io_phys_children++;
 
@@ -2467,7 +2524,7 @@ zio_write_gang_block(zio_t *pio)
 
 	error = metaslab_alloc(spa, mc, SPA_GANGBLOCKSIZE,
 	    bp, gbh_copies, txg, pio == gio ? NULL : gio->io_bp, flags,
-	    &pio->io_alloc_list, pio);
+	    &pio->io_alloc_list, pio, pio->io_allocator);
 	if (error) {
 		if (pio->io_flags & ZIO_FLAG_IO_ALLOCATING) {
 			ASSERT(pio->io_priority == ZIO_PRIORITY_ASYNC_WRITE);
@@ -2505,6 +2562,7 @@ zio_write_gang_block(zio_t *pio)
 	zio = zio_rewrite(pio, spa, txg, bp, gbh_abd, SPA_GANGBLOCKSIZE,
 	    zio_write_gang_done, NULL, pio->io_priority,
 	    ZIO_GANG_CHILD_FLAGS(pio), &pio->io_bookmark);
+	zio->io_metaslab_class = mc;
 
 	/*
 	 * Create and nowait the gang children.
@@ -2523,6 +2581,8 @@ zio_write_gang_block(zio_t *pio)
 		zp.zp_dedup = B_FALSE;
 		zp.zp_dedup_verify = B_FALSE;
 		zp.zp_nopwrite = B_FALSE;
+		zp.zp_ioweight = gio->io_prop.zp_ioweight;
+		zp.zp_zpl_smallblk = gio->io_prop.zp_zpl_smallblk;
 		bzero(zp.zp_salt, ZIO_DATA_SALT_LEN);
 		bzero(zp.zp_iv, ZIO_DATA_IV_LEN);
 		bzero(zp.zp_mac, ZIO_DATA_MAC_LEN);
@@ -2533,6 +2593,12 @@ zio_write_gang_block(zio_t *pio)
 		    zio_write_gang_done, &gn->gn_child[g], pio->io_priority,
 		    ZIO_GANG_CHILD_FLAGS(pio), &pio->io_bookmark);
 
+		/*
+		 * Gang members are allocated from the same class as the
+		 * header, which is also where their slots are reserved.
+		 */
+		cio->io_metaslab_class = mc;
+
 		if (pio->io_flags & ZIO_FLAG_IO_ALLOCATING) {
 			ASSERT(pio->io_priority == ZIO_PRIORITY_ASYNC_WRITE);
 			ASSERT(!(pio->io_flags & ZIO_FLAG_NODATA));
@@ -3059,7 +3125,8 @@ zio_io_to_allocate(spa_t *spa)
 	 * Try to place a reservation for this zio. If we're unable to
 	 * reserve then we throttle.
 	 */
-	if (!metaslab_class_throttle_reserve(spa_normal_class(spa),
+	ASSERT(zio->io_metaslab_class != NULL);
+	if (!metaslab_class_throttle_reserve(zio->io_metaslab_class,
 	    zio->io_prop.zp_copies, zio, 0)) {
 		return (NULL);
 	}
@@ -3075,6 +3142,7 @@ zio_dva_throttle(zio_t *zio)
 {
 	spa_t *spa = zio->io_spa;
 	zio_t *nio;
+	metaslab_class_t *mc;
 
 	if (zio->io_priority == ZIO_PRIORITY_SYNC_WRITE ||
 	    !spa_normal_class(zio->io_spa)->mc_alloc_throttle_enabled ||
@@ -3083,6 +3151,16 @@ zio_dva_throttle(zio_t *zio)
 		return (ZIO_PIPELINE_CONTINUE);
 	}
 
+	/*
+	 * The slots are reserved in the class the block will be allocated
+	 * from, so pick it now.
+	 */
+	mc = spa_preferred_class(spa, zio->io_size, zio->io_prop.zp_type,
+	    zio->io_prop.zp_level, zio->io_prop.zp_zpl_smallblk);
+	zio->io_metaslab_class = mc;
+	if (!mc->mc_alloc_throttle_enabled)
+		return (ZIO_PIPELINE_CONTINUE);
+
 	ASSERT(zio->io_child_type > ZIO_CHILD_GANG);
 
 	ASSERT3U(zio->io_queued_timestamp, >, 0);
@@ -3134,7 +3212,7 @@ static int
 zio_dva_allocate(zio_t *zio)
 {
 	spa_t *spa = zio->io_spa;
-	metaslab_class_t *mc = spa_normal_class(spa);
+	metaslab_class_t *mc;
 	blkptr_t *bp = zio->io_bp;
 	int error;
 	int flags = 0;
@@ -3163,16 +3241,57 @@ zio_dva_allocate(zio_t *zio)
 		flags |= METASLAB_FASTWRITE;
 	}
 
+	zio->io_allocator = spa_alloc_select(spa, zio->io_bookmark.zb_objset,
+	    zio->io_bookmark.zb_object, zio->io_bookmark.zb_blkid);
+
+	/*
+	 * If the throttle didn't already pick one, locate an appropriate
+	 * allocation class.
+	 */
+	mc = zio->io_metaslab_class;
+	if (mc == NULL) {
+		mc = spa_preferred_class(spa, zio->io_size,
+		    zio->io_prop.zp_type, zio->io_prop.zp_level,
+		    zio->io_prop.zp_zpl_smallblk);
+		zio->io_metaslab_class = mc;
+	}
+
 	error = metaslab_alloc(spa, mc, zio->io_size, bp,
 	    zio->io_prop.zp_copies, zio->io_txg, NULL, flags,
-	    &zio->io_alloc_list, zio);
+	    &zio->io_alloc_list, zio, zio->io_allocator);
+
+	/*
+	 * Fall back to the normal class when another class is full.  If
+	 * the i/o holds throttle slots, move them over to the normal class.
+	 */
+	if (error == ENOSPC && mc != spa_normal_class(spa)) {
+		if (zio->io_flags & ZIO_FLAG_IO_ALLOCATING) {
+			metaslab_class_throttle_unreserve(mc,
+			    zio->io_prop.zp_copies, zio);
+			zio->io_flags &= ~ZIO_FLAG_IO_ALLOCATING;
+
+			mc = spa_normal_class(spa);
+			VERIFY(metaslab_class_throttle_reserve(mc,
+			    zio->io_prop.zp_copies, zio,
+			    flags | METASLAB_MUST_RESERVE));
+		} else {
+			mc = spa_normal_class(spa);
+		}
+		zio->io_metaslab_class = mc;
+
+		error = metaslab_alloc(spa, mc, zio->io_size, bp,
+		    zio->io_prop.zp_copies, zio->io_txg, NULL, flags,
+		    &zio->io_alloc_list, zio, zio->io_allocator);
+	}
 
 	if (error != 0) {
 		spa_dbgmsg(spa, "%s: metaslab allocation failure: zio %p, "
 		    "size %llu, error %d", spa_name(spa), zio, zio->io_size,
 		    error);
-		if (error == ENOSPC && zio->io_size > SPA_MINBLOCKSIZE)
+		if (error == ENOSPC && zio->io_size > SPA_MINBLOCKSIZE) {
+			metaslab_trace_gang();
 			return (zio_write_gang_block(zio));
+		}
 		zio->io_error = error;
 	}
 
@@ -3231,20 +3350,28 @@ zio_alloc_zil(spa_t *spa, objset_t *os, uint64_t txg, blkptr_t *new_bp,
     blkptr_t *old_bp, uint64_t size, boolean_t *slog)
 {
 	int error = 1;
+	int allocator;
 	zio_alloc_list_t io_alloc_list;
 
 	ASSERT(txg > spa_syncing_txg(spa));
 
+	/*
+	 * Each dataset's intent log blocks come from one allocator, so
+	 * that the logs of different datasets don't contend with each
+	 * other.
+	 */
+	allocator = spa_alloc_select(spa, dmu_objset_id(os), 0, 0);
+
 	metaslab_trace_init(&io_alloc_list);
 	error = metaslab_alloc(spa, spa_log_class(spa), size, new_bp, 1,
 	    txg, old_bp, METASLAB_FASTWRITE|METASLAB_HINTBP_AVOID,
-		&io_alloc_list, NULL);
+		&io_alloc_list, NULL, allocator);
 	if (error == 0) {
 		*slog = TRUE;
 	} else {
 		error = metaslab_alloc(spa, spa_normal_class(spa), size,
 		    new_bp, 1, txg, old_bp, METASLAB_FASTWRITE|METASLAB_HINTBP_AVOID,
-		    &io_alloc_list, NULL);
+		    &io_alloc_list, NULL, allocator);
 		if (error == 0)
 			*slog = FALSE;
 	}
@@ -3572,6 +3699,12 @@ zio_vdev_io_assess(zio_t *zio)
 	    zio->io_cmd == DKIOCFLUSHWRITECACHE && vd != NULL)
 		vd->vdev_nowritecache = B_TRUE;
 
+	/* Likewise for a device that cannot TRIM. */
+	if ((zio->io_error == ENOTSUP || zio->io_error == ENOTTY) &&
+	    zio->io_type == ZIO_TYPE_IOCTL &&
+	    zio->io_cmd == DKIOCFREE && vd != NULL)
+		vd->vdev_notrim = B_TRUE;
+
 	if (zio->io_error)
 		zio->io_pipeline = ZIO_INTERLOCK_PIPELINE;
 
@@ -3895,7 +4028,7 @@ zio_ready(zio_t *zio)
 			 * issue the next I/O to allocate.
 			 */
 			metaslab_class_throttle_unreserve(
-			    spa_normal_class(zio->io_spa),
+			    zio->io_metaslab_class,
 			    zio->io_prop.zp_copies, zio);
 			zio_allocate_dispatch(zio->io_spa);
 		}
@@ -3983,8 +4116,7 @@ zio_dva_throttle_done(zio_t *zio)
 	metaslab_group_alloc_decrement(zio->io_spa, vd->vdev_id, pio, flags);
 	mutex_exit(&pio->io_lock);
 
-	metaslab_class_throttle_unreserve(spa_normal_class(zio->io_spa),
-	    1, pio);
+	metaslab_class_throttle_unreserve(pio->io_metaslab_class, 1, pio);
 
 	/*
 	 * Call into the pipeline to see if there is more work that
@@ -4034,8 +4166,8 @@ zio_done(zio_t *zio)
 		ASSERT(zio->io_priority == ZIO_PRIORITY_ASYNC_WRITE);
 		ASSERT(zio->io_bp != NULL);
 		metaslab_group_alloc_verify(zio->io_spa, zio->io_bp, zio);
-		VERIFY(refcount_not_held(
-				&(spa_normal_class(zio->io_spa)->mc_alloc_slots), zio));
+		VERIFY(zio->io_metaslab_class == NULL || refcount_not_held(
+		    &(zio->io_metaslab_class->mc_alloc_slots), zio));
 	}
 
 	for (c = 0; c < ZIO_CHILD_TYPES; c++)